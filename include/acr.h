@@ -231,11 +231,16 @@ class RalfACR : public ACR
 {
 public:
   /// Constructor.
+  /// @param deferred         If true, messages passed to the ACR are only
+  ///                         captured, and the fields are extracted and
+  ///                         encoded on the Ralf thread pool when the ACR is
+  ///                         sent.
   RalfACR(RalfProcessor* ralf,
           SAS::TrailId trail,
           Node node_functionality,
           Initiator initiator,
-          NodeRole role);
+          NodeRole role,
+          bool deferred=false);
 
   /// Destructor.
   ~RalfACR();
@@ -304,6 +309,14 @@ public:
   ///
   /// @param session_id       The session ID to use.
   virtual void override_session_id(const std::string& session_id);
+
+  /// Extracts any captured messages and builds the Ralf request for this
+  /// ACR.  For deferred ACRs this is called on the Ralf thread pool.
+  /// @returns                false if the ACR should be dropped.
+  /// @param   rr             The request to populate.
+  /// @param   timestamp      Timestamp to be used as Event-Timestamp AVP.
+  bool build_request(RalfProcessor::RalfRequest* rr, pj_time_val timestamp);
+
 private:
 
   /// Called when the Rf message should be triggered.  In general this will
@@ -324,6 +337,20 @@ private:
 
   typedef enum { SDP_OFFER=0, SDP_ANSWER=1 } SDPType;
 
+  typedef enum { RX_REQUEST=0,
+                 TX_REQUEST=1,
+                 RX_RESPONSE=2,
+                 TX_RESPONSE=3 } CaptureType;
+
+  /// A message captured by a deferred ACR, holding a copy of just the parts
+  /// of the message the ACR fields are extracted from.
+  struct CapturedMessage
+  {
+    CaptureType type;
+    pjsip_msg* msg;
+    pj_time_val timestamp;
+  };
+
   typedef enum { CALLING_PARTY=0, CALLED_PARTY=1 } Originator;
 
   typedef enum { STATUS_CODE_NONE=-1,
@@ -410,6 +437,22 @@ private:
 
   std::string hdr_contents(pjsip_hdr* hdr);
 
+  /// Captures a copy of the message if this is a deferred ACR.
+  /// @returns                true if the message was captured.
+  bool capture(CaptureType type, pjsip_msg* msg, pj_time_val& timestamp);
+
+  /// Extracts the fields from any captured messages, in the order the
+  /// messages were passed to the ACR.
+  void extract_captured();
+
+  /// Moves the captured messages to a new copy of this ACR, which takes
+  /// ownership of them.
+  RalfACR* detach();
+
+  bool _deferred;
+  pj_pool_t* _pool;
+  std::vector<CapturedMessage> _captured;
+
   RalfProcessor* _ralf;
   SAS::TrailId _trail;
 
@@ -501,8 +544,11 @@ public:
   /// @param ralf                 RalfProcessor pool set up to connect to
   ///                             Ralf cluster.
   /// @param node_functionality   Node-Functionality value to set in ACRs.
+  /// @param deferred             Whether to defer extracting and encoding
+  ///                             the ACR fields to the Ralf thread pool.
   RalfACRFactory(RalfProcessor* ralf,
-                 ACR::Node node_functionality);
+                 ACR::Node node_functionality,
+                 bool deferred=false);
 
   /// Destructor.
   ~RalfACRFactory();
@@ -520,6 +566,7 @@ public:
 private:
   RalfProcessor* _ralf;
   ACR::Node _node_functionality;
+  bool _deferred;
 };
 
 #endif
@@ -0,0 +1,187 @@
+/**
+ * @file aor_expiry_manager.h Local expiry of registrations and subscriptions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_EXPIRY_MANAGER_H__
+#define AOR_EXPIRY_MANAGER_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <pthread.h>
+
+#include "chronosconnection.h"
+#include "timer_wheel.h"
+#include "sas.h"
+
+/// Tracks when the AoRs written by this node are next due to expire, and
+/// kicks off expiry processing for them in batches.
+///
+/// Each AoR's next expiry time is held on a local timer wheel, which is
+/// checked once a second.  Rather than each AoR having its own Chronos
+/// timer, AoRs are grouped into buckets by expiry time and each bucket has
+/// one Chronos timer, set to pop some time after the bucket is due.  If
+/// this node processes the bucket it deletes the timer; if the node fails,
+/// the timer pops on another node and the AoRs are expired from there.
+/// Bucket timers are only updated periodically, so a bucket that changes
+/// many times between updates costs a single Chronos request.  They are also
+/// brought up to date when the manager is destroyed.
+class AoRExpiryManager
+{
+public:
+  /// Handler for AoRs that are due to expire.
+  typedef std::function<void(const std::vector<std::string>&,
+                             SAS::TrailId)> ExpiryHandler;
+
+  /// Constructor.
+  ///
+  /// @param chronos       - Chronos connection for the bucket timers.
+  /// @param handler       - Called (on the manager's thread) with each batch
+  ///                        of AoRs that are due to expire.
+  /// @param bucket_s      - The span of expiry times (in seconds) covered
+  ///                        by each bucket.
+  /// @param flush_interval_s - How often (in seconds) to update the Chronos
+  ///                        timers for buckets that have changed.
+  AoRExpiryManager(ChronosConnection* chronos,
+                   const ExpiryHandler& handler,
+                   int bucket_s = DEFAULT_BUCKET_S,
+                   int flush_interval_s = DEFAULT_FLUSH_INTERVAL_S);
+
+  /// Destructor.  Stops the manager's thread, then updates the Chronos timers
+  /// for any buckets that have changed since they were last updated.
+  ~AoRExpiryManager();
+
+  /// Starts the thread that checks the wheel.
+  void start();
+
+  /// Records when an AoR is next due to expire.  Called whenever this node
+  /// writes the AoR.
+  ///
+  /// @param aor_id        - The AoR.
+  /// @param next_expires  - When the first binding or subscription in the
+  ///                        AoR expires, or 0 if the AoR is now empty.
+  /// @param tags          - Chronos tags for the AoR, which are summed into
+  ///                        its bucket's timer.
+  /// @param old_timer_id  - A Chronos timer for just this AoR, left over from
+  ///                        before local expiry was enabled.  It is deleted
+  ///                        once the AoR's bucket timer has been set.  Must
+  ///                        be empty if next_expires is 0.
+  void aor_updated(const std::string& aor_id,
+                   int next_expires,
+                   const std::map<std::string, uint32_t>& tags,
+                   const std::string& old_timer_id = "");
+
+  /// Pops any AoRs that are due by the specified time and updates the
+  /// Chronos bucket timers.  Called once a second by the manager's thread.
+  void tick(int now);
+
+  /// Returns the number of AoRs being tracked.
+  size_t size();
+
+  static const int DEFAULT_BUCKET_S = TimerWheel::SLOTS;
+  static const int DEFAULT_FLUSH_INTERVAL_S = 5;
+
+private:
+  struct AoREntry
+  {
+    int bucket;
+    std::map<std::string, uint32_t> tags;
+  };
+
+  struct Bucket
+  {
+    Bucket() : dirty(false) {}
+
+    std::set<std::string> aor_ids;
+    std::map<std::string, uint32_t> tags;
+    std::string timer_id;
+    bool dirty;
+
+    /// Per-AoR timers to delete once this bucket's timer has been set.
+    std::vector<std::string> old_timers;
+  };
+
+  /// An update to a bucket's Chronos timer, built under the lock and sent
+  /// without it.
+  struct TimerUpdate
+  {
+    int bucket;
+    std::string timer_id;
+    int interval;
+    std::string opaque;
+    std::map<std::string, uint32_t> tags;
+    std::vector<std::string> old_timers;
+  };
+
+  /// Removes an AoR from its bucket.  Must be called with the lock held.
+  void remove_from_bucket(const std::string& aor_id,
+                          const AoREntry& entry,
+                          bool mark_dirty);
+
+  /// Builds the timer updates for buckets that have changed since they were
+  /// last flushed.  Must be called with the lock held.
+  void flush_buckets(int now,
+                     std::vector<std::string>& timers_to_delete,
+                     std::vector<TimerUpdate>& timers_to_set);
+
+  /// Sends a batch of timer updates to Chronos and records the resulting
+  /// timer IDs.  Per-AoR timers superseded by the updates are then deleted.
+  void send_timer_updates(std::vector<TimerUpdate>& updates,
+                          SAS::TrailId trail);
+
+  void tick_loop();
+  static void* tick_thread(void* p);
+
+  ChronosConnection* _chronos;
+  ExpiryHandler _handler;
+  int _bucket_s;
+  int _flush_interval_s;
+  int _next_flush;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+  bool _started;
+  pthread_t _thread;
+
+  TimerWheel _wheel;
+  std::unordered_map<std::string, AoREntry> _aors;
+  std::map<int, Bucket> _buckets;
+};
+
+#endif
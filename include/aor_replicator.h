@@ -0,0 +1,161 @@
+/**
+ * @file aor_replicator.h Asynchronous replication of AoRs to a remote site.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_REPLICATOR_H__
+#define AOR_REPLICATOR_H__
+
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+#include "subscriber_data_manager.h"
+#include "snmp_event_accumulator_table.h"
+#include "sas.h"
+
+/// Replicates AoRs to the remote site's store in the background, so that
+/// requests which update the local store don't wait for a write to the
+/// remote site before completing.
+///
+/// Each write to the local store queues a replication record for the AoR.
+/// If the AoR is already queued, the records are coalesced so that only the
+/// latest state is written.  Records are written in the order they were
+/// first queued, and there is never more than one write in progress for any
+/// AoR, so updates to an AoR reach the remote store in order.
+///
+/// Replication merges the local AoR into the remote one rather than
+/// overwriting it: bindings and subscriptions present locally are copied,
+/// those removed locally are removed, and any others (which may have been
+/// written by the remote site) are left alone.
+class AoRReplicator
+{
+public:
+  /// Constructor.
+  ///
+  /// @param remote_sdm    - The remote store to replicate to.
+  /// @param num_threads   - The number of threads writing to the remote
+  ///                        store.
+  /// @param max_backlog   - The maximum number of AoRs waiting to be
+  ///                        replicated.  If the backlog is full, AoRs are
+  ///                        replicated synchronously by the caller.
+  /// @param lag_tbl       - Records how long AoRs wait to be replicated.
+  /// @param backlog_tbl   - Records the number of AoRs waiting to be
+  ///                        replicated.
+  AoRReplicator(SubscriberDataManager* remote_sdm,
+                int num_threads = DEFAULT_THREADS,
+                size_t max_backlog = DEFAULT_MAX_BACKLOG,
+                SNMP::EventAccumulatorTable* lag_tbl = NULL,
+                SNMP::EventAccumulatorTable* backlog_tbl = NULL);
+
+  /// Destructor.  Replicates any queued AoRs before returning.
+  virtual ~AoRReplicator();
+
+  /// Start the replication threads.
+  void start();
+
+  /// Queue an AoR for replication.  Must be called after the AoR has been
+  /// successfully written to the local store.
+  ///
+  /// @param aor_id        - The AoR.
+  /// @param aor_pair      - The AoR pair written to the local store.
+  /// @param trail         - SAS trail.
+  void replicate(const std::string& aor_id,
+                 SubscriberDataManager::AoRPair* aor_pair,
+                 SAS::TrailId trail);
+
+  /// The number of AoRs waiting to be replicated.
+  size_t backlog();
+
+  static const int DEFAULT_THREADS = 10;
+  static const size_t DEFAULT_MAX_BACKLOG = 10000;
+
+private:
+  /// The changes to replicate for an AoR.
+  struct Record
+  {
+    /// The local AoR at the time of the latest write.  Owned by the record.
+    SubscriberDataManager::AoR* aor;
+
+    /// Bindings and subscriptions removed locally since the AoR was last
+    /// replicated.
+    std::set<std::string> removed_bindings;
+    std::set<std::string> removed_subscriptions;
+
+    /// When the AoR was first queued, in milliseconds.
+    unsigned long queued_ms;
+
+    SAS::TrailId trail;
+  };
+
+  static void build_record(SubscriberDataManager::AoRPair* aor_pair,
+                           SAS::TrailId trail,
+                           Record& record);
+  static void merge_record(Record& existing, Record& update);
+  static void free_record(Record& record);
+
+  void write_record(const std::string& aor_id, Record& record);
+  void replicate_loop();
+  static void* replicate_thread(void* p);
+
+  unsigned long now_ms();
+
+  SubscriberDataManager* _remote_sdm;
+  int _num_threads;
+  size_t _max_backlog;
+  SNMP::EventAccumulatorTable* _lag_tbl;
+  SNMP::EventAccumulatorTable* _backlog_tbl;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+
+  /// Records waiting to be written, one per AoR.
+  std::map<std::string, Record> _records;
+
+  /// AoRs with records ready to be written, in the order they were queued.
+  /// AoRs which are being written are not in the queue; a record queued for
+  /// one of these is added to the queue when the write completes.
+  std::deque<std::string> _queue;
+
+  /// AoRs currently being written to the remote store.
+  std::set<std::string> _in_flight;
+
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+};
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * @file aor_write_serializer.h Serializes writes to each AoR on this node.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_WRITE_SERIALIZER_H__
+#define AOR_WRITE_SERIALIZER_H__
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "store.h"
+#include "snmp_event_accumulator_table.h"
+
+/// Serializes the read-modify-write cycles that threads on this node make
+/// to each AoR, so that they queue rather than repeatedly losing the
+/// store's compare-and-swap to each other.  Writers that still hit
+/// contention (because another node wrote the AoR) back off for a random,
+/// exponentially increasing time before retrying.
+///
+/// AoRs are hashed onto a fixed set of locks, so unrelated AoRs may
+/// occasionally share a lock.  A thread must therefore only write one AoR at
+/// a time.
+class AoRWriteSerializer
+{
+public:
+  /// Constructor.
+  ///
+  /// @param stripes        - The number of locks AoRs are hashed onto.
+  /// @param min_backoff_us - The maximum backoff before the first retry.
+  /// @param max_backoff_us - The maximum backoff before any retry.
+  /// @param retries_tbl    - Accumulates the number of retries per write.
+  AoRWriteSerializer(size_t stripes = DEFAULT_STRIPES,
+                     int min_backoff_us = DEFAULT_MIN_BACKOFF_US,
+                     int max_backoff_us = DEFAULT_MAX_BACKOFF_US,
+                     SNMP::EventAccumulatorTable* retries_tbl = NULL);
+  virtual ~AoRWriteSerializer();
+
+  /// A write to an AoR, which holds the AoR's lock until it is destroyed
+  /// (other than while backing off).  Used as follows.
+  ///
+  ///   AoRWriteSerializer::Write write(sdm->write_serializer(), aor_id);
+  ///   do
+  ///   {
+  ///     // Get, modify and set the AoR.
+  ///   }
+  ///   while (write.retry(set_rc));
+  ///   write.finish();
+  ///
+  /// If the serializer is NULL, writes aren't serialized and contention is
+  /// retried immediately.
+  class Write
+  {
+  public:
+    Write(AoRWriteSerializer* serializer, const std::string& aor_id);
+    ~Write();
+
+    /// Returns whether the write should be retried, backing off first if
+    /// so.  The AoR's lock is released while backing off, so the AoR must
+    /// be re-read before it is retried.
+    ///
+    /// @param status   - The result of the last attempt to set the AoR.
+    bool retry(Store::Status status);
+
+    /// Releases the AoR's lock.  Called on destruction if not called
+    /// explicitly.
+    void finish();
+
+  private:
+    AoRWriteSerializer* _serializer;
+    pthread_mutex_t* _lock;
+    int _retries;
+  };
+
+  static const size_t DEFAULT_STRIPES = 1024;
+  static const int DEFAULT_MIN_BACKOFF_US = 1000;
+  static const int DEFAULT_MAX_BACKOFF_US = 64000;
+
+private:
+  /// Returns the lock for an AoR.
+  pthread_mutex_t* lock_for(const std::string& aor_id);
+
+  /// Sleeps before a retry.
+  ///
+  /// @param retries  - The number of retries made so far.
+  void backoff(int retries);
+
+  std::vector<pthread_mutex_t> _locks;
+  int _min_backoff_us;
+  int _max_backoff_us;
+  SNMP::EventAccumulatorTable* _retries_tbl;
+};
+
+#endif
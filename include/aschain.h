@@ -42,8 +42,10 @@ extern "C" {
 #include <pjlib.h>
 }
 
+#include <stdint.h>
 #include <string>
 #include <vector>
+#include <atomic>
 
 #include "log.h"
 #include "sessioncase.h"
@@ -166,6 +168,9 @@ private:
   /// ODI tokens, one for each step.
   std::vector<std::string> _odi_tokens;
 
+  /// The slot in the AsChainTable that the ODI tokens refer to.
+  uint32_t _odi_slot;
+
   /// Vector keeping track of whether particular app servers have responded
   /// (either by sending a response to the original request, or forwarding
   /// the request back).
@@ -377,6 +382,15 @@ private:
 
 
 /// Lookup table of AsChain objects.
+//
+// Each AsChain occupies a slot in the table.  An ODI token encodes the
+// slot, the slot's generation (which changes each time the slot is
+// reused), the step in the chain and a random nonce, so that lookups and
+// unregistration go straight to the slot without taking a lock, and stale
+// or forged tokens are rejected.
+//
+// Slots are allocated in chunks, which are never freed while the table
+// exists.
 class AsChainTable
 {
 public:
@@ -387,16 +401,62 @@ public:
   // token. The 0th token thus indicates the 1st step, the 1st token
   // the 2nd step, and so on.
   AsChainLink lookup(const std::string& token);
+  AsChainLink lookup(const char* token, size_t token_len);
 
 private:
   friend class AsChain;
 
   void register_(AsChain* as_chain, std::vector<std::string>& tokens);
-  void unregister(std::vector<std::string>& tokens);
+  void unregister(uint32_t slot_index);
+
+  /// A slot holding an AsChain.
+  struct Slot
+  {
+    /// The slot's generation (top 32 bits), the number of lookups currently
+    /// reading the slot, and whether the slot holds a chain (bottom bit).
+    std::atomic<uint64_t> state;
+
+    /// The chain and its nonce.  Only written while no lookups are reading
+    /// the slot.
+    AsChain* chain;
+    uint64_t nonce;
+
+    /// The next slot on the free list, plus one (so zero means none).
+    std::atomic<uint32_t> next_free;
+  };
+
+  static const uint64_t SLOT_LIVE = 1;
+  static const uint64_t SLOT_PIN = 2;
+  static const uint64_t SLOT_PINS_MASK = 0xFFFFFFFEull;
+
+  static const uint32_t CHUNK_SIZE = 4096;
+  static const uint32_t MAX_CHUNKS = 256;
+  static const uint32_t NO_SLOT = 0xFFFFFFFF;
+
+  /// Tokens are fixed-length hex strings: 6 digits of slot, 8 of generation,
+  /// 4 of step and 16 of nonce.
+  static const size_t TOKEN_LENGTH = 34;
+
+  Slot* slot(uint32_t slot_index);
+  static Slot* new_chunk();
+  uint32_t allocate_slot();
+  void free_slot(uint32_t slot_index);
+
+  static bool parse_token(const char* token,
+                          size_t token_len,
+                          uint32_t& slot_index,
+                          uint32_t& generation,
+                          uint32_t& step,
+                          uint64_t& nonce);
+  static uint64_t random_nonce();
+
+  std::atomic<Slot*> _chunks[MAX_CHUNKS];
+  pthread_mutex_t _chunks_lock;
 
-  static const int TOKEN_LENGTH = 10;
+  /// The number of slots that have ever been allocated.
+  std::atomic<uint32_t> _next_unused;
 
-  /// Map from ODI token to pair of (AsChain, index).
-  std::map<std::string, AsChainLink> _odi_token_map;
-  pthread_mutex_t _lock;
+  /// Head of the free list: the first free slot plus one in the bottom 32
+  /// bits, and a counter in the top 32 bits to guard against ABA.
+  std::atomic<uint64_t> _free_head;
 };
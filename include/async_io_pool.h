@@ -0,0 +1,102 @@
+/**
+ * @file async_io_pool.h Pool of threads for blocking I/O on behalf of sproutlets.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ASYNC_IO_POOL_H__
+#define ASYNC_IO_POOL_H__
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <pthread.h>
+
+/// Runs blocking I/O (such as HSS, XDM and ENUM queries, or store reads)
+/// for sproutlets, so that the worker threads aren't held up waiting for
+/// it.
+///
+/// Each operation is run on one of the pool's threads.  When it completes,
+/// its completion callback is passed to the dispatcher, which normally
+/// queues it to run on a worker thread.
+class AsyncIOPool
+{
+public:
+  typedef std::function<void()> Callback;
+  typedef std::function<void(const Callback&)> Dispatcher;
+
+  /// Constructor.
+  ///
+  /// @param num_threads   - The number of I/O threads.
+  /// @param dispatcher    - Called with each completion callback.  If not
+  ///                        set, completion callbacks are run on the I/O
+  ///                        thread.
+  AsyncIOPool(int num_threads, Dispatcher dispatcher = Dispatcher());
+
+  /// Destructor.  Runs any queued operations before returning.
+  virtual ~AsyncIOPool();
+
+  /// Start the I/O threads.
+  void start();
+
+  /// Queue an operation.
+  ///
+  /// @param work          - The operation, run on an I/O thread.
+  /// @param done          - The completion callback, passed to the
+  ///                        dispatcher once the operation has run.
+  void run(const Callback& work, const Callback& done);
+
+  /// The number of operations waiting for an I/O thread.
+  size_t queue_size();
+
+private:
+  struct Operation
+  {
+    Callback work;
+    Callback done;
+  };
+
+  void io_loop();
+  static void* io_thread(void* p);
+
+  int _num_threads;
+  Dispatcher _dispatcher;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<Operation> _queue;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+};
+
+#endif
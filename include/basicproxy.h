@@ -324,6 +324,34 @@ protected:
     /// Called when timer C expires.
     void timer_c_expired();
 
+    /// Starts the hedge timer if the request is eligible to be hedged to an
+    /// alternate server.
+    void start_hedge_timer();
+
+    /// Stops the hedge timer.
+    void stop_hedge_timer();
+
+    /// Called when the hedge timer expires.
+    void hedge_timer_expired();
+
+    /// Sends a hedged copy of the request to the next server in the list.
+    void send_hedge();
+
+    /// Makes the hedged request the current transaction.
+    void switch_to_hedge();
+
+    /// Abandons the hedged request, if there is one.
+    void drop_hedge();
+
+    /// Handles a state change on the hedged request's transaction.
+    void on_hedge_tsx_state(pjsip_event* event);
+
+    /// Reports the outcome of a request to the destination health tracker.
+    void record_health(pjsip_transaction* tsx,
+                       pjsip_event* event,
+                       const AddrInfo& server,
+                       unsigned long send_time_ms);
+
     /// Owning proxy object.
     BasicProxy* _proxy;
 
@@ -360,6 +388,22 @@ protected:
     /// either cancelled or reported as non-responsive.
     pj_timer_entry _timer_c;
 
+    /// Time the request was sent to the current server.
+    unsigned long _send_time_ms;
+
+    /// Pointer to the PJSIP UAC transaction used to send a hedged copy of
+    /// the request to the next server, along with the index of that server
+    /// and the time the copy was sent.  _hedge_tsx is NULL if no hedge is
+    /// outstanding.
+    pjsip_transaction* _hedge_tsx;
+    int _hedge_server;
+    unsigned long _hedge_send_time_ms;
+
+    /// Hedge timer entry.  This timer runs while a hedgeable request is
+    /// waiting for a response from the current server.  If the timer
+    /// expires, a copy of the request is sent to the next server.
+    pj_timer_entry _timer_hedge;
+
     SAS::TrailId _trail;
 
     bool _pending_destroy;
@@ -371,6 +415,7 @@ protected:
     friend class UASTsx;
 
     static const int TIMER_C = 3;
+    static const int TIMER_HEDGE = 4;
   };
 
   void* get_from_transaction(pjsip_transaction* tsx);
@@ -63,6 +63,9 @@ public:
   std::vector<std::string> get_route_from_number(const std::string &number,
                                                  SAS::TrailId trail) const;
 
+  /// Returns every route URI in the configuration.
+  std::vector<std::string> all_routes() const;
+
 private:
   std::map<std::string, std::vector<std::string>> _domain_routes;
   std::map<std::string, std::vector<std::string>> _number_routes;
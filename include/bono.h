@@ -379,7 +379,8 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* sdm,
                                 SCSCFSelector *scscfSelector,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted);
+                                bool emerg_reg_accepted,
+                                bool stateless_in_dialog_enabled = false);
 
 void destroy_stateful_proxy();
 
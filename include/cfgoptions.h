@@ -68,6 +68,7 @@ struct options
   int                                  pcscf_untrusted_port;
   int                                  pcscf_trusted_port;
   int                                  webrtc_port;
+  int                                  webrtc_threads;
   std::string                          upstream_proxy;
   int                                  upstream_proxy_port;
   int                                  upstream_proxy_connections;
@@ -136,6 +137,24 @@ struct options
   std::string                          pbx_service_route;
   NonRegisterAuthentication            non_register_auth_mode;
   bool                                 force_third_party_register_body;
+  bool                                 suppress_third_party_register_refreshes;
+  bool                                 outlier_ejection;
+  bool                                 request_hedging;
+  bool                                 async_remote_replication;
+  int                                  sas_log_threads;
+  std::string                          sas_sample_rates;
+  bool                                 peer_fair_share;
+  std::string                          peer_weights;
+  int                                  icscf_hss_cache_ttl_ms;
+  int                                  async_io_threads;
+  bool                                 local_aor_expiry;
+  bool                                 separate_reg_subscriptions;
+  bool                                 dns_prefetch;
+  bool                                 latency_breakdown;
+  int                                  slow_request_threshold_ms;
+  bool                                 stateless_in_dialog;
+  bool                                 deferred_acrs;
+  std::string                          warm_start_snapshot;
   std::string                          memento_notify_url;
   std::string                          pidfile;
   std::map<std::string, std::multimap<std::string, std::string>>
@@ -53,12 +53,16 @@ extern "C" {
 #include "load_monitor.h"
 #include "snmp_counter_table.h"
 #include "health_checker.h"
+#include "sas_msg_logger.h"
+#include "peer_admission.h"
 
 pj_status_t
 init_common_sip_processing(LoadMonitor* load_monitor_arg,
                            SNMP::CounterTable* requests_counter_arg,
                            SNMP::CounterTable* overload_counter_arg,
-                           HealthChecker* health_checker_arg);
+                           HealthChecker* health_checker_arg,
+                           SasMsgLogger* sas_msg_logger_arg = NULL,
+                           PeerAdmission* peer_admission_arg = NULL);
 
 void unregister_common_processing_module(void);
 
@@ -0,0 +1,89 @@
+/**
+ * @file contact_features.h Pre-parsed Contact header feature parameters.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CONTACT_FEATURES_H__
+#define CONTACT_FEATURES_H__
+
+#include <string>
+#include <vector>
+#include <map>
+
+/// The value of a feature parameter (RFC 3840) from a Contact,
+/// Accept-Contact or Reject-Contact header, parsed into the form used for
+/// matching.  Parsing is done once, so that matching doesn't need to copy,
+/// split or lower-case any strings.
+class ContactFeature
+{
+public:
+  /// The type of a feature value.
+  enum Type { TOKENS, STRING, NUMERIC };
+
+  /// Parses a feature value.  A value with no contents is the boolean TRUE.
+  ContactFeature(const std::string& value);
+
+  /// Parses a numeric value, of the form "#N", "#>=N", "#<=N" or "#N:M".
+  /// Returns false if it is badly formed.
+  static bool parse_numeric(const std::string& value,
+                            float& minimum,
+                            float& maximum);
+
+  /// The value as supplied, for logging.
+  std::string _value;
+
+  Type _type;
+
+  /// For a string value, the string literal (including the angle brackets).
+  std::string _literal;
+
+  /// For a token value, the lower-cased tokens.  A negated token (!X) keeps
+  /// its leading '!'.
+  std::vector<std::string> _tokens;
+
+  /// For a numeric value, the range it covers and whether it was well
+  /// formed.
+  float _minimum;
+  float _maximum;
+  bool _valid;
+};
+
+/// A set of features, indexed by feature name.
+typedef std::map<std::string, ContactFeature> ContactFeatureSet;
+
+/// Parses a set of Contact header parameters into features.
+void parse_contact_features(const std::map<std::string, std::string>& params,
+                            ContactFeatureSet& features);
+
+#endif
@@ -40,6 +40,7 @@
 #include "subscriber_data_manager.h"
 #include "aschain.h"
 #include "custom_headers.h"
+#include "contact_features.h"
 
 typedef std::map<std::string, std::string> FeatureSet;
 typedef std::pair<const std::string, std::string> Feature;
@@ -47,6 +48,19 @@ typedef std::pair<const std::string, std::string> Feature;
 // Exception thrown if a feature rule doesn't parse
 class FeatureParseError {};
 
+// The feature predicate from an Accept-Contact or Reject-Contact header,
+// parsed once per request so it can be matched against each binding.
+struct ContactPredicate
+{
+  ContactPredicate(const pjsip_param* feature_set,
+                   bool explicit_match = false,
+                   bool required_match = false);
+
+  std::vector<std::pair<std::string, ContactFeature>> features;
+  bool explicit_match;
+  bool required_match;
+};
+
 // Entry point for contact filtering.  Convert the set of bindings to a set of
 // Targets, applying filtering where required.
 void filter_bindings_to_targets(const std::string& aor,
@@ -72,6 +86,21 @@ void add_implicit_filters(const pjsip_msg* msg,
 
 // Utility functions for comparing feature sets.
 enum MatchResult { YES, NO };
+MatchResult match_accept_contact(const ContactFeatureSet& contact_features,
+                                 const ContactPredicate& accept);
+MatchResult match_reject_contact(const ContactFeatureSet& contact_features,
+                                 const ContactPredicate& reject);
+MatchResult match_feature(const std::string& name,
+                          const ContactFeature& matcher,
+                          const ContactFeature& matchee);
+MatchResult match_ranges(float matcher_minimum,
+                         float matcher_maximum,
+                         float matchee_minimum,
+                         float matchee_maximum);
+MatchResult match_token_lists(const std::vector<std::string>& matcher_tokens,
+                              const std::vector<std::string>& matchee_tokens);
+
+// Versions of the above that parse the features as they go.
 MatchResult match_feature_sets(const FeatureSet& contact_filter_set,
                                pjsip_accept_contact_hdr* accept);
 MatchResult match_feature_sets(const FeatureSet& contact_filter_set,
@@ -0,0 +1,188 @@
+/**
+ * @file destination_health.h Latency and error tracking for downstream SIP destinations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef DESTINATION_HEALTH_H__
+#define DESTINATION_HEALTH_H__
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#include "baseresolver.h"
+
+/// Tracks the latency and error rate of each downstream destination
+/// (IP address/port/transport) that SIP requests are sent to statefully, as
+/// exponentially weighted moving averages.
+///
+/// This is used to
+/// -  eject outliers - destinations that are failing or are much slower than
+///    they should be are moved to the back of the list of targets returned by
+///    the resolver for a while, and are then gradually reintroduced
+/// -  pick the delay before a hedged request is sent to an alternate
+///    destination, based on an estimate of the 99th percentile latency of the
+///    destination first tried.
+class DestinationHealth
+{
+public:
+  /// Constructor.
+  ///
+  /// @param outlier_ejection      - Whether to eject outliers.
+  /// @param hedging               - Whether to send hedged requests.
+  /// @param ejection_latency_ms   - Destinations whose average latency is
+  ///                                higher than this are ejected.
+  DestinationHealth(bool outlier_ejection,
+                    bool hedging,
+                    unsigned long ejection_latency_ms = DEFAULT_EJECTION_LATENCY_MS);
+  virtual ~DestinationHealth();
+
+  /// Records that a destination responded to a request.
+  ///
+  /// @param server                - The destination.
+  /// @param latency_ms            - The time from sending the request to
+  ///                                receiving the first response.
+  void record_response(const AddrInfo& server, unsigned long latency_ms);
+
+  /// Records that a request to a destination failed (with a timeout, a
+  /// transport error or a 5xx response).
+  void record_failure(const AddrInfo& server);
+
+  /// Moves any ejected destinations to the end of a list of targets, leaving
+  /// the relative order of the remaining destinations unchanged.  Ejected
+  /// destinations are kept as a last resort.
+  void reorder_servers(std::vector<AddrInfo>& servers);
+
+  /// Returns how long to wait for a response from a destination before
+  /// sending a hedged request to an alternate one, or zero if too little is
+  /// known about the destination to say.
+  unsigned long hedge_delay_ms(const AddrInfo& server);
+
+  /// The number of destinations being tracked.
+  size_t size();
+
+  /// Whether hedged requests are enabled.
+  bool hedging_enabled() const { return _hedging; }
+
+  /// Returns the current time in milliseconds.  Virtual so that UT can
+  /// control time.
+  virtual unsigned long now_ms();
+
+  static const unsigned long DEFAULT_EJECTION_LATENCY_MS = 1000;
+
+protected:
+  /// Generates a random number in [0, 1).  Virtual so UT can control it.
+  virtual double random();
+
+private:
+  struct Stats
+  {
+    Stats();
+
+    double latency_ms;
+    double latency_variance;
+    double error_rate;
+    unsigned int samples;
+
+    /// The number of times in a row the destination has been ejected.  This
+    /// is reset once a destination has been healthy for a while.
+    int ejections;
+
+    /// The destination is ejected until ejected_until_ms, and is then
+    /// reintroduced gradually until reintroduced_at_ms.
+    unsigned long ejected_until_ms;
+    unsigned long reintroduced_at_ms;
+
+    /// When a request to the destination last completed.
+    unsigned long last_used_ms;
+  };
+
+  Stats* find_or_add(const AddrInfo& server, unsigned long now);
+  void prune(unsigned long now);
+  void update(Stats& stats, double latency_ms, bool failed);
+  void check_for_ejection(Stats& stats, unsigned long now);
+  bool available(const Stats& stats, unsigned long now);
+
+  /// Weight given to each new sample in the moving averages.
+  static const double SMOOTHING_FACTOR;
+
+  /// Number of z-scores above the mean latency of the 99th percentile, if
+  /// latencies are roughly normally distributed.
+  static const double P99_Z_SCORE;
+
+  /// The number of samples needed before a destination's averages are
+  /// trusted.
+  static const unsigned int MIN_SAMPLES = 20;
+
+  /// Destinations whose error rate exceeds this are ejected.
+  static const double EJECTION_ERROR_RATE;
+
+  /// Outlier ejection never ejects more than this percentage of the known
+  /// destinations, so a general problem downstream doesn't eject everything.
+  static const int MAX_EJECTED_PERCENT = 50;
+
+  /// The first ejection lasts BASE_EJECTION_MS, and each consecutive ejection
+  /// lasts twice as long as the previous one, up to MAX_EJECTION_MS.
+  static const unsigned long BASE_EJECTION_MS = 10000;
+  static const unsigned long MAX_EJECTION_MS = 300000;
+
+  /// The time over which an ejected destination's share of traffic is
+  /// increased back to normal.
+  static const unsigned long REINTRODUCTION_MS = 30000;
+
+  /// Destinations that haven't been used for IDLE_EXPIRY_MS are forgotten.
+  /// The statistics are checked for idle destinations every
+  /// PRUNE_INTERVAL_MS.
+  static const unsigned long IDLE_EXPIRY_MS = 600000;
+  static const unsigned long PRUNE_INTERVAL_MS = 60000;
+
+  /// The maximum number of destinations tracked.  Requests routed directly
+  /// to UE contacts can reach any number of destinations, so once this many
+  /// are tracked, new destinations are ignored until idle ones are pruned.
+  static const size_t MAX_DESTINATIONS = 10000;
+
+  /// Bounds on the delay before a hedged request.
+  static const unsigned long MIN_HEDGE_DELAY_MS = 10;
+  static const unsigned long MAX_HEDGE_DELAY_MS = 2000;
+
+  bool _outlier_ejection;
+  bool _hedging;
+  unsigned long _ejection_latency_ms;
+
+  pthread_mutex_t _lock;
+  std::map<AddrInfo, Stats> _stats;
+  unsigned long _next_prune_ms;
+};
+
+#endif
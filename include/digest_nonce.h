@@ -0,0 +1,188 @@
+/**
+ * @file digest_nonce.h Self-validating digest nonces and nonce count tracking.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef DIGEST_NONCE_H__
+#define DIGEST_NONCE_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/// Mints digest nonces that carry their own expiry, protected by an HMAC
+/// under a key private to this node.  This allows requests with forged or
+/// expired nonces to be rejected without reading the IMPI store.
+///
+/// A nonce is 48 hex digits: 16 random digits, the expiry time (8 digits),
+/// the ID of the key (8 digits) and a truncated HMAC of the preceding fields
+/// and the IMPI (16 digits).  Nonces minted by other nodes (or before a
+/// restart) have a different key ID, so can't be checked and must be looked
+/// up in the store as before.
+class DigestNonceSigner
+{
+public:
+  enum Validity
+  {
+    // Minted by this node, and not yet expired.
+    VALID,
+
+    // Minted by this node, but its initial expiry has passed.
+    EXPIRED,
+
+    // Claims to be minted by this node, but the HMAC doesn't match.
+    FORGED,
+
+    // Not minted by this node, so its validity is unknown.
+    UNKNOWN
+  };
+
+  /// Constructor.  Generates a random key.
+  DigestNonceSigner();
+
+  /// Constructor.
+  ///
+  /// @param key           - The key to sign nonces with.
+  DigestNonceSigner(const std::string& key);
+
+  virtual ~DigestNonceSigner() {}
+
+  /// Mints a nonce.
+  ///
+  /// @param impi          - The private identity the nonce is for.
+  /// @param expires       - When the challenge initially expires.
+  std::string mint(const std::string& impi, time_t expires);
+
+  /// Checks a nonce.
+  ///
+  /// @param nonce         - The nonce to check.
+  /// @param impi          - The private identity the nonce was used with.
+  /// @param now           - The current time.
+  Validity check(const std::string& nonce,
+                 const std::string& impi,
+                 time_t now);
+
+  static const size_t NONCE_LENGTH = 48;
+
+private:
+  /// Calculates the HMAC over a nonce prefix and IMPI, as hex.
+  std::string sign(const std::string& prefix, const std::string& impi);
+
+  std::string _key;
+  std::string _key_id;
+};
+
+/// Tracks the nonce counts that have been accepted on this node for each
+/// nonce, so that replayed requests can be rejected without reading the IMPI
+/// store.  Each nonce has a sliding window of the most recent counts seen.
+///
+/// Nonces not in the window (for example because another node accepted
+/// them, or they have been evicted) must be checked against the store.
+class NonceCountWindow
+{
+public:
+  enum Result
+  {
+    // The nonce count hasn't been seen.
+    NEW,
+
+    // The nonce count has been seen, or is too old to tell.
+    REPLAYED,
+
+    // The nonce isn't tracked.
+    UNKNOWN
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_nonces    - The maximum number of nonces to track.  If this
+  ///                        is reached, the least recently used nonce is
+  ///                        forgotten.
+  NonceCountWindow(size_t max_nonces = DEFAULT_MAX_NONCES);
+  virtual ~NonceCountWindow();
+
+  /// Checks whether a nonce count has been seen.
+  ///
+  /// @param nonce         - The nonce.
+  /// @param nonce_count   - The nonce count on the request.
+  /// @param now           - The current time.
+  /// @param next_count    - (out) If the count is replayed, the lowest count
+  ///                        that could be accepted.
+  Result check(const std::string& nonce,
+               uint32_t nonce_count,
+               time_t now,
+               uint32_t& next_count);
+
+  /// Records that a nonce count has been accepted.
+  ///
+  /// @param nonce         - The nonce.
+  /// @param nonce_count   - The nonce count that has been accepted.
+  /// @param expires       - When the challenge expires.  The nonce is
+  ///                        forgotten after this.
+  void record(const std::string& nonce, uint32_t nonce_count, time_t expires);
+
+  /// The number of nonces tracked.
+  size_t size();
+
+  static const size_t DEFAULT_MAX_NONCES = 100000;
+
+  /// The number of nonce counts in each window.
+  static const uint32_t WINDOW_SIZE = 64;
+
+private:
+  struct Window
+  {
+    // The highest nonce count accepted.
+    uint32_t highest;
+
+    // Bit N is set if (highest - N) has been accepted.
+    uint64_t seen;
+
+    time_t expires;
+    std::list<std::string>::iterator lru;
+  };
+
+  size_t _max_nonces;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, Window> _windows;
+
+  // The nonces, least recently used first.
+  std::list<std::string> _lru;
+};
+
+#endif
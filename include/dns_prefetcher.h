@@ -0,0 +1,222 @@
+/**
+ * @file dns_prefetcher.h Keeps the DNS records for configured next hops warm.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef DNS_PREFETCHER_H__
+#define DNS_PREFETCHER_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <atomic>
+#include <pthread.h>
+
+#include "sipresolver.h"
+#include "snmp_counter_table.h"
+#include "warm_start_snapshot.h"
+
+/// Keeps the DNS records for the next hops Sprout routes to warm, so that
+/// the call processing threads don't have to wait for them to be looked up.
+///
+/// Targets come from two places - sources, which are polled periodically
+/// for the URIs of configured next hops (BGCF routes, S-CSCFs, the I-CSCF
+/// and so on), and learn_uri, which is called with the URIs of application
+/// servers as they are used.  Each target is re-resolved on the
+/// prefetcher's thread as its records reach the end of their TTL, so the
+/// cache is repopulated there rather than on the first request to need it.
+/// Learned targets that haven't been looked up for a while are dropped.
+class DnsPrefetcher
+{
+public:
+  /// Returns the URIs of a set of configured next hops.
+  typedef std::function<std::vector<std::string>()> Source;
+
+  /// Constructor.
+  ///
+  /// @param resolver      - The resolver to prefetch through.
+  /// @param af            - The address family to resolve.
+  /// @param hits_tbl      - Counts lookups of prefetched targets whose
+  ///                        records were in the resolver's cache.
+  /// @param misses_tbl    - Counts lookups of prefetched targets whose
+  ///                        records weren't (because they have never been
+  ///                        resolved, or the last prefetch failed or has
+  ///                        expired).
+  /// @param refreshes_tbl - Counts prefetches.
+  DnsPrefetcher(SIPResolver* resolver,
+                int af,
+                SNMP::CounterTable* hits_tbl = NULL,
+                SNMP::CounterTable* misses_tbl = NULL,
+                SNMP::CounterTable* refreshes_tbl = NULL);
+
+  /// Destructor.  Stops the prefetcher's thread.
+  virtual ~DnsPrefetcher();
+
+  /// Starts the thread that refreshes the targets.
+  void start();
+
+  /// Adds a source of configured next hops.  Sources are called on the
+  /// prefetcher's thread, so must be thread-safe.
+  ///
+  /// @returns             - An ID to pass to remove_source.
+  int add_source(const Source& source);
+
+  /// Removes a source.  Once this returns the source won't be called again.
+  void remove_source(int id);
+
+  /// Records that a request has been routed to the specified URI, so that
+  /// its target is kept warm.
+  void learn_uri(const std::string& uri);
+
+  /// Records a lookup made by the call processing threads, so that the
+  /// prefetch hit rate can be tracked.  Lookups of targets the prefetcher
+  /// isn't tracking are ignored.
+  void record_lookup(const std::string& name,
+                     int port,
+                     int transport);
+
+  /// Polls the sources if they are due and refreshes any targets whose
+  /// records are due to expire.  Called once a second by the prefetcher's
+  /// thread.
+  void tick(int now);
+
+  /// Returns the number of targets being tracked.
+  size_t size();
+
+  /// Writes the learned targets to a warm-start snapshot.  Configured
+  /// targets aren't saved, since the sources supply them again.
+  void save(WarmStartSnapshot::Writer& writer);
+
+  /// Reads learned targets back from a warm-start snapshot.  Their records
+  /// aren't saved, so they are all resolved again on the next tick, before
+  /// the call processing threads need them.
+  void restore(WarmStartSnapshot::Reader& reader, int age_s);
+
+  /// Parses the target to resolve out of a SIP URI.
+  ///
+  /// @returns             - false if the URI isn't a SIP URI.
+  static bool parse_target(const std::string& uri,
+                           std::string& name,
+                           int& port,
+                           int& transport);
+
+  static const int SOURCE_POLL_INTERVAL_S = 60;
+  static const int FAILURE_RETRY_S = 5;
+  static const int MAX_REFRESH_INTERVAL_S = 3600;
+  static const int IDLE_EXPIRY_S = 3600;
+  static const size_t MAX_TARGETS = 1000;
+
+protected:
+  /// Resolves a target through the resolver.
+  ///
+  /// @returns             - The TTL of the target's records, or -1 if the
+  ///                        target didn't resolve.
+  virtual int resolve(const std::string& name, int port, int transport);
+
+private:
+  struct Target
+  {
+    std::string name;
+    int port;
+    int transport;
+
+    bool operator<(const Target& other) const
+    {
+      if (name != other.name)
+      {
+        return name < other.name;
+      }
+      if (port != other.port)
+      {
+        return port < other.port;
+      }
+      return transport < other.transport;
+    }
+  };
+
+  struct TargetState
+  {
+    int next_refresh;
+
+    /// When the records the resolver returned on the last successful
+    /// prefetch expire from its cache (zero if there aren't any).
+    int records_expire;
+
+    /// Updated by the call processing threads under the read lock.
+    std::atomic<int> last_used;
+
+    bool configured;
+  };
+
+  /// Adds a learned target, if there's room.
+  void add_learned_target(const Target& target, int now);
+
+  /// Builds the key for a target, skipping IP addresses.
+  static bool make_target(const std::string& name,
+                          int port,
+                          int transport,
+                          Target& target);
+
+  /// Calls each of the sources and updates the configured targets.
+  void poll_sources(int now);
+
+  void tick_loop();
+  static void* tick_thread(void* p);
+
+  SIPResolver* _resolver;
+  int _af;
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::CounterTable* _refreshes_tbl;
+
+  pthread_mutex_t _sources_lock;
+  int _next_source_id;
+  std::map<int, Source> _sources;
+
+  /// Protects the targets and the next poll time.  The call processing
+  /// threads only need to read the targets, so take this for reading.
+  pthread_rwlock_t _lock;
+  int _next_poll;
+  std::map<Target, TargetState> _targets;
+
+  /// Protects the thread state, and wakes the thread.
+  pthread_mutex_t _thread_lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+  bool _started;
+  pthread_t _thread;
+};
+
+#endif
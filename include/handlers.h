@@ -37,6 +37,10 @@
 #ifndef HANDLERS_H__
 #define HANDLERS_H__
 
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
 #include "httpstack.h"
 #include "httpstack_utils.h"
 #include "chronosconnection.h"
@@ -44,6 +48,9 @@
 #include "subscriber_data_manager.h"
 #include "sipresolver.h"
 #include "impistore.h"
+#include "aor_replicator.h"
+#include "latency_breakdown.h"
+#include "async_io_pool.h"
 
 /// Common factory for all handlers that deal with chronos timer pops. This is
 /// a subclass of SpawningHandler that requests HTTP flows to be
@@ -70,14 +77,20 @@ public:
   {
     Config(SubscriberDataManager* sdm,
            SubscriberDataManager* remote_sdm,
-           HSSConnection* hss) :
+           HSSConnection* hss,
+           AoRReplicator* replicator = NULL) :
       _sdm(sdm),
       _remote_sdm(remote_sdm),
-      _hss(hss)
+      _hss(hss),
+      _replicator(replicator)
     {}
     SubscriberDataManager* _sdm;
     SubscriberDataManager* _remote_sdm;
     HSSConnection* _hss;
+
+    /// Replicates AoRs to the remote store asynchronously.  If NULL, AoRs
+    /// are written to the remote store directly.
+    AoRReplicator* _replicator;
   };
 
   AoRTimeoutTask(HttpStack::Request& req,
@@ -88,19 +101,47 @@ public:
 
   void run();
 
+  /// Expires any bindings and subscriptions in an AoR that are due, writes
+  /// the AoR back to the local and remote stores, and deregisters it at the
+  /// HSS if it has no bindings left.
+  ///
+  /// @param cfg          - The task configuration.
+  /// @param aor_id       - The AoR.
+  /// @param only_if_due  - If set, the AoR is left alone unless some of it is
+  ///                       due to expire.
+  /// @param trail        - SAS trail.
+  static void expire_aor(const Config* cfg,
+                         const std::string& aor_id,
+                         bool only_if_due,
+                         SAS::TrailId trail);
+
+  /// Expires a batch of AoRs, popped by the local expiry wheel or a Chronos
+  /// bucket timer.  AoRs with nothing due yet are left alone - they have
+  /// been refreshed since the batch was built, and the node that refreshed
+  /// them is tracking their expiry.
+  static void expire_aors(const Config* cfg,
+                          const std::vector<std::string>& aor_ids,
+                          SAS::TrailId trail);
+
 protected:
   void handle_response();
   HTTPCode parse_response(std::string body);
-  SubscriberDataManager::AoRPair* set_aor_data(
+  static SubscriberDataManager::AoRPair* set_aor_data(
                         SubscriberDataManager* current_sdm,
                         std::string aor_id,
                         SubscriberDataManager::AoRPair* previous_aor_data,
                         SubscriberDataManager* remote_sdm,
-                        bool& all_bindings_expired);
+                        bool& all_bindings_expired,
+                        bool only_if_due,
+                        bool& not_due,
+                        SAS::TrailId trail);
 
 protected:
   const Config* _cfg;
   std::string _aor_id;
+
+  /// The AoRs in a Chronos bucket timer, if this is a bucket timer pop.
+  std::vector<std::string> _aor_ids;
 };
 
 class DeregistrationTask : public HttpStackUtils::Task
@@ -112,26 +153,47 @@ public:
            SubscriberDataManager* remote_sdm,
            HSSConnection* hss,
            SIPResolver* sipresolver,
-           ImpiStore* impi_store) :
+           ImpiStore* impi_store,
+           AoRReplicator* replicator = NULL,
+           AsyncIOPool* worker_pool = NULL,
+           int max_workers = DEFAULT_MAX_WORKERS) :
       _sdm(sdm),
       _remote_sdm(remote_sdm),
       _hss(hss),
       _sipresolver(sipresolver),
-      _impi_store(impi_store)
+      _impi_store(impi_store),
+      _replicator(replicator),
+      _worker_pool(worker_pool),
+      _max_workers(max_workers)
     {}
     SubscriberDataManager* _sdm;
     SubscriberDataManager* _remote_sdm;
     HSSConnection* _hss;
     SIPResolver* _sipresolver;
     ImpiStore* _impi_store;
+
+    /// Replicates AoRs to the remote store asynchronously.  If NULL, AoRs
+    /// are written to the remote store by this task.
+    AoRReplicator* _replicator;
+
+    /// The threads shared by all requests to process AoRs (and IMPIs)
+    /// concurrently, which bounds the total number of threads however many
+    /// requests are in progress.  If NULL, each request is processed on the
+    /// HTTP thread alone.
+    AsyncIOPool* _worker_pool;
+
+    /// The maximum number of AoRs (or IMPIs) a single request processes
+    /// concurrently.
+    int _max_workers;
+
+    static const int DEFAULT_MAX_WORKERS = 16;
   };
 
 
   DeregistrationTask(HttpStack::Request& req,
                      const Config* cfg,
-                     SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail), _cfg(cfg)
-  {};
+                     SAS::TrailId trail);
+  virtual ~DeregistrationTask();
 
   void run();
   HTTPCode handle_request();
@@ -145,9 +207,53 @@ public:
                     std::set<std::string>& impis_to_delete);
 
 protected:
+  /// An AoR that has been deregistered locally, waiting to be written to
+  /// the remote site.
+  struct RemoteWrite
+  {
+    std::string aor_id;
+    std::string private_id;
+    SubscriberDataManager::AoRPair* aor_pair;
+  };
+
+  size_t num_workers(size_t work_items);
+  void start_pool_workers(void (DeregistrationTask::*worker)(),
+                          size_t num_workers);
+  void wait_for_pool_workers();
+  void deregister_aors();
+  void delete_impis();
+  void write_to_remote();
+  void queue_remote_write(const std::string& aor_id,
+                          const std::string& private_id,
+                          SubscriberDataManager::AoRPair* aor_pair);
+  void delete_impi(const std::string& impi);
+  std::string build_response_body();
+
+  /// The number of locally deregistered AoRs that can be waiting to be
+  /// written to the remote site before local processing waits.
+  static const size_t MAX_REMOTE_BACKLOG = 256;
+
+  /// How often to log progress through a bulk deregistration.
+  static const size_t PROGRESS_LOG_INTERVAL = 1000;
+
   const Config* _cfg;
   std::map<std::string, std::string> _bindings;
   std::string _notify;
+
+  // State shared between the threads processing a request, protected by
+  // _lock.
+  pthread_mutex_t _lock;
+  pthread_cond_t _remote_cond;
+  pthread_cond_t _remote_space_cond;
+  bool _remote_writer_running;
+  std::map<std::string, std::string>::const_iterator _next_binding;
+  std::set<std::string> _impis_to_delete;
+  std::set<std::string>::const_iterator _next_impi;
+  std::deque<RemoteWrite> _remote_writes;
+  pthread_cond_t _workers_cond;
+  size_t _pool_workers_running;
+  size_t _aors_processed;
+  std::vector<std::string> _failed_aors;
 };
 
 class AuthTimeoutTask : public HttpStackUtils::Task
@@ -176,4 +282,26 @@ protected:
 
 };
 
+/// Reports the latency breakdown statistics as JSON.
+class LatencyBreakdownTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config(LatencyBreakdown* breakdown) : _breakdown(breakdown) {}
+    LatencyBreakdown* _breakdown;
+  };
+
+  LatencyBreakdownTask(HttpStack::Request& req,
+                       const Config* cfg,
+                       SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(cfg)
+  {};
+
+  void run();
+
+protected:
+  const Config* _cfg;
+};
+
 #endif
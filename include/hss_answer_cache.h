@@ -0,0 +1,156 @@
+/**
+ * @file hss_answer_cache.h Cache of HSS answers used for S-CSCF selection.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HSS_ANSWER_CACHE_H__
+#define HSS_ANSWER_CACHE_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <pthread.h>
+
+#include "servercaps.h"
+#include "snmp_counter_table.h"
+#include "warm_start_snapshot.h"
+
+/// Caches the parsed answers to the LIRs and UARs the I-CSCF sends to the
+/// HSS, so that the HSS isn't queried for every terminating request and
+/// every REGISTER.
+///
+/// The S-CSCF assigned to a subscriber (or the capabilities it needs) only
+/// changes when the subscriber registers or deregisters, so answers are
+/// cached for a short time only, and are invalidated if the S-CSCF they
+/// selected turns out to be unusable.
+class HSSAnswerCache
+{
+public:
+  /// A parsed HSS answer.
+  struct Answer
+  {
+    /// The S-CSCF name or capabilities returned by the HSS.
+    ServerCapabilities caps;
+
+    /// Whether the HSS returned capabilities.
+    bool queried_caps;
+  };
+
+  /// Constructor.
+  ///
+  /// @param ttl_ms        - How long answers are cached for.
+  /// @param max_entries   - The maximum number of cached answers.  If the
+  ///                        cache is full, the oldest answer is discarded.
+  /// @param hits_tbl      - Counts lookups which found an answer.
+  /// @param misses_tbl    - Counts lookups which didn't find an answer.
+  /// @param invalidations_tbl
+  ///                      - Counts answers invalidated before they expired.
+  HSSAnswerCache(int ttl_ms,
+                 size_t max_entries = DEFAULT_MAX_ENTRIES,
+                 SNMP::CounterTable* hits_tbl = NULL,
+                 SNMP::CounterTable* misses_tbl = NULL,
+                 SNMP::CounterTable* invalidations_tbl = NULL);
+  virtual ~HSSAnswerCache();
+
+  /// Builds the key for a UAR.  The answer depends on the private identity
+  /// as well as the public one, since the HSS checks they are associated.
+  static std::string uar_key(const std::string& impi,
+                             const std::string& impu,
+                             const std::string& visited_network,
+                             const std::string& auth_type);
+
+  /// Builds the key for an LIR.
+  static std::string lir_key(const std::string& impu, bool originating);
+
+  /// Look up an answer.
+  ///
+  /// @param key           - The key of the query.
+  /// @param answer        - (out) The answer, if found.
+  ///
+  /// @return              - Whether an unexpired answer was found.
+  bool get(const std::string& key, Answer& answer);
+
+  /// Store an answer.
+  void put(const std::string& key, const Answer& answer);
+
+  /// Discard an answer, if it is cached.
+  void invalidate(const std::string& key);
+
+  /// The number of cached answers (including any which have expired but not
+  /// yet been discarded).
+  size_t size();
+
+  /// Writes the unexpired answers to a warm-start snapshot, along with how
+  /// long each has left to live.
+  void save(WarmStartSnapshot::Writer& writer);
+
+  /// Reads answers back from a warm-start snapshot.  Answers which expired
+  /// while Sprout was down are discarded.  Any that are now wrong are
+  /// invalidated in the usual way when the S-CSCF they select fails.
+  ///
+  /// This must be called before any answers are stored, since restored
+  /// answers expire before new ones.
+  void restore(WarmStartSnapshot::Reader& reader, int age_s);
+
+  static const size_t DEFAULT_MAX_ENTRIES = 100000;
+
+private:
+  struct Entry
+  {
+    Answer answer;
+    unsigned long expiry_ms;
+
+    /// The entry's position in _expiry_order.
+    std::list<std::string>::iterator order_it;
+  };
+
+  void erase(std::map<std::string, Entry>::iterator it);
+
+  unsigned long now_ms();
+
+  int _ttl_ms;
+  size_t _max_entries;
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::CounterTable* _invalidations_tbl;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, Entry> _cache;
+
+  /// Cached keys, oldest first.  All answers have the same TTL, so this is
+  /// also the order in which they expire.
+  std::list<std::string> _expiry_order;
+};
+
+#endif
@@ -44,6 +44,7 @@
 #include "rapidjson/document.h"
 
 #include "httpconnection.h"
+#include "http_request_coalescer.h"
 #include "rapidxml/rapidxml.hpp"
 #include "ifchandler.h"
 #include "sas.h"
@@ -163,7 +164,14 @@ private:
                                   rapidxml::xml_document<>*& root,
                                   SAS::TrailId trail);
 
+  // Sends a GET, sharing the response with any identical GETs that are
+  // in flight (except for authentication vector requests).
+  HTTPCode send_get(const std::string& path,
+                    std::string& response,
+                    SAS::TrailId trail);
+
   HttpConnection* _http;
+  HttpRequestCoalescer _coalescer;
   SNMP::EventAccumulatorTable* _latency_tbl;
   SNMP::EventAccumulatorTable* _mar_latency_tbl;
   SNMP::EventAccumulatorTable* _sar_latency_tbl;
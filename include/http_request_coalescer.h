@@ -0,0 +1,108 @@
+/**
+ * @file http_request_coalescer.h Coalesces identical concurrent HTTP requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HTTP_REQUEST_COALESCER_H__
+#define HTTP_REQUEST_COALESCER_H__
+
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "httpconnection.h"
+
+/// Coalesces identical HTTP requests that are in flight at the same time, so
+/// that (for example) a burst of calls to the same subscriber results in a
+/// single request to Homestead.
+///
+/// The first thread to make a request sends it.  Any thread making an
+/// identical request while it is outstanding waits for it to complete and
+/// is given the same response.  Requests are only coalesced while they are
+/// in flight - responses are never reused once they have been returned.
+class HttpRequestCoalescer
+{
+public:
+  /// Sends a request, filling in the response body and returning the HTTP
+  /// result code.
+  typedef std::function<HTTPCode(std::string&)> Request;
+
+  HttpRequestCoalescer();
+  virtual ~HttpRequestCoalescer();
+
+  /// Sends a request, or waits for an identical request that is already in
+  /// flight.
+  ///
+  /// @param key           - Identifies the request.  Requests with the same
+  ///                        key must have the same response (so the key
+  ///                        must include the method, path and any body).
+  /// @param request       - Sends the request if there is no identical
+  ///                        request in flight.
+  /// @param response      - (out) The response body.
+  ///
+  /// @return              - The HTTP result code.
+  HTTPCode send(const std::string& key,
+                const Request& request,
+                std::string& response);
+
+  /// The number of requests that have been satisfied by waiting for an
+  /// identical request, rather than being sent.
+  uint64_t coalesced_count();
+
+private:
+  /// A request that is in flight.
+  struct InFlight
+  {
+    InFlight() : complete(false), rc(0) {}
+
+    bool complete;
+    HTTPCode rc;
+    std::string response;
+  };
+
+  pthread_mutex_t _lock;
+
+  /// Signalled whenever an in-flight request completes.  Requests are
+  /// short-lived and followers are rare, so a single condition is used for
+  /// all of them rather than one per request.
+  pthread_cond_t _cond;
+
+  std::map<std::string, std::shared_ptr<InFlight> > _in_flight;
+  uint64_t _coalesced_count;
+};
+
+#endif
@@ -46,6 +46,7 @@
 #include "scscfselector.h"
 #include "servercaps.h"
 #include "acr.h"
+#include "hss_answer_cache.h"
 
 #include "rapidjson/document.h"
 
@@ -57,11 +58,20 @@ public:
               SCSCFSelector* scscf_selector,
               SAS::TrailId trail,
               ACR* acr,
-              int port);
+              int port,
+              HSSAnswerCache* cache = NULL);
   virtual ~ICSCFRouter();
 
   int get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_uri, bool do_billing=false);
 
+  /// Queries the HSS ahead of selecting an S-CSCF, so that the next call to
+  /// get_scscf doesn't need to.  This blocks, so may be run on an I/O thread.
+  void query_hss();
+
+  /// Discards the cached HSS answer used to select the S-CSCF (if any).
+  /// Called when the S-CSCF fails and the request is retried.
+  void invalidate_cached_answer();
+
 protected:
   /// Do the HSS query.  This must be implemented by the request-type specific
   /// routers.
@@ -73,6 +83,12 @@ protected:
   /// Parses a set of capabilities in the HSS response.
   bool parse_capabilities(rapidjson::Value& caps, std::vector<int>& parsed_caps);
 
+  /// Uses a cached HSS answer, if there is one for the query.
+  bool use_cached_answer(const std::string& key);
+
+  /// Caches the most recent HSS answer.
+  void cache_answer(const std::string& key);
+
   /// Homestead connection class for performing HSS queries.
   HSSConnection* _hss;
 
@@ -88,6 +104,13 @@ protected:
   // Port that I-CSCF is listening on
   int _port;
 
+  /// Cache of HSS answers, or NULL if answers aren't cached.
+  HSSAnswerCache* _cache;
+
+  /// The cache key of the HSS answer the S-CSCF was selected from, or empty
+  /// if that answer isn't cached.
+  std::string _cached_key;
+
   /// Flag which indicates whether or not we have asked the HSS for
   /// capabilities and got a successful response (even if there were no
   /// capabilities specified for this subscriber).
@@ -97,6 +120,13 @@ protected:
   /// transaction.
   ServerCapabilities _hss_rsp;
 
+  /// Whether the HSS has been queried by query_hss, but the result not yet
+  /// used by get_scscf.
+  bool _hss_queried;
+
+  /// The status code from the query made by query_hss.
+  int _hss_query_status;
+
   /// The list of S-CSCFs already attempted for this request.
   std::vector<std::string> _attempted_scscfs;
 };
@@ -114,7 +144,8 @@ public:
                 const std::string& impi,
                 const std::string& impu,
                 const std::string& visited_network,
-                const std::string& auth_type);
+                const std::string& auth_type,
+                HSSAnswerCache* cache = NULL);
   ~ICSCFUARouter();
 
 private:
@@ -146,7 +177,8 @@ public:
                  ACR* acr,
                  int port,
                  const std::string& impu,
-                 bool originating);
+                 bool originating,
+                 HSSAnswerCache* cache = NULL);
   ~ICSCFLIRouter();
 
   /// Function to change the _impu we're looking up. This is used after
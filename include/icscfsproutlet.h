@@ -75,7 +75,8 @@ public:
                  ACRFactory* acr_factory,
                  SCSCFSelector* scscf_selector,
                  EnumService* enum_service,
-                 bool override_npdi);
+                 bool override_npdi,
+                 int hss_cache_ttl_ms = 0);
 
   virtual ~ICSCFSproutlet();
 
@@ -103,6 +104,11 @@ private:
     return _scscf_selector;
   }
 
+  inline HSSAnswerCache* get_hss_cache() const
+  {
+    return _hss_cache;
+  }
+
   inline bool should_override_npdi() const
   {
     return _override_npdi;
@@ -131,6 +137,12 @@ private:
 
   bool _override_npdi;
 
+  /// Cache of HSS answers, or NULL if HSS answers aren't cached.
+  HSSAnswerCache* _hss_cache;
+  SNMP::CounterTable* _hss_cache_hits_tbl;
+  SNMP::CounterTable* _hss_cache_misses_tbl;
+  SNMP::CounterTable* _hss_cache_invalidations_tbl;
+
   /// String versions of cluster URIs
   std::string _bgcf_uri_str;
 };
@@ -186,6 +198,7 @@ public:
   virtual void on_rx_response(pjsip_msg* rsp, int fork_id) override;
   virtual void on_tx_response(pjsip_msg* rsp) override;
   virtual void on_rx_cancel(int status_code, pjsip_msg* req) override;
+  virtual void on_async_complete(void* context) override;
 
 private:
   ICSCFSproutlet* _icscf;
@@ -44,6 +44,7 @@ extern "C" {
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include <memory>
 
 #include "rapidxml/rapidxml.hpp"
@@ -83,6 +84,14 @@ public:
 
   AsInvocation as_invocation() const;
 
+  /// Adds this iFC to a running fingerprint of a set of iFCs.
+  uint64_t fingerprint(uint64_t hash) const;
+
+  /// Whether matching this iFC against a REGISTER depends on the contents
+  /// of the message (headers, Request-URI or body), rather than just the
+  /// method and registration type.
+  bool register_match_uses_message() const;
+
 private:
   static bool spt_matches(const SessionCase& session_case,
                           bool is_registered,
@@ -130,9 +139,31 @@ public:
                  std::vector<AsInvocation>& application_servers,
                  SAS::TrailId trail) const;
 
+  /// Returns a fingerprint of the iFCs.  Two sets of iFCs with the same
+  /// fingerprint select the same application servers for the same message.
+  uint64_t fingerprint() const
+  {
+    return _fingerprint;
+  }
+
+  /// Whether matching these iFCs against a REGISTER depends on the contents
+  /// of the message.  If not, the application servers selected for a
+  /// REGISTER depend only on the iFCs and the registration type.
+  bool register_match_uses_message() const
+  {
+    return _register_match_uses_message;
+  }
+
 private:
+  /// FNV-1a offset basis, which is the fingerprint of an empty set of iFCs.
+  static const uint64_t FINGERPRINT_BASIS = 0xcbf29ce484222325ULL;
+
   std::shared_ptr<rapidxml::xml_document<> > _ifc_doc;
   std::vector<Ifc> _ifcs;
+
+  /// Worked out when the iFCs are parsed.
+  uint64_t _fingerprint;
+  bool _register_match_uses_message;
 };
 
 
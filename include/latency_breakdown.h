@@ -0,0 +1,203 @@
+/**
+ * @file latency_breakdown.h Breaks down message processing latency by phase.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef LATENCY_BREAKDOWN_H__
+#define LATENCY_BREAKDOWN_H__
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+#include "sas.h"
+#include "utils.h"
+#include "snmp_event_accumulator_table.h"
+
+/// Histogram of latencies, with buckets that are exact up to 8us and then
+/// split each power of two into eight, so values are held to within 12.5%.
+/// Recording a value is a couple of atomic increments, so the histogram can
+/// be shared between threads without a lock.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+
+  /// Records a latency.
+  void record(unsigned long value_us);
+
+  /// Returns the number of latencies recorded.
+  uint64_t count() const;
+
+  /// Returns the mean latency.
+  unsigned long mean() const;
+
+  /// Returns the largest latency recorded.
+  unsigned long max() const;
+
+  /// Returns an upper bound on the specified percentile of the recorded
+  /// latencies, or 0 if none have been recorded.
+  unsigned long percentile(double percent) const;
+
+  static const int SUB_BUCKET_BITS = 3;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int NUM_BUCKETS = SUB_BUCKETS * (33 - SUB_BUCKET_BITS);
+
+  /// Maps a latency to its bucket, and a bucket to the largest latency it
+  /// holds.
+  static int bucket_index(unsigned long value_us);
+  static unsigned long bucket_max(int index);
+
+private:
+  std::atomic<uint64_t> _counts[NUM_BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sum_us;
+  std::atomic<unsigned long> _max_us;
+};
+
+/// Splits the time Sprout spends on each message (or callback) run by the
+/// worker threads into phases - waiting in the queue, the store, Homestead,
+/// XDM, ENUM, DNS, iFC evaluation - and accumulates each phase into a
+/// histogram and an SNMP table.  Application server round trips span
+/// messages, so are recorded per AS invocation.
+///
+/// The worker threads call start_message and end_message around each unit of
+/// work, and the phases are timed with PhaseTimers where the work is done.
+/// Phases timed on other threads (for example, on the async I/O threads) are
+/// recorded individually.  Messages that take longer than a threshold can be
+/// logged to SAS with their breakdown.
+///
+/// All the static methods do nothing unless a LatencyBreakdown has been
+/// created.
+class LatencyBreakdown
+{
+public:
+  enum Phase
+  {
+    QUEUE = 0,
+    STORE,
+    HSS,
+    XDM,
+    ENUM,
+    DNS,
+    IFC,
+    AS,
+    NUM_PHASES
+  };
+
+  /// Constructor.  Only one LatencyBreakdown may exist at a time.
+  ///
+  /// @param phase_tbls    - Accumulates the latency of each phase, indexed
+  ///                        by Phase.  May be empty.
+  /// @param slow_request_threshold_us
+  ///                      - Messages that take at least this long are
+  ///                        logged to SAS with their breakdown.  0 disables
+  ///                        this.
+  LatencyBreakdown(const std::vector<SNMP::EventAccumulatorTable*>& phase_tbls,
+                   unsigned long slow_request_threshold_us = 0);
+  ~LatencyBreakdown();
+
+  /// Starts accumulating the phases for a unit of work on this thread.
+  static void start_message();
+
+  /// Records the phases accumulated since start_message.
+  ///
+  /// @param total_us      - The end-to-end latency of the message.
+  /// @param trail         - The message's SAS trail, or 0 if slow requests
+  ///                        shouldn't be logged.
+  static void end_message(unsigned long total_us, SAS::TrailId trail);
+
+  /// Adds time spent in a phase to the current message on this thread, or
+  /// records it directly if this thread isn't processing a message.
+  static void add(Phase phase, unsigned long elapsed_us);
+
+  /// Records time spent in a phase that spans messages, such as an
+  /// application server round trip.
+  static void add_span(Phase phase, unsigned long elapsed_us);
+
+  /// Returns whether latency breakdown is enabled.
+  static bool enabled() { return _instance != NULL; }
+
+  /// Returns the name of a phase.
+  static const char* phase_name(Phase phase);
+
+  /// Returns the statistics for each phase as a JSON object.
+  std::string to_json() const;
+
+  const LatencyHistogram& histogram(Phase phase) const
+  {
+    return _histograms[phase];
+  }
+
+  /// Times a phase for as long as the timer is in scope.
+  class PhaseTimer
+  {
+  public:
+    PhaseTimer(Phase phase) :
+      _phase(phase),
+      _running(LatencyBreakdown::enabled())
+    {
+      if (_running)
+      {
+        _stop_watch.start();
+      }
+    }
+
+    ~PhaseTimer()
+    {
+      unsigned long elapsed_us = 0;
+      if ((_running) && (_stop_watch.read(elapsed_us)))
+      {
+        LatencyBreakdown::add(_phase, elapsed_us);
+      }
+    }
+
+  private:
+    Phase _phase;
+    bool _running;
+    Utils::StopWatch _stop_watch;
+  };
+
+private:
+  void record(Phase phase, unsigned long elapsed_us);
+
+  static LatencyBreakdown* _instance;
+
+  std::vector<SNMP::EventAccumulatorTable*> _phase_tbls;
+  unsigned long _slow_request_threshold_us;
+  LatencyHistogram _histograms[NUM_PHASES];
+};
+
+#endif
@@ -0,0 +1,164 @@
+/**
+ * @file peer_admission.h Per-peer fair-share admission control.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef PEER_ADMISSION_H__
+#define PEER_ADMISSION_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <string>
+#include <map>
+#include <atomic>
+#include <pthread.h>
+
+#include "load_monitor.h"
+#include "snmp_ip_count_table.h"
+
+/// Admission control that shares the load monitor's capacity fairly between
+/// the peers sending requests.
+///
+/// Each peer (identified by its IP address) has a token bucket filled at its
+/// fair share of the load monitor's current rate limit, weighted by the
+/// peer's configured weight.  While no requests are being rejected, a peer
+/// may exceed its share.  Once the load monitor starts rejecting requests,
+/// peers over their share are rejected without taking tokens from the load
+/// monitor, leaving them for peers within their share.
+class PeerAdmission
+{
+public:
+  /// Constructor.
+  ///
+  /// @param min_peer_rate - The minimum rate (requests per second) that each
+  ///                        peer is allowed, however many peers there are.
+  /// @param rejected_tbl  - Counts the requests rejected from each peer.
+  PeerAdmission(int min_peer_rate = DEFAULT_MIN_PEER_RATE,
+                SNMP::IPCountTable* rejected_tbl = NULL);
+
+  virtual ~PeerAdmission();
+
+  /// Configure the peers' weights.
+  ///
+  /// @param weights       - A comma-separated list of <IP address>=<weight>.
+  ///                        Peers not in the list have a weight of 1.
+  ///
+  /// @return false if the list could not be parsed, in which case all peers
+  ///         have a weight of 1.
+  bool set_weights(const std::string& weights);
+
+  /// Decide whether to admit a request from a peer.
+  ///
+  /// @param peer          - The peer's IP address.
+  /// @param load_monitor  - The load monitor.
+  bool admit_request(const std::string& peer, LoadMonitor* load_monitor);
+
+  /// Whether a request must be admitted even when overloaded.  These are
+  /// ACK, BYE and CANCEL requests, other in-dialog requests, and emergency
+  /// requests.
+  static bool is_high_priority(pjsip_msg* msg);
+
+  /// The number of peers being tracked.
+  size_t num_peers();
+
+  static const int DEFAULT_MIN_PEER_RATE = 10;
+
+  /// How long a peer is tracked after its last request.
+  static const unsigned long PEER_IDLE_TIMEOUT_MS = 60000;
+
+  /// How long after the load monitor rejects a request peers over their
+  /// share are rejected.
+  static const unsigned long CONTENTION_PERIOD_MS = 1000;
+
+private:
+  /// The state held for each peer.
+  struct Peer
+  {
+    /// Tokens in the peer's bucket.
+    float tokens;
+    unsigned long last_refill_ms;
+    unsigned long last_request_ms;
+
+    /// The last epoch in which the peer sent a request.
+    unsigned long epoch;
+    int weight;
+
+    /// Whether the peer has a row in the rejected requests table.
+    bool rejected;
+  };
+
+  /// Peers are split between a number of stripes, each with its own lock, so
+  /// that transport threads don't all contend on a single lock.
+  struct Stripe
+  {
+    pthread_mutex_t lock;
+    std::map<std::string, Peer> peers;
+    unsigned long last_sweep_ms;
+  };
+
+  static const int NUM_STRIPES = 16;
+
+  /// The active weight is recalculated every epoch.
+  static const unsigned long EPOCH_MS = 1000;
+
+  Stripe& stripe(const std::string& peer);
+  Peer& find_peer(Stripe& stripe, const std::string& peer, unsigned long now_ms);
+  void refill(Peer& peer, float rate_limit, unsigned long now_ms);
+  void note_active(Peer& peer, unsigned long now_ms);
+  void sweep(Stripe& stripe, unsigned long now_ms);
+  void reject(const std::string& peer_id, Peer& peer);
+
+  unsigned long now_ms();
+
+  int _min_peer_rate;
+  SNMP::IPCountTable* _rejected_tbl;
+
+  /// Configured weights.  Not modified once requests are being admitted, so
+  /// read without a lock.
+  std::map<std::string, int> _weights;
+
+  Stripe _stripes[NUM_STRIPES];
+
+  /// The total weight of the peers that sent requests in the current and
+  /// previous epochs.
+  std::atomic<unsigned long> _epoch;
+  std::atomic<int> _active_weight[2];
+
+  /// Peers over their share are rejected until this time.
+  std::atomic<unsigned long> _contended_until_ms;
+};
+
+#endif
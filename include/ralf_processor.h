@@ -37,11 +37,17 @@
 #ifndef RALF_PROCESSOR_H_
 #define RALF_PROCESSOR_H_
 
+extern "C" {
+#include <pjlib.h>
+}
+
 #include "threadpool.h"
 #include "sas.h"
 #include "httpconnection.h"
 #include "exception_handler.h"
 
+class RalfACR;
+
 class RalfProcessor
 {
 public:
@@ -55,9 +61,22 @@ public:
 
   struct RalfRequest
   {
+    RalfRequest() :
+      trail(0),
+      acr(NULL)
+    {
+      timestamp.sec = 0;
+      timestamp.msec = 0;
+    }
+
     std::string path;
     std::string message;
     SAS::TrailId trail;
+
+    /// If set, the path and message are built from this ACR on the Ralf
+    /// thread pool (using the timestamp), and the ACR is then deleted.
+    RalfACR* acr;
+    pj_time_val timestamp;
   };
 
   /// This function adds a ralf request to the pool. Actually sending
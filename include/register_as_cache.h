@@ -0,0 +1,109 @@
+/**
+ * @file register_as_cache.h Cache of the application servers selected for third-party REGISTERs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REGISTER_AS_CACHE_H__
+#define REGISTER_AS_CACHE_H__
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ifchandler.h"
+#include "warm_start_snapshot.h"
+
+/// Caches the application servers that a set of iFCs selects for a
+/// REGISTER, so that they aren't re-evaluated for every REGISTER (and so
+/// that timer-driven and administrative deregistrations don't need to build
+/// a REGISTER message just to evaluate the iFCs).
+///
+/// Only iFCs whose result doesn't depend on the contents of the message can
+/// be cached.  For these, the result depends only on the iFCs themselves
+/// (identified by their fingerprint) and on the registration type.
+class RegisterAsCache
+{
+public:
+  RegisterAsCache(size_t max_entries = DEFAULT_MAX_ENTRIES);
+  virtual ~RegisterAsCache();
+
+  /// Look up the application servers for a REGISTER.
+  ///
+  /// @param fingerprint     - The fingerprint of the served user's iFCs.
+  /// @param is_initial_registration
+  ///                        - Whether this is an initial registration.
+  /// @param is_deregistration
+  ///                        - Whether this is a deregistration.
+  /// @param as_list         - (out) The application servers, if found.
+  ///
+  /// @return                - Whether the application servers were found.
+  bool get(uint64_t fingerprint,
+           bool is_initial_registration,
+           bool is_deregistration,
+           std::vector<AsInvocation>& as_list);
+
+  /// Store the application servers for a REGISTER.
+  void put(uint64_t fingerprint,
+           bool is_initial_registration,
+           bool is_deregistration,
+           const std::vector<AsInvocation>& as_list);
+
+  /// The number of cached results.
+  size_t size();
+
+  /// Writes the cached results to a warm-start snapshot.
+  void save(WarmStartSnapshot::Writer& writer);
+
+  /// Reads cached results back from a warm-start snapshot.  Results are
+  /// keyed on the iFCs that produced them, so they can't go stale and are
+  /// restored regardless of age.
+  void restore(WarmStartSnapshot::Reader& reader, int age_s);
+
+  static const size_t DEFAULT_MAX_ENTRIES = 10000;
+
+private:
+  typedef std::pair<uint64_t, int> Key;
+
+  static Key make_key(uint64_t fingerprint,
+                      bool is_initial_registration,
+                      bool is_deregistration);
+
+  size_t _max_entries;
+
+  pthread_mutex_t _lock;
+  std::map<Key, std::vector<AsInvocation>> _cache;
+};
+
+#endif
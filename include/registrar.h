@@ -48,6 +48,9 @@ extern "C" {
 #include "analyticslogger.h"
 #include "acr.h"
 #include "snmp_success_fail_count_table.h"
+#include "snmp_counter_table.h"
+#include "third_party_reg_tracker.h"
+#include "aor_replicator.h"
 
 extern pjsip_module mod_registrar;
 
@@ -62,7 +65,11 @@ extern pj_status_t init_registrar(SubscriberDataManager* sdm,
                                   int cfg_max_expires,
                                   bool force_third_party_register_body,
                                   SNMP::RegistrationStatsTables* reg_stats_tbls,
-                                  SNMP::RegistrationStatsTables* third_party_reg_stats_tbls);
+                                  SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
+                                  ThirdPartyRegTracker* third_party_reg_tracker,
+                                  SNMP::CounterTable* third_party_reg_sent_tbl,
+                                  SNMP::CounterTable* third_party_reg_suppressed_tbl,
+                                  AoRReplicator* replicator = NULL);
 
 
 /// Calculate the expiry time for a binding.
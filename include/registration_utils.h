@@ -49,11 +49,37 @@ extern "C" {
 #include "ifchandler.h"
 #include "hssconnection.h"
 #include "snmp_success_fail_count_table.h"
+#include "snmp_counter_table.h"
+#include "third_party_reg_tracker.h"
+#include "aor_replicator.h"
+#include "warm_start_snapshot.h"
 
 namespace RegistrationUtils {
 
+/// Sends the third-party REGISTER refreshes scheduled by a
+/// ThirdPartyRegTracker.
+class ThirdPartyRegRefresher : public ThirdPartyRegTracker::RefreshSender
+{
+public:
+  void send_refresh(const std::string& served_user,
+                    const AsInvocation& as,
+                    int expires);
+};
+
 void init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-          bool force_third_party_register_body_arg);
+          bool force_third_party_register_body_arg,
+          ThirdPartyRegTracker* third_party_reg_tracker_arg,
+          SNMP::CounterTable* third_party_reg_sent_tbl_arg,
+          SNMP::CounterTable* third_party_reg_suppressed_tbl_arg,
+          AoRReplicator* replicator_arg = NULL);
+
+/// Registers the cache of application servers selected for REGISTERs with
+/// the warm-start snapshot.
+void add_to_warm_start_snapshot(WarmStartSnapshot* snapshot);
+
+/// Hash the parts of an AoR's bindings that are not refreshed by a
+/// re-REGISTER, so that a change to any of them can be spotted.
+uint64_t bindings_hash(SubscriberDataManager::AoR* aor_data);
 
 void remove_bindings(SubscriberDataManager* sdm,
                      HSSConnection* hss,
@@ -69,6 +95,7 @@ void register_with_application_servers(Ifcs& ifcs,
                                        int expires,
                                        bool is_initial_registration,
                                        const std::string& served_user,
+                                       uint64_t bindings_hash,
                                        SAS::TrailId trail);
 
 void deregister_with_application_servers(Ifcs&,
@@ -0,0 +1,146 @@
+/**
+ * @file sas_msg_logger.h Logging of SIP messages to SAS, optionally on a pool of threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_MSG_LOGGER_H__
+#define SAS_MSG_LOGGER_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+#include "sas.h"
+#include "snmp_counter_table.h"
+
+/// Logs SIP messages, and the To/From, Call-ID and branch markers that
+/// correlate them, to SAS.
+///
+/// Compressing a message for SAS is expensive, and is done on the transport
+/// thread that sent or received the message.  If the logger has threads of
+/// its own, the transport thread instead copies the message into a queue,
+/// and the logging threads parse it again, report the markers and compress
+/// it.  If the queue is full the message is not logged.
+///
+/// The logger can also be told to log only a sample of the messages with a
+/// given CSeq method (so that, say, one in ten REGISTER transactions is
+/// logged).  Whether to log is decided from the trail ID, so a request and
+/// its responses are either all logged or all skipped.
+class SasMsgLogger
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_threads   - The number of logging threads.  If zero,
+  ///                        messages are logged by the caller.
+  /// @param max_queue     - The maximum number of messages waiting to be
+  ///                        logged.
+  /// @param dropped_tbl   - Counts messages not logged because the queue was
+  ///                        full.
+  SasMsgLogger(int num_threads,
+               size_t max_queue = DEFAULT_MAX_QUEUE,
+               SNMP::CounterTable* dropped_tbl = NULL);
+
+  /// Destructor.  Logs any queued messages before returning.
+  virtual ~SasMsgLogger();
+
+  /// Start the logging threads.
+  void start();
+
+  /// Configure which methods are sampled.
+  ///
+  /// @param sample_rates  - A comma-separated list of METHOD=N, meaning
+  ///                        log one in N transactions with that CSeq
+  ///                        method, e.g. "OPTIONS=100,REGISTER=10".
+  ///
+  /// @return false if the list could not be parsed, in which case no
+  ///         sampling is configured.
+  bool set_sample_rates(const std::string& sample_rates);
+
+  /// Whether a message should be logged.
+  ///
+  /// @param trail         - The message's SAS trail.
+  /// @param method        - The message's CSeq method.
+  bool should_log(SAS::TrailId trail, const pjsip_method* method) const;
+
+  /// Log a received message.
+  void log_rx_msg(SAS::TrailId trail, pjsip_rx_data* rdata);
+
+  /// Log a message that is being sent.
+  void log_tx_msg(SAS::TrailId trail, pjsip_tx_data* tdata);
+
+  /// The number of messages waiting to be logged.
+  size_t queue_size();
+
+  static const size_t DEFAULT_MAX_QUEUE = 10000;
+
+private:
+  /// A message waiting to be logged.
+  struct Msg
+  {
+    SAS::TrailId trail;
+    bool rx;
+    int transport_type;
+    int port;
+    std::string name;
+    std::string buf;
+  };
+
+  void queue_msg(Msg& msg);
+  void log_msg(Msg& msg, pj_pool_t* pool);
+  void log_loop();
+  static void* log_thread(void* p);
+
+  int _num_threads;
+  size_t _max_queue;
+  SNMP::CounterTable* _dropped_tbl;
+
+  /// Sample rates keyed on method name.  Not modified once the threads are
+  /// running, so read without the lock.
+  std::map<std::string, int> _sample_rates;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<Msg> _queue;
+  std::vector<pthread_t> _threads;
+  bool _terminated;
+};
+
+#endif
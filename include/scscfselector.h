@@ -41,6 +41,7 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <stdint.h>
 #include <boost/thread.hpp>
 #include "updater.h"
 #include "sas.h"
@@ -59,6 +60,9 @@ public:
                         const std::vector<int> &optional,
                         const std::vector<std::string> &rejects,
                         SAS::TrailId trail);
+
+  // returns the names of all the configured s-cscfs
+  std::vector<std::string> get_all_scscfs();
 private:
   typedef struct scscf
   {
@@ -66,10 +70,41 @@ private:
     int priority;
     int weight;
     std::vector<int> capabilities;
+
+    // The capabilities as a bitset, with bits assigned by
+    // _capability_bits.
+    std::vector<uint64_t> capability_bits;
+
+    // The index of this S-CSCF's entry in _priority_groups, and the sum of
+    // its weight and those of the S-CSCFs before it in the group.
+    size_t group;
+    int cumulative_weight;
   } scscf_t;
 
+  // A run of S-CSCFs in _scscfs with the same priority.
+  typedef struct priority_group
+  {
+    size_t begin;
+    size_t end;
+    int total_weight;
+  } priority_group_t;
+
+  // Sets the bits for a list of capabilities.  Returns false if any of the
+  // capabilities isn't offered by any S-CSCF.
+  bool capabilities_to_bits(const std::vector<int>& capabilities,
+                            std::vector<uint64_t>& bits);
+
   std::string _configuration;
+
+  // The S-CSCFs, sorted by priority (keeping configuration order within
+  // each priority).
   std::vector<scscf> _scscfs;
+  std::vector<priority_group_t> _priority_groups;
+
+  // Maps each capability offered by any S-CSCF to its bit in the bitsets.
+  std::map<int, size_t> _capability_bits;
+  size_t _capability_words;
+
   Updater<void, SCSCFSelector>* _updater;
   boost::shared_mutex _scscfs_rw_lock;
 };
@@ -67,6 +67,7 @@ extern "C" {
 #include "snmp_counter_table.h"
 #include "session_expires_helper.h"
 #include "as_communication_tracker.h"
+#include "latency_breakdown.h"
 
 class SCSCFSproutletTsx;
 
@@ -236,8 +237,13 @@ public:
   virtual void on_tx_response(pjsip_msg* rsp) override;
   virtual void on_rx_cancel(int status_code, pjsip_msg* req) override;
   virtual void on_timer_expiry(void* context) override;
+  virtual void on_async_complete(void* context) override;
 
 private:
+  /// Continues processing an initial request once any HSS data needed for
+  /// the served user has been retrieved.
+  void continue_initial_request(pjsip_msg* req);
+
   /// Examines the top route header to determine the relevant AS chain
   /// (from the ODI token) and the session case (based on the presence of
   /// the 'orig' param), and sets those as member variables.
@@ -284,6 +290,13 @@ private:
   /// Route the request to UE bindings retrieved from the registration store.
   void route_to_ue_bindings(pjsip_msg* req);
 
+  /// Works out the AoR for the public ID and reads its bindings from the
+  /// registration store.  Runs on an I/O thread.
+  void get_ue_bindings(const std::string& public_id);
+
+  /// Route the request to the bindings read by get_ue_bindings.
+  void route_to_ue_targets(pjsip_msg* req);
+
   /// Add a Route header with the specified URI.
   void add_route_uri(pjsip_msg* msg, pjsip_sip_uri* uri);
 
@@ -350,6 +363,10 @@ private:
   /// Flag indicating if the transaction has been cancelled.
   bool _cancelled;
 
+  /// The status code the transaction was cancelled with, or zero if it
+  /// hasn't been.
+  int _cancel_status;
+
   /// The session case for this service hop (originating, terminating or
   /// originating-cdiv).
   const SessionCase* _session_case;
@@ -385,10 +402,30 @@ private:
   std::string _target_aor;
   std::unordered_map<int, std::string> _target_bindings;
 
+  /// The blocking operation this transaction is waiting for, if any.
+  enum AsyncOp
+  {
+    ASYNC_NONE,
+    ASYNC_HSS_QUERY,
+    ASYNC_GET_BINDINGS
+  };
+  AsyncOp _async_op;
+
+  /// Results of the registration store lookup, filled in by get_ue_bindings.
+  std::string _ue_public_id;
+  bool _ue_registered;
+  std::string _ue_aor;
+  SubscriberDataManager::AoRPair* _ue_aor_pair;
+
   /// Liveness timer used for determining when an application server is not
   /// responding.
   TimerID _liveness_timer;
 
+  /// Times the round trip to the application server, if latency breakdown
+  /// is enabled.
+  Utils::StopWatch _as_stop_watch;
+  bool _as_timing;
+
   /// Track if this transaction has already record-routed itself to prevent
   /// us accidentally record routing twice.
   bool _record_routed;
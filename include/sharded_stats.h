@@ -0,0 +1,205 @@
+/**
+ * @file sharded_stats.h Per-thread sharding for hot-path SNMP statistics.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SHARDED_STATS_H__
+#define SHARDED_STATS_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+#include "snmp_success_fail_count_by_request_type_table.h"
+
+/// Base class for statistics tables that are updated per thread, so that
+/// threads updating the same statistic don't contend for its cache lines.
+///
+/// Each thread is assigned one of NUM_SHARDS shards (threads share shards if
+/// there are more threads than shards).  Updates go to the thread's shard,
+/// and are merged into the underlying SNMP table when the table is flushed.
+/// Tables are flushed once a second by the ShardedStatsFlusher, and when they
+/// are destroyed.
+class ShardedStats
+{
+public:
+  ShardedStats();
+  virtual ~ShardedStats();
+
+  /// Merges the shards into the underlying table.
+  virtual void flush() = 0;
+
+  /// Flushes every sharded table.
+  static void flush_all();
+
+  static const int NUM_SHARDS = 64;
+  static const int CACHE_LINE_SIZE = 64;
+
+  /// Tables are allocated on a cache line boundary, so that their shards
+  /// (which are aligned to cache lines) are too.  Plain new only honours
+  /// alignments beyond that of max_align_t from C++17.
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
+protected:
+  /// Returns the calling thread's shard.
+  static int shard_index();
+
+  /// Registers the table to be flushed.  Must be called at the end of a
+  /// derived class's constructor, so that the table isn't flushed until it
+  /// is fully constructed.
+  void register_table();
+
+  /// Stops the table being flushed.  Must be called at the start of a
+  /// derived class's destructor, for the same reason.
+  void unregister_table();
+
+private:
+  bool _registered;
+};
+
+/// Counter table that counts per thread.
+class ShardedCounterTable : public SNMP::CounterTable, public ShardedStats
+{
+public:
+  /// Constructor.  Takes ownership of the underlying table.
+  ShardedCounterTable(SNMP::CounterTable* table);
+  virtual ~ShardedCounterTable();
+
+  void increment();
+  void flush();
+
+private:
+  struct alignas(CACHE_LINE_SIZE) Shard
+  {
+    std::atomic<uint64_t> count;
+  };
+
+  SNMP::CounterTable* _table;
+  Shard _shards[NUM_SHARDS];
+};
+
+/// Event accumulator table that batches samples per thread.  The samples
+/// are passed to the underlying table individually, so its statistics are
+/// unchanged, but each thread only touches the underlying table once per
+/// BATCH_SIZE samples.
+class ShardedEventAccumulatorTable : public SNMP::EventAccumulatorTable,
+                                     public ShardedStats
+{
+public:
+  /// Constructor.  Takes ownership of the underlying table.
+  ShardedEventAccumulatorTable(SNMP::EventAccumulatorTable* table);
+  virtual ~ShardedEventAccumulatorTable();
+
+  void accumulate(uint32_t sample);
+  void flush();
+
+  static const int BATCH_SIZE = 32;
+
+private:
+  struct alignas(CACHE_LINE_SIZE) Shard
+  {
+    pthread_mutex_t lock;
+    int count;
+    uint32_t samples[BATCH_SIZE];
+  };
+
+  /// Passes a batch of samples to the underlying table.
+  void accumulate_batch(const uint32_t* samples, int count);
+
+  SNMP::EventAccumulatorTable* _table;
+  Shard _shards[NUM_SHARDS];
+};
+
+/// Success/fail count table, by request type, that counts per thread.
+class ShardedSuccessFailCountByRequestTypeTable :
+  public SNMP::SuccessFailCountByRequestTypeTable,
+  public ShardedStats
+{
+public:
+  /// Constructor.  Takes ownership of the underlying table.
+  ShardedSuccessFailCountByRequestTypeTable(
+                              SNMP::SuccessFailCountByRequestTypeTable* table);
+  virtual ~ShardedSuccessFailCountByRequestTypeTable();
+
+  void increment_attempts(SNMP::SIPRequestTypes type);
+  void increment_successes(SNMP::SIPRequestTypes type);
+  void increment_failures(SNMP::SIPRequestTypes type);
+  void flush();
+
+  /// Request types beyond this are passed straight to the underlying table.
+  static const int MAX_REQUEST_TYPES = 16;
+
+private:
+  enum Outcome { ATTEMPT = 0, SUCCESS, FAILURE, NUM_OUTCOMES };
+
+  struct alignas(CACHE_LINE_SIZE) Shard
+  {
+    std::atomic<uint32_t> counts[MAX_REQUEST_TYPES][NUM_OUTCOMES];
+  };
+
+  void increment(SNMP::SIPRequestTypes type, Outcome outcome);
+
+  SNMP::SuccessFailCountByRequestTypeTable* _table;
+  Shard _shards[NUM_SHARDS];
+};
+
+/// Flushes the sharded tables once a second.
+class ShardedStatsFlusher
+{
+public:
+  ShardedStatsFlusher();
+
+  /// Destructor.  Stops the flusher's thread and does a final flush.
+  ~ShardedStatsFlusher();
+
+  /// Starts the thread that flushes the tables.
+  void start();
+
+  static const int FLUSH_INTERVAL_MS = 1000;
+
+private:
+  void flush_loop();
+  static void* flush_thread(void* p);
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+  bool _started;
+  pthread_t _thread;
+};
+
+#endif
@@ -55,6 +55,18 @@ public:
                std::vector<AddrInfo>& targets,
                SAS::TrailId trail = 0);
 
+  /// As above, but also returns the remaining time to live (in seconds) of
+  /// the DNS records the targets were resolved from.  This is zero if the
+  /// name is an IP address.
+  void resolve(const std::string& name,
+               int af,
+               int port,
+               int transport,
+               int retries,
+               std::vector<AddrInfo>& targets,
+               int& ttl,
+               SAS::TrailId trail = 0);
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
 
@@ -50,6 +50,7 @@ extern "C" {
 }
 
 #include <list>
+#include <functional>
 #include "sas.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
 
@@ -252,6 +253,19 @@ public:
   ///
   virtual bool timer_running(TimerID id) = 0;
 
+  /// Runs a blocking operation (such as an HSS or XDM query) without holding
+  /// up the worker thread.  The on_async_complete callback will be called
+  /// back with the context parameter on a worker thread once the operation
+  /// has run.
+  ///
+  /// The operation runs without the transaction lock held, so must only
+  /// access state that the transaction doesn't touch until the callback.
+  ///
+  /// @param  context      - Context parameter returned on the callback.
+  /// @param  work         - The operation.
+  ///
+  virtual void run_async(void* context, const std::function<void()>& work) = 0;
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -343,6 +357,12 @@ public:
   ///                        was scheduled.
   virtual void on_timer_expiry(void* context) {}
 
+  /// Called when an operation started with run_async has run.
+  ///
+  /// @param  context      - The context parameter specified when the
+  ///                        operation was started.
+  virtual void on_async_complete(void* context) {}
+
 protected:
 
   /// Returns a mutable clone of the original request.  This can be modified
@@ -530,6 +550,16 @@ protected:
   bool timer_running(TimerID id)
     {return _helper->timer_running(id);}
 
+  /// Runs a blocking operation without holding up the worker thread.  The
+  /// on_async_complete callback will be called back with the context
+  /// parameter once the operation has run.
+  ///
+  /// @param  context      - Context parameter returned on the callback.
+  /// @param  work         - The operation.
+  ///
+  void run_async(void* context, const std::function<void()>& work)
+    {_helper->run_async(context, work);}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
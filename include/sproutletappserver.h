@@ -246,10 +246,12 @@ private:
 class SproutletAppServerShimTsx : public SproutletTsx
 {
 public:
-  /// Constructor
+  /// Constructor.  If app_tsx is NULL, the AppServerTsx is created from app
+  /// when the initial request is received.
   SproutletAppServerShimTsx(SproutletTsxHelper* sproutlet_helper,
                             SproutletAppServerTsxHelper*& app_server_helper,
-                            AppServerTsx* app_tsx);
+                            AppServerTsx* app_tsx,
+                            AppServer* app = NULL);
 
   /// Destructor
   virtual ~SproutletAppServerShimTsx();
@@ -277,9 +279,25 @@ public:
   /// Called if a programmed timer expires.
   virtual void on_timer_expiry(void* context);
 
+  /// Called once the AppServerTsx has been created for an initial request.
+  virtual void on_async_complete(void* context);
+
 private:
+  /// Asks the AppServer for a Tsx, falling back to one that simply forwards
+  /// requests and responses.
+  static AppServerTsx* create_app_tsx(AppServer* app,
+                                      SproutletAppServerTsxHelper* helper,
+                                      pjsip_msg* req);
+
   SproutletAppServerTsxHelper* _app_server_helper;
   AppServerTsx* _app_tsx;
+  AppServer* _app;
+
+  /// The status code passed to on_rx_cancel, or zero if the request hasn't
+  /// been cancelled.
+  int _cancel_status;
+
+  friend class SproutletAppServerShim;
 };
 
 #endif
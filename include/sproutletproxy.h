@@ -51,6 +51,7 @@
 #include "sproutlet.h"
 #include "snmp_sip_request_types.h"
 #include "sproutlet_options.h"
+#include "async_io_pool.h"
 
 class SproutletWrapper;
 
@@ -65,12 +66,16 @@ public:
   /// @param  sproutlets        - Sproutlets to load in this proxy.
   /// @param  stateless_proxies - A set of next-hops that are considered to be
   ///                             stateless proxies.
+  /// @param  async_io_pool     - Threads that run Sproutlets' blocking
+  ///                             operations.  If NULL, these are run on
+  ///                             the worker thread.
   SproutletProxy(pjsip_endpoint* endpt,
                  int priority,
                  const std::string& root_uri,
                  const std::unordered_set<std::string>& host_aliases,
                  const std::list<Sproutlet*>& sproutlets,
-                 const std::set<std::string>& stateless_proxies);
+                 const std::set<std::string>& stateless_proxies,
+                 AsyncIOPool* async_io_pool = NULL);
 
   /// Destructor.
   virtual ~SproutletProxy();
@@ -166,6 +171,11 @@ protected:
     bool cancel_timer(TimerID id);
     bool timer_running(TimerID id);
 
+    void run_async(SproutletWrapper* tsx,
+                   void* context,
+                   const std::function<void()>& work);
+    void process_async_complete(SproutletWrapper* tsx, void* context);
+
     void tx_response(SproutletWrapper* sproutlet,
                      pjsip_tx_data* rsp);
 
@@ -232,6 +242,11 @@ protected:
     /// The UASTsx will persist while there are pending timers.
     std::set<pj_timer_entry*> _pending_timers;
 
+    /// The number of blocking operations started by sproutlet tsxs that are
+    /// children of this UASTsx which are running on the I/O threads.  The
+    /// UASTsx will persist while there are operations running.
+    int _pending_async;
+
     friend class SproutletWrapper;
   };
 
@@ -242,6 +257,8 @@ protected:
 
   std::list<Sproutlet*> _sproutlets;
 
+  AsyncIOPool* _async_io_pool;
+
   static const pj_str_t STR_SERVICE;
 
   friend class UASTsx;
@@ -288,6 +305,7 @@ public:
   bool schedule_timer(void* context, TimerID& id, int duration);
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
+  void run_async(void* context, const std::function<void()>& work);
   SAS::TrailId trail() const;
   bool is_uri_reflexive(const pjsip_uri*) const;
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
@@ -299,6 +317,7 @@ private:
   void rx_error(int status_code);
   void rx_fork_error(pjsip_event_id_e event, int fork_id);
   void on_timer_pop(TimerID id, void* context);
+  void on_async_complete(void* context);
   void register_tdata(pjsip_tx_data* tdata);
   void deregister_tdata(pjsip_tx_data* tdata);
 
@@ -371,6 +390,16 @@ private:
   /// until all these timers have popped or been cancelled.
   std::set<TimerID> _pending_timers;
 
+  /// The number of blocking operations started by this SproutletWrapper
+  /// whose results haven't been passed to the SproutletTsx.  The
+  /// SproutletWrapper won't be deleted until they all have.
+  int _pending_async;
+
+  /// The contexts of blocking operations which were run synchronously (as
+  /// there are no I/O threads), and whose results will be passed to the
+  /// SproutletTsx once its current callback returns.
+  std::list<void*> _completed_async;
+
   SAS::TrailId _trail_id;
 
   friend class SproutletProxy::UASTsx;
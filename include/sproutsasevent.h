@@ -202,6 +202,8 @@ namespace SASEvent
   const int AUTHENTICATION_NC_NOT_SUPP = SPROUT_BASE + 0x0100;
   const int AUTHENTICATION_NC_TOO_LOW = SPROUT_BASE + 0x0101;
   const int AUTHENTICATION_NC_ON_NON_REG = SPROUT_BASE + 0x0102;
+
+  const int SLOW_REQUEST = SPROUT_BASE + 0x0110;
 } //namespace SASEvent
 
 #endif
@@ -54,6 +54,9 @@ extern "C" {
 #include "quiescing_manager.h"
 #include "load_monitor.h"
 #include "sipresolver.h"
+#include "destination_health.h"
+#include "dns_prefetcher.h"
+#include "warm_start_snapshot.h"
 
 /* Pre-declariations */
 class LastValueCache;
@@ -63,6 +66,18 @@ struct stack_data_struct
 {
   SIPResolver*         sipresolver;
 
+  // Health of downstream destinations, used for outlier ejection and request
+  // hedging.  NULL if neither is enabled.
+  DestinationHealth*   destination_health;
+
+  // Keeps the DNS records for configured next hops warm.  NULL if DNS
+  // prefetching isn't enabled.
+  DnsPrefetcher*       dns_prefetcher;
+
+  // Saves the in-memory caches when Sprout quiesces and reloads them when it
+  // next starts.  NULL if warm starts aren't enabled.
+  WarmStartSnapshot*   warm_start_snapshot;
+
   pj_caching_pool      cp;
   pj_pool_t           *pool;
   pjsip_endpoint      *endpt;
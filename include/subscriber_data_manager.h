@@ -51,8 +51,12 @@ extern "C" {
 
 #include "store.h"
 #include "chronosconnection.h"
+#include "contact_features.h"
 #include "sas.h"
 
+class AoRExpiryManager;
+class AoRWriteSerializer;
+
 
 class SubscriberDataManager
 {
@@ -69,7 +73,9 @@ public:
     class Binding
     {
     public:
-      Binding(std::string* address_of_record): _address_of_record(address_of_record) {};
+      Binding(std::string* address_of_record):
+        _address_of_record(address_of_record),
+        _features_parsed(false) {};
 
       /// The address of record, e.g. "sip:name@example.com". Defined
       /// as a pointer rather than a reference to allow assignment to work.
@@ -104,6 +110,18 @@ public:
       /// value.  E.g., "+sip.ice" -> "".
       std::map<std::string, std::string> _params;
 
+      /// The parameters in _params, parsed into features for contact
+      /// filtering.  Only valid if _features_parsed is set - call
+      /// parse_features() after changing _params.
+      ContactFeatureSet _features;
+      bool _features_parsed;
+
+      void parse_features()
+      {
+        parse_contact_features(_params, _features);
+        _features_parsed = true;
+      }
+
       /// The timer ID provided by Chronos.
       std::string _timer_id;
 
@@ -212,11 +230,11 @@ public:
 
     /// CSeq value for event notifications for this AoR.  This is initialised
     /// to one when the AoR record is first set up and incremented every time
-    /// the record is updated while there are active subscriptions.  (It is
-    /// sufficient to use the same CSeq for each NOTIFY sent on each active
-    /// because there is no requirement that the first NOTIFY in a dialog has
-    /// CSeq=1, and once a subscription dialog is established it should
-    /// receive every NOTIFY for the AoR.)
+    /// the record is updated (other than by refresh_aor_data) while there
+    /// are active subscriptions.  (It is sufficient to use the same CSeq for
+    /// each NOTIFY sent on each active because there is no requirement that
+    /// the first NOTIFY in a dialog has CSeq=1, and once a subscription
+    /// dialog is established it should receive every NOTIFY for the AoR.)
     int _notify_cseq;
 
     // Chronos Timer ID
@@ -234,6 +252,16 @@ public:
     /// Zero for a new record that has not yet been written to a store.
     uint64_t _cas;
 
+    /// CAS value for the AoR's subscriptions record, if subscriptions are
+    /// stored separately from the bindings.  Zero if there is no such record
+    /// yet.
+    uint64_t _subscriptions_cas;
+
+    /// Whether the bindings record read from the store still holds
+    /// subscriptions, because it was written before subscriptions were
+    /// stored separately.
+    bool _legacy_subscriptions;
+
     // SIP URI for this AoR
     std::string _uri;
 
@@ -272,6 +300,9 @@ public:
 
     /// The subscriber data manager is allowed to access the original AoR
     friend class SubscriberDataManager;
+
+    /// So is the replicator, to work out what has been removed.
+    friend class AoRReplicator;
   };
 
   /// Interface used by the SubscriberDataManager to serialize AoRs from C++ objects to the
@@ -352,6 +383,25 @@ public:
     std::string serialize_aor(AoR* aor_data);
     AoR* deserialize_aor(const std::string& aor_id, const std::string& s);
 
+    /// Read the AoR's subscriptions record into aor_data, replacing any
+    /// subscriptions and NOTIFY CSeq it already holds.  If there is no
+    /// subscriptions record, aor_data is left as it is.
+    Store::Status get_subscriptions_data(const std::string& aor_id,
+                                         AoR* aor_data,
+                                         SAS::TrailId trail);
+
+    Store::Status set_subscriptions_data(const std::string& aor_id,
+                                         AoR* aor_data,
+                                         int expiry,
+                                         SAS::TrailId trail);
+
+    /// The records used when subscriptions are stored separately.  These
+    /// have the same format as a full AoR record, but the bindings record
+    /// omits the subscriptions and the NOTIFY CSeq, and the subscriptions
+    /// record omits the bindings and the timer ID.
+    std::string serialize_bindings(AoR* aor_data);
+    std::string serialize_subscriptions(AoR* aor_data);
+
     bool underlying_store_has_servers() { return (_data_store != NULL) && _data_store->has_servers(); }
 
     Store* _data_store;
@@ -359,6 +409,9 @@ public:
     /// SubscriberDataManager is the only class that can use Connector
     friend class SubscriberDataManager;
 
+    /// Whether subscriptions are stored in their own record.
+    bool _separate_subscriptions;
+
   private:
     SerializerDeserializer* _serializer;
     std::vector<SerializerDeserializer*> _deserializers;
@@ -537,7 +590,77 @@ public:
                                      pjsip_rx_data* extra_message_rdata = NULL,
                                      pjsip_tx_data* extra_message_tdata = NULL);
 
+  /// Update an address of record whose bindings have only had their expiry
+  /// times and CSeqs changed.  The timers are updated and the AoR written as
+  /// for set_aor_data, but the NOTIFY CSeq is left alone and no NOTIFYs are
+  /// sent, as subscribers aren't told about refreshes.
+  ///
+  /// @param aor_id               The AoR to retrieve
+  /// @param aor_pair             The AoR pair to set
+  /// @param trail                SAS trail
+  virtual Store::Status refresh_aor_data(const std::string& aor_id,
+                                         AoRPair* aor_pair,
+                                         SAS::TrailId trail);
+
+  /// Tracks AoR expiry on this node's timer wheel, rather than giving each
+  /// AoR its own Chronos timer.  Only used by the primary store.
+  void set_expiry_manager(AoRExpiryManager* expiry_manager)
+  {
+    _expiry_manager = expiry_manager;
+  }
+
+  /// Serializes the writes this node makes to each AoR.  Code that reads,
+  /// modifies and writes an AoR should hold an AoRWriteSerializer::Write on
+  /// this while doing so.  May be NULL.
+  void set_write_serializer(AoRWriteSerializer* write_serializer)
+  {
+    _write_serializer = write_serializer;
+  }
+
+  AoRWriteSerializer* write_serializer() const
+  {
+    return _write_serializer;
+  }
+
+  /// Stores each AoR's reg-event subscriptions (and NOTIFY CSeq) in a record
+  /// of their own, so that SUBSCRIBEs only contend with REGISTERs when both
+  /// change the subscriptions.  AoRs stored in a single record are read
+  /// correctly and are split the next time they are written.
+  void set_separate_subscriptions(bool separate_subscriptions)
+  {
+    _connector->_separate_subscriptions = separate_subscriptions;
+  }
+
 private:
+  // Write an AoR whose subscriptions are stored separately from its
+  // bindings, writing each record only if it has changed.
+  //
+  // @param aor_id    The AoR ID
+  // @param aor_pair  The AoRPair being written
+  // @param expiry    The expiry of the records
+  // @param trail     SAS trail
+  Store::Status set_separate_aor_data(const std::string& aor_id,
+                                      AoRPair* aor_pair,
+                                      int expiry,
+                                      SAS::TrailId trail);
+
+  // Apply the subscription changes in aor_pair on top of the subscriptions
+  // in latest, and make latest's subscriptions the original ones.
+  //
+  // @param aor_pair  The AoRPair being written
+  // @param latest    The AoR's subscriptions as now in the store
+  void merge_subscriptions(AoRPair* aor_pair,
+                           AoR* latest);
+
+  // Schedule the AoR's next expiry on the local expiry wheel.
+  //
+  // @param aor_id    The AoR ID
+  // @param aor_pair  The AoRPair being written
+  // @param trail     SAS trail
+  void schedule_local_expiry(const std::string& aor_id,
+                             AoRPair* aor_pair,
+                             SAS::TrailId trail);
+
   // Expire any out of date bindings in the current AoR
   //
   // @param aor_pair  The AoRPair to expir
@@ -566,6 +689,8 @@ private:
   Connector* _connector;
   ChronosTimerRequestSender* _chronos_timer_request_sender;
   NotifySender* _notify_sender;
+  AoRExpiryManager* _expiry_manager;
+  AoRWriteSerializer* _write_serializer;
   bool _primary_sdm;
 };
 
@@ -46,6 +46,7 @@ extern "C" {
 #include "hssconnection.h"
 #include "analyticslogger.h"
 #include "acr.h"
+#include "aor_replicator.h"
 
 extern pjsip_module mod_subscription;
 
@@ -54,7 +55,8 @@ pj_status_t init_subscription(SubscriberDataManager* sdm,
                               HSSConnection* hss_connection,
                               ACRFactory* rfacr_factory,
                               AnalyticsLogger* analytics_logger,
-                              int cfg_max_expires);
+                              int cfg_max_expires,
+                              AoRReplicator* replicator = NULL);
 
 pj_bool_t request_acceptable_to_subscription_module(pjsip_msg* msg,
                                                     SAS::TrailId trail);
@@ -0,0 +1,190 @@
+/**
+ * @file third_party_reg_tracker.h Tracking and refresh scheduling of third-party registrations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef THIRD_PARTY_REG_TRACKER_H__
+#define THIRD_PARTY_REG_TRACKER_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ifchandler.h"
+
+/// Tracks the third-party registrations that this node has made with
+/// application servers on behalf of each served user, so that re-REGISTERs
+/// which change nothing the AS can see do not each generate a third-party
+/// REGISTER.
+///
+/// Instead of following the UE's re-registrations, the registration at the
+/// AS is refreshed from a timer wheel a randomized margin before it would
+/// expire, for as long as the UE's own registration has been kept alive.
+/// The AS registration is never extended beyond the UE's registration.
+class ThirdPartyRegTracker
+{
+public:
+  /// Interface used to send refreshes as they fall due.
+  class RefreshSender
+  {
+  public:
+    virtual ~RefreshSender() {}
+
+    /// Send a third-party REGISTER refresh.
+    ///
+    /// @param served_user - The public ID the registration is for.
+    /// @param as          - The AS to register with.
+    /// @param expires     - The expiry to request, in seconds.
+    virtual void send_refresh(const std::string& served_user,
+                              const AsInvocation& as,
+                              int expires) = 0;
+  };
+
+  ThirdPartyRegTracker(RefreshSender* sender);
+  virtual ~ThirdPartyRegTracker();
+
+  /// Start the thread that sends refreshes as they fall due.
+  void start();
+
+  /// Decide whether a REGISTER for a served user must be passed on to an AS
+  /// as a third-party REGISTER.  If it must, the third-party registration is
+  /// recorded as sent (or forgotten, for a deregistration) and a refresh is
+  /// scheduled.
+  ///
+  /// @param served_user      - The public ID the REGISTER is for.
+  /// @param as               - The AS the REGISTER would be sent to.
+  /// @param expires          - The expiry of the UE's registration.
+  /// @param is_initial_registration
+  ///                         - Whether this is an initial registration.
+  /// @param bindings_hash    - Hash of the AoR's bindings.  A change in the
+  ///                           bindings always forces a third-party REGISTER.
+  /// @param now              - The current time, in seconds.
+  ///
+  /// @return                 - true if a third-party REGISTER must be sent,
+  ///                           false if it can be suppressed.
+  bool should_send(const std::string& served_user,
+                   const AsInvocation& as,
+                   int expires,
+                   bool is_initial_registration,
+                   uint64_t bindings_hash,
+                   int now);
+
+  /// Record that a third-party REGISTER to an AS failed.  The AS may not
+  /// hold a registration, so the registration is forgotten and the next
+  /// REGISTER from the UE is passed on rather than suppressed.
+  ///
+  /// @param served_user      - The public ID the REGISTER was for.
+  /// @param server_name      - The AS the REGISTER was sent to.
+  void send_failed(const std::string& served_user,
+                   const std::string& server_name);
+
+  /// Send any refreshes that are due at or before now.  Called once a
+  /// second by the refresh thread.
+  void tick(int now);
+
+  /// The number of third-party registrations being tracked.
+  size_t size();
+
+private:
+  /// State held for each (served user, AS) pair.
+  struct Registration
+  {
+    AsInvocation as;
+    uint64_t bindings_hash;
+
+    /// When the UE's registration expires.
+    int ue_expires;
+
+    /// When the registration at the AS expires.
+    int as_expires;
+
+    /// When the refresh for this registration is scheduled.  Timers in the
+    /// wheel that don't match this value are stale and are discarded.
+    int refresh_at;
+  };
+
+  /// An entry in a timer wheel slot.
+  struct Timer
+  {
+    std::string served_user;
+    std::string server_name;
+    int due;
+  };
+
+  /// A refresh that has fallen due, collected under the lock and sent
+  /// after it has been released.
+  struct Refresh
+  {
+    std::string served_user;
+    AsInvocation as;
+    int expires;
+  };
+
+  /// The wheel has one slot per second.  Timers further in the future than
+  /// the size of the wheel stay in their slot for multiple revolutions.
+  static const int WHEEL_SLOTS = 1024;
+
+  /// Refreshes are sent a random margin of between 10% and 30% of the
+  /// registration period before the AS registration would expire, so that
+  /// refreshes for UEs which registered together are spread out.
+  static const int MIN_REFRESH_MARGIN_PERCENT = 10;
+  static const int MAX_REFRESH_MARGIN_PERCENT = 30;
+
+  void forget(const std::string& served_user, const std::string& server_name);
+  int refresh_time(int now, int expires);
+  void schedule(const std::string& served_user,
+                const std::string& server_name,
+                int due);
+  void process_slot(int slot, int now, std::vector<Refresh>& refreshes);
+  void refresh_loop();
+  static void* refresh_thread(void* p);
+
+  RefreshSender* _sender;
+
+  pthread_mutex_t _lock;
+  std::unordered_map<std::string, std::map<std::string, Registration>> _registrations;
+  std::vector<std::list<Timer>> _wheel;
+  int _last_tick;
+
+  pthread_t _thread;
+  bool _thread_started;
+  volatile bool _terminated;
+  pthread_cond_t _cond;
+};
+
+#endif
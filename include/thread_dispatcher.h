@@ -47,6 +47,8 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <functional>
+
 #include "load_monitor.h"
 #include "snmp_event_accumulator_table.h"
 #include "exception_handler.h"
@@ -60,6 +62,10 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
 void unregister_thread_dispatcher(void);
 
 pj_status_t start_worker_threads();
+
+/// Queues a callback to be run on a worker thread.
+void add_callback_to_queue(const std::function<void()>& callback);
+
 pj_status_t stop_worker_threads();
 
 #endif
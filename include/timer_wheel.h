@@ -0,0 +1,111 @@
+/**
+ * @file timer_wheel.h Hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef TIMER_WHEEL_H__
+#define TIMER_WHEEL_H__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+/// Hierarchical timer wheel keyed by string ID, with one second resolution.
+///
+/// The wheel has LEVELS levels of SLOTS slots.  A slot on level n covers
+/// SLOTS^n seconds, so timers far in the future sit in coarse slots and are
+/// cascaded down to finer levels as their expiry approaches.  Setting,
+/// cancelling and popping a timer are all O(1) (amortised over cascades),
+/// however many timers there are.  Timers beyond the range of the top level
+/// are parked in its furthest slot and re-filed when it cascades.
+///
+/// This class isn't thread-safe - callers must serialize access to it.
+class TimerWheel
+{
+public:
+  /// Constructor.
+  ///
+  /// @param now           - The current time in seconds.  Timers are popped
+  ///                        relative to this.
+  TimerWheel(int now);
+
+  /// Sets the timer for an ID, replacing any existing timer for it.  A timer
+  /// in the past pops on the next call to advance().
+  ///
+  /// @param id            - The ID.
+  /// @param expiry        - The time (in seconds) the timer should pop.
+  void set(const std::string& id, int expiry);
+
+  /// Cancels the timer for an ID, if there is one.
+  void cancel(const std::string& id);
+
+  /// Returns when the timer for an ID pops, or 0 if it has no timer.
+  int expiry(const std::string& id) const;
+
+  /// Advances the wheel to the specified time, appending the IDs of any
+  /// timers that pop to the supplied vector.  Popped timers are removed.
+  void advance(int now, std::vector<std::string>& expired);
+
+  /// Returns the number of timers on the wheel.
+  size_t size() const { return _timers.size(); }
+
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+
+private:
+  struct Timer
+  {
+    int expiry;
+    int level;
+    int slot;
+  };
+
+  /// Files a timer in the correct slot, given the first second whose slot
+  /// hasn't been processed yet.
+  void insert(const std::string& id, Timer& timer, int first);
+
+  /// Re-files the timers in a slot, which has come due.
+  void cascade(int level, int slot);
+
+  /// The time the wheel has been advanced to.  All timers that expire at or
+  /// before this time have popped.
+  int _now;
+
+  std::unordered_map<std::string, Timer> _timers;
+  std::unordered_set<std::string> _slots[LEVELS][SLOTS];
+};
+
+#endif
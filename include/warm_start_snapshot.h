@@ -0,0 +1,170 @@
+/**
+ * @file warm_start_snapshot.h Snapshot of in-memory caches that survives a restart.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef WARM_START_SNAPSHOT_H__
+#define WARM_START_SNAPSHOT_H__
+
+#include <string>
+#include <map>
+#include <functional>
+#include <pthread.h>
+#include <stdint.h>
+
+/// Saves the contents of Sprout's in-memory caches to a file when Sprout
+/// finishes quiescing, and reloads them when it next starts, so that a
+/// restarted node doesn't have to repopulate its caches from the HSS and
+/// DNS while it is taking traffic.
+///
+/// Each cache registers a section, identified by a fixed ID, with a
+/// function that writes its contents and a function that reads them back.
+/// The file is written in host byte order and is only ever read by the
+/// node that wrote it - a file with the wrong magic number or version, or
+/// which is truncated, is ignored.  The file is deleted once it has been
+/// loaded, so a node that crashes doesn't reload stale data.
+class WarmStartSnapshot
+{
+public:
+  /// Serializes the contents of a section.
+  class Writer
+  {
+  public:
+    void put_u32(uint32_t value);
+    void put_u64(uint64_t value);
+    void put_string(const std::string& value);
+
+    /// Appends raw bytes, without a length.
+    void put_bytes(const std::string& value);
+
+    const std::string& data() const { return _data; }
+
+  private:
+    std::string _data;
+  };
+
+  /// Parses the contents of a section.  If any read overruns the section,
+  /// the reader fails and all subsequent reads return zero values.
+  class Reader
+  {
+  public:
+    Reader(const char* data, size_t length);
+
+    uint32_t get_u32();
+    uint64_t get_u64();
+    std::string get_string();
+
+    /// Returns a pointer to the next length bytes, without copying them.
+    ///
+    /// @returns           - NULL if there are fewer than length bytes left.
+    const char* get_bytes(size_t length);
+
+    /// Whether any read has overrun the section.
+    bool failed() const { return _failed; }
+
+    /// Whether the whole section has been read.
+    bool at_end() const { return (_failed) || (_pos == _length); }
+
+  private:
+    bool check(size_t length);
+
+    const char* _data;
+    size_t _length;
+    size_t _pos;
+    bool _failed;
+  };
+
+  /// Writes the contents of a section.
+  typedef std::function<void(Writer&)> SaveFn;
+
+  /// Reads back the contents of a section.
+  ///
+  /// @param age_s         - How long ago the snapshot was saved, so that
+  ///                        TTLs can be adjusted.
+  typedef std::function<void(Reader&, int age_s)> LoadFn;
+
+  /// Constructor.
+  ///
+  /// @param filename      - The file to save the snapshot to and load it
+  ///                        from.
+  /// @param max_age_s     - Snapshots older than this aren't loaded.
+  WarmStartSnapshot(const std::string& filename,
+                    int max_age_s = DEFAULT_MAX_AGE_S);
+  virtual ~WarmStartSnapshot();
+
+  /// Registers a section.  Sections registered after load has been called
+  /// aren't loaded.
+  void add_section(uint32_t id, const SaveFn& save_fn, const LoadFn& load_fn);
+
+  /// Removes a section.  Once this returns its functions won't be called
+  /// again.
+  void remove_section(uint32_t id);
+
+  /// Saves all the registered sections.
+  ///
+  /// @returns             - Whether the snapshot was written.
+  bool save();
+
+  /// Loads the snapshot (if there is one) into the registered sections,
+  /// then deletes it.
+  ///
+  /// @returns             - Whether a snapshot was loaded.
+  bool load();
+
+  static const uint32_t SECTION_HSS_ANSWERS = 1;
+  static const uint32_t SECTION_REGISTER_AS = 2;
+  static const uint32_t SECTION_DNS_TARGETS = 3;
+
+  /// Bump this whenever the format of the file or of any section changes.
+  static const uint32_t VERSION = 1;
+
+  static const int DEFAULT_MAX_AGE_S = 3600;
+
+private:
+  struct Section
+  {
+    SaveFn save_fn;
+    LoadFn load_fn;
+  };
+
+  bool load_file(const char* data, size_t length);
+
+  std::string _filename;
+  int _max_age_s;
+
+  pthread_mutex_t _lock;
+  std::map<uint32_t, Section> _sections;
+};
+
+#endif
@@ -42,8 +42,51 @@
 
 #include <websocketpp/websocketpp.hpp>
 
+#include <unordered_map>
+#include <pthread.h>
+
+struct ws_transport;
+
+/// Table of live WebSocket connections, mapping the websocketpp connection
+/// object to the PJSIP transport created for it.  The WebSocket server runs
+/// on a pool of I/O threads, so the table is hashed and split into
+/// independently locked shards to keep lookups on the message path from
+/// contending with each other.
+class WSConnectionTable
+{
+public:
+  WSConnectionTable();
+  ~WSConnectionTable();
+
+  /// Adds a connection to the table, replacing any existing entry.
+  void insert(const void* con, ws_transport* transport);
+
+  /// Returns the transport for the connection, or NULL if there isn't one.
+  ws_transport* find(const void* con);
+
+  /// Removes the connection from the table, returning its transport (or
+  /// NULL if the connection was not in the table).
+  ws_transport* erase(const void* con);
+
+  /// Returns the number of connections in the table.
+  size_t size();
+
+private:
+  static const int NUM_SHARDS = 64;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<const void*, ws_transport*> connections;
+  };
+
+  Shard& shard(const void* con);
+
+  Shard _shards[NUM_SHARDS];
+};
+
 extern pjsip_module mod_ws_transport;
-extern pj_status_t init_websockets(unsigned short port);
+extern pj_status_t init_websockets(unsigned short port, int num_threads);
 extern void  destroy_websockets();
 
 #endif
@@ -37,6 +37,7 @@
 #include "log.h"
 #include "utils.h"
 #include "pjutils.h"
+#include "stack.h"
 #include "constants.h"
 #include "custom_headers.h"
 #include "acr.h"
@@ -44,6 +45,55 @@
 
 const pj_time_val ACR::unspec = {-1,0};
 
+/// Names of the headers that ACR fields are extracted from by name.  When a
+/// deferred ACR captures a message it only copies these headers, plus the
+/// typed headers checked in is_acr_hdr, so this must be kept in step with
+/// the header lookups in RalfACR.
+static const pj_str_t* const ACR_HDR_NAMES[] =
+{
+  &STR_EVENT,
+  &STR_SESSION_EXPIRES,
+  &STR_X,
+  &STR_P_ASSERTED_IDENTITY,
+  &STR_P_ASSOCIATED_URI,
+  &STR_P_C_V,
+  &STR_P_C_F_A,
+  &STR_REASON,
+  &STR_P_A_N_I,
+  &STR_P_V_N_I,
+  &STR_CONTENT_DISPOSITION
+};
+
+/// Determines whether any ACR fields are extracted from the header.
+static bool is_acr_hdr(const pjsip_hdr* hdr)
+{
+  switch (hdr->type)
+  {
+    case PJSIP_H_TO:
+    case PJSIP_H_FROM:
+    case PJSIP_H_CALL_ID:
+    case PJSIP_H_EXPIRES:
+    case PJSIP_H_AUTHORIZATION:
+    case PJSIP_H_CONTACT:
+      return true;
+
+    default:
+      break;
+  }
+
+  for (size_t ii = 0;
+       ii < sizeof(ACR_HDR_NAMES) / sizeof(ACR_HDR_NAMES[0]);
+       ++ii)
+  {
+    if (pj_stricmp(&hdr->name, ACR_HDR_NAMES[ii]) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 ACR::ACR() : _cancelled(false)
 {
   TRC_DEBUG("Created ACR (%p)", this);
@@ -157,7 +207,11 @@ RalfACR::RalfACR(RalfProcessor* ralf,
                  SAS::TrailId trail,
                  Node node_functionality,
                  Initiator initiator,
-                 NodeRole role) :
+                 NodeRole role,
+                 bool deferred) :
+  _deferred(deferred),
+  _pool(NULL),
+  _captured(),
   _ralf(ralf),
   _trail(trail),
   _initiator(initiator),
@@ -179,6 +233,10 @@ RalfACR::RalfACR(RalfProcessor* ralf,
 
 RalfACR::~RalfACR()
 {
+  if (_pool != NULL)
+  {
+    pj_pool_release(_pool); _pool = NULL;
+  }
 }
 
 void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
@@ -189,6 +247,11 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  if (capture(RX_REQUEST, req, timestamp))
+  {
+    return;
+  }
+
   if (_first_req)
   {
     // This is the first time we have seen a request for this transaction,
@@ -448,6 +511,11 @@ void RalfACR::tx_request(pjsip_msg* req, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  if (capture(TX_REQUEST, req, timestamp))
+  {
+    return;
+  }
+
   // Store the contents of the top-most route header if present.
   pjsip_route_hdr* route_hdr = (pjsip_route_hdr*)
                                   pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, NULL);
@@ -503,6 +571,11 @@ void RalfACR::rx_response(pjsip_msg* rsp, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  if (capture(RX_RESPONSE, rsp, timestamp))
+  {
+    return;
+  }
+
   if (rsp->line.status.code >= PJSIP_SC_OK)
   {
     // This is a final response.
@@ -550,6 +623,11 @@ void RalfACR::tx_response(pjsip_msg* rsp, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  if (capture(TX_RESPONSE, rsp, timestamp))
+  {
+    return;
+  }
+
   _rsp_timestamp = timestamp;
 
   // Store the charging function addresses if present.
@@ -631,6 +709,40 @@ void RalfACR::send_message(pj_time_val timestamp)
   // call `get_message()` to produce our request body.
   assert(!_cancelled);
 
+  RalfProcessor::RalfRequest* rr = new RalfProcessor::RalfRequest();
+
+  if (_deferred)
+  {
+    // Hand the captured messages over to the Ralf thread pool, which
+    // extracts and encodes the fields.  Fix the timestamp now so it isn't
+    // affected by queueing.
+    if (timestamp.sec == -1)
+    {
+      pj_gettimeofday(&timestamp);
+    }
+
+    TRC_VERBOSE("Deferring %s Ralf ACR (%p)",
+                ACR::node_name(_node_functionality).c_str(), this);
+    rr->acr = detach();
+    rr->timestamp = timestamp;
+    rr->trail = _trail;
+    _ralf->send_request_to_ralf(rr);
+  }
+  else if (build_request(rr, timestamp))
+  {
+    _ralf->send_request_to_ralf(rr);
+  }
+  else
+  {
+    delete rr; rr = NULL;
+  }
+}
+
+bool RalfACR::build_request(RalfProcessor::RalfRequest* rr,
+                            pj_time_val timestamp)
+{
+  extract_captured();
+
   // If we have a CCF or ECF, or this isn't a record type that needs one, send
   // the message.
   if ((!_ccfs.empty()) ||
@@ -643,13 +755,11 @@ void RalfACR::send_message(pj_time_val timestamp)
                 ACR::node_name(_node_functionality).c_str(), this);
     std::string path = "/call-id/" + Utils::url_escape(_user_session_id);
 
-    // Create a Ralf request and populate it
-    RalfProcessor::RalfRequest* rr = new RalfProcessor::RalfRequest();
+    // Populate the Ralf request.
     rr->path = path;
     rr->message = get_message(timestamp);
     rr->trail = _trail;
-
-    _ralf->send_request_to_ralf(rr);
+    return true;
   }
   else
   {
@@ -660,6 +770,7 @@ void RalfACR::send_message(pj_time_val timestamp)
              _user_session_id.c_str());
     SAS::Event event(_trail, SASEvent::NO_CCFS_FOR_ACR, 0);
     SAS::report_event(event);
+    return false;
   }
 }
 
@@ -670,6 +781,8 @@ std::string RalfACR::get_message(pj_time_val timestamp)
     return "Cancelled ACR";
   }
 
+  extract_captured();
+
   TRC_DEBUG("Building message");
 
   if (timestamp.sec == -1)
@@ -1740,11 +1853,120 @@ std::string RalfACR::hdr_contents(pjsip_hdr* hdr)
   return std::string(p);
 }
 
+bool RalfACR::capture(CaptureType type, pjsip_msg* msg, pj_time_val& timestamp)
+{
+  if (!_deferred)
+  {
+    return false;
+  }
+
+  if (_pool == NULL)
+  {
+    _pool = pj_pool_create(&stack_data.cp.factory, "acr", 1024, 1024, NULL);
+  }
+
+  // Build a compact copy of the message, with the start line, the body and
+  // only the headers the ACR needs.  Only the top Route header is used.
+  CapturedMessage captured;
+  captured.type = type;
+  captured.timestamp = timestamp;
+  captured.msg = pjsip_msg_create(_pool, msg->type);
+
+  if (msg->type == PJSIP_REQUEST_MSG)
+  {
+    pjsip_method_copy(_pool,
+                      &captured.msg->line.req.method,
+                      &msg->line.req.method);
+    captured.msg->line.req.uri =
+                    (pjsip_uri*)pjsip_uri_clone(_pool, msg->line.req.uri);
+  }
+  else
+  {
+    captured.msg->line.status.code = msg->line.status.code;
+    pj_strdup(_pool,
+              &captured.msg->line.status.reason,
+              &msg->line.status.reason);
+  }
+
+  bool route_copied = false;
+  for (pjsip_hdr* hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next)
+  {
+    if ((is_acr_hdr(hdr)) ||
+        ((hdr->type == PJSIP_H_ROUTE) && (!route_copied)))
+    {
+      route_copied = route_copied || (hdr->type == PJSIP_H_ROUTE);
+      pjsip_msg_add_hdr(captured.msg,
+                        (pjsip_hdr*)pjsip_hdr_clone(_pool, hdr));
+    }
+  }
+
+  if (msg->body != NULL)
+  {
+    captured.msg->body = pjsip_msg_body_clone(_pool, msg->body);
+  }
+
+  _captured.push_back(captured);
+
+  return true;
+}
+
+void RalfACR::extract_captured()
+{
+  if (_captured.empty())
+  {
+    return;
+  }
+
+  // Pass the captured messages through the normal (non-deferred) processing.
+  std::vector<CapturedMessage> captured;
+  captured.swap(_captured);
+  bool deferred = _deferred;
+  _deferred = false;
+
+  for (std::vector<CapturedMessage>::const_iterator i = captured.begin();
+       i != captured.end();
+       ++i)
+  {
+    switch (i->type)
+    {
+      case RX_REQUEST:
+        rx_request(i->msg, i->timestamp);
+        break;
+
+      case TX_REQUEST:
+        tx_request(i->msg, i->timestamp);
+        break;
+
+      case RX_RESPONSE:
+        rx_response(i->msg, i->timestamp);
+        break;
+
+      case TX_RESPONSE:
+        tx_response(i->msg, i->timestamp);
+        break;
+    }
+  }
+
+  _deferred = deferred;
+}
+
+RalfACR* RalfACR::detach()
+{
+  // The copy shares the captured messages and their pool, so this ACR must
+  // give them up.
+  RalfACR* acr = new RalfACR(*this);
+  _pool = NULL;
+  _captured.clear();
+  return acr;
+}
+
 /// RalfACRFactory Constructor.
 RalfACRFactory::RalfACRFactory(RalfProcessor* ralf,
-                               ACR::Node node_functionality) :
+                               ACR::Node node_functionality,
+                               bool deferred) :
   _ralf(ralf),
-  _node_functionality(node_functionality)
+  _node_functionality(node_functionality),
+  _deferred(deferred)
 {
   TRC_DEBUG("Created RalfACR factory for node type %s",
             ACR::node_name(_node_functionality).c_str());
@@ -1764,6 +1986,11 @@ ACR* RalfACRFactory::get_acr(SAS::TrailId trail,
             ACR::node_name(_node_functionality).c_str(),
             ACR::node_role_str(role).c_str());
 
-  return (ACR*)new RalfACR(_ralf, trail, _node_functionality, initiator, role);
+  return (ACR*)new RalfACR(_ralf,
+                           trail,
+                           _node_functionality,
+                           initiator,
+                           role,
+                           _deferred);
 }
 
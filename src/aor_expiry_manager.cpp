@@ -0,0 +1,491 @@
+/**
+ * @file aor_expiry_manager.cpp Local expiry of registrations and subscriptions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <string.h>
+#include <time.h>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "log.h"
+#include "aor_expiry_manager.h"
+
+AoRExpiryManager::AoRExpiryManager(ChronosConnection* chronos,
+                                   const ExpiryHandler& handler,
+                                   int bucket_s,
+                                   int flush_interval_s) :
+  _chronos(chronos),
+  _handler(handler),
+  _bucket_s(bucket_s),
+  _flush_interval_s(flush_interval_s),
+  _next_flush(0),
+  _terminated(false),
+  _started(false),
+  _wheel(time(NULL)),
+  _aors(),
+  _buckets()
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+AoRExpiryManager::~AoRExpiryManager()
+{
+  if (_started)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+  }
+
+  // AoRs written since the last flush aren't covered by a Chronos timer yet,
+  // so flush now to make sure they are still expired once we've gone.
+  std::vector<std::string> timers_to_delete;
+  std::vector<TimerUpdate> timers_to_set;
+
+  pthread_mutex_lock(&_lock);
+  flush_buckets(time(NULL), timers_to_delete, timers_to_set);
+  pthread_mutex_unlock(&_lock);
+
+  if ((!timers_to_delete.empty()) || (!timers_to_set.empty()))
+  {
+    SAS::TrailId trail = SAS::new_trail(1u);
+
+    for (std::vector<std::string>::const_iterator i = timers_to_delete.begin();
+         i != timers_to_delete.end();
+         ++i)
+    {
+      _chronos->send_delete(*i, trail);
+    }
+
+    send_timer_updates(timers_to_set, trail);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AoRExpiryManager::start()
+{
+  int rc = pthread_create(&_thread, NULL, &tick_thread, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start AoR expiry thread: %s", strerror(rc));
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _started = true;
+}
+
+
+void AoRExpiryManager::aor_updated(const std::string& aor_id,
+                                   int next_expires,
+                                   const std::map<std::string, uint32_t>& tags,
+                                   const std::string& old_timer_id)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, AoREntry>::iterator i = _aors.find(aor_id);
+
+  if (next_expires == 0)
+  {
+    TRC_DEBUG("Stop tracking expiry of AoR %s", aor_id.c_str());
+    _wheel.cancel(aor_id);
+
+    if (i != _aors.end())
+    {
+      remove_from_bucket(aor_id, i->second, true);
+      _aors.erase(i);
+    }
+  }
+  else
+  {
+    TRC_DEBUG("AoR %s next expires at %d", aor_id.c_str(), next_expires);
+    _wheel.set(aor_id, next_expires);
+
+    int bucket = next_expires / _bucket_s;
+
+    if (old_timer_id != "")
+    {
+      // Keep the AoR's own timer until its bucket has a timer to take over.
+      Bucket& b = _buckets[bucket];
+      b.old_timers.push_back(old_timer_id);
+      b.dirty = true;
+    }
+
+    if (i != _aors.end())
+    {
+      if ((i->second.bucket == bucket) && (i->second.tags == tags))
+      {
+        // The AoR's bucket timer is still correct.
+        pthread_mutex_unlock(&_lock);
+        return;
+      }
+
+      remove_from_bucket(aor_id, i->second, true);
+    }
+    else
+    {
+      i = _aors.insert(std::make_pair(aor_id, AoREntry())).first;
+    }
+
+    i->second.bucket = bucket;
+    i->second.tags = tags;
+
+    Bucket& b = _buckets[bucket];
+    b.aor_ids.insert(aor_id);
+    b.dirty = true;
+
+    for (std::map<std::string, uint32_t>::const_iterator t = tags.begin();
+         t != tags.end();
+         ++t)
+    {
+      b.tags[t->first] += t->second;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void AoRExpiryManager::tick(int now)
+{
+  std::vector<std::string> expired;
+  std::vector<std::string> timers_to_delete;
+  std::vector<TimerUpdate> timers_to_set;
+
+  pthread_mutex_lock(&_lock);
+
+  _wheel.advance(now, expired);
+
+  for (std::vector<std::string>::const_iterator i = expired.begin();
+       i != expired.end();
+       ++i)
+  {
+    // The AoR is re-added when the expiry processing writes it back.  Its
+    // bucket will be deleted once the bucket is due, so there's no need to
+    // update the bucket's timer.
+    std::unordered_map<std::string, AoREntry>::iterator entry = _aors.find(*i);
+
+    if (entry != _aors.end())
+    {
+      remove_from_bucket(*i, entry->second, false);
+      _aors.erase(entry);
+    }
+  }
+
+  // Every AoR in a bucket that is entirely in the past has been popped from
+  // the wheel, so its safety net timer is no longer needed.
+  while ((!_buckets.empty()) &&
+         ((_buckets.begin()->first + 1) * _bucket_s <= now))
+  {
+    Bucket& b = _buckets.begin()->second;
+    if (b.timer_id != "")
+    {
+      timers_to_delete.push_back(b.timer_id);
+    }
+    timers_to_delete.insert(timers_to_delete.end(),
+                            b.old_timers.begin(),
+                            b.old_timers.end());
+    _buckets.erase(_buckets.begin());
+  }
+
+  if (now >= _next_flush)
+  {
+    flush_buckets(now, timers_to_delete, timers_to_set);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if ((expired.empty()) &&
+      (timers_to_delete.empty()) &&
+      (timers_to_set.empty()))
+  {
+    return;
+  }
+
+  SAS::TrailId trail = SAS::new_trail(1u);
+
+  if (!expired.empty())
+  {
+    TRC_DEBUG("%lu AoRs due to expire", expired.size());
+    _handler(expired, trail);
+  }
+
+  for (std::vector<std::string>::const_iterator i = timers_to_delete.begin();
+       i != timers_to_delete.end();
+       ++i)
+  {
+    _chronos->send_delete(*i, trail);
+  }
+
+  send_timer_updates(timers_to_set, trail);
+}
+
+
+void AoRExpiryManager::flush_buckets(int now,
+                                     std::vector<std::string>& timers_to_delete,
+                                     std::vector<TimerUpdate>& timers_to_set)
+{
+  std::map<int, Bucket>::iterator b = _buckets.begin();
+
+  while (b != _buckets.end())
+  {
+    if (!b->second.dirty)
+    {
+      ++b;
+    }
+    else if (b->second.aor_ids.empty())
+    {
+      if (b->second.timer_id != "")
+      {
+        timers_to_delete.push_back(b->second.timer_id);
+      }
+      timers_to_delete.insert(timers_to_delete.end(),
+                              b->second.old_timers.begin(),
+                              b->second.old_timers.end());
+      _buckets.erase(b++);
+    }
+    else
+    {
+      rapidjson::StringBuffer sb;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+      writer.StartObject();
+      writer.String("aor_ids");
+      writer.StartArray();
+      for (std::set<std::string>::const_iterator i = b->second.aor_ids.begin();
+           i != b->second.aor_ids.end();
+           ++i)
+      {
+        writer.String(i->c_str());
+      }
+      writer.EndArray();
+      writer.EndObject();
+
+      // Give this node a full bucket's grace to process the AoRs before
+      // the safety net pops.
+      TimerUpdate update;
+      update.bucket = b->first;
+      update.timer_id = b->second.timer_id;
+      update.interval = (b->first + 2) * _bucket_s - now;
+      update.opaque = sb.GetString();
+      update.tags = b->second.tags;
+      update.old_timers.swap(b->second.old_timers);
+      timers_to_set.push_back(update);
+
+      b->second.dirty = false;
+      ++b;
+    }
+  }
+
+  _next_flush = now + _flush_interval_s;
+}
+
+
+size_t AoRExpiryManager::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _aors.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void AoRExpiryManager::remove_from_bucket(const std::string& aor_id,
+                                          const AoREntry& entry,
+                                          bool mark_dirty)
+{
+  std::map<int, Bucket>::iterator b = _buckets.find(entry.bucket);
+
+  if (b == _buckets.end())
+  {
+    return;
+  }
+
+  b->second.aor_ids.erase(aor_id);
+
+  for (std::map<std::string, uint32_t>::const_iterator t = entry.tags.begin();
+       t != entry.tags.end();
+       ++t)
+  {
+    b->second.tags[t->first] -= t->second;
+  }
+
+  if (mark_dirty)
+  {
+    b->second.dirty = true;
+  }
+}
+
+
+void AoRExpiryManager::send_timer_updates(std::vector<TimerUpdate>& updates,
+                                          SAS::TrailId trail)
+{
+  std::vector<std::string> old_timers;
+
+  for (std::vector<TimerUpdate>::iterator u = updates.begin();
+       u != updates.end();
+       ++u)
+  {
+    std::string timer_id = u->timer_id;
+    HTTPCode status;
+
+    if (timer_id == "")
+    {
+      status = _chronos->send_post(timer_id,
+                                   u->interval,
+                                   "/timers",
+                                   u->opaque,
+                                   trail,
+                                   u->tags);
+    }
+    else
+    {
+      status = _chronos->send_put(timer_id,
+                                  u->interval,
+                                  "/timers",
+                                  u->opaque,
+                                  trail,
+                                  u->tags);
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    std::map<int, Bucket>::iterator b = _buckets.find(u->bucket);
+    bool orphaned = false;
+
+    if (status != HTTP_OK)
+    {
+      // Try again on the next flush.
+      TRC_DEBUG("Failed to update timer for expiry bucket %d", u->bucket);
+      if (b != _buckets.end())
+      {
+        b->second.dirty = true;
+        b->second.old_timers.insert(b->second.old_timers.end(),
+                                    u->old_timers.begin(),
+                                    u->old_timers.end());
+      }
+      else
+      {
+        old_timers.insert(old_timers.end(),
+                          u->old_timers.begin(),
+                          u->old_timers.end());
+      }
+    }
+    else if (b != _buckets.end())
+    {
+      b->second.timer_id = timer_id;
+      old_timers.insert(old_timers.end(),
+                        u->old_timers.begin(),
+                        u->old_timers.end());
+    }
+    else
+    {
+      // The bucket was processed while the timer was being set.
+      orphaned = true;
+      old_timers.insert(old_timers.end(),
+                        u->old_timers.begin(),
+                        u->old_timers.end());
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if (orphaned)
+    {
+      _chronos->send_delete(timer_id, trail);
+    }
+  }
+
+  // Only delete the per-AoR timers once every bucket in the batch has been
+  // updated, as an AoR may have moved between buckets.
+  for (std::vector<std::string>::const_iterator i = old_timers.begin();
+       i != old_timers.end();
+       ++i)
+  {
+    _chronos->send_delete(*i, trail);
+  }
+}
+
+
+void AoRExpiryManager::tick_loop()
+{
+  // Expiry processing sends NOTIFYs, so PJSIP needs to know about this
+  // thread.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pj_bzero(desc, sizeof(pj_thread_desc));
+  pj_thread_register("aor-expiry", desc, &thread);
+
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += 1;
+    pthread_cond_timedwait(&_cond, &_lock, &wake);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    tick(time(NULL));
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* AoRExpiryManager::tick_thread(void* p)
+{
+  ((AoRExpiryManager*)p)->tick_loop();
+  return NULL;
+}
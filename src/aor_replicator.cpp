@@ -0,0 +1,396 @@
+/**
+ * @file aor_replicator.cpp Asynchronous replication of AoRs to a remote site.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "aor_replicator.h"
+
+AoRReplicator::AoRReplicator(SubscriberDataManager* remote_sdm,
+                             int num_threads,
+                             size_t max_backlog,
+                             SNMP::EventAccumulatorTable* lag_tbl,
+                             SNMP::EventAccumulatorTable* backlog_tbl) :
+  _remote_sdm(remote_sdm),
+  _num_threads(num_threads),
+  _max_backlog(max_backlog),
+  _lag_tbl(lag_tbl),
+  _backlog_tbl(backlog_tbl),
+  _records(),
+  _queue(),
+  _in_flight(),
+  _threads(),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+AoRReplicator::~AoRReplicator()
+{
+  // Let the threads drain the queue and exit.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  // Free anything left over (only possible if the threads never started).
+  for (std::map<std::string, Record>::iterator it = _records.begin();
+       it != _records.end();
+       ++it)
+  {
+    free_record(it->second);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AoRReplicator::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &replicate_thread, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start AoR replication thread: %s", strerror(rc));
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    _threads.push_back(thread);
+  }
+}
+
+
+void AoRReplicator::replicate(const std::string& aor_id,
+                              SubscriberDataManager::AoRPair* aor_pair,
+                              SAS::TrailId trail)
+{
+  if ((aor_pair == NULL) || (aor_pair->get_current() == NULL))
+  {
+    return;
+  }
+
+  Record record;
+  build_record(aor_pair, trail, record);
+  record.queued_ms = now_ms();
+
+  bool synchronous = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Record>::iterator it = _records.find(aor_id);
+
+  if (it != _records.end())
+  {
+    // The AoR is already waiting to be replicated, so just bring the
+    // waiting record up to date.
+    TRC_DEBUG("Coalescing replication of %s", aor_id.c_str());
+    merge_record(it->second, record);
+  }
+  else if ((_threads.empty()) ||
+           ((_records.size() >= _max_backlog) &&
+            (_in_flight.find(aor_id) == _in_flight.end())))
+  {
+    // Either there are no replication threads or the backlog is full, so
+    // write the AoR now.  This can't overtake an earlier write of the same
+    // AoR as there isn't one in progress.
+    synchronous = true;
+  }
+  else
+  {
+    _records[aor_id] = record;
+
+    if (_in_flight.find(aor_id) == _in_flight.end())
+    {
+      _queue.push_back(aor_id);
+      pthread_cond_signal(&_cond);
+    }
+  }
+
+  size_t backlog = _records.size();
+
+  pthread_mutex_unlock(&_lock);
+
+  if (_backlog_tbl != NULL)
+  {
+    _backlog_tbl->accumulate(backlog);
+  }
+
+  if (synchronous)
+  {
+    TRC_DEBUG("Replicating %s synchronously", aor_id.c_str());
+    write_record(aor_id, record);
+    free_record(record);
+  }
+}
+
+
+size_t AoRReplicator::backlog()
+{
+  pthread_mutex_lock(&_lock);
+  size_t backlog = _records.size();
+  pthread_mutex_unlock(&_lock);
+  return backlog;
+}
+
+
+/// Builds a replication record from an AoR that has just been written to
+/// the local store.
+void AoRReplicator::build_record(SubscriberDataManager::AoRPair* aor_pair,
+                                 SAS::TrailId trail,
+                                 Record& record)
+{
+  SubscriberDataManager::AoR* current = aor_pair->get_current();
+  SubscriberDataManager::AoR* orig = aor_pair->get_orig();
+
+  record.aor = new SubscriberDataManager::AoR(*current);
+  record.trail = trail;
+
+  if (orig != NULL)
+  {
+    for (SubscriberDataManager::AoR::Bindings::const_iterator it = orig->bindings().begin();
+         it != orig->bindings().end();
+         ++it)
+    {
+      if (current->bindings().find(it->first) == current->bindings().end())
+      {
+        record.removed_bindings.insert(it->first);
+      }
+    }
+
+    for (SubscriberDataManager::AoR::Subscriptions::const_iterator it = orig->subscriptions().begin();
+         it != orig->subscriptions().end();
+         ++it)
+    {
+      if (current->subscriptions().find(it->first) == current->subscriptions().end())
+      {
+        record.removed_subscriptions.insert(it->first);
+      }
+    }
+  }
+}
+
+
+/// Merges a new replication record for an AoR into the one that is already
+/// waiting.  Takes ownership of the new record's AoR.
+void AoRReplicator::merge_record(Record& existing, Record& update)
+{
+  existing.removed_bindings.insert(update.removed_bindings.begin(),
+                                   update.removed_bindings.end());
+  existing.removed_subscriptions.insert(update.removed_subscriptions.begin(),
+                                        update.removed_subscriptions.end());
+
+  // Anything that has been added back since it was removed is no longer
+  // removed.
+  for (SubscriberDataManager::AoR::Bindings::const_iterator it = update.aor->bindings().begin();
+       it != update.aor->bindings().end();
+       ++it)
+  {
+    existing.removed_bindings.erase(it->first);
+  }
+
+  for (SubscriberDataManager::AoR::Subscriptions::const_iterator it = update.aor->subscriptions().begin();
+       it != update.aor->subscriptions().end();
+       ++it)
+  {
+    existing.removed_subscriptions.erase(it->first);
+  }
+
+  delete existing.aor;
+  existing.aor = update.aor;
+  existing.trail = update.trail;
+  update.aor = NULL;
+}
+
+
+void AoRReplicator::free_record(Record& record)
+{
+  delete record.aor;
+  record.aor = NULL;
+}
+
+
+/// Merges a replication record into the AoR in the remote store.
+void AoRReplicator::write_record(const std::string& aor_id, Record& record)
+{
+  if (!_remote_sdm->has_servers())
+  {
+    return;
+  }
+
+  SubscriberDataManager::AoRPair* remote_aor_pair = NULL;
+  Store::Status set_rc;
+
+  do
+  {
+    delete remote_aor_pair;
+    remote_aor_pair = _remote_sdm->get_aor_data(aor_id, record.trail);
+
+    if ((remote_aor_pair == NULL) ||
+        (remote_aor_pair->get_current() == NULL))
+    {
+      TRC_DEBUG("Failed to get AoR %s from remote store", aor_id.c_str());
+      set_rc = Store::ERROR;
+      break;
+    }
+
+    SubscriberDataManager::AoR* remote_aor = remote_aor_pair->get_current();
+
+    for (std::set<std::string>::const_iterator it = record.removed_bindings.begin();
+         it != record.removed_bindings.end();
+         ++it)
+    {
+      remote_aor->remove_binding(*it);
+    }
+
+    for (std::set<std::string>::const_iterator it = record.removed_subscriptions.begin();
+         it != record.removed_subscriptions.end();
+         ++it)
+    {
+      remote_aor->remove_subscription(*it);
+    }
+
+    for (SubscriberDataManager::AoR::Bindings::const_iterator it = record.aor->bindings().begin();
+         it != record.aor->bindings().end();
+         ++it)
+    {
+      SubscriberDataManager::AoR::Binding* dst = remote_aor->get_binding(it->first);
+      std::string* address_of_record = dst->_address_of_record;
+      *dst = *(it->second);
+      dst->_address_of_record = address_of_record;
+    }
+
+    for (SubscriberDataManager::AoR::Subscriptions::const_iterator it = record.aor->subscriptions().begin();
+         it != record.aor->subscriptions().end();
+         ++it)
+    {
+      *(remote_aor->get_subscription(it->first)) = *(it->second);
+    }
+
+    set_rc = _remote_sdm->set_aor_data(aor_id, remote_aor_pair, record.trail);
+  }
+  while (set_rc == Store::DATA_CONTENTION);
+
+  delete remote_aor_pair;
+
+  if (set_rc != Store::OK)
+  {
+    // We don't worry about failures to write to the remote store.
+    TRC_DEBUG("Failed to replicate AoR %s to remote store", aor_id.c_str());
+  }
+}
+
+
+void AoRReplicator::replicate_loop()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((_queue.empty()) && (!_terminated))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_queue.empty())
+    {
+      // Terminated, and there's nothing left to replicate.
+      break;
+    }
+
+    std::string aor_id = _queue.front();
+    _queue.pop_front();
+
+    std::map<std::string, Record>::iterator it = _records.find(aor_id);
+    Record record = it->second;
+    _records.erase(it);
+    _in_flight.insert(aor_id);
+
+    pthread_mutex_unlock(&_lock);
+
+    write_record(aor_id, record);
+
+    if (_lag_tbl != NULL)
+    {
+      _lag_tbl->accumulate((now_ms() - record.queued_ms) * 1000);
+    }
+
+    free_record(record);
+
+    pthread_mutex_lock(&_lock);
+
+    _in_flight.erase(aor_id);
+
+    if (_records.find(aor_id) != _records.end())
+    {
+      // The AoR was updated again while it was being written.
+      _queue.push_back(aor_id);
+      pthread_cond_signal(&_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* AoRReplicator::replicate_thread(void* p)
+{
+  ((AoRReplicator*)p)->replicate_loop();
+  return NULL;
+}
+
+
+unsigned long AoRReplicator::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file aor_write_serializer.cpp Serializes writes to each AoR on this node.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <functional>
+#include <algorithm>
+
+#include "log.h"
+#include "aor_write_serializer.h"
+
+const size_t AoRWriteSerializer::DEFAULT_STRIPES;
+const int AoRWriteSerializer::DEFAULT_MIN_BACKOFF_US;
+const int AoRWriteSerializer::DEFAULT_MAX_BACKOFF_US;
+
+AoRWriteSerializer::AoRWriteSerializer(size_t stripes,
+                                       int min_backoff_us,
+                                       int max_backoff_us,
+                                       SNMP::EventAccumulatorTable* retries_tbl) :
+  _locks((stripes > 0) ? stripes : 1),
+  _min_backoff_us(min_backoff_us),
+  _max_backoff_us(max_backoff_us),
+  _retries_tbl(retries_tbl)
+{
+  for (size_t ii = 0; ii < _locks.size(); ++ii)
+  {
+    pthread_mutex_init(&_locks[ii], NULL);
+  }
+}
+
+
+AoRWriteSerializer::~AoRWriteSerializer()
+{
+  for (size_t ii = 0; ii < _locks.size(); ++ii)
+  {
+    pthread_mutex_destroy(&_locks[ii]);
+  }
+}
+
+
+pthread_mutex_t* AoRWriteSerializer::lock_for(const std::string& aor_id)
+{
+  return &_locks[std::hash<std::string>()(aor_id) % _locks.size()];
+}
+
+
+void AoRWriteSerializer::backoff(int retries)
+{
+  // Back off for a random time up to a limit that doubles with each retry
+  // (so that writers on different nodes spread out), capped at the maximum.
+  int limit_us = _min_backoff_us;
+
+  for (int ii = 1; (ii < retries) && (limit_us < _max_backoff_us); ++ii)
+  {
+    limit_us *= 2;
+  }
+
+  limit_us = std::min(limit_us, _max_backoff_us);
+
+  if (limit_us > 0)
+  {
+    int backoff_us = rand() % limit_us;
+    TRC_DEBUG("Contention writing AoR (retry %d) - back off for %dus",
+              retries, backoff_us);
+    usleep(backoff_us);
+  }
+}
+
+
+AoRWriteSerializer::Write::Write(AoRWriteSerializer* serializer,
+                                 const std::string& aor_id) :
+  _serializer(serializer),
+  _lock(NULL),
+  _retries(0)
+{
+  if (_serializer != NULL)
+  {
+    _lock = _serializer->lock_for(aor_id);
+    pthread_mutex_lock(_lock);
+  }
+}
+
+
+AoRWriteSerializer::Write::~Write()
+{
+  finish();
+}
+
+
+void AoRWriteSerializer::Write::finish()
+{
+  if (_lock != NULL)
+  {
+    pthread_mutex_unlock(_lock);
+    _lock = NULL;
+
+    if (_serializer->_retries_tbl != NULL)
+    {
+      _serializer->_retries_tbl->accumulate(_retries);
+    }
+  }
+}
+
+
+bool AoRWriteSerializer::Write::retry(Store::Status status)
+{
+  if (status != Store::DATA_CONTENTION)
+  {
+    return false;
+  }
+
+  ++_retries;
+
+  if (_serializer != NULL)
+  {
+    // Don't hold the lock while backing off, as other AoRs may hash onto it.
+    // The AoR is re-read after the backoff, so it's safe for another writer
+    // on this node to get in first.
+    if (_lock != NULL)
+    {
+      pthread_mutex_unlock(_lock);
+    }
+
+    _serializer->backoff(_retries);
+
+    if (_lock != NULL)
+    {
+      pthread_mutex_lock(_lock);
+    }
+  }
+
+  return true;
+}
@@ -34,10 +34,15 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <stdio.h>
+#include <sched.h>
+#include <random>
 #include <boost/lexical_cast.hpp>
 
 #include "log.h"
 #include "pjutils.h"
+#include "stack.h"
+#include "latency_breakdown.h"
 
 #include "constants.h"
 #include "aschain.h"
@@ -60,6 +65,7 @@ AsChain::AsChain(AsChainTable* as_chain_table,
   _refs(1),  // for the initial chain link being returned
   _as_info(ifcs.size() + 1),
   _odi_tokens(),
+  _odi_slot(0),
   _responsive(ifcs.size() + 1),
   _session_case(session_case),
   _served_user(served_user),
@@ -108,7 +114,7 @@ AsChain::~AsChain()
     delete _acr;
   }
 
-  _as_chain_table->unregister(_odi_tokens);
+  _as_chain_table->unregister(_odi_slot);
 }
 
 
@@ -191,6 +197,8 @@ void AsChainLink::on_initial_request(pjsip_msg* msg,
     SAS::associate_trails(_as_chain->trail(), msg_trail);
   }
 
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::IFC);
+
   while (!complete())
   {
     const Ifc& ifc = (_as_chain->_ifcs)[_index];
@@ -213,6 +221,11 @@ void AsChainLink::on_initial_request(pjsip_msg* msg,
       // Store the default handling as we may need it later.
       _default_handling = application_server.default_handling;
 
+      if (stack_data.dns_prefetcher != NULL)
+      {
+        stack_data.dns_prefetcher->learn_uri(server_name);
+      }
+
       break;
     }
     ++_index;
@@ -242,15 +255,30 @@ void AsChainLink::on_response(int status_code)
 }
 
 
-AsChainTable::AsChainTable()
+AsChainTable::AsChainTable() :
+  _next_unused(0),
+  _free_head(0)
 {
-  pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_chunks_lock, NULL);
+
+  for (uint32_t ii = 0; ii < MAX_CHUNKS; ++ii)
+  {
+    _chunks[ii] = NULL;
+  }
+
+  // Allocate the first chunk up front.
+  _chunks[0] = new_chunk();
 }
 
 
 AsChainTable::~AsChainTable()
 {
-  pthread_mutex_destroy(&_lock);
+  for (uint32_t ii = 0; ii < MAX_CHUNKS; ++ii)
+  {
+    delete[] _chunks[ii].load();
+  }
+
+  pthread_mutex_destroy(&_chunks_lock);
 }
 
 
@@ -259,32 +287,69 @@ AsChainTable::~AsChainTable()
 void AsChainTable::register_(AsChain* as_chain, std::vector<std::string>& tokens)
 {
   size_t len = as_chain->size() + 1;
-  pthread_mutex_lock(&_lock);
+  uint32_t slot_index = allocate_slot();
+  as_chain->_odi_slot = slot_index;
 
-  for (size_t i = 0; i < len; i++)
+  if (slot_index == NO_SLOT)
   {
-    std::string token;
-    Utils::create_random_token(TOKEN_LENGTH, token);
-    tokens.push_back(token);
-    _odi_token_map[token] = AsChainLink(as_chain, i);
+    // The table is full.  Hand out tokens that won't match, so requests
+    // returning from the application servers are treated as new requests.
+    // LCOV_EXCL_START
+    TRC_ERROR("No free slots in AS chain table");
+    tokens.assign(len, std::string(TOKEN_LENGTH, 'x'));
+    return;
+    // LCOV_EXCL_STOP
   }
 
-  pthread_mutex_unlock(&_lock);
+  Slot* s = slot(slot_index);
+  s->chain = as_chain;
+  s->nonce = random_nonce();
+
+  // Make the slot visible to lookups.
+  uint32_t generation = s->state.load() >> 32;
+  s->state.store(((uint64_t)generation << 32) | SLOT_LIVE);
+
+  for (size_t i = 0; i < len; i++)
+  {
+    char token[TOKEN_LENGTH + 1];
+    snprintf(token, sizeof(token), "%06x%08x%04x%016llx",
+             slot_index,
+             generation,
+             (unsigned int)i,
+             (unsigned long long)s->nonce);
+    tokens.push_back(std::string(token, TOKEN_LENGTH));
+  }
 }
 
 
-void AsChainTable::unregister(std::vector<std::string>& tokens)
+void AsChainTable::unregister(uint32_t slot_index)
 {
-  pthread_mutex_lock(&_lock);
+  if (slot_index == NO_SLOT)
+  {
+    return; // LCOV_EXCL_LINE
+  }
+
+  Slot* s = slot(slot_index);
+
+  // Stop new lookups reading the slot.
+  uint64_t state = s->state.load();
+  while (!s->state.compare_exchange_weak(state, state & ~SLOT_LIVE))
+  {
+  }
 
-  for (std::vector<std::string>::iterator it = tokens.begin();
-       it != tokens.end();
-       ++it)
+  // Wait for any lookups already reading the slot to finish.  They only
+  // take a reference to the chain, so this is brief.
+  while ((s->state.load() & SLOT_PINS_MASK) != 0)
   {
-    _odi_token_map.erase(*it);
+    sched_yield(); // LCOV_EXCL_LINE - can't hit this window in UT.
   }
 
-  pthread_mutex_unlock(&_lock);
+  // Move on to the next generation, so existing tokens are stale.
+  s->chain = NULL;
+  s->nonce = 0;
+  s->state.store(((state >> 32) + 1) << 32);
+
+  free_slot(slot_index);
 }
 
 
@@ -294,32 +359,212 @@ void AsChainTable::unregister(std::vector<std::string>& tokens)
 // is finished with the link.
 AsChainLink AsChainTable::lookup(const std::string& token)
 {
-  pthread_mutex_lock(&_lock);
-  std::map<std::string, AsChainLink>::const_iterator it =
-                                                    _odi_token_map.find(token);
-  if (it == _odi_token_map.end())
+  return lookup(token.data(), token.length());
+}
+
+
+AsChainLink AsChainTable::lookup(const char* token, size_t token_len)
+{
+  uint32_t slot_index;
+  uint32_t generation;
+  uint32_t step;
+  uint64_t nonce;
+
+  if ((!parse_token(token, token_len, slot_index, generation, step, nonce)) ||
+      (slot_index >= MAX_CHUNKS * CHUNK_SIZE))
   {
-    pthread_mutex_unlock(&_lock);
     return AsChainLink(NULL, 0);
   }
-  else
+
+  Slot* s = slot(slot_index);
+
+  if (s == NULL)
+  {
+    return AsChainLink(NULL, 0);
+  }
+
+  // Pin the slot, if it still holds the chain the token was issued for.
+  uint64_t state = s->state.load();
+  do
+  {
+    if (((state & SLOT_LIVE) == 0) || ((state >> 32) != generation))
+    {
+      return AsChainLink(NULL, 0);
+    }
+  }
+  while (!s->state.compare_exchange_weak(state, state + SLOT_PIN));
+
+  AsChainLink as_chain_link(NULL, 0);
+  AsChain* as_chain = s->chain;
+
+  // Step 0 is never handed out, as it is the start of the chain.
+  if ((nonce == s->nonce) &&
+      (step >= 1) &&
+      (step <= as_chain->size()))
   {
     // Found the AsChainLink.  Add a reference to the AsChain.
-    const AsChainLink& as_chain_link = it->second;
-    if (as_chain_link._as_chain->inc_ref())
+    if (as_chain->inc_ref())
     {
       // Flag that the AS corresponding to the previous link in the chain has
       // effectively responded.
-      as_chain_link._as_chain->_responsive[as_chain_link._index - 1] = true;
-      pthread_mutex_unlock(&_lock);
-      return as_chain_link;
-    } else {
-      // Failed to increment the count - AS chain must be in the process of
-      // being destroyed.  Pretend we didn't find it.
-      // LCOV_EXCL_START - Can't hit this window condition in UT.
-      pthread_mutex_unlock(&_lock);
-      return AsChainLink(NULL, 0);
-      // LCOV_EXCL_STOP
+      as_chain->_responsive[step - 1] = true;
+      as_chain_link = AsChainLink(as_chain, step);
     }
+    // Otherwise failed to increment the count - AS chain must be in the
+    // process of being destroyed.  Pretend we didn't find it.
   }
+
+  s->state.fetch_sub(SLOT_PIN);
+
+  return as_chain_link;
+}
+
+
+AsChainTable::Slot* AsChainTable::slot(uint32_t slot_index)
+{
+  Slot* chunk = _chunks[slot_index / CHUNK_SIZE].load();
+  return (chunk != NULL) ? &chunk[slot_index % CHUNK_SIZE] : NULL;
+}
+
+
+/// Allocates a slot, from the free list if possible.
+uint32_t AsChainTable::allocate_slot()
+{
+  uint64_t head = _free_head.load();
+
+  while ((head & 0xFFFFFFFF) != 0)
+  {
+    uint32_t slot_index = (uint32_t)(head & 0xFFFFFFFF) - 1;
+    uint64_t next = slot(slot_index)->next_free.load();
+    uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+
+    if (_free_head.compare_exchange_weak(head, new_head))
+    {
+      return slot_index;
+    }
+  }
+
+  // The free list is empty, so use a new slot.
+  uint32_t slot_index = _next_unused++;
+
+  if (slot_index >= MAX_CHUNKS * CHUNK_SIZE)
+  {
+    // LCOV_EXCL_START
+    _next_unused--;
+    return NO_SLOT;
+    // LCOV_EXCL_STOP
+  }
+
+  uint32_t chunk_index = slot_index / CHUNK_SIZE;
+
+  if (_chunks[chunk_index].load() == NULL)
+  {
+    // LCOV_EXCL_START - UT doesn't use more than one chunk.
+    pthread_mutex_lock(&_chunks_lock);
+
+    if (_chunks[chunk_index].load() == NULL)
+    {
+      _chunks[chunk_index] = new_chunk();
+    }
+
+    pthread_mutex_unlock(&_chunks_lock);
+    // LCOV_EXCL_STOP
+  }
+
+  return slot_index;
+}
+
+
+AsChainTable::Slot* AsChainTable::new_chunk()
+{
+  Slot* chunk = new Slot[CHUNK_SIZE];
+
+  for (uint32_t ii = 0; ii < CHUNK_SIZE; ++ii)
+  {
+    chunk[ii].state = 0;
+    chunk[ii].chain = NULL;
+    chunk[ii].nonce = 0;
+    chunk[ii].next_free = 0;
+  }
+
+  return chunk;
+}
+
+
+void AsChainTable::free_slot(uint32_t slot_index)
+{
+  Slot* s = slot(slot_index);
+  uint64_t head = _free_head.load();
+  uint64_t new_head;
+
+  do
+  {
+    s->next_free = (uint32_t)(head & 0xFFFFFFFF);
+    new_head = (((head >> 32) + 1) << 32) | (slot_index + 1);
+  }
+  while (!_free_head.compare_exchange_weak(head, new_head));
+}
+
+
+/// Parses an ODI token without allocating.
+bool AsChainTable::parse_token(const char* token,
+                               size_t token_len,
+                               uint32_t& slot_index,
+                               uint32_t& generation,
+                               uint32_t& step,
+                               uint64_t& nonce)
+{
+  if (token_len != TOKEN_LENGTH)
+  {
+    return false;
+  }
+
+  uint64_t fields[4] = {0, 0, 0, 0};
+  static const size_t FIELD_LENGTHS[4] = {6, 8, 4, 16};
+  size_t pos = 0;
+
+  for (int field = 0; field < 4; ++field)
+  {
+    for (size_t ii = 0; ii < FIELD_LENGTHS[field]; ++ii, ++pos)
+    {
+      char c = token[pos];
+      int digit;
+
+      if ((c >= '0') && (c <= '9'))
+      {
+        digit = c - '0';
+      }
+      else if ((c >= 'a') && (c <= 'f'))
+      {
+        digit = c - 'a' + 10;
+      }
+      else
+      {
+        return false;
+      }
+
+      fields[field] = (fields[field] << 4) | digit;
+    }
+  }
+
+  slot_index = (uint32_t)fields[0];
+  generation = (uint32_t)fields[1];
+  step = (uint32_t)fields[2];
+  nonce = fields[3];
+  return true;
+}
+
+
+static uint64_t random_seed()
+{
+  std::random_device rd;
+  return ((uint64_t)rd() << 32) | rd();
+}
+
+
+uint64_t AsChainTable::random_nonce()
+{
+  // Each thread has its own generator, so no lock is needed.
+  static thread_local std::mt19937_64 generator(random_seed());
+  return generator();
 }
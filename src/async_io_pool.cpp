@@ -0,0 +1,170 @@
+/**
+ * @file async_io_pool.cpp Pool of threads for blocking I/O on behalf of sproutlets.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <string.h>
+
+#include "log.h"
+#include "async_io_pool.h"
+
+AsyncIOPool::AsyncIOPool(int num_threads, Dispatcher dispatcher) :
+  _num_threads(num_threads),
+  _dispatcher(dispatcher),
+  _queue(),
+  _threads(),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+AsyncIOPool::~AsyncIOPool()
+{
+  // Let the threads drain the queue and exit.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AsyncIOPool::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &io_thread, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start I/O thread: %s", strerror(rc));
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    _threads.push_back(thread);
+  }
+}
+
+
+void AsyncIOPool::run(const Callback& work, const Callback& done)
+{
+  Operation op;
+  op.work = work;
+  op.done = done;
+
+  pthread_mutex_lock(&_lock);
+  _queue.push_back(op);
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t AsyncIOPool::queue_size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _queue.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void AsyncIOPool::io_loop()
+{
+  // Operations may use PJSIP, which needs to know about this thread.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pj_bzero(desc, sizeof(pj_thread_desc));
+  pj_thread_register("async-io", desc, &thread);
+
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((_queue.empty()) && (!_terminated))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_queue.empty())
+    {
+      // Terminated, and there's nothing left to run.
+      break;
+    }
+
+    Operation op = _queue.front();
+    _queue.pop_front();
+
+    pthread_mutex_unlock(&_lock);
+
+    op.work();
+
+    if (_dispatcher)
+    {
+      _dispatcher(op.done);
+    }
+    else
+    {
+      op.done();
+    }
+
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* AsyncIOPool::io_thread(void* p)
+{
+  ((AsyncIOPool*)p)->io_loop();
+  return NULL;
+}
@@ -61,6 +61,7 @@ extern "C" {
 #include "impistore.h"
 #include "snmp_success_fail_count_table.h"
 #include "base64.h"
+#include "digest_nonce.h"
 
 
 //
@@ -120,6 +121,14 @@ static SNMP::AuthenticationStatsTables* auth_stats_tables;
 // Whether nonce counts are supported.
 static bool nonce_count_supported = false;
 
+// Mints and checks the nonces on digest challenges, so that forged and
+// expired nonces can be rejected without reading the IMPI store.
+static DigestNonceSigner* nonce_signer = NULL;
+
+// The nonce counts accepted on this node, so that replayed requests can be
+// rejected without reading the IMPI store.
+static NonceCountWindow* nonce_count_window = NULL;
+
 // A function that the authentication module can use to work out the expiry
 // time for a given binding. This is needed so that it knows how long to
 // authentication challenges for.
@@ -496,9 +505,9 @@ void create_challenge(pjsip_digest_credential* credentials,
       }
       pj_strdup2(tdata->pool, &hdr->challenge.digest.realm, realm.c_str());
       hdr->challenge.digest.algorithm = STR_MD5;
-      pj_create_random_string(buf, sizeof(buf));
-      nonce.assign(buf, sizeof(buf));
-      pj_strdup(tdata->pool, &hdr->challenge.digest.nonce, &random);
+      int expires = time(NULL) + AUTH_CHALLENGE_INIT_EXPIRES;
+      nonce = nonce_signer->mint(impi, expires);
+      pj_strdup2(tdata->pool, &hdr->challenge.digest.nonce, nonce.c_str());
       pj_create_random_string(buf, sizeof(buf));
       pj_strdup(tdata->pool, &hdr->challenge.digest.opaque, &random);
       pj_strdup2(tdata->pool, &hdr->challenge.digest.qop, qop.c_str());
@@ -518,7 +527,7 @@ void create_challenge(pjsip_digest_credential* credentials,
                                                           realm,
                                                           qop,
                                                           ha1,
-                                                          time(NULL) + AUTH_CHALLENGE_INIT_EXPIRES);
+                                                          expires);
     }
 
     // Add the header to the message.
@@ -800,7 +809,55 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
   {
     std::string impi = PJUtils::pj_str_to_string(&credentials->username);
     std::string nonce = PJUtils::pj_str_to_string(&credentials->nonce);
-    impi_obj = impi_store->get_impi_with_nonce(impi, nonce, trail);
+
+    // Calculate the nonce count on the request (if it is not present default
+    // to 1).
+    unsigned long nonce_count = pj_strtoul2(&credentials->nc, NULL, 16);
+    nonce_count = (nonce_count == 0) ? 1 : nonce_count;
+
+    // Check whether we can tell that the nonce is unusable without reading
+    // the challenge from the store.
+    time_t now = time(NULL);
+    DigestNonceSigner::Validity validity = nonce_signer->check(nonce, impi, now);
+    uint32_t next_count;
+
+    if (validity == DigestNonceSigner::FORGED)
+    {
+      TRC_INFO("Nonce %s supplied by %s was not issued by this node - ignore it",
+               nonce.c_str(), impi.c_str());
+      status = PJSIP_EAUTHACCNOTFOUND;
+    }
+    else if ((validity == DigestNonceSigner::EXPIRED) &&
+             ((nonce_count == 1) || (!nonce_count_supported) || (!is_register)))
+    {
+      // The challenge has expired.  (If nonce counts are supported, the
+      // challenge is kept after a successful REGISTER, so if this isn't the
+      // first response to it we have to check the store.)
+      TRC_INFO("Nonce %s supplied by %s has expired - ignore it",
+               nonce.c_str(), impi.c_str());
+      status = PJSIP_EAUTHACCNOTFOUND;
+    }
+    else if ((nonce_count_supported) &&
+             (is_register) &&
+             (nonce_count_window->check(nonce, nonce_count, now, next_count) ==
+                                                   NonceCountWindow::REPLAYED))
+    {
+      // This node has already accepted this nonce count - this might be a
+      // replay attack.
+      TRC_INFO("Nonce count supplied (%d) has already been used (expected at least %d) - ignore it",
+               nonce_count, next_count);
+      SAS::Event event(trail, SASEvent::AUTHENTICATION_NC_TOO_LOW, 0);
+      event.add_static_param(nonce_count);
+      event.add_static_param(next_count);
+      SAS::report_event(event);
+
+      status = PJSIP_EAUTHACCNOTFOUND;
+    }
+    else
+    {
+      impi_obj = impi_store->get_impi_with_nonce(impi, nonce, trail);
+    }
+
     ImpiStore::AuthChallenge* auth_challenge = NULL;
     if (impi_obj != NULL)
     {
@@ -844,11 +901,6 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
       auth_stats_table->increment_attempts();
     }
 
-    // Calculate the nonce count on the request (if it is not present default
-    // to 1).
-    unsigned long nonce_count = pj_strtoul2(&credentials->nc, NULL, 16);
-    nonce_count = (nonce_count == 0) ? 1 : nonce_count;
-
     if ((auth_challenge != NULL) && (auth_challenge->nonce_count > 1))
     {
       // A nonce count > 1 is supplied. Check that it is acceptable. If it is
@@ -983,6 +1035,13 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
         }
         while (store_status == Store::DATA_CONTENTION);
 
+        if (nonce_count_supported && is_register)
+        {
+          // Remember that this nonce count has been used, so that replays of
+          // this request to this node are rejected without reading the store.
+          nonce_count_window->record(nonce, nonce_count, new_expiry);
+        }
+
         if (store_status != Store::OK)
         {
           // LCOV_EXCL_START
@@ -1210,6 +1269,8 @@ pj_status_t init_authentication(const std::string& realm_name,
   auth_stats_tables = auth_stats_tbls;
   nonce_count_supported = nonce_count_supported_arg;
   get_expiry_for_binding = get_expiry_for_binding_arg;
+  nonce_signer = new DigestNonceSigner();
+  nonce_count_window = new NonceCountWindow();
 
   // Register the authentication module.  This needs to be in the stack
   // before the transaction layer.
@@ -1234,4 +1295,7 @@ pj_status_t init_authentication(const std::string& realm_name,
 void destroy_authentication()
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_authentication);
+
+  delete nonce_count_window; nonce_count_window = NULL;
+  delete nonce_signer; nonce_signer = NULL;
 }
@@ -1518,6 +1518,11 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   _current_server(0),
   _cancel_tsx(NULL),
   _timer_c(),
+  _send_time_ms(0),
+  _hedge_tsx(NULL),
+  _hedge_server(0),
+  _hedge_send_time_ms(0),
+  _timer_hedge(),
   _trail(0),
   _pending_destroy(false),
   _context_count(0),
@@ -1526,6 +1531,7 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   // Don't put any initialization that can fail here, implement in init()
   // instead.
   pj_timer_entry_init(&_timer_c, 0, this, timer_expired);
+  pj_timer_entry_init(&_timer_hedge, 0, this, timer_expired);
 }
 
 
@@ -1536,6 +1542,8 @@ BasicProxy::UACTsx::~UACTsx()
   pj_assert(_context_count == 0);
 
   stop_timer_c();
+  stop_hedge_timer();
+  drop_hedge();
 
   if (_tsx != NULL)
   {
@@ -1690,12 +1698,23 @@ void BasicProxy::UACTsx::send_request()
     else
     {
       // Send non-ACK request statefully.
+      if (stack_data.destination_health != NULL)
+      {
+        _send_time_ms = stack_data.destination_health->now_ms();
+      }
+
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
-      if ((status == PJ_SUCCESS) &&
-          (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD))
+      if (status == PJ_SUCCESS)
       {
-        start_timer_c();
+        if (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD)
+        {
+          start_timer_c();
+        }
+        else
+        {
+          start_hedge_timer();
+        }
       }
     }
   }
@@ -1812,6 +1831,15 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
   // terminated or been cancelled).
   TRC_DEBUG("%s - uac_tsx = %p, uas_tsx = %p", name(), this, _uas_tsx);
 
+  if ((_hedge_tsx != NULL) &&
+      (event->body.tsx_state.tsx == _hedge_tsx))
+  {
+    // Event on the hedged copy of the request.  If this is a response we can
+    // use the hedged transaction becomes the current transaction, so the
+    // response is handled below.
+    on_hedge_tsx_state(event);
+  }
+
   // Check that the event is on the current UAC transaction (we may have
   // created a new one for a retry) and is still connected to the UAS
   // transaction.
@@ -1830,6 +1858,11 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
       stop_timer_c();
     }
 
+    if (!_servers.empty())
+    {
+      record_health(_tsx, event, _servers[_current_server], _send_time_ms);
+    }
+
     if (!_servers.empty())
     {
       // Check to see if the destination server has failed so we can blacklist
@@ -1841,8 +1874,17 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
         TRC_DEBUG("Failed to connected to server so add to blacklist");
         PJUtils::blacklist_server(_servers[_current_server]);
 
-        // Attempt a retry.
-        retrying = retry_request();
+        // Attempt a retry, or wait for the hedged request if one has already
+        // been sent.
+        if (_hedge_tsx != NULL)
+        {
+          switch_to_hedge();
+          retrying = true;
+        }
+        else
+        {
+          retrying = retry_request();
+        }
       }
       else if ((_tsx->state == PJSIP_TSX_STATE_TERMINATED) &&
                (event->body.tsx_state.type == PJSIP_EVENT_TIMER))
@@ -1864,7 +1906,14 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
         // the upstream transaction has probably failed anyway.  Not retrying
         // also avoids us sending an INVITE with a chasing CANCEL when an AS
         // is unresponsive (see
-        // https://github.com/Metaswitch/sprout/issues/1095).
+        // https://github.com/Metaswitch/sprout/issues/1095).  However, if a
+        // hedged request is already in flight, give it the chance to
+        // complete.
+        if (_hedge_tsx != NULL)
+        {
+          switch_to_hedge();
+          retrying = true;
+        }
       }
       else if ((_tsx->state == PJSIP_TSX_STATE_COMPLETED) &&
                (_tsx->status_code == PJSIP_SC_SERVICE_UNAVAILABLE))
@@ -1873,10 +1922,28 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
         // as it may indicated a transient overload condition, but we can
         // retry to an alternate server if one is available.
         TRC_DEBUG("Server return 503 error");
-        retrying = retry_request();
+        if (_hedge_tsx != NULL)
+        {
+          switch_to_hedge();
+          retrying = true;
+        }
+        else
+        {
+          retrying = retry_request();
+        }
       }
     }
 
+    if ((!retrying) &&
+        ((_tsx->state == PJSIP_TSX_STATE_COMPLETED) ||
+         (_tsx->state == PJSIP_TSX_STATE_TERMINATED)))
+    {
+      // The request has completed on the current server, so there's no
+      // longer any need for a hedged request.
+      stop_hedge_timer();
+      drop_hedge();
+    }
+
     if (!retrying)
     {
       if (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG)
@@ -1997,6 +2064,9 @@ bool BasicProxy::UACTsx::retry_request()
 {
   bool retrying = false;
 
+  // Any hedge timer was for the previous server.
+  stop_hedge_timer();
+
   // See if we have any more servers in the list returned by the resolver that
   // we can try.
   _current_server++;
@@ -2052,6 +2122,10 @@ bool BasicProxy::UACTsx::retry_request()
       // Copy across the destination information for a retry and try to
       // resend the request.
       PJUtils::set_dest_info(_tdata, _servers[_current_server]);
+      if (stack_data.destination_health != NULL)
+      {
+        _send_time_ms = stack_data.destination_health->now_ms();
+      }
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
@@ -2065,6 +2139,10 @@ bool BasicProxy::UACTsx::retry_request()
           // Start Timer C again.
           start_timer_c();
         }
+        else
+        {
+          start_hedge_timer();
+        }
       }
       else
       {
@@ -2192,6 +2270,248 @@ void BasicProxy::UACTsx::timer_c_expired()
 }
 
 
+/// Start the hedge timer on the transaction if the request can be hedged.
+/// Only OPTIONS requests are hedged, as they have no side effects.  Other
+/// non-INVITE requests can't be cancelled, so both servers would process
+/// them in full.  Requests are only hedged when there is an alternate server
+/// to send the copy to.
+void BasicProxy::UACTsx::start_hedge_timer()
+{
+  DestinationHealth* health = stack_data.destination_health;
+
+  if ((health == NULL) ||
+      (!health->hedging_enabled()) ||
+      (_hedge_tsx != NULL) ||
+      (_tdata->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT) ||
+      (_current_server + 1 >= (int)_servers.size()))
+  {
+    return;
+  }
+
+  if (_tdata->msg->line.req.method.id != PJSIP_OPTIONS_METHOD)
+  {
+    return;
+  }
+
+  unsigned long delay_ms = health->hedge_delay_ms(_servers[_current_server]);
+  if (delay_ms == 0)
+  {
+    // Not enough is known about this server's latency to pick a delay.
+    return;
+  }
+
+  TRC_DEBUG("Starting hedge timer (%lu ms)", delay_ms);
+  _timer_hedge.id = TIMER_HEDGE;
+  pj_time_val delay = {(long)(delay_ms / 1000), (long)(delay_ms % 1000)};
+  pjsip_endpt_schedule_timer(stack_data.endpt, &_timer_hedge, &delay);
+}
+
+
+/// Stop the hedge timer on the transaction.
+void BasicProxy::UACTsx::stop_hedge_timer()
+{
+  if (_timer_hedge.id == TIMER_HEDGE)
+  {
+    TRC_DEBUG("Stopping hedge timer");
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer_hedge);
+    _timer_hedge.id = 0;
+  }
+}
+
+
+/// Called when the hedge timer expires.  If the current server still hasn't
+/// responded, send a copy of the request to the next server.
+void BasicProxy::UACTsx::hedge_timer_expired()
+{
+  enter_context();
+
+  _timer_hedge.id = 0;
+
+  if ((_tsx != NULL) &&
+      (_uas_tsx != NULL) &&
+      (_hedge_tsx == NULL) &&
+      (_tsx->state == PJSIP_TSX_STATE_TRYING))
+  {
+    TRC_INFO("No response from server within hedge delay, sending hedged request");
+    send_hedge();
+  }
+
+  exit_context();
+}
+
+
+/// Sends a copy of the request to the next server in the list on a new
+/// transaction.  The original transaction is left running, and whichever
+/// server responds first is used.
+void BasicProxy::UACTsx::send_hedge()
+{
+  // The original request is still owned by the original transaction, so the
+  // hedge needs its own copy with a different branch.
+  pjsip_tx_data* tdata = PJUtils::clone_tdata(_tdata);
+  if (tdata == NULL)
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to clone request for hedging");
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  PJUtils::generate_new_branch_id(tdata);
+  pj_status_t status = pjsip_tsx_create_uac2(_proxy->_mod_tu.module(),
+                                             tdata,
+                                             _lock,
+                                             &_hedge_tsx);
+
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to create transaction for hedged request");
+    pjsip_tx_data_dec_ref(tdata);
+    _hedge_tsx = NULL;
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _proxy->bind_transaction(this, _hedge_tsx);
+  set_trail(_hedge_tsx, _trail);
+
+  _hedge_server = _current_server + 1;
+  _hedge_send_time_ms = stack_data.destination_health->now_ms();
+  PJUtils::set_dest_info(tdata, _servers[_hedge_server]);
+
+  status = pjsip_tsx_send_msg(_hedge_tsx, tdata);
+
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_INFO("Failed to send hedged request");
+    pjsip_tx_data_dec_ref(tdata);
+    if (_hedge_tsx != NULL)
+    {
+      _proxy->unbind_transaction(_hedge_tsx);
+      _hedge_tsx = NULL;
+    }
+    // LCOV_EXCL_STOP
+  }
+}
+
+
+/// Makes the hedged request the current transaction.  The original
+/// transaction is left to complete, but future events from it are ignored.
+void BasicProxy::UACTsx::switch_to_hedge()
+{
+  TRC_INFO("Switching to hedged request to alternate target");
+  stop_hedge_timer();
+
+  if (_tsx != NULL)
+  {
+    _proxy->unbind_transaction(_tsx);
+  }
+
+  _tsx = _hedge_tsx;
+  _current_server = _hedge_server;
+  _send_time_ms = _hedge_send_time_ms;
+  _hedge_tsx = NULL;
+}
+
+
+/// Abandons the hedged request.  The hedged transaction is terminated and
+/// future events from it are ignored.
+void BasicProxy::UACTsx::drop_hedge()
+{
+  if (_hedge_tsx != NULL)
+  {
+    TRC_DEBUG("Dropping hedged request");
+    pjsip_transaction* hedge_tsx = _hedge_tsx;
+    _proxy->unbind_transaction(hedge_tsx);
+    _hedge_tsx = NULL;
+
+    if ((hedge_tsx->state != PJSIP_TSX_STATE_COMPLETED) &&
+        (hedge_tsx->state != PJSIP_TSX_STATE_TERMINATED) &&
+        (hedge_tsx->state != PJSIP_TSX_STATE_DESTROYED))
+    {
+      pjsip_tsx_terminate(hedge_tsx, PJSIP_SC_REQUEST_TERMINATED);
+    }
+  }
+}
+
+
+/// Handles a state change on the hedged request's transaction.
+void BasicProxy::UACTsx::on_hedge_tsx_state(pjsip_event* event)
+{
+  TRC_DEBUG("%s event on hedged transaction",
+            pjsip_event_str(event->body.tsx_state.type));
+
+  if (_hedge_tsx->state == PJSIP_TSX_STATE_DESTROYED)
+  {
+    _proxy->unbind_transaction(_hedge_tsx);
+    _hedge_tsx = NULL;
+  }
+  else if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+           (_hedge_tsx->status_code >= 200) &&
+           (!PJSIP_IS_STATUS_IN_CLASS(_hedge_tsx->status_code, 500)) &&
+           (_tsx != NULL) &&
+           (_uas_tsx != NULL))
+  {
+    // The alternate server responded first, so use its response.
+    switch_to_hedge();
+  }
+  else if ((_hedge_tsx->state == PJSIP_TSX_STATE_COMPLETED) ||
+           (_hedge_tsx->state == PJSIP_TSX_STATE_TERMINATED))
+  {
+    // The hedged request failed, so carry on waiting for the original.
+    if (event->body.tsx_state.type == PJSIP_EVENT_TRANSPORT_ERROR)
+    {
+      PJUtils::blacklist_server(_servers[_hedge_server]);
+    }
+
+    record_health(_hedge_tsx, event, _servers[_hedge_server], _hedge_send_time_ms);
+    drop_hedge();
+  }
+}
+
+
+/// Reports the outcome of a request to the destination health tracker.  The
+/// latency of final responses is only tracked for non-INVITE requests, as
+/// INVITE latency is dominated by the called party.
+void BasicProxy::UACTsx::record_health(pjsip_transaction* tsx,
+                                       pjsip_event* event,
+                                       const AddrInfo& server,
+                                       unsigned long send_time_ms)
+{
+  DestinationHealth* health = stack_data.destination_health;
+
+  if (health == NULL)
+  {
+    return;
+  }
+
+  if ((tsx->state == PJSIP_TSX_STATE_TERMINATED) &&
+      ((event->body.tsx_state.type == PJSIP_EVENT_TRANSPORT_ERROR) ||
+       ((event->body.tsx_state.type == PJSIP_EVENT_TIMER) &&
+        (tsx->status_code == PJSIP_SC_TSX_TIMEOUT) &&
+        (!_stateless_proxy))))
+  {
+    // As for blacklisting, don't penalise stateless proxies for timeouts as
+    // these may be caused by a server further downstream.  The status code
+    // check excludes the timer that cleans up a completed transaction.
+    health->record_failure(server);
+  }
+  else if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+           (tsx->status_code >= 200))
+  {
+    if (PJSIP_IS_STATUS_IN_CLASS(tsx->status_code, 500))
+    {
+      health->record_failure(server);
+    }
+    else if (tsx->method.id != PJSIP_INVITE_METHOD)
+    {
+      health->record_response(server, health->now_ms() - send_time_ms);
+    }
+  }
+}
+
+
 /// Static function called when a timer expires.
 void BasicProxy::UACTsx::timer_expired(pj_timer_heap_t *timer_heap,
                                        struct pj_timer_entry *entry)
@@ -2200,5 +2520,9 @@ void BasicProxy::UACTsx::timer_expired(pj_timer_heap_t *timer_heap,
   {
     ((BasicProxy::UACTsx*)entry->user_data)->timer_c_expired();
   }
+  else if (entry->id == TIMER_HEDGE)
+  {
+    ((BasicProxy::UACTsx*)entry->user_data)->hedge_timer_expired();
+  }
 }
 
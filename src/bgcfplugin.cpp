@@ -42,6 +42,7 @@
 #include "cfgoptions.h"
 #include "acr.h"
 #include "sproutletplugin.h"
+#include "stack.h"
 #include "bgcfservice.h"
 #include "bgcfsproutlet.h"
 
@@ -58,6 +59,7 @@ private:
   BGCFSproutlet* _bgcf_sproutlet;
   ACRFactory* _acr_factory;
   BgcfService* _bgcf_service;
+  int _dns_prefetch_source;
 };
 
 /// Export the plug-in using the magic symbol "sproutlet_plugin"
@@ -69,7 +71,8 @@ BGCFPlugin sproutlet_plugin;
 BGCFPlugin::BGCFPlugin() :
   _bgcf_sproutlet(NULL),
   _acr_factory(NULL),
-  _bgcf_service(NULL)
+  _bgcf_service(NULL),
+  _dns_prefetch_source(-1)
 {
 }
 
@@ -89,7 +92,9 @@ bool BGCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 
     // Create the BGCF ACR factory.
     _acr_factory = (ralf_processor != NULL) ?
-                       (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::BGCF) :
+                       (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                       ACR::BGCF,
+                                                       opt.deferred_acrs) :
                        new ACRFactory();
 
     // Create the Sproutlet.
@@ -101,6 +106,13 @@ bool BGCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                         opt.override_npdi);
 
     sproutlets.push_back(_bgcf_sproutlet);
+
+    if (stack_data.dns_prefetcher != NULL)
+    {
+      // Keep the DNS records for the configured BGCF routes warm.
+      _dns_prefetch_source = stack_data.dns_prefetcher->add_source(
+                               std::bind(&BgcfService::all_routes, _bgcf_service));
+    }
   }
 
   return plugin_loaded;
@@ -109,6 +121,11 @@ bool BGCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 /// Unloads the BGCF plug-in.
 void BGCFPlugin::unload()
 {
+  if (_dns_prefetch_source != -1)
+  {
+    stack_data.dns_prefetcher->remove_source(_dns_prefetch_source);
+  }
+
   delete _bgcf_sproutlet;
   delete _acr_factory;
   delete _bgcf_service;
@@ -290,3 +290,30 @@ std::vector<std::string> BgcfService::get_route_from_number(
 
   return std::vector<std::string>();
 }
+
+
+std::vector<std::string> BgcfService::all_routes() const
+{
+  // Take a read lock on the mutex in RAII style
+  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
+
+  std::vector<std::string> routes;
+
+  for (std::map<std::string, std::vector<std::string>>::const_iterator it =
+         _domain_routes.begin();
+       it != _domain_routes.end();
+       ++it)
+  {
+    routes.insert(routes.end(), it->second.begin(), it->second.end());
+  }
+
+  for (std::map<std::string, std::vector<std::string>>::const_iterator it =
+         _number_routes.begin();
+       it != _number_routes.end();
+       ++it)
+  {
+    routes.insert(routes.end(), it->second.begin(), it->second.end());
+  }
+
+  return routes;
+}
@@ -43,6 +43,7 @@
 #include "log.h"
 #include "sproutsasevent.h"
 #include "bgcfsproutlet.h"
+#include "sharded_stats.h"
 #include <fstream>
 
 /// BGCFSproutlet constructor.
@@ -58,10 +59,12 @@ BGCFSproutlet::BGCFSproutlet(const std::string& bgcf_name,
   _acr_factory(acr_factory),
   _override_npdi(override_npdi)
 {
-  _incoming_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("bgcf_incoming_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.22");
-  _outgoing_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("bgcf_outgoing_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.23");
+  _incoming_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("bgcf_incoming_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.22"));
+  _outgoing_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("bgcf_outgoing_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.23"));
 }
 
 
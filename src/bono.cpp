@@ -163,6 +163,7 @@ static bool ibcf = false;
 static bool icscf = false;
 static bool scscf = false;
 static bool allow_emergency_reg = false;
+static bool stateless_in_dialog = false;
 
 PJUtils::host_list_t trusted_hosts(&PJUtils::compare_pj_sockaddr);
 PJUtils::host_list_t pbx_hosts(&PJUtils::compare_pj_sockaddr);
@@ -238,6 +239,9 @@ static pj_bool_t proxy_trusted_source(pjsip_rx_data* rdata);
 
 // Helper functions.
 static int compare_sip_sc(int sc1, int sc2);
+static bool is_stateless_in_dialog_method(const pjsip_method* method);
+static void set_transport_on_tdata(const struct Target& target,
+                                   pjsip_tx_data* tdata);
 static pj_status_t add_path(pjsip_tx_data* tdata,
                             const Flow* flow_data,
                             const pjsip_rx_data* rdata);
@@ -305,8 +309,11 @@ static pj_bool_t proxy_on_rx_response(pjsip_rx_data *rdata)
   pjsip_via_hdr *hvia;
   pj_status_t status;
 
-  // Only forward responses to INVITES
-  if (rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD)
+  // Only forward responses to INVITES, or to in-dialog requests we may have
+  // forwarded statelessly.
+  if ((rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD) ||
+      ((stateless_in_dialog) &&
+       (is_stateless_in_dialog_method(&rdata->msg_info.cseq->method))))
   {
     // Create response to be forwarded upstream (Via will be stripped here)
     status = PJUtils::create_response_fwd(stack_data.endpt, rdata, 0, &tdata);
@@ -524,28 +531,7 @@ void process_tsx_request(pjsip_rx_data* rdata)
         };
       }
 
-      if (target->transport != NULL)
-      {
-        // The target includes a selected transport, so set it here.
-        pjsip_tpselector tp_selector;
-        tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
-        tp_selector.u.transport = target->transport;
-        pjsip_tx_data_set_transport(tdata, &tp_selector);
-
-        tdata->dest_info.addr.count = 1;
-        tdata->dest_info.addr.entry[0].type =
-                           (pjsip_transport_type_e)target->transport->key.type;
-        pj_memcpy(&tdata->dest_info.addr.entry[0].addr,
-                  &target->remote_addr,
-                  sizeof(pj_sockaddr));
-        tdata->dest_info.addr.entry[0].addr_len =
-             (tdata->dest_info.addr.entry[0].addr.addr.sa_family == pj_AF_INET()) ?
-             sizeof(pj_sockaddr_in) : sizeof(pj_sockaddr_in6);
-        tdata->dest_info.cur_addr = 0;
-
-        // Remove the reference to the transport added when it was chosen.
-        pjsip_transport_dec_ref(target->transport);
-      }
+      set_transport_on_tdata(*target, tdata);
     }
 
     // Add a via header for ACKs (this is handled in init_uac_transactions
@@ -574,6 +560,49 @@ void process_tsx_request(pjsip_rx_data* rdata)
     return;
   }
 
+  // If enabled, forward in-dialog requests that don't need a transaction
+  // statelessly.  These only need Route processing and flow translation, so
+  // this saves the cost of the UAS and UAC transactions and their timers.
+  if ((stateless_in_dialog) &&
+      (rdata->msg_info.to->tag.slen != 0) &&
+      (is_stateless_in_dialog_method(&tdata->msg->line.req.method)))
+  {
+    TRC_DEBUG("Statelessly forwarding in-dialog %.*s request",
+              tdata->msg->line.req.method.name.slen,
+              tdata->msg->line.req.method.name.ptr);
+
+    trust->process_request(tdata);
+
+    // Set up the target on the request exactly as a UAC transaction would.
+    set_target_on_tdata(*target, tdata);
+    set_transport_on_tdata(*target, tdata);
+
+    // Derive the branch on our Via from the received request's, rather than
+    // generating a random one, so retransmissions of the request are
+    // forwarded with the same branch and match the same transaction
+    // downstream.
+    pjsip_via_hdr* hvia = pjsip_via_hdr_create(tdata->pool);
+    pjsip_msg_insert_first_hdr(tdata->msg, (pjsip_hdr*)hvia);
+    pj_str_t branch = pjsip_calculate_branch_id(rdata);
+    pj_strdup(tdata->pool, &hvia->branch_param, &branch);
+
+    // About to send the request to notify the ACR.
+    acr->tx_request(tdata->msg);
+
+    status = PJUtils::send_request_stateless(tdata);
+
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error forwarding request, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+    }
+
+    acr->send();
+    delete acr; acr = NULL;
+    delete target; target = NULL;
+    return;
+  }
+
   // Create the transaction.  This implicitly enters its context, so we're
   // safe to operate on it (and have to exit its context below).
   status = UASTransaction::create(rdata, tdata, trust, acr, &uas_data);
@@ -1594,6 +1623,47 @@ static pj_status_t proxy_process_routing(pjsip_tx_data *tdata)
   return PJ_SUCCESS;
 }
 
+/// Determine whether in-dialog requests with this method can be forwarded
+/// statelessly.  INVITE, BYE and UPDATE requests always need a transaction
+/// (for dialog tracking and session timer processing), as do CANCEL and
+/// REGISTER.  ACKs are always forwarded statelessly anyway.
+static bool is_stateless_in_dialog_method(const pjsip_method* method)
+{
+  return ((method->id != PJSIP_INVITE_METHOD) &&
+          (method->id != PJSIP_ACK_METHOD) &&
+          (method->id != PJSIP_BYE_METHOD) &&
+          (method->id != PJSIP_CANCEL_METHOD) &&
+          (method->id != PJSIP_REGISTER_METHOD) &&
+          (pjsip_method_cmp(method, &METHOD_UPDATE) != 0));
+}
+
+/// If the target includes a selected transport, set it on the request.
+static void set_transport_on_tdata(const struct Target& target,
+                                   pjsip_tx_data* tdata)
+{
+  if (target.transport != NULL)
+  {
+    pjsip_tpselector tp_selector;
+    tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
+    tp_selector.u.transport = target.transport;
+    pjsip_tx_data_set_transport(tdata, &tp_selector);
+
+    tdata->dest_info.addr.count = 1;
+    tdata->dest_info.addr.entry[0].type =
+                           (pjsip_transport_type_e)target.transport->key.type;
+    pj_memcpy(&tdata->dest_info.addr.entry[0].addr,
+              &target.remote_addr,
+              sizeof(pj_sockaddr));
+    tdata->dest_info.addr.entry[0].addr_len =
+         (tdata->dest_info.addr.entry[0].addr.addr.sa_family == pj_AF_INET()) ?
+         sizeof(pj_sockaddr_in) : sizeof(pj_sockaddr_in6);
+    tdata->dest_info.cur_addr = 0;
+
+    // Remove the reference to the transport added when it was chosen.
+    pjsip_transport_dec_ref(target.transport);
+  }
+}
+
 /// For a given message, calculate the role the message is requesting the
 /// node carry out.
 static ACR::NodeRole acr_node_role(pjsip_msg *req)
@@ -3232,7 +3302,8 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
                                 SCSCFSelector *scscfSelector,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted)
+                                bool emerg_reg_accepted,
+                                bool stateless_in_dialog_enabled)
 {
   pj_status_t status;
 
@@ -3245,6 +3316,7 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
   icscf = icscf_enabled;
   scscf = scscf_enabled;
   allow_emergency_reg = emerg_reg_accepted;
+  stateless_in_dialog = stateless_in_dialog_enabled;
 
   cscf_acr_factory = cscf_rfacr_factory;
   bgcf_acr_factory = bgcf_rfacr_factory;
@@ -3393,6 +3465,7 @@ void destroy_stateful_proxy()
   icscf = false;
   scscf = false;
   allow_emergency_reg = false;
+  stateless_in_dialog = false;
 
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_stateful_proxy);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_tu);
@@ -43,6 +43,7 @@
 #include "sproutletplugin.h"
 #include "sproutletappserver.h"
 #include "mmtel.h"
+#include "sharded_stats.h"
 
 class CDivASPlugin : public SproutletPlugin
 {
@@ -81,10 +82,12 @@ bool CDivASPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 
   if (opt.enabled_cdiv)
   {
-    SNMP::SuccessFailCountByRequestTypeTable* incoming_sip_transactions = SNMP::SuccessFailCountByRequestTypeTable::create("cdiv_as_incoming_sip_transactions",
-                                                                                                                           "1.2.826.0.1.1578918.9.7.2");
-    SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions = SNMP::SuccessFailCountByRequestTypeTable::create("cdiv_as_outgoing_sip_transactions",
-                                                                                                                         "1.2.826.0.1.1578918.9.7.3");
+    SNMP::SuccessFailCountByRequestTypeTable* incoming_sip_transactions = new ShardedSuccessFailCountByRequestTypeTable(
+        SNMP::SuccessFailCountByRequestTypeTable::create("cdiv_as_incoming_sip_transactions",
+                                                         "1.2.826.0.1.1578918.9.7.2"));
+    SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions = new ShardedSuccessFailCountByRequestTypeTable(
+        SNMP::SuccessFailCountByRequestTypeTable::create("cdiv_as_outgoing_sip_transactions",
+                                                         "1.2.826.0.1.1578918.9.7.3"));
     // Load the CDiv AppServer
     _cdiv = new CallDiversionAS(opt.prefix_cdiv);
     _cdiv_sproutlet = new SproutletAppServerShim(_cdiv, opt.port_cdiv, incoming_sip_transactions, outgoing_sip_transactions);
@@ -68,12 +68,23 @@ extern "C" {
 #include "load_monitor.h"
 #include "health_checker.h"
 #include "uri_classifier.h"
+#include "sas_msg_logger.h"
+#include "peer_admission.h"
 
 static SNMP::CounterTable* requests_counter = NULL;
 static SNMP::CounterTable* overload_counter = NULL;
 static LoadMonitor* load_monitor = NULL;
 static HealthChecker* health_checker = NULL;
 
+// Shares the load monitor's capacity between peers.  NULL if all requests
+// are admitted by the load monitor alone.
+static PeerAdmission* peer_admission = NULL;
+
+// Logs SIP messages to SAS.  Unless told otherwise, messages are all logged
+// on the thread that sends or receives them.
+static SasMsgLogger inline_sas_msg_logger(0);
+static SasMsgLogger* sas_msg_logger = &inline_sas_msg_logger;
+
 static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata);
 static pj_status_t process_on_tx_msg(pjsip_tx_data* tdata);
 
@@ -229,18 +240,12 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
   // Store the trail in the message as it gets passed up the stack.
   set_trail(rdata, trail);
 
-  PJUtils::report_sas_to_from_markers(trail, rdata->msg_info.msg);
-
-  pjsip_cid_hdr* cid = (pjsip_cid_hdr*)rdata->msg_info.cid;
-  PJUtils::mark_sas_call_branch_ids(trail, cid, rdata->msg_info.msg);
-
-  // Log the message event.
-  SAS::Event event(trail, SASEvent::RX_SIP_MSG, 0);
-  event.add_static_param(pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag));
-  event.add_static_param(rdata->pkt_info.src_port);
-  event.add_var_param(rdata->pkt_info.src_name);
-  event.add_compressed_param(rdata->msg_info.len, rdata->msg_info.msg_buf, &SASEvent::PROFILE_SIP);
-  SAS::report_event(event);
+  // Log the markers and the message event, unless this method is sampled
+  // and this trail isn't in the sample.
+  if (sas_msg_logger->should_log(trail, &rdata->msg_info.cseq->method))
+  {
+    sas_msg_logger->log_rx_msg(trail, rdata);
+  }
 }
 
 
@@ -256,19 +261,12 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
   }
   else if (trail != 0)
   {
-    PJUtils::report_sas_to_from_markers(trail, tdata->msg);
-
-    PJUtils::mark_sas_call_branch_ids(trail, NULL, tdata->msg);
-
-    // Log the message event.
-    SAS::Event event(trail, SASEvent::TX_SIP_MSG, 0);
-    event.add_static_param(pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag));
-    event.add_static_param(tdata->tp_info.dst_port);
-    event.add_var_param(tdata->tp_info.dst_name);
-    event.add_compressed_param((int)(tdata->buf.cur - tdata->buf.start),
-                               tdata->buf.start,
-                               &SASEvent::PROFILE_SIP);
-    SAS::report_event(event);
+    // Log the markers and the message event, unless this method is sampled
+    // and this trail isn't in the sample.
+    if (sas_msg_logger->should_log(trail, &PJSIP_MSG_CSEQ_HDR(tdata->msg)->method))
+    {
+      sas_msg_logger->log_tx_msg(trail, tdata);
+    }
   }
   else
   {
@@ -279,6 +277,25 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
 }
 // LCOV_EXCL_STOP
 
+static bool admit_request(pjsip_rx_data* rdata)
+{
+  if ((peer_admission == NULL) ||
+      (rdata->msg_info.msg->type != PJSIP_REQUEST_MSG))
+  {
+    return load_monitor->admit_request();
+  }
+
+  if (PeerAdmission::is_high_priority(rdata->msg_info.msg))
+  {
+    // Take a token if there is one, so the load monitor still sees the
+    // request, but admit the request whether or not there is.
+    load_monitor->admit_request();
+    return true;
+  }
+
+  return peer_admission->admit_request(rdata->pkt_info.src_name, load_monitor);
+}
+
 static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata)
 {
   // Do logging.
@@ -288,7 +305,7 @@ static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata)
   requests_counter->increment();
 
   // Check whether the request should be processed
-  if (!(load_monitor->admit_request()) &&
+  if (!(admit_request(rdata)) &&
       (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
       (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD))
   {
@@ -398,7 +415,9 @@ pj_status_t
 init_common_sip_processing(LoadMonitor* load_monitor_arg,
                            SNMP::CounterTable* requests_counter_arg,
                            SNMP::CounterTable* overload_counter_arg,
-                           HealthChecker* health_checker_arg)
+                           HealthChecker* health_checker_arg,
+                           SasMsgLogger* sas_msg_logger_arg,
+                           PeerAdmission* peer_admission_arg)
 {
   // Register the stack modules.
   pjsip_endpt_register_module(stack_data.endpt, &mod_common_processing);
@@ -411,6 +430,11 @@ init_common_sip_processing(LoadMonitor* load_monitor_arg,
 
   health_checker = health_checker_arg;
 
+  peer_admission = peer_admission_arg;
+
+  sas_msg_logger = (sas_msg_logger_arg != NULL) ?
+                     sas_msg_logger_arg : &inline_sas_msg_logger;
+
   return PJ_SUCCESS;
 }
 
@@ -418,4 +442,6 @@ init_common_sip_processing(LoadMonitor* load_monitor_arg,
 void unregister_common_processing_module(void)
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_common_processing);
+  sas_msg_logger = &inline_sas_msg_logger;
+  peer_admission = NULL;
 }
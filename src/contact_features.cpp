@@ -0,0 +1,127 @@
+/**
+ * @file contact_features.cpp Pre-parsed Contact header feature parameters.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdio.h>
+#include <limits>
+#include <boost/algorithm/string.hpp>
+
+#include "utils.h"
+#include "contact_features.h"
+
+ContactFeature::ContactFeature(const std::string& value) :
+  _value(value),
+  _type(TOKENS),
+  _literal(),
+  _tokens(),
+  _minimum(0),
+  _maximum(0),
+  _valid(true)
+{
+  // Features with no value are boolean terms, equivalent to "TRUE"
+  // according to RFC 3841.
+  std::string unquoted = value.empty() ? "TRUE" : value;
+
+  // Unquote the value, as the quotes don't matter.
+  if ((unquoted.front() == '"') && (unquoted.back() == '"'))
+  {
+    unquoted = unquoted.substr(1, (unquoted.size() - 2));
+  }
+
+  if (unquoted[0] == '<')
+  {
+    _type = STRING;
+    _literal = unquoted;
+  }
+  else if (unquoted[0] == '#')
+  {
+    _type = NUMERIC;
+    _valid = parse_numeric(unquoted, _minimum, _maximum);
+  }
+  else
+  {
+    _type = TOKENS;
+    Utils::split_string(unquoted, ',', _tokens, 0, true);
+
+    for (std::vector<std::string>::iterator token = _tokens.begin();
+         token != _tokens.end();
+         ++token)
+    {
+      boost::algorithm::to_lower(*token);
+    }
+  }
+}
+
+bool ContactFeature::parse_numeric(const std::string& value,
+                                   float& minimum,
+                                   float& maximum)
+{
+  if (sscanf(value.c_str(), "#%f:%f", &minimum, &maximum) == 2)
+  {
+    return (minimum <= maximum);
+  }
+  else if (sscanf(value.c_str(), "#>=%f", &minimum) == 1)
+  {
+    maximum = std::numeric_limits<float>::max();
+  }
+  else if (sscanf(value.c_str(), "#<=%f", &maximum) == 1)
+  {
+    minimum = std::numeric_limits<float>::min();
+  }
+  else if (sscanf(value.c_str(), "#%f", &minimum) == 1)
+  {
+    maximum = minimum;
+  }
+  else
+  {
+    // Invalid format for numeric.
+    return false;
+  }
+
+  return true;
+}
+
+void parse_contact_features(const std::map<std::string, std::string>& params,
+                            ContactFeatureSet& features)
+{
+  features.clear();
+
+  for (std::map<std::string, std::string>::const_iterator param = params.begin();
+       param != params.end();
+       ++param)
+  {
+    features.insert(std::make_pair(param->first, ContactFeature(param->second)));
+  }
+}
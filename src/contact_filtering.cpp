@@ -39,7 +39,6 @@
 #include "pjutils.h"
 #include "sproutsasevent.h"
 
-#include <limits>
 #include <boost/algorithm/string.hpp>
 
 // Entry point for contact filtering.  Convert the set of bindings to a set of
@@ -93,9 +92,28 @@ void filter_bindings_to_targets(const std::string& aor,
                        accept_headers,
                        reject_headers);
 
+  // Parse the feature predicates once, rather than once per binding.
+  std::vector<ContactPredicate> accept_predicates;
+  for (std::vector<pjsip_accept_contact_hdr*>::const_iterator accept = accept_headers.begin();
+       accept != accept_headers.end();
+       ++accept)
+  {
+    accept_predicates.push_back(ContactPredicate(&(*accept)->feature_set,
+                                                 (*accept)->explicit_match,
+                                                 (*accept)->required_match));
+  }
+
+  std::vector<ContactPredicate> reject_predicates;
+  for (std::vector<pjsip_reject_contact_hdr*>::const_iterator reject = reject_headers.begin();
+       reject != reject_headers.end();
+       ++reject)
+  {
+    reject_predicates.push_back(ContactPredicate(&(*reject)->feature_set));
+  }
+
   // Iterate over the Bindings, checking if they're valid and creating a target
   // if so.
-  const SubscriberDataManager::AoR::Bindings bindings = aor_data->bindings();
+  const SubscriberDataManager::AoR::Bindings& bindings = aor_data->bindings();
   int bindings_rejected_due_to_gruu = 0;
   bool request_uri_is_gruu = false;
   std::string requri;
@@ -140,12 +158,22 @@ void filter_bindings_to_targets(const std::string& aor,
       }
     }
 
+    // Bindings read from the store have their features parsed already.
+    const ContactFeatureSet* features = &binding->second->_features;
+    ContactFeatureSet parsed_features;
+
+    if (!binding->second->_features_parsed)
+    {
+      parse_contact_features(binding->second->_params, parsed_features);
+      features = &parsed_features;
+    }
+
     // Perform Reject-Contact filtering.
-    for (std::vector<pjsip_reject_contact_hdr*>::iterator reject = reject_headers.begin();
-         reject != reject_headers.end() && (!rejected);
+    for (std::vector<ContactPredicate>::const_iterator reject = reject_predicates.begin();
+         reject != reject_predicates.end() && (!rejected);
          ++reject)
     {
-      if (match_feature_sets(binding->second->_params, *reject) == YES)
+      if (match_reject_contact(*features, *reject) == YES)
       {
         TRC_DEBUG("Rejecting Contact: header matching Reject-Contact header");
         // TODO SAS log.
@@ -157,14 +185,14 @@ void filter_bindings_to_targets(const std::string& aor,
     // headers, Accept-Contact headers have a "require" parameter,
     // which determines whetner to reject or just deprioritise
     // non-matching bindings.
-    for (std::vector<pjsip_accept_contact_hdr*>::iterator accept = accept_headers.begin();
-         accept != accept_headers.end() && (!rejected);
+    for (std::vector<ContactPredicate>::const_iterator accept = accept_predicates.begin();
+         accept != accept_predicates.end() && (!rejected);
          ++accept)
     {
-      MatchResult accept_rc = match_feature_sets(binding->second->_params, *accept);
+      MatchResult accept_rc = match_accept_contact(*features, *accept);
       if (accept_rc == NO)
       {
-        if ((*accept)->required_match) {
+        if (accept->required_match) {
           TRC_DEBUG("Rejecting Contact: header matching Accept-Contact header");
           // TODO SAS log.
           rejected = true;
@@ -312,6 +340,23 @@ void add_implicit_filters(const pjsip_msg* msg,
   }
 }
 
+ContactPredicate::ContactPredicate(const pjsip_param* feature_set,
+                                   bool explicit_match,
+                                   bool required_match) :
+  features(),
+  explicit_match(explicit_match),
+  required_match(required_match)
+{
+  for (const pjsip_param* feature_param = feature_set->next;
+       feature_param != feature_set;
+       feature_param = feature_param->next)
+  {
+    features.push_back(
+      std::make_pair(PJUtils::pj_str_to_string(&feature_param->name),
+                     ContactFeature(PJUtils::pj_str_to_string(&feature_param->value))));
+  }
+}
+
 // Compares the feature predicate in the Contact header with the
 // feature predicate in the Accept-Contact header. Under the RFC 3841
 // logic, two feature predicates match if there is any feature
@@ -321,27 +366,24 @@ void add_implicit_filters(const pjsip_msg* msg,
 // the features in the Accept-Contact header (i.e. the list of feature
 // names in the Contact header must be a subset of the list in the
 // Accept-Contact header).
-MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
-                               pjsip_accept_contact_hdr* accept)
+MatchResult match_accept_contact(const ContactFeatureSet& contact_feature_set,
+                                 const ContactPredicate& accept)
 {
   MatchResult rc = YES;
 
-  // Iterate over the parameters on the Accept-Contact header, we can drop out
+  // Iterate over the features in the Accept-Contact header, we can drop out
   // early if the main match value ever drops to NO since there's no way it will
   // change to YES afterwards.
-  for (pjsip_param* feature_param = accept->feature_set.next;
-       (feature_param != &accept->feature_set) && (rc != NO);
-       feature_param = feature_param->next)
+  for (std::vector<std::pair<std::string, ContactFeature>>::const_iterator feature = accept.features.begin();
+       (feature != accept.features.end()) && (rc != NO);
+       ++feature)
   {
-    std::string feature_name = PJUtils::pj_str_to_string(&feature_param->name);
-    std::string feature_value = PJUtils::pj_str_to_string(&feature_param->value);
-    TRC_DEBUG("Trying to match Accept-Contact parameter '%s' (value '%s')", feature_name.c_str(), feature_value.c_str());
-
-    Feature feature(feature_name, feature_value);
+    TRC_DEBUG("Trying to match Accept-Contact parameter '%s' (value '%s')",
+              feature->first.c_str(), feature->second._value.c_str());
 
     // Now find the Contact's version of this feature.
-    FeatureSet::const_iterator contact_feature;
-    contact_feature = contact_feature_set.find(feature_name);
+    ContactFeatureSet::const_iterator contact_feature =
+                                     contact_feature_set.find(feature->first);
 
     // Now attempt to compare the two features.
     if (contact_feature == contact_feature_set.end())
@@ -349,21 +391,22 @@ MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
       // Contact header doesn't contain a feature in the
       // Accept-Contact header - should fail the match if "explicit"
       // was specified.
-      if (accept->explicit_match)
+      if (accept.explicit_match)
       {
         rc = NO;
-        TRC_DEBUG("Parameter %s is not in the Contact parameters and is explicitly required", feature_name.c_str());
+        TRC_DEBUG("Parameter %s is not in the Contact parameters and is explicitly required", feature->first.c_str());
       }
       else
       {
         rc = YES;
-        TRC_DEBUG("Parameter %s is not in the Contact parameters but is not explicitly required", feature_name.c_str());
+        TRC_DEBUG("Parameter %s is not in the Contact parameters but is not explicitly required", feature->first.c_str());
       }
     }
     else
     {
-      rc = match_feature(feature,
-                         *contact_feature);
+      rc = match_feature(feature->first,
+                         feature->second,
+                         contact_feature->second);
     }
   }
 
@@ -374,27 +417,24 @@ MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
 // feature predicate in the Accept-Contact header. Under the RFC 3841
 // logic, two feature predicates match if there is any feature
 // collection which could satisfy them both.
-MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
-                               pjsip_reject_contact_hdr* reject)
+MatchResult match_reject_contact(const ContactFeatureSet& contact_feature_set,
+                                 const ContactPredicate& reject)
 {
   MatchResult rc = YES;
 
-  // Iterate over the parameters on the Reject-Contact header, since
+  // Iterate over the features in the Reject-Contact header, since
   // the only way a Reject-Contact header can match is perfectly, we
   // can drop out early if rc is ever non-YES.
-  for (pjsip_param* feature_param = reject->feature_set.next;
-       (feature_param != &reject->feature_set) && (rc == YES);
-       feature_param = feature_param->next)
+  for (std::vector<std::pair<std::string, ContactFeature>>::const_iterator feature = reject.features.begin();
+       (feature != reject.features.end()) && (rc == YES);
+       ++feature)
   {
-    std::string feature_name = PJUtils::pj_str_to_string(&feature_param->name);
-    std::string feature_value = PJUtils::pj_str_to_string(&feature_param->value);
-    TRC_DEBUG("Trying to match Reject-Contact parameter '%s' (value '%s')", feature_name.c_str(), feature_value.c_str());
-
-    Feature feature(feature_name, feature_value);
+    TRC_DEBUG("Trying to match Reject-Contact parameter '%s' (value '%s')",
+              feature->first.c_str(), feature->second._value.c_str());
 
     // Now find the Contact's version of this feature.
-    FeatureSet::const_iterator contact_feature;
-    contact_feature = contact_feature_set.find(feature_name);
+    ContactFeatureSet::const_iterator contact_feature =
+                                     contact_feature_set.find(feature->first);
 
     // Now attempt to compare the two features.
     if (contact_feature == contact_feature_set.end())
@@ -402,83 +442,73 @@ MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
       // The Contact header doesn't contain this feature tag, so this
       // Reject-Contact predicate is discarded.
       rc = NO;
-      TRC_DEBUG("Parameter %s is not in the Contact parameters", feature_name.c_str());
+      TRC_DEBUG("Parameter %s is not in the Contact parameters", feature->first.c_str());
     }
     else
     {
-      rc = match_feature(feature,
-                         *contact_feature);
+      rc = match_feature(feature->first,
+                         feature->second,
+                         contact_feature->second);
     }
   }
 
   return rc;
 }
 
+MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
+                               pjsip_accept_contact_hdr* accept)
+{
+  ContactFeatureSet features;
+  parse_contact_features(contact_feature_set, features);
+  return match_accept_contact(features,
+                              ContactPredicate(&accept->feature_set,
+                                               accept->explicit_match,
+                                               accept->required_match));
+}
+
+MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
+                               pjsip_reject_contact_hdr* reject)
+{
+  ContactFeatureSet features;
+  parse_contact_features(contact_feature_set, features);
+  return match_reject_contact(features,
+                              ContactPredicate(&reject->feature_set));
+}
+
 // Compares a single term of a feature predicate in the
 // Accept/Reject-Contact header (the matcher) and in the Contact
 // header (the matchee).
-MatchResult match_feature(Feature matcher,
-                          Feature matchee)
+MatchResult match_feature(const std::string& name,
+                          const ContactFeature& matcher,
+                          const ContactFeature& matchee)
 {
   MatchResult rc;
   TRC_DEBUG("Matching parameter '%s' - Accept-Contact/Reject-Contact value '%s', Contact value '%s'",
-            matcher.first.c_str(),
-            matcher.second.c_str(),
-            matchee.second.c_str());
+            name.c_str(),
+            matcher._value.c_str(),
+            matchee._value.c_str());
 
-  // Features with no value are boolean terms, equivalent to "TRUE"
-  // according to RFC 3841.
-  if (matcher.second.empty())
+  if (matcher._type == ContactFeature::STRING)
   {
-    matcher.second = "TRUE";
+    // Matcher is checking for string literal, so the matchee must be the
+    // same string literal.  Otherwise no possible feature collection could
+    // match both.
+    rc = ((matchee._type == ContactFeature::STRING) &&
+          (matcher._literal == matchee._literal)) ? YES : NO;
   }
-
-  if (matchee.second.empty())
-  {
-    matchee.second = "TRUE";
-  }
-
-  // Unquote the values, as they don't matter.
-  if ((matcher.second.front() == '"') && (matcher.second.back() == '"'))
-  {
-    matcher.second = matcher.second.substr(1, (matcher.second.size() - 2));
-  }
-  if ((matchee.second.front() == '"') && (matchee.second.back() == '"'))
-  {
-    matchee.second = matchee.second.substr(1, (matchee.second.size() - 2));
-  }
-
-  if (matcher.second[0] == '<')
-  {
-    // Matcher is checking for string literal...
-    if (matchee.second[0] == '<')
-    {
-      // ...as is the matchee...
-      if (matcher.second == matchee.second)
-      {
-        // ...and it's the same string literal
-        rc = YES;
-      }
-      else
-      {
-        // ...but it's a different string literal
-        rc = NO;
-      }
-    }
-    else
-    {
-      // ...but matchee isn't, so no possible feature collection could
-      // match both
-      rc = NO;
-    }
-  }
-  else if (matcher.second[0] == '#')
+  else if (matcher._type == ContactFeature::NUMERIC)
   {
     // Matcher is looking for a numeric predicate...
-    if (matchee.second[0] == '#')
+    if (matchee._type == ContactFeature::NUMERIC)
     {
       // ...as is the matchee
-      rc = match_numeric(matcher.second, matchee.second);
+      if ((!matcher._valid) || (!matchee._valid))
+      {
+        throw FeatureParseError();
+      }
+
+      rc = match_ranges(matcher._minimum, matcher._maximum,
+                        matchee._minimum, matchee._maximum);
     }
     else
     {
@@ -490,8 +520,7 @@ MatchResult match_feature(Feature matcher,
   else
   {
     // Matcher is a token set...
-    if ((matchee.second[0] == '#') ||
-        (matchee.second[0] == '<'))
+    if (matchee._type != ContactFeature::TOKENS)
     {
       // The two feature predicates each require a term of different
       // types, so no feature collection can match both.
@@ -499,7 +528,7 @@ MatchResult match_feature(Feature matcher,
     }
     else
     {
-      rc = match_tokens(matcher.second, matchee.second);
+      rc = match_token_lists(matcher._tokens, matchee._tokens);
     }
   }
 
@@ -515,56 +544,29 @@ MatchResult match_feature(Feature matcher,
   return rc;
 }
 
-// Represents a NumericFeature
-struct NumericRange
+MatchResult match_feature(Feature matcher,
+                          Feature matchee)
 {
-  float minimum;
-  float maximum;
-
-  NumericRange(const std::string& str)
-  {
-    if (sscanf(str.c_str(), "#%f:%f", &minimum, &maximum) == 2)
-    {
-      if (minimum > maximum)
-      {
-        throw FeatureParseError();
-      }
-    }
-    else if (sscanf(str.c_str(), "#>=%f", &minimum) == 1)
-    {
-      maximum = std::numeric_limits<float>::max();
-    }
-    else if (sscanf(str.c_str(), "#<=%f", &maximum) == 1)
-    {
-      minimum = std::numeric_limits<float>::min();
-    }
-    else if (sscanf(str.c_str(), "#%f", &minimum) == 1)
-    {
-      maximum = minimum;
-    }
-    else
-    {
-      // Invalid format for numeric.
-      throw FeatureParseError();
-    }
-  }
-};
+  return match_feature(matcher.first,
+                       ContactFeature(matcher.second),
+                       ContactFeature(matchee.second));
+}
 
-// Compare two numeric features to see if the matcher matches the matchee.
-MatchResult match_numeric(const std::string& matcher,
-                          const std::string& matchee)
+// Compare two numeric ranges to see if the matcher matches the matchee.
+MatchResult match_ranges(float matcher_minimum,
+                         float matcher_maximum,
+                         float matchee_minimum,
+                         float matchee_maximum)
 {
-  NumericRange matcher_range(matcher);
-  NumericRange matchee_range(matchee);
   MatchResult rc;
 
-  if (matcher_range.minimum <= matchee_range.minimum)
+  if (matcher_minimum <= matchee_minimum)
   {
-    if (matcher_range.maximum >= matchee_range.maximum)
+    if (matcher_maximum >= matchee_maximum)
     {
       rc = YES;
     }
-    else if (matcher_range.maximum >= matchee_range.minimum)
+    else if (matcher_maximum >= matchee_minimum)
     {
       rc = YES;
     }
@@ -573,7 +575,7 @@ MatchResult match_numeric(const std::string& matcher,
       rc = NO;
     }
   }
-  else if (matcher_range.minimum <= matchee_range.maximum)
+  else if (matcher_minimum <= matchee_maximum)
   {
     rc = YES;
   }
@@ -585,28 +587,51 @@ MatchResult match_numeric(const std::string& matcher,
   return rc;
 }
 
-// Only needed for passing in to "transform" below.
-std::string string_to_lowercase(std::string& str)
+// Compare two numeric features to see if the matcher matches the matchee.
+MatchResult match_numeric(const std::string& matcher,
+                          const std::string& matchee)
 {
-  ::boost::algorithm::to_lower(str);
-  return str;
+  float matcher_minimum, matcher_maximum;
+  float matchee_minimum, matchee_maximum;
+
+  if ((!ContactFeature::parse_numeric(matcher, matcher_minimum, matcher_maximum)) ||
+      (!ContactFeature::parse_numeric(matchee, matchee_minimum, matchee_maximum)))
+  {
+    throw FeatureParseError();
+  }
+
+  return match_ranges(matcher_minimum, matcher_maximum,
+                      matchee_minimum, matchee_maximum);
 }
 
 MatchResult match_tokens(const std::string& matcher,
                          const std::string& matchee)
 {
-  // Convert both strings to lists of tokens
+  // Convert both strings to lists of lower-case tokens
   std::vector<std::string> matcher_tokens;
   Utils::split_string(matcher, ',', matcher_tokens, 0, true);
   std::vector<std::string> matchee_tokens;
   Utils::split_string(matchee, ',', matchee_tokens, 0, true);
 
-  // Lower-case everything so we can safely compare.
-  std::transform(matcher_tokens.begin(), matcher_tokens.end(),
-                 matcher_tokens.begin(), string_to_lowercase);
-  std::transform(matchee_tokens.begin(), matchee_tokens.end(),
-                 matchee_tokens.begin(), string_to_lowercase);
+  for (std::vector<std::string>::iterator token = matcher_tokens.begin();
+       token != matcher_tokens.end();
+       ++token)
+  {
+    boost::algorithm::to_lower(*token);
+  }
+  for (std::vector<std::string>::iterator token = matchee_tokens.begin();
+       token != matchee_tokens.end();
+       ++token)
+  {
+    boost::algorithm::to_lower(*token);
+  }
+
+  return match_token_lists(matcher_tokens, matchee_tokens);
+}
 
+MatchResult match_token_lists(const std::vector<std::string>& matcher_tokens,
+                              const std::vector<std::string>& matchee_tokens)
+{
   // Loop over both sets of tokens, to see whether a feature
   // collection (i.e. a single token) could satisfy both predicates.
   // Specifically, we want:
@@ -614,11 +639,11 @@ MatchResult match_tokens(const std::string& matcher,
   // * any negation (i.e. !X, which in this context means "anything
   // but X") and any token in the other list which matches that
   // negation (i.e. anything but X, or any other negation).
-  for (std::vector<std::string>::iterator token1 = matcher_tokens.begin();
+  for (std::vector<std::string>::const_iterator token1 = matcher_tokens.begin();
        token1 != matcher_tokens.end();
        token1++)
   {
-    for (std::vector<std::string>::iterator token2 = matchee_tokens.begin();
+    for (std::vector<std::string>::const_iterator token2 = matchee_tokens.begin();
          token2 != matchee_tokens.end();
          token2++)
     {
@@ -632,9 +657,8 @@ MatchResult match_tokens(const std::string& matcher,
       // equal to X, then that token satisfies both feature predicates.
       if ((*token1)[0] == '!')
       {
-        std::string token1_without_negation = token1->substr(1, std::string::npos);
-        TRC_DEBUG("Comparing negation of %s to %s", token1_without_negation.c_str(), token2->c_str());
-        if (token1_without_negation != *token2)
+        TRC_DEBUG("Comparing negation of %s to %s", token1->c_str() + 1, token2->c_str());
+        if (token1->compare(1, std::string::npos, *token2) != 0)
         {
           return YES;
         }
@@ -642,9 +666,8 @@ MatchResult match_tokens(const std::string& matcher,
 
       if ((*token2)[0] == '!')
       {
-        std::string token2_without_negation = token2->substr(1, std::string::npos);
-        TRC_DEBUG("Comparing negation of %s to %s", token2_without_negation.c_str(), token1->c_str());
-        if (token2_without_negation != *token1)
+        TRC_DEBUG("Comparing negation of %s to %s", token2->c_str() + 1, token1->c_str());
+        if (token2->compare(1, std::string::npos, *token1) != 0)
         {
           return YES;
         }
@@ -0,0 +1,357 @@
+/**
+ * @file destination_health.cpp Latency and error tracking for downstream SIP destinations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "log.h"
+#include "destination_health.h"
+
+const double DestinationHealth::SMOOTHING_FACTOR = 0.1;
+const double DestinationHealth::P99_Z_SCORE = 2.33;
+const double DestinationHealth::EJECTION_ERROR_RATE = 0.5;
+const unsigned long DestinationHealth::MAX_EJECTION_MS;
+const unsigned long DestinationHealth::MIN_HEDGE_DELAY_MS;
+const unsigned long DestinationHealth::MAX_HEDGE_DELAY_MS;
+const unsigned long DestinationHealth::IDLE_EXPIRY_MS;
+const unsigned long DestinationHealth::PRUNE_INTERVAL_MS;
+const size_t DestinationHealth::MAX_DESTINATIONS;
+
+DestinationHealth::Stats::Stats() :
+  latency_ms(0.0),
+  latency_variance(0.0),
+  error_rate(0.0),
+  samples(0),
+  ejections(0),
+  ejected_until_ms(0),
+  reintroduced_at_ms(0),
+  last_used_ms(0)
+{
+}
+
+
+DestinationHealth::DestinationHealth(bool outlier_ejection,
+                                     bool hedging,
+                                     unsigned long ejection_latency_ms) :
+  _outlier_ejection(outlier_ejection),
+  _hedging(hedging),
+  _ejection_latency_ms(ejection_latency_ms),
+  _stats(),
+  _next_prune_ms(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+DestinationHealth::~DestinationHealth()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void DestinationHealth::record_response(const AddrInfo& server,
+                                        unsigned long latency_ms)
+{
+  unsigned long now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  Stats* stats = find_or_add(server, now);
+  if (stats != NULL)
+  {
+    update(*stats, latency_ms, false);
+    check_for_ejection(*stats, now);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void DestinationHealth::record_failure(const AddrInfo& server)
+{
+  unsigned long now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  Stats* stats = find_or_add(server, now);
+  if (stats != NULL)
+  {
+    update(*stats, -1.0, true);
+    check_for_ejection(*stats, now);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void DestinationHealth::reorder_servers(std::vector<AddrInfo>& servers)
+{
+  if (!_outlier_ejection)
+  {
+    return;
+  }
+
+  unsigned long now = now_ms();
+  std::vector<AddrInfo> ejected;
+  std::vector<AddrInfo>::iterator keep = servers.begin();
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<AddrInfo>::iterator server = servers.begin();
+       server != servers.end();
+       ++server)
+  {
+    std::map<AddrInfo, Stats>::const_iterator stats = _stats.find(*server);
+
+    if ((stats == _stats.end()) || (available(stats->second, now)))
+    {
+      *keep++ = *server;
+    }
+    else
+    {
+      ejected.push_back(*server);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!ejected.empty())
+  {
+    TRC_DEBUG("Moved %d ejected destinations to the end of the target list",
+              ejected.size());
+    std::copy(ejected.begin(), ejected.end(), keep);
+  }
+}
+
+
+unsigned long DestinationHealth::hedge_delay_ms(const AddrInfo& server)
+{
+  unsigned long delay = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<AddrInfo, Stats>::const_iterator stats = _stats.find(server);
+
+  if ((stats != _stats.end()) && (stats->second.samples >= MIN_SAMPLES))
+  {
+    double p99 = stats->second.latency_ms +
+                 P99_Z_SCORE * sqrt(stats->second.latency_variance);
+    delay = std::min(MAX_HEDGE_DELAY_MS,
+                     std::max(MIN_HEDGE_DELAY_MS, (unsigned long)p99));
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return delay;
+}
+
+
+size_t DestinationHealth::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _stats.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+unsigned long DestinationHealth::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+double DestinationHealth::random()
+{
+  return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+
+/// Returns the statistics for a destination, adding them if the destination
+/// is new, or NULL if too many destinations are already tracked.  Must be
+/// called with the lock held.
+DestinationHealth::Stats* DestinationHealth::find_or_add(const AddrInfo& server,
+                                                         unsigned long now)
+{
+  if (now >= _next_prune_ms)
+  {
+    prune(now);
+    _next_prune_ms = now + PRUNE_INTERVAL_MS;
+  }
+
+  std::map<AddrInfo, Stats>::iterator stats = _stats.find(server);
+
+  if (stats == _stats.end())
+  {
+    if (_stats.size() >= MAX_DESTINATIONS)
+    {
+      TRC_DEBUG("Too many destinations tracked, ignoring new destination");
+      return NULL;
+    }
+
+    stats = _stats.insert(std::make_pair(server, Stats())).first;
+  }
+
+  stats->second.last_used_ms = now;
+  return &stats->second;
+}
+
+
+/// Forgets destinations that haven't been used for a while, unless they are
+/// still ejected or being reintroduced.  Must be called with the lock held.
+void DestinationHealth::prune(unsigned long now)
+{
+  std::map<AddrInfo, Stats>::iterator i = _stats.begin();
+
+  while (i != _stats.end())
+  {
+    if ((now >= i->second.last_used_ms + IDLE_EXPIRY_MS) &&
+        (now >= i->second.reintroduced_at_ms))
+    {
+      _stats.erase(i++);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
+
+
+void DestinationHealth::update(Stats& stats, double latency_ms, bool failed)
+{
+  if (latency_ms >= 0.0)
+  {
+    if (stats.samples == 0)
+    {
+      stats.latency_ms = latency_ms;
+      stats.latency_variance = 0.0;
+    }
+    else
+    {
+      // Incremental EWMA of the mean and variance.
+      double diff = latency_ms - stats.latency_ms;
+      stats.latency_ms += SMOOTHING_FACTOR * diff;
+      stats.latency_variance = (1.0 - SMOOTHING_FACTOR) *
+                      (stats.latency_variance + SMOOTHING_FACTOR * diff * diff);
+    }
+  }
+
+  stats.error_rate = (1.0 - SMOOTHING_FACTOR) * stats.error_rate +
+                     (failed ? SMOOTHING_FACTOR : 0.0);
+  stats.samples++;
+}
+
+
+void DestinationHealth::check_for_ejection(Stats& stats, unsigned long now)
+{
+  if ((!_outlier_ejection) ||
+      (stats.samples < MIN_SAMPLES) ||
+      (now < stats.reintroduced_at_ms))
+  {
+    // Ejection is disabled, we don't know enough about the destination yet,
+    // or it is still being (re)introduced.
+    return;
+  }
+
+  bool slow = (stats.latency_ms > _ejection_latency_ms);
+  bool failing = (stats.error_rate > EJECTION_ERROR_RATE);
+
+  if ((!slow) && (!failing))
+  {
+    if ((stats.ejections > 0) &&
+        (now > stats.reintroduced_at_ms + MAX_EJECTION_MS))
+    {
+      // The destination has been healthy for long enough to forget about
+      // its previous ejections.
+      stats.ejections = 0;
+    }
+
+    return;
+  }
+
+  int ejected = 0;
+
+  for (std::map<AddrInfo, Stats>::const_iterator i = _stats.begin();
+       i != _stats.end();
+       ++i)
+  {
+    if (now < i->second.ejected_until_ms)
+    {
+      ejected++;
+    }
+  }
+
+  if ((ejected + 1) * 100 > (int)_stats.size() * MAX_EJECTED_PERCENT)
+  {
+    TRC_DEBUG("Not ejecting unhealthy destination - too many already ejected");
+    return;
+  }
+
+  unsigned long duration = BASE_EJECTION_MS << std::min(stats.ejections, 5);
+  duration = std::min(duration, MAX_EJECTION_MS);
+  stats.ejections++;
+  stats.ejected_until_ms = now + duration;
+  stats.reintroduced_at_ms = stats.ejected_until_ms + REINTRODUCTION_MS;
+
+  TRC_INFO("Ejecting %s destination for %lums (latency %.0fms, error rate %.2f)",
+           slow ? "slow" : "failing",
+           duration,
+           stats.latency_ms,
+           stats.error_rate);
+
+  // Start afresh when the destination is reintroduced.
+  stats.samples = 0;
+  stats.error_rate = 0.0;
+}
+
+
+bool DestinationHealth::available(const Stats& stats, unsigned long now)
+{
+  if (now < stats.ejected_until_ms)
+  {
+    return false;
+  }
+  else if (now < stats.reintroduced_at_ms)
+  {
+    // Being reintroduced, so give the destination a share of the traffic
+    // that grows linearly over the reintroduction period.
+    double share = (double)(now - stats.ejected_until_ms) / REINTRODUCTION_MS;
+    return (random() < share);
+  }
+
+  return true;
+}
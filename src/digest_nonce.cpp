@@ -0,0 +1,289 @@
+/**
+ * @file digest_nonce.cpp Self-validating digest nonces and nonce count tracking.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "log.h"
+#include "digest_nonce.h"
+
+/// Converts binary data to lower case hex.
+static std::string to_hex(const unsigned char* data, size_t len)
+{
+  static const char HEX[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(len * 2);
+
+  for (size_t ii = 0; ii < len; ++ii)
+  {
+    hex.push_back(HEX[data[ii] >> 4]);
+    hex.push_back(HEX[data[ii] & 0xf]);
+  }
+
+  return hex;
+}
+
+const size_t DigestNonceSigner::NONCE_LENGTH;
+const size_t NonceCountWindow::DEFAULT_MAX_NONCES;
+const uint32_t NonceCountWindow::WINDOW_SIZE;
+
+DigestNonceSigner::DigestNonceSigner()
+{
+  unsigned char key[32];
+
+  if (RAND_bytes(key, sizeof(key)) != 1)
+  {
+    // LCOV_EXCL_START - OpenSSL only fails if it has no entropy source.
+    TRC_ERROR("Failed to generate digest nonce key");
+    for (size_t ii = 0; ii < sizeof(key); ++ii)
+    {
+      key[ii] = (unsigned char)rand();
+    }
+    // LCOV_EXCL_STOP
+  }
+
+  _key.assign((char*)key, sizeof(key));
+  _key_id = sign("key-id", "").substr(0, 8);
+}
+
+
+DigestNonceSigner::DigestNonceSigner(const std::string& key) :
+  _key(key)
+{
+  _key_id = sign("key-id", "").substr(0, 8);
+}
+
+
+std::string DigestNonceSigner::mint(const std::string& impi, time_t expires)
+{
+  unsigned char random[8];
+
+  if (RAND_bytes(random, sizeof(random)) != 1)
+  {
+    // LCOV_EXCL_START
+    for (size_t ii = 0; ii < sizeof(random); ++ii)
+    {
+      random[ii] = (unsigned char)rand();
+    }
+    // LCOV_EXCL_STOP
+  }
+
+  char expires_hex[9];
+  snprintf(expires_hex, sizeof(expires_hex), "%08x", (uint32_t)expires);
+
+  std::string prefix = to_hex(random, sizeof(random)) + expires_hex + _key_id;
+  return prefix + sign(prefix, impi).substr(0, 16);
+}
+
+
+DigestNonceSigner::Validity DigestNonceSigner::check(const std::string& nonce,
+                                                     const std::string& impi,
+                                                     time_t now)
+{
+  if ((nonce.length() != NONCE_LENGTH) ||
+      (nonce.find_first_not_of("0123456789abcdef") != std::string::npos) ||
+      (nonce.compare(24, 8, _key_id) != 0))
+  {
+    // This isn't a nonce minted with our key.
+    return UNKNOWN;
+  }
+
+  std::string prefix = nonce.substr(0, 32);
+  std::string hmac = sign(prefix, impi);
+
+  if (CRYPTO_memcmp(hmac.data(), nonce.data() + 32, 16) != 0)
+  {
+    TRC_INFO("Digest nonce %s for %s failed validation",
+             nonce.c_str(), impi.c_str());
+    return FORGED;
+  }
+
+  time_t expires = (time_t)strtoul(nonce.substr(16, 8).c_str(), NULL, 16);
+
+  if (expires < now)
+  {
+    TRC_DEBUG("Digest nonce %s expired at %ld", nonce.c_str(), (long)expires);
+    return EXPIRED;
+  }
+
+  return VALID;
+}
+
+
+std::string DigestNonceSigner::sign(const std::string& prefix,
+                                    const std::string& impi)
+{
+  std::string data = prefix + impi;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+
+  HMAC(EVP_sha256(),
+       _key.data(),
+       _key.length(),
+       (const unsigned char*)data.data(),
+       data.length(),
+       md,
+       &md_len);
+
+  return to_hex(md, md_len);
+}
+
+
+NonceCountWindow::NonceCountWindow(size_t max_nonces) :
+  _max_nonces(max_nonces),
+  _windows(),
+  _lru()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+NonceCountWindow::~NonceCountWindow()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+NonceCountWindow::Result NonceCountWindow::check(const std::string& nonce,
+                                                 uint32_t nonce_count,
+                                                 time_t now,
+                                                 uint32_t& next_count)
+{
+  Result result = UNKNOWN;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Window>::iterator it = _windows.find(nonce);
+
+  if (it != _windows.end())
+  {
+    Window& window = it->second;
+
+    if (window.expires < now)
+    {
+      // The challenge has expired, so whether it is still usable is up to the
+      // store.
+      _lru.erase(window.lru);
+      _windows.erase(it);
+    }
+    else
+    {
+      if (nonce_count > window.highest)
+      {
+        result = NEW;
+      }
+      else if ((window.highest - nonce_count < WINDOW_SIZE) &&
+               (!(window.seen & ((uint64_t)1 << (window.highest - nonce_count)))))
+      {
+        // A count we haven't seen, but which arrived out of order.
+        result = NEW;
+      }
+      else
+      {
+        result = REPLAYED;
+        next_count = window.highest + 1;
+      }
+
+      _lru.splice(_lru.end(), _lru, window.lru);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return result;
+}
+
+
+void NonceCountWindow::record(const std::string& nonce,
+                              uint32_t nonce_count,
+                              time_t expires)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Window>::iterator it = _windows.find(nonce);
+
+  if (it == _windows.end())
+  {
+    if ((_max_nonces > 0) && (_windows.size() >= _max_nonces))
+    {
+      // Forget the least recently used nonce.
+      _windows.erase(_lru.front());
+      _lru.pop_front();
+    }
+
+    Window window;
+    window.highest = nonce_count;
+    window.seen = 1;
+    window.expires = expires;
+    window.lru = _lru.insert(_lru.end(), nonce);
+    _windows[nonce] = window;
+  }
+  else
+  {
+    Window& window = it->second;
+
+    if (nonce_count > window.highest)
+    {
+      uint32_t shift = nonce_count - window.highest;
+      window.seen = (shift < WINDOW_SIZE) ? ((window.seen << shift) | 1) : 1;
+      window.highest = nonce_count;
+    }
+    else if (window.highest - nonce_count < WINDOW_SIZE)
+    {
+      window.seen |= ((uint64_t)1 << (window.highest - nonce_count));
+    }
+
+    window.expires = std::max(window.expires, expires);
+    _lru.splice(_lru.end(), _lru, window.lru);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t NonceCountWindow::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _windows.size();
+  pthread_mutex_unlock(&_lock);
+
+  return size;
+}
@@ -0,0 +1,625 @@
+/**
+ * @file dns_prefetcher.cpp Keeps the DNS records for configured next hops warm.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+
+#include "log.h"
+#include "dns_prefetcher.h"
+
+const int DnsPrefetcher::SOURCE_POLL_INTERVAL_S;
+const int DnsPrefetcher::FAILURE_RETRY_S;
+const int DnsPrefetcher::MAX_REFRESH_INTERVAL_S;
+const int DnsPrefetcher::IDLE_EXPIRY_S;
+const size_t DnsPrefetcher::MAX_TARGETS;
+
+DnsPrefetcher::DnsPrefetcher(SIPResolver* resolver,
+                             int af,
+                             SNMP::CounterTable* hits_tbl,
+                             SNMP::CounterTable* misses_tbl,
+                             SNMP::CounterTable* refreshes_tbl) :
+  _resolver(resolver),
+  _af(af),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl),
+  _refreshes_tbl(refreshes_tbl),
+  _next_source_id(0),
+  _sources(),
+  _next_poll(0),
+  _targets(),
+  _terminated(false),
+  _started(false)
+{
+  pthread_mutex_init(&_sources_lock, NULL);
+  pthread_rwlock_init(&_lock, NULL);
+  pthread_mutex_init(&_thread_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+DnsPrefetcher::~DnsPrefetcher()
+{
+  if (_started)
+  {
+    pthread_mutex_lock(&_thread_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_thread_lock);
+
+    pthread_join(_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_thread_lock);
+  pthread_rwlock_destroy(&_lock);
+  pthread_mutex_destroy(&_sources_lock);
+}
+
+
+void DnsPrefetcher::start()
+{
+  int rc = pthread_create(&_thread, NULL, &tick_thread, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start DNS prefetch thread: %s", strerror(rc));
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _started = true;
+}
+
+
+int DnsPrefetcher::add_source(const Source& source)
+{
+  pthread_mutex_lock(&_sources_lock);
+  int id = _next_source_id++;
+  _sources[id] = source;
+  pthread_mutex_unlock(&_sources_lock);
+
+  // Pick up the new source's targets on the next tick.
+  pthread_rwlock_wrlock(&_lock);
+  _next_poll = 0;
+  pthread_rwlock_unlock(&_lock);
+
+  return id;
+}
+
+
+void DnsPrefetcher::remove_source(int id)
+{
+  // The sources lock is held while the sources are called, so once we have
+  // it the source can't be running.
+  pthread_mutex_lock(&_sources_lock);
+  _sources.erase(id);
+  pthread_mutex_unlock(&_sources_lock);
+
+  pthread_rwlock_wrlock(&_lock);
+  _next_poll = 0;
+  pthread_rwlock_unlock(&_lock);
+}
+
+
+void DnsPrefetcher::learn_uri(const std::string& uri)
+{
+  std::string name;
+  int port;
+  int transport;
+  Target target;
+
+  if ((!parse_target(uri, name, port, transport)) ||
+      (!make_target(name, port, transport, target)))
+  {
+    return;
+  }
+
+  int now = time(NULL);
+
+  // This is called on every initial request, and the target is nearly
+  // always known already, so only take the lock for reading unless it
+  // needs adding.
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<Target, TargetState>::iterator i = _targets.find(target);
+  bool found = (i != _targets.end());
+
+  if (found)
+  {
+    i->second.last_used = now;
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (!found)
+  {
+    pthread_rwlock_wrlock(&_lock);
+    add_learned_target(target, now);
+    pthread_rwlock_unlock(&_lock);
+  }
+}
+
+
+void DnsPrefetcher::add_learned_target(const Target& target, int now)
+{
+  std::map<Target, TargetState>::iterator i = _targets.find(target);
+
+  if (i != _targets.end())
+  {
+    // Another thread got there first.
+    i->second.last_used = now;
+  }
+  else if (_targets.size() < MAX_TARGETS)
+  {
+    TRC_DEBUG("Learned DNS prefetch target %s", target.name.c_str());
+    TargetState& state = _targets[target];
+    state.next_refresh = now;
+    state.records_expire = 0;
+    state.last_used = now;
+    state.configured = false;
+  }
+}
+
+
+void DnsPrefetcher::record_lookup(const std::string& name,
+                                  int port,
+                                  int transport)
+{
+  Target target;
+
+  if (!make_target(name, port, transport, target))
+  {
+    return;
+  }
+
+  int now = time(NULL);
+  bool tracked = false;
+  bool cached = false;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  std::map<Target, TargetState>::iterator i = _targets.find(target);
+
+  if (i != _targets.end())
+  {
+    // The lookup was answered from the resolver's cache if the records the
+    // last prefetch put there haven't expired yet.
+    i->second.last_used = now;
+    tracked = true;
+    cached = (now < i->second.records_expire);
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (tracked)
+  {
+    SNMP::CounterTable* tbl = cached ? _hits_tbl : _misses_tbl;
+    if (tbl != NULL)
+    {
+      tbl->increment();
+    }
+  }
+}
+
+
+void DnsPrefetcher::tick(int now)
+{
+  bool poll;
+
+  pthread_rwlock_wrlock(&_lock);
+  poll = (now >= _next_poll);
+  if (poll)
+  {
+    _next_poll = now + SOURCE_POLL_INTERVAL_S;
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  if (poll)
+  {
+    poll_sources(now);
+  }
+
+  std::vector<Target> due;
+
+  pthread_rwlock_wrlock(&_lock);
+
+  std::map<Target, TargetState>::iterator i = _targets.begin();
+
+  while (i != _targets.end())
+  {
+    if ((!i->second.configured) &&
+        (i->second.last_used + IDLE_EXPIRY_S <= now))
+    {
+      TRC_DEBUG("Dropping idle DNS prefetch target %s", i->first.name.c_str());
+      _targets.erase(i++);
+    }
+    else
+    {
+      if (i->second.next_refresh <= now)
+      {
+        due.push_back(i->first);
+      }
+      ++i;
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  for (std::vector<Target>::const_iterator t = due.begin();
+       t != due.end();
+       ++t)
+  {
+    // Resolve without the lock, so the call processing threads aren't held
+    // up if DNS is slow.
+    int ttl = resolve(t->name, t->port, t->transport);
+
+    if (_refreshes_tbl != NULL)
+    {
+      _refreshes_tbl->increment();
+    }
+
+    // The TTL is what's left of the records in the cache, so the next
+    // refresh lands as they expire.
+    int interval = (ttl < 0) ? FAILURE_RETRY_S :
+                               std::min(std::max(ttl, 1), MAX_REFRESH_INTERVAL_S);
+    TRC_DEBUG("Prefetched %s, next refresh in %ds", t->name.c_str(), interval);
+
+    pthread_rwlock_wrlock(&_lock);
+    i = _targets.find(*t);
+    if (i != _targets.end())
+    {
+      i->second.next_refresh = now + interval;
+      i->second.records_expire = (ttl < 0) ? 0 : now + ttl;
+    }
+    pthread_rwlock_unlock(&_lock);
+  }
+}
+
+
+size_t DnsPrefetcher::size()
+{
+  pthread_rwlock_rdlock(&_lock);
+  size_t size = _targets.size();
+  pthread_rwlock_unlock(&_lock);
+  return size;
+}
+
+
+void DnsPrefetcher::save(WarmStartSnapshot::Writer& writer)
+{
+  int now = time(NULL);
+  std::vector<std::pair<Target, int>> learned;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (std::map<Target, TargetState>::const_iterator i = _targets.begin();
+       i != _targets.end();
+       ++i)
+  {
+    if (!i->second.configured)
+    {
+      learned.push_back(std::make_pair(i->first,
+                                       now - i->second.last_used.load()));
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  writer.put_u32(learned.size());
+
+  for (size_t i = 0; i < learned.size(); ++i)
+  {
+    writer.put_string(learned[i].first.name);
+    writer.put_u32(learned[i].first.port);
+    writer.put_u32(learned[i].first.transport);
+    writer.put_u32(std::max(learned[i].second, 0));
+  }
+}
+
+
+void DnsPrefetcher::restore(WarmStartSnapshot::Reader& reader, int age_s)
+{
+  int now = time(NULL);
+  size_t restored = 0;
+  uint32_t count = reader.get_u32();
+
+  pthread_rwlock_wrlock(&_lock);
+
+  for (uint32_t i = 0; (i < count) && (!reader.failed()); ++i)
+  {
+    Target target;
+    target.name = reader.get_string();
+    target.port = reader.get_u32();
+    target.transport = reader.get_u32();
+    int idle_s = reader.get_u32() + age_s;
+
+    if ((reader.failed()) ||
+        (idle_s >= IDLE_EXPIRY_S) ||
+        (_targets.size() >= MAX_TARGETS) ||
+        (_targets.find(target) != _targets.end()))
+    {
+      continue;
+    }
+
+    TargetState& state = _targets[target];
+    state.next_refresh = now;
+    state.records_expire = 0;
+    state.last_used = now - idle_s;
+    state.configured = false;
+    ++restored;
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (restored > 0)
+  {
+    pthread_mutex_lock(&_thread_lock);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_thread_lock);
+  }
+
+  TRC_STATUS("Restored %ld of %u DNS prefetch targets from warm-start snapshot",
+             restored, count);
+}
+
+
+bool DnsPrefetcher::parse_target(const std::string& uri,
+                                 std::string& name,
+                                 int& port,
+                                 int& transport)
+{
+  std::string s = uri;
+
+  // Strip any name-addr wrapping.
+  size_t start = s.find('<');
+  if (start != std::string::npos)
+  {
+    size_t end = s.find('>', start);
+    s = s.substr(start + 1,
+                 (end == std::string::npos) ? std::string::npos : end - start - 1);
+  }
+
+  size_t colon = s.find(':');
+  if (colon == std::string::npos)
+  {
+    return false;
+  }
+
+  std::string scheme = s.substr(0, colon);
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+  if ((scheme != "sip") && (scheme != "sips"))
+  {
+    return false;
+  }
+
+  s = s.substr(colon + 1);
+
+  size_t params_start = s.find_first_of(";?");
+  std::string hostport = s.substr(0, params_start);
+  std::string params = (params_start == std::string::npos) ? "" :
+                                                             s.substr(params_start);
+
+  size_t at = hostport.rfind('@');
+  if (at != std::string::npos)
+  {
+    hostport = hostport.substr(at + 1);
+  }
+
+  std::string port_str;
+
+  if ((!hostport.empty()) && (hostport[0] == '['))
+  {
+    size_t close = hostport.find(']');
+    if (close == std::string::npos)
+    {
+      return false;
+    }
+    name = hostport.substr(1, close - 1);
+    port_str = hostport.substr(close + 1);
+  }
+  else
+  {
+    size_t port_colon = hostport.find(':');
+    name = hostport.substr(0, port_colon);
+    port_str = (port_colon == std::string::npos) ? "" :
+                                                   hostport.substr(port_colon);
+  }
+
+  port = 0;
+  if (!port_str.empty())
+  {
+    if (port_str[0] != ':')
+    {
+      return false;
+    }
+    port = atoi(port_str.c_str() + 1);
+  }
+
+  std::transform(params.begin(), params.end(), params.begin(), ::tolower);
+  params += ";";
+
+  if (params.find(";transport=tcp;") != std::string::npos)
+  {
+    transport = IPPROTO_TCP;
+  }
+  else if (params.find(";transport=udp;") != std::string::npos)
+  {
+    transport = IPPROTO_UDP;
+  }
+  else
+  {
+    transport = -1;
+  }
+
+  return !name.empty();
+}
+
+
+int DnsPrefetcher::resolve(const std::string& name, int port, int transport)
+{
+  std::vector<AddrInfo> targets;
+  int ttl = 0;
+  _resolver->resolve(name, _af, port, transport, 1, targets, ttl);
+  return targets.empty() ? -1 : ttl;
+}
+
+
+bool DnsPrefetcher::make_target(const std::string& name,
+                                int port,
+                                int transport,
+                                Target& target)
+{
+  // There's nothing to prefetch for an IP address.
+  unsigned char buf[sizeof(struct in6_addr)];
+  if ((inet_pton(AF_INET, name.c_str(), buf) == 1) ||
+      (inet_pton(AF_INET6, name.c_str(), buf) == 1))
+  {
+    return false;
+  }
+
+  target.name = name;
+  std::transform(target.name.begin(), target.name.end(),
+                 target.name.begin(), ::tolower);
+  target.port = port;
+  target.transport = transport;
+  return true;
+}
+
+
+void DnsPrefetcher::poll_sources(int now)
+{
+  std::vector<std::string> uris;
+
+  pthread_mutex_lock(&_sources_lock);
+  for (std::map<int, Source>::const_iterator s = _sources.begin();
+       s != _sources.end();
+       ++s)
+  {
+    std::vector<std::string> source_uris = s->second();
+    uris.insert(uris.end(), source_uris.begin(), source_uris.end());
+  }
+  pthread_mutex_unlock(&_sources_lock);
+
+  pthread_rwlock_wrlock(&_lock);
+
+  // Targets that are no longer configured age out like learned ones.
+  for (std::map<Target, TargetState>::iterator i = _targets.begin();
+       i != _targets.end();
+       ++i)
+  {
+    if (i->second.configured)
+    {
+      i->second.configured = false;
+      i->second.last_used = now;
+    }
+  }
+
+  for (std::vector<std::string>::const_iterator u = uris.begin();
+       u != uris.end();
+       ++u)
+  {
+    std::string name;
+    int port;
+    int transport;
+    Target target;
+
+    if ((!parse_target(*u, name, port, transport)) ||
+        (!make_target(name, port, transport, target)))
+    {
+      continue;
+    }
+
+    std::map<Target, TargetState>::iterator i = _targets.find(target);
+
+    if (i == _targets.end())
+    {
+      if (_targets.size() >= MAX_TARGETS)
+      {
+        TRC_DEBUG("Too many DNS prefetch targets to add %s", u->c_str());
+        continue;
+      }
+
+      TargetState& state = _targets[target];
+      state.next_refresh = now;
+      state.records_expire = 0;
+      state.last_used = now;
+      state.configured = true;
+    }
+    else
+    {
+      i->second.configured = true;
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+
+void DnsPrefetcher::tick_loop()
+{
+  pthread_mutex_lock(&_thread_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += 1;
+    pthread_cond_timedwait(&_cond, &_thread_lock, &wake);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&_thread_lock);
+    tick(time(NULL));
+    pthread_mutex_lock(&_thread_lock);
+  }
+
+  pthread_mutex_unlock(&_thread_lock);
+}
+
+
+void* DnsPrefetcher::tick_thread(void* p)
+{
+  ((DnsPrefetcher*)p)->tick_loop();
+  return NULL;
+}
@@ -43,6 +43,7 @@
 #include "sproutletplugin.h"
 #include "mobiletwinned.h"
 #include "sproutletappserver.h"
+#include "sharded_stats.h"
 
 class GeminiPlugin : public SproutletPlugin
 {
@@ -81,10 +82,12 @@ bool GeminiPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 
   if (opt.enabled_gemini)
   {
-    SNMP::SuccessFailCountByRequestTypeTable* incoming_sip_transactions = SNMP::SuccessFailCountByRequestTypeTable::create("gemini_as_incoming_sip_transactions",
-                                                                                                                           "1.2.826.0.1.1578918.9.11.1");
-    SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions = SNMP::SuccessFailCountByRequestTypeTable::create("gemini_as_outgoing_sip_transactions",
-                                                                                                                           "1.2.826.0.1.1578918.9.11.2");
+    SNMP::SuccessFailCountByRequestTypeTable* incoming_sip_transactions = new ShardedSuccessFailCountByRequestTypeTable(
+        SNMP::SuccessFailCountByRequestTypeTable::create("gemini_as_incoming_sip_transactions",
+                                                         "1.2.826.0.1.1578918.9.11.1"));
+    SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions = new ShardedSuccessFailCountByRequestTypeTable(
+        SNMP::SuccessFailCountByRequestTypeTable::create("gemini_as_outgoing_sip_transactions",
+                                                         "1.2.826.0.1.1578918.9.11.2"));
     // Create the Sproutlet.
     _gemini = new MobileTwinnedAppServer(opt.prefix_gemini);
     _gemini_sproutlet = new SproutletAppServerShim(_gemini, opt.port_gemini, incoming_sip_transactions, outgoing_sip_transactions);
@@ -35,6 +35,8 @@
  */
 
 #include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
 
@@ -53,6 +55,9 @@ extern "C" {
 #include "pjutils.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
+#include "aor_write_serializer.h"
+
+#include <algorithm>
 
 static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
                               bool& previous_aor_pair_alloced,
@@ -212,6 +217,29 @@ void AuthTimeoutTask::run()
 }
 //LCOV_EXCL_STOP
 
+DeregistrationTask::DeregistrationTask(HttpStack::Request& req,
+                                       const Config* cfg,
+                                       SAS::TrailId trail) :
+  HttpStackUtils::Task(req, trail),
+  _cfg(cfg),
+  _remote_writer_running(false),
+  _pool_workers_running(0),
+  _aors_processed(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_remote_cond, NULL);
+  pthread_cond_init(&_remote_space_cond, NULL);
+  pthread_cond_init(&_workers_cond, NULL);
+}
+
+DeregistrationTask::~DeregistrationTask()
+{
+  pthread_cond_destroy(&_workers_cond);
+  pthread_cond_destroy(&_remote_space_cond);
+  pthread_cond_destroy(&_remote_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
 void DeregistrationTask::run()
 {
   // HTTP method must be a DELETE
@@ -247,33 +275,82 @@ void DeregistrationTask::run()
 
   rc = handle_request();
 
+  // Report which AoRs were deregistered and which failed.
+  _req.add_content(build_response_body());
+
   send_http_reply(rc);
   delete this;
 }
 
 void AoRTimeoutTask::handle_response()
+{
+  if (_aor_id.empty())
+  {
+    expire_aors(_cfg, _aor_ids, trail());
+  }
+  else
+  {
+    expire_aor(_cfg, _aor_id, false, trail());
+  }
+}
+
+void AoRTimeoutTask::expire_aors(const Config* cfg,
+                                 const std::vector<std::string>& aor_ids,
+                                 SAS::TrailId trail)
+{
+  // The store doesn't support multi-key operations, so work through the
+  // batch one AoR at a time.
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
+  {
+    expire_aor(cfg, *i, true, trail);
+  }
+}
+
+void AoRTimeoutTask::expire_aor(const Config* cfg,
+                                const std::string& aor_id,
+                                bool only_if_due,
+                                SAS::TrailId trail)
 {
   bool all_bindings_expired = false;
-  SubscriberDataManager::AoRPair* aor_pair = set_aor_data(_cfg->_sdm,
-                                                          _aor_id,
+  bool not_due = false;
+  SubscriberDataManager::AoRPair* aor_pair = set_aor_data(cfg->_sdm,
+                                                          aor_id,
                                                           NULL,
-                                                          _cfg->_remote_sdm,
-                                                          all_bindings_expired);
+                                                          cfg->_remote_sdm,
+                                                          all_bindings_expired,
+                                                          only_if_due,
+                                                          not_due,
+                                                          trail);
+
+  if (not_due)
+  {
+    TRC_DEBUG("Nothing in AoR %s is due to expire yet", aor_id.c_str());
+    return;
+  }
 
   if (aor_pair != NULL)
   {
     // If we have a remote store, try to store this there too.  We don't worry
     // about failures in this case.
     // LCOV_EXCL_START
-    if ((_cfg->_remote_sdm != NULL) && (_cfg->_remote_sdm->has_servers()))
+    if (cfg->_replicator != NULL)
+    {
+      cfg->_replicator->replicate(aor_id, aor_pair, trail);
+    }
+    else if ((cfg->_remote_sdm != NULL) && (cfg->_remote_sdm->has_servers()))
     {
       bool ignored;
       SubscriberDataManager::AoRPair* remote_aor_pair =
-                                         set_aor_data(_cfg->_remote_sdm,
-                                                      _aor_id,
+                                         set_aor_data(cfg->_remote_sdm,
+                                                      aor_id,
                                                       aor_pair,
                                                       NULL,
-                                                      ignored);
+                                                      ignored,
+                                                      false,
+                                                      ignored,
+                                                      trail);
       delete remote_aor_pair;
     }
     // LCOV_EXCL_STOP
@@ -281,16 +358,16 @@ void AoRTimeoutTask::handle_response()
     if (all_bindings_expired)
     {
       TRC_DEBUG("All bindings have expired based on a Chronos callback - triggering deregistration at the HSS");
-      SAS::Event event(trail(), SASEvent::REGISTRATION_EXPIRED, 0);
-      event.add_var_param(_aor_id);
+      SAS::Event event(trail, SASEvent::REGISTRATION_EXPIRED, 0);
+      event.add_var_param(aor_id);
       SAS::report_event(event);
 
-      _cfg->_hss->update_registration_state(_aor_id, "", HSSConnection::DEREG_TIMEOUT, trail());
+      cfg->_hss->update_registration_state(aor_id, "", HSSConnection::DEREG_TIMEOUT, trail);
     }
     else
     {
-      SAS::Event event(trail(), SASEvent::SOME_BINDINGS_EXPIRED, 0);
-      event.add_var_param(_aor_id);
+      SAS::Event event(trail, SASEvent::SOME_BINDINGS_EXPIRED, 0);
+      event.add_var_param(aor_id);
       SAS::report_event(event);
     }
   }
@@ -299,11 +376,11 @@ void AoRTimeoutTask::handle_response()
     // We couldn't update the SubscriberDataManager but there is nothing else we can do to
     // recover from this.
     TRC_INFO("Could not update SubscriberDataManager on registration timeout for AoR: %s",
-             _aor_id.c_str());
+             aor_id.c_str());
   }
 
   delete aor_pair;
-  report_sip_all_register_marker(trail(), _aor_id);
+  report_sip_all_register_marker(trail, aor_id);
 }
 
 SubscriberDataManager::AoRPair* AoRTimeoutTask::set_aor_data(
@@ -311,11 +388,16 @@ SubscriberDataManager::AoRPair* AoRTimeoutTask::set_aor_data(
                           std::string aor_id,
                           SubscriberDataManager::AoRPair* previous_aor_pair,
                           SubscriberDataManager* remote_sdm,
-                          bool& all_bindings_expired)
+                          bool& all_bindings_expired,
+                          bool only_if_due,
+                          bool& not_due,
+                          SAS::TrailId trail)
 {
   SubscriberDataManager::AoRPair* aor_pair = NULL;
   bool previous_aor_pair_alloced = false;
   Store::Status set_rc;
+  not_due = false;
+  AoRWriteSerializer::Write write(current_sdm->write_serializer(), aor_id);
 
   do
   {
@@ -325,21 +407,32 @@ SubscriberDataManager::AoRPair* AoRTimeoutTask::set_aor_data(
                            current_sdm,
                            remote_sdm,
                            &previous_aor_pair,
-                           trail()))
+                           trail))
+    {
+      break;
+    }
+
+    if ((only_if_due) &&
+        (!aor_pair->get_current()->bindings().empty()) &&
+        (aor_pair->get_current()->get_next_expires() > time(NULL)))
     {
+      delete aor_pair; aor_pair = NULL;
+      not_due = true;
       break;
     }
 
     set_rc = current_sdm->set_aor_data(aor_id,
                                        aor_pair,
-                                       trail(),
+                                       trail,
                                        all_bindings_expired);
     if (set_rc != Store::OK)
     {
       delete aor_pair; aor_pair = NULL;
     }
   }
-  while (set_rc == Store::DATA_CONTENTION);
+  while (write.retry(set_rc));
+
+  write.finish();
 
   // If we allocated the AoR, tidy up.
   // LCOV_EXCL_START
@@ -367,6 +460,25 @@ HTTPCode AoRTimeoutTask::parse_response(std::string body)
     return HTTP_BAD_REQUEST;
   }
 
+  // Bucket timers set by the local expiry wheel carry a list of AoRs.
+  if ((doc.HasMember("aor_ids")) && (doc["aor_ids"].IsArray()))
+  {
+    const rapidjson::Value& aor_ids = doc["aor_ids"];
+
+    for (rapidjson::Value::ConstValueIterator i = aor_ids.Begin();
+         i != aor_ids.End();
+         ++i)
+    {
+      if (i->IsString())
+      {
+        _aor_ids.push_back(i->GetString());
+      }
+    }
+
+    TRC_DEBUG("Handling bucket timer pop for %lu AoRs", _aor_ids.size());
+    return HTTP_OK;
+  }
+
   try
   {
     JSON_GET_STRING_MEMBER(doc, "aor_id", _aor_id);
@@ -437,82 +549,345 @@ HTTPCode DeregistrationTask::parse_request(std::string body)
 
 HTTPCode DeregistrationTask::handle_request()
 {
-  std::set<std::string> impis_to_delete;
+  TRC_DEBUG("Deregistering %d AoRs", _bindings.size());
+
+  // Work through the AoRs concurrently.  Each AoR is handled by a single
+  // worker (and then by the remote writer), so updates to any one AoR are
+  // still made in order.
+  _next_binding = _bindings.begin();
+  size_t workers = num_workers(_bindings.size());
+
+  if ((_cfg->_remote_sdm != NULL) &&
+      (_cfg->_replicator == NULL) &&
+      (_cfg->_worker_pool != NULL) &&
+      (workers > 0))
+  {
+    // Writes to the remote site are pipelined behind the local writes on
+    // this thread, so that the local site isn't held up waiting for the
+    // remote one.  The pool's threads only ever wait for this thread, so
+    // they can't deadlock with each other however busy the pool is.
+    _remote_writer_running = true;
+    start_pool_workers(&DeregistrationTask::deregister_aors, workers);
+    write_to_remote();
+    wait_for_pool_workers();
+  }
+  else
+  {
+    // This thread does its share of the work alongside the pool.
+    start_pool_workers(&DeregistrationTask::deregister_aors,
+                       (workers > 0) ? workers - 1 : 0);
+    deregister_aors();
+    wait_for_pool_workers();
+  }
+
+  TRC_DEBUG("Processed %d AoRs, %d failed",
+            _aors_processed, _failed_aors.size());
+
+  // Delete the IMPIs of the bindings that we have deregistered.
+  _next_impi = _impis_to_delete.begin();
+  workers = num_workers(_impis_to_delete.size());
+  start_pool_workers(&DeregistrationTask::delete_impis,
+                     (workers > 0) ? workers - 1 : 0);
+  delete_impis();
+  wait_for_pool_workers();
+
+  if (!_failed_aors.empty())
+  {
+    // Can't connect to memcached, return 500.  This will lead to an
+    // inconsistency between the HSS and Sprout, as Sprout will have changed
+    // some of the AoRs, but HSS will believe they all failed.  Sprout accepts
+    // changes to AoRs that don't exist though.
+    return HTTP_SERVER_ERROR;
+  }
+
+  return HTTP_OK;
+}
+
+/// Returns the number of workers to process a number of work items with.
+size_t DeregistrationTask::num_workers(size_t work_items)
+{
+  if (_cfg->_worker_pool == NULL)
+  {
+    return std::min((size_t)1, work_items);
+  }
+
+  return std::min((size_t)std::max(_cfg->_max_workers, 1), work_items);
+}
+
+/// Runs a worker on a number of the shared pool's threads.
+void DeregistrationTask::start_pool_workers(void (DeregistrationTask::*worker)(),
+                                            size_t num_workers)
+{
+  if (num_workers == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _pool_workers_running += num_workers;
+  pthread_mutex_unlock(&_lock);
 
-  for (std::map<std::string, std::string>::iterator it=_bindings.begin();
-       it!=_bindings.end();
-       ++it)
+  for (size_t ii = 0; ii < num_workers; ++ii)
   {
+    _cfg->_worker_pool->run(std::bind(worker, this),
+                            [this]()
+                            {
+                              pthread_mutex_lock(&_lock);
+                              --_pool_workers_running;
+                              pthread_cond_broadcast(&_workers_cond);
+                              pthread_cond_signal(&_remote_cond);
+                              pthread_mutex_unlock(&_lock);
+                            });
+  }
+}
+
+/// Waits until all the workers started on the shared pool have finished.
+void DeregistrationTask::wait_for_pool_workers()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_pool_workers_running > 0)
+  {
+    pthread_cond_wait(&_workers_cond, &_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void DeregistrationTask::deregister_aors()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_next_binding == _bindings.end())
+    {
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+
+    std::string aor_id = _next_binding->first;
+    std::string private_id = _next_binding->second;
+    ++_next_binding;
+
+    pthread_mutex_unlock(&_lock);
+
+    std::set<std::string> impis;
     SubscriberDataManager::AoRPair* aor_pair =
       deregister_bindings(_cfg->_sdm,
-                          it->first,
-                          it->second,
+                          aor_id,
+                          private_id,
                           NULL,
                           _cfg->_remote_sdm,
-                          impis_to_delete);
+                          impis);
 
-    // LCOV_EXCL_START
-    if ((aor_pair != NULL) &&
-        (aor_pair->get_current() != NULL))
+    bool success = ((aor_pair != NULL) &&
+                    (aor_pair->get_current() != NULL));
+
+    if (!success)
     {
-      // If we have a remote store, try to store this there too.  We don't worry
-      // about failures in this case.
-      if (_cfg->_remote_sdm != NULL)
-      {
-        SubscriberDataManager::AoRPair* remote_aor_pair =
-          deregister_bindings(_cfg->_remote_sdm,
-                              it->first,
-                              it->second,
-                              aor_pair,
-                              NULL,
-                              impis_to_delete);
-        delete remote_aor_pair;
-      }
+      TRC_WARNING("Unable to connect to memcached for AoR %s", aor_id.c_str());
+      delete aor_pair; aor_pair = NULL;
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    if (success)
+    {
+      // Only delete the IMPIs of bindings we have actually removed.
+      _impis_to_delete.insert(impis.begin(), impis.end());
     }
-    // LCOV_EXCL_STOP
     else
     {
-      // Can't connect to memcached, return 500. If this isn't the first AoR being edited
-      // then this will lead to an inconsistency between the HSS and Sprout, as
-      // Sprout will have changed some of the AoRs, but HSS will believe they all failed.
-      // Sprout accepts changes to AoRs that don't exist though.
-      TRC_WARNING("Unable to connect to memcached for AoR %s", it->first.c_str());
+      _failed_aors.push_back(aor_id);
+    }
+
+    if (++_aors_processed % PROGRESS_LOG_INTERVAL == 0)
+    {
+      TRC_INFO("Deregistered %d of %d AoRs", _aors_processed, _bindings.size());
+    }
+
+    pthread_mutex_unlock(&_lock);
 
+    if ((aor_pair != NULL) && (_cfg->_replicator != NULL))
+    {
+      // Hand the AoR to the replicator, which writes it to the remote store
+      // in the background.
+      _cfg->_replicator->replicate(aor_id, aor_pair, trail());
       delete aor_pair;
-      return HTTP_SERVER_ERROR;
     }
+    else if ((aor_pair != NULL) && (_cfg->_remote_sdm != NULL))
+    {
+      // If we have a remote store, try to store this there too.  We don't
+      // worry about failures in this case.
+      queue_remote_write(aor_id, private_id, aor_pair); // LCOV_EXCL_LINE
+    }
+    else
+    {
+      delete aor_pair;
+    }
+  }
+}
 
+// LCOV_EXCL_START - remote store not tested in UT
+void DeregistrationTask::queue_remote_write(const std::string& aor_id,
+                                           const std::string& private_id,
+                                           SubscriberDataManager::AoRPair* aor_pair)
+{
+  if (!_remote_writer_running)
+  {
+    // There's no thread to hand the write to, so do it ourselves.
+    std::set<std::string> impis;
+    SubscriberDataManager::AoRPair* remote_aor_pair =
+      deregister_bindings(_cfg->_remote_sdm,
+                          aor_id,
+                          private_id,
+                          aor_pair,
+                          NULL,
+                          impis);
+    delete remote_aor_pair;
     delete aor_pair;
+    return;
   }
 
-  // Delete IMPIs from the store.
-  for(std::set<std::string>::iterator impi = impis_to_delete.begin();
-      impi != impis_to_delete.end();
-      ++impi)
+  RemoteWrite write;
+  write.aor_id = aor_id;
+  write.private_id = private_id;
+  write.aor_pair = aor_pair;
+
+  pthread_mutex_lock(&_lock);
+
+  // Don't let the local site get too far ahead of the remote one.
+  while (_remote_writes.size() >= MAX_REMOTE_BACKLOG)
   {
-    TRC_DEBUG("Delete %s from the IMPI store", impi->c_str());
+    pthread_cond_wait(&_remote_space_cond, &_lock);
+  }
+
+  _remote_writes.push_back(write);
+  pthread_cond_signal(&_remote_cond);
+  pthread_mutex_unlock(&_lock);
+}
 
-    Store::Status store_rc = Store::OK;
-    ImpiStore::Impi* impi_obj = NULL;
+void DeregistrationTask::write_to_remote()
+{
+  pthread_mutex_lock(&_lock);
 
-    do
+  while (true)
+  {
+    while ((_remote_writes.empty()) && (_pool_workers_running > 0))
     {
-      // Free any IMPI we had from the last loop iteration.
-      delete impi_obj; impi_obj = NULL;
+      pthread_cond_wait(&_remote_cond, &_lock);
+    }
 
-      impi_obj = _cfg->_impi_store->get_impi(*impi, _trail);
+    if (_remote_writes.empty())
+    {
+      break;
+    }
 
-      if (impi_obj != NULL)
-      {
-        store_rc = _cfg->_impi_store->delete_impi(impi_obj, _trail);
-      }
+    RemoteWrite write = _remote_writes.front();
+    _remote_writes.pop_front();
+    pthread_cond_broadcast(&_remote_space_cond);
+
+    pthread_mutex_unlock(&_lock);
+
+    std::set<std::string> impis;
+    SubscriberDataManager::AoRPair* remote_aor_pair =
+      deregister_bindings(_cfg->_remote_sdm,
+                          write.aor_id,
+                          write.private_id,
+                          write.aor_pair,
+                          NULL,
+                          impis);
+    bool success = (remote_aor_pair != NULL);
+    delete remote_aor_pair;
+    delete write.aor_pair;
+
+    pthread_mutex_lock(&_lock);
+
+    if (success)
+    {
+      _impis_to_delete.insert(impis.begin(), impis.end());
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+// LCOV_EXCL_STOP
+
+void DeregistrationTask::delete_impis()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_next_impi == _impis_to_delete.end())
+    {
+      pthread_mutex_unlock(&_lock);
+      break;
     }
-    while ((impi_obj != NULL) && (store_rc == Store::DATA_CONTENTION));
 
+    std::string impi = *_next_impi;
+    ++_next_impi;
+
+    pthread_mutex_unlock(&_lock);
+
+    delete_impi(impi);
+  }
+}
+
+void DeregistrationTask::delete_impi(const std::string& impi)
+{
+  TRC_DEBUG("Delete %s from the IMPI store", impi.c_str());
+
+  Store::Status store_rc = Store::OK;
+  ImpiStore::Impi* impi_obj = NULL;
+
+  do
+  {
+    // Free any IMPI we had from the last loop iteration.
     delete impi_obj; impi_obj = NULL;
+
+    impi_obj = _cfg->_impi_store->get_impi(impi, _trail);
+
+    if (impi_obj != NULL)
+    {
+      store_rc = _cfg->_impi_store->delete_impi(impi_obj, _trail);
+    }
   }
+  while ((impi_obj != NULL) && (store_rc == Store::DATA_CONTENTION));
 
-  return HTTP_OK;
+  delete impi_obj; impi_obj = NULL;
+}
+
+// Build a JSON body reporting how many AoRs were processed and listing any
+// that could not be deregistered, so that the HSS can retry just those.
+std::string DeregistrationTask::build_response_body()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("processed");
+    writer.Uint((unsigned int)_aors_processed);
+
+    writer.String("failed");
+    writer.StartArray();
+    {
+      for (std::vector<std::string>::const_iterator aor = _failed_aors.begin();
+           aor != _failed_aors.end();
+           ++aor)
+      {
+        writer.StartObject();
+        writer.String("primary-impu"); writer.String(aor->c_str());
+        writer.EndObject();
+      }
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
 }
 
 SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
@@ -528,6 +903,7 @@ SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
   bool all_bindings_expired = false;
   Store::Status set_rc;
   std::vector<std::string> impis_to_dereg;
+  AoRWriteSerializer::Write write(current_sdm->write_serializer(), aor_id);
 
   do
   {
@@ -582,7 +958,9 @@ SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
       delete aor_pair; aor_pair = NULL;
     }
   }
-  while (set_rc == Store::DATA_CONTENTION);
+  while (write.retry(set_rc));
+
+  write.finish();
 
   if (private_id == "")
   {
@@ -687,3 +1065,17 @@ HTTPCode AuthTimeoutTask::handle_response(std::string body)
 
   return success ? HTTP_OK : HTTP_SERVER_ERROR;
 }
+
+void LatencyBreakdownTask::run()
+{
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(_cfg->_breakdown->to_json());
+  send_http_reply(HTTP_OK);
+  delete this;
+}
@@ -0,0 +1,294 @@
+/**
+ * @file hss_answer_cache.cpp Cache of HSS answers used for S-CSCF selection.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <algorithm>
+
+#include "log.h"
+#include "hss_answer_cache.h"
+
+HSSAnswerCache::HSSAnswerCache(int ttl_ms,
+                               size_t max_entries,
+                               SNMP::CounterTable* hits_tbl,
+                               SNMP::CounterTable* misses_tbl,
+                               SNMP::CounterTable* invalidations_tbl) :
+  _ttl_ms(ttl_ms),
+  _max_entries(max_entries),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl),
+  _invalidations_tbl(invalidations_tbl),
+  _cache(),
+  _expiry_order()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+HSSAnswerCache::~HSSAnswerCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+std::string HSSAnswerCache::uar_key(const std::string& impi,
+                                    const std::string& impu,
+                                    const std::string& visited_network,
+                                    const std::string& auth_type)
+{
+  // None of the fields can contain a newline (they come from single SIP
+  // header values), so use that as the separator.
+  return "UAR\n" + impi + "\n" + impu + "\n" + visited_network + "\n" + auth_type;
+}
+
+
+std::string HSSAnswerCache::lir_key(const std::string& impu, bool originating)
+{
+  return std::string(originating ? "LIR-orig\n" : "LIR-term\n") + impu;
+}
+
+
+bool HSSAnswerCache::get(const std::string& key, Answer& answer)
+{
+  bool found = false;
+  unsigned long now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  // Discard any expired answers.
+  while (!_expiry_order.empty())
+  {
+    std::map<std::string, Entry>::iterator oldest =
+                                       _cache.find(_expiry_order.front());
+    if (oldest->second.expiry_ms > now)
+    {
+      break;
+    }
+    erase(oldest);
+  }
+
+  std::map<std::string, Entry>::const_iterator it = _cache.find(key);
+  if (it != _cache.end())
+  {
+    answer = it->second.answer;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("HSS answer for %s %s in cache",
+            key.c_str(), found ? "found" : "not found");
+
+  SNMP::CounterTable* tbl = found ? _hits_tbl : _misses_tbl;
+  if (tbl != NULL)
+  {
+    tbl->increment();
+  }
+
+  return found;
+}
+
+
+void HSSAnswerCache::put(const std::string& key, const Answer& answer)
+{
+  unsigned long expiry_ms = now_ms() + _ttl_ms;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entry>::iterator it = _cache.find(key);
+  if (it != _cache.end())
+  {
+    // Replace the existing answer, which restarts its TTL.
+    erase(it);
+  }
+  else if (_cache.size() >= _max_entries)
+  {
+    TRC_DEBUG("HSS answer cache full, discarding oldest answer");
+    erase(_cache.find(_expiry_order.front()));
+  }
+
+  Entry& entry = _cache[key];
+  entry.answer = answer;
+  entry.expiry_ms = expiry_ms;
+  entry.order_it = _expiry_order.insert(_expiry_order.end(), key);
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void HSSAnswerCache::invalidate(const std::string& key)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Entry>::iterator it = _cache.find(key);
+  if (it != _cache.end())
+  {
+    erase(it);
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (found)
+  {
+    TRC_DEBUG("Invalidated HSS answer for %s", key.c_str());
+
+    if (_invalidations_tbl != NULL)
+    {
+      _invalidations_tbl->increment();
+    }
+  }
+}
+
+
+size_t HSSAnswerCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _cache.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void HSSAnswerCache::save(WarmStartSnapshot::Writer& writer)
+{
+  unsigned long now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  // Answers are written oldest first, so that they can be restored in
+  // expiry order.
+  writer.put_u32(_cache.size());
+
+  for (std::list<std::string>::const_iterator i = _expiry_order.begin();
+       i != _expiry_order.end();
+       ++i)
+  {
+    const Entry& entry = _cache.find(*i)->second;
+    const ServerCapabilities& caps = entry.answer.caps;
+
+    writer.put_string(*i);
+    writer.put_u32((entry.expiry_ms > now) ? (entry.expiry_ms - now) : 0);
+    writer.put_u32(entry.answer.queried_caps ? 1 : 0);
+    writer.put_string(caps.scscf);
+
+    writer.put_u32(caps.mandatory_caps.size());
+    for (size_t j = 0; j < caps.mandatory_caps.size(); ++j)
+    {
+      writer.put_u32(caps.mandatory_caps[j]);
+    }
+
+    writer.put_u32(caps.optional_caps.size());
+    for (size_t j = 0; j < caps.optional_caps.size(); ++j)
+    {
+      writer.put_u32(caps.optional_caps[j]);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void HSSAnswerCache::restore(WarmStartSnapshot::Reader& reader, int age_s)
+{
+  unsigned long now = now_ms();
+  long age_ms = (long)age_s * 1000;
+  size_t restored = 0;
+
+  uint32_t count = reader.get_u32();
+
+  pthread_mutex_lock(&_lock);
+
+  for (uint32_t i = 0; (i < count) && (!reader.failed()); ++i)
+  {
+    std::string key = reader.get_string();
+    long remaining_ms = (long)reader.get_u32() - age_ms;
+
+    Answer answer;
+    answer.queried_caps = (reader.get_u32() != 0);
+    answer.caps.scscf = reader.get_string();
+
+    uint32_t num_caps = reader.get_u32();
+    for (uint32_t j = 0; (j < num_caps) && (!reader.failed()); ++j)
+    {
+      answer.caps.mandatory_caps.push_back(reader.get_u32());
+    }
+
+    num_caps = reader.get_u32();
+    for (uint32_t j = 0; (j < num_caps) && (!reader.failed()); ++j)
+    {
+      answer.caps.optional_caps.push_back(reader.get_u32());
+    }
+
+    if ((reader.failed()) ||
+        (remaining_ms <= 0) ||
+        (_cache.size() >= _max_entries) ||
+        (_cache.find(key) != _cache.end()))
+    {
+      continue;
+    }
+
+    // Don't keep answers for longer than the current TTL, in case it has
+    // been reduced since the snapshot was taken.
+    Entry& entry = _cache[key];
+    entry.answer = answer;
+    entry.expiry_ms = now + std::min(remaining_ms, (long)_ttl_ms);
+    entry.order_it = _expiry_order.insert(_expiry_order.end(), key);
+    ++restored;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_STATUS("Restored %ld of %u HSS answers from warm-start snapshot",
+             restored, count);
+}
+
+
+/// Removes an entry.  Must be called with the lock held.
+void HSSAnswerCache::erase(std::map<std::string, Entry>::iterator it)
+{
+  _expiry_order.erase(it->second.order_it);
+  _cache.erase(it);
+}
+
+
+unsigned long HSSAnswerCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -45,6 +45,7 @@
 #include "sproutsasevent.h"
 #include "httpconnection.h"
 #include "hssconnection.h"
+#include "latency_breakdown.h"
 #include "rapidjson/error/en.h"
 #include "snmp_continuous_accumulator_table.h"
 
@@ -76,6 +77,7 @@ HSSConnection::HSSConnection(const std::string& server,
                            load_monitor,
                            SASEvent::HttpLogLevel::PROTOCOL,
                            comm_monitor)),
+  _coalescer(),
   _latency_tbl(homestead_overall_latency_tbl),
   _mar_latency_tbl(homestead_mar_latency_tbl),
   _sar_latency_tbl(homestead_sar_latency_tbl),
@@ -157,7 +159,7 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
                                         SAS::TrailId trail)
 {
   std::string json_data;
-  HTTPCode rc = _http->send_get(path, json_data, "", trail);
+  HTTPCode rc = send_get(path, json_data, trail);
 
   if (rc == HTTP_OK)
   {
@@ -208,6 +210,7 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
                                            rapidxml::xml_document<>*& root,
                                            SAS::TrailId trail)
 {
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::HSS);
   std::string raw_data;
   std::map<std::string, std::string> rsp_headers;
   std::vector<std::string> req_headers;
@@ -217,12 +220,28 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
     req_headers.push_back("Cache-control: no-cache");
   }
 
-  HTTPCode http_code = _http->send_put(path,
-                                       rsp_headers,
-                                       raw_data,
-                                       body,
-                                       req_headers,
-                                       trail);
+  HttpRequestCoalescer::Request request =
+    [&](std::string& response)
+    {
+      return _http->send_put(path,
+                             rsp_headers,
+                             response,
+                             body,
+                             req_headers,
+                             trail);
+    };
+  HTTPCode http_code;
+
+  if (cache_allowed)
+  {
+    // Homestead may answer this from its cache, so an identical PUT that is
+    // already in flight will get the same answer.
+    http_code = _coalescer.send("PUT " + path + "\n" + body, request, raw_data);
+  }
+  else
+  {
+    http_code = request(raw_data);
+  }
 
   if (http_code == HTTP_OK)
   {
@@ -233,6 +252,30 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
 }
 
 
+HTTPCode HSSConnection::send_get(const std::string& path,
+                                 std::string& response,
+                                 SAS::TrailId trail)
+{
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::HSS);
+  HttpRequestCoalescer::Request request =
+    [&](std::string& rsp)
+    {
+      return _http->send_get(path, rsp, "", trail);
+    };
+
+  // Every authentication challenge must use a fresh vector, so requests for
+  // vectors (/impi/<impi>/av...) are never coalesced.  The IMPI is escaped,
+  // so can't contain "/av" itself.
+  if ((path.compare(0, 6, "/impi/") == 0) &&
+      (path.find("/av", 6) != std::string::npos))
+  {
+    return request(response);
+  }
+
+  return _coalescer.send("GET " + path, request, response);
+}
+
+
 /// Retrieve an XML object from a path on the server. Caller is responsible for deleting.
 HTTPCode HSSConnection::get_xml_object(const std::string& path,
                                        rapidxml::xml_document<>*& root,
@@ -240,7 +283,7 @@ HTTPCode HSSConnection::get_xml_object(const std::string& path,
 {
   std::string raw_data;
 
-  HTTPCode http_code = _http->send_get(path, raw_data, "", trail);
+  HTTPCode http_code = send_get(path, raw_data, trail);
 
   if (http_code == HTTP_OK)
   {
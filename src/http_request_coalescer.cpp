@@ -0,0 +1,117 @@
+/**
+ * @file http_request_coalescer.cpp Coalesces identical concurrent HTTP requests.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "log.h"
+#include "http_request_coalescer.h"
+
+HttpRequestCoalescer::HttpRequestCoalescer() :
+  _in_flight(),
+  _coalesced_count(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+HttpRequestCoalescer::~HttpRequestCoalescer()
+{
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+HTTPCode HttpRequestCoalescer::send(const std::string& key,
+                                    const Request& request,
+                                    std::string& response)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, std::shared_ptr<InFlight> >::iterator it =
+                                                          _in_flight.find(key);
+
+  if (it != _in_flight.end())
+  {
+    // There's an identical request in flight, so wait for its response.  Hold
+    // a reference to the request, as the sender removes it from the map when
+    // it completes.
+    std::shared_ptr<InFlight> in_flight = it->second;
+    ++_coalesced_count;
+    TRC_DEBUG("Waiting for in-flight request %s", key.c_str());
+
+    while (!in_flight->complete)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    HTTPCode rc = in_flight->rc;
+    response = in_flight->response;
+    pthread_mutex_unlock(&_lock);
+
+    return rc;
+  }
+
+  std::shared_ptr<InFlight> in_flight(new InFlight());
+  _in_flight[key] = in_flight;
+  pthread_mutex_unlock(&_lock);
+
+  HTTPCode rc = request(response);
+
+  pthread_mutex_lock(&_lock);
+  _in_flight.erase(key);
+
+  if (!in_flight.unique())
+  {
+    // Other threads are waiting for this response.
+    in_flight->complete = true;
+    in_flight->rc = rc;
+    in_flight->response = response;
+    pthread_cond_broadcast(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return rc;
+}
+
+
+uint64_t HttpRequestCoalescer::coalesced_count()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t count = _coalesced_count;
+  pthread_mutex_unlock(&_lock);
+
+  return count;
+}
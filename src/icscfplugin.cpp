@@ -58,6 +58,8 @@ private:
   ICSCFSproutlet* _icscf_sproutlet;
   ACRFactory* _acr_factory;
   SCSCFSelector* _scscf_selector;
+  int _dns_prefetch_source;
+  bool _warm_start_section;
 };
 
 /// Export the plug-in using the magic symbol "sproutlet_plugin"
@@ -68,7 +70,9 @@ ICSCFPlugin sproutlet_plugin;
 ICSCFPlugin::ICSCFPlugin() :
   _icscf_sproutlet(NULL),
   _acr_factory(NULL),
-  _scscf_selector(NULL)
+  _scscf_selector(NULL),
+  _dns_prefetch_source(-1),
+  _warm_start_section(false)
 {
 }
 
@@ -88,7 +92,9 @@ bool ICSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 
     // Create the I-CSCF ACR factory.
     _acr_factory = (ralf_processor != NULL) ?
-                        (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::ICSCF) :
+                        (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                        ACR::ICSCF,
+                                                        opt.deferred_acrs) :
                         new ACRFactory();
 
     // Create the I-CSCF sproutlet.
@@ -99,10 +105,35 @@ bool ICSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                           _acr_factory,
                                           _scscf_selector,
                                           enum_service,
-                                          opt.override_npdi);
+                                          opt.override_npdi,
+                                          opt.icscf_hss_cache_ttl_ms);
     _icscf_sproutlet->init();
 
     sproutlets.push_back(_icscf_sproutlet);
+
+    if (stack_data.dns_prefetcher != NULL)
+    {
+      // Keep the DNS records for the configured S-CSCFs warm.
+      _dns_prefetch_source = stack_data.dns_prefetcher->add_source(
+                               std::bind(&SCSCFSelector::get_all_scscfs, _scscf_selector));
+    }
+
+    HSSAnswerCache* hss_cache = _icscf_sproutlet->get_hss_cache();
+
+    if ((stack_data.warm_start_snapshot != NULL) && (hss_cache != NULL))
+    {
+      // Save the cached HSS answers across restarts.
+      stack_data.warm_start_snapshot->add_section(
+                   WarmStartSnapshot::SECTION_HSS_ANSWERS,
+                   std::bind(&HSSAnswerCache::save,
+                             hss_cache,
+                             std::placeholders::_1),
+                   std::bind(&HSSAnswerCache::restore,
+                             hss_cache,
+                             std::placeholders::_1,
+                             std::placeholders::_2));
+      _warm_start_section = true;
+    }
   }
 
   return plugin_loaded;
@@ -111,6 +142,16 @@ bool ICSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 /// Unloads the I-CSCF plug-in.
 void ICSCFPlugin::unload()
 {
+  if (_dns_prefetch_source != -1)
+  {
+    stack_data.dns_prefetcher->remove_source(_dns_prefetch_source);
+  }
+
+  if (_warm_start_section)
+  {
+    stack_data.warm_start_snapshot->remove_section(WarmStartSnapshot::SECTION_HSS_ANSWERS);
+  }
+
   delete _icscf_sproutlet;
   delete _acr_factory;
   delete _scscf_selector;
@@ -57,14 +57,19 @@ ICSCFRouter::ICSCFRouter(HSSConnection* hss,
                          SCSCFSelector* scscf_selector,
                          SAS::TrailId trail,
                          ACR* acr,
-                         int port) :
+                         int port,
+                         HSSAnswerCache* cache) :
   _hss(hss),
   _scscf_selector(scscf_selector),
   _trail(trail),
   _acr(acr),
   _port(port),
+  _cache(cache),
+  _cached_key(),
   _queried_caps(false),
   _hss_rsp(),
+  _hss_queried(false),
+  _hss_query_status(PJSIP_SC_OK),
   _attempted_scscfs()
 {
 }
@@ -90,7 +95,18 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri, bool
   std::string scscf;
   scscf_sip_uri = NULL;
 
-  if (!_queried_caps)
+  if (_hss_queried)
+  {
+    // The HSS has already been queried, so use the result.
+    status_code = _hss_query_status;
+    _hss_queried = false;
+
+    if (do_billing)
+    {
+      _acr->send();
+    }
+  }
+  else if (!_queried_caps)
   {
     // Do the HSS query.
     status_code = hss_query();
@@ -203,6 +219,71 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri, bool
 }
 
 
+/// Queries the HSS, if get_scscf would, and saves the result for the next
+/// call to get_scscf.
+void ICSCFRouter::query_hss()
+{
+  if (!_queried_caps)
+  {
+    _hss_query_status = hss_query();
+    _hss_queried = true;
+  }
+}
+
+
+/// Discards the cached HSS answer used to select the S-CSCF, so that the
+/// next request for the subscriber queries the HSS again.
+void ICSCFRouter::invalidate_cached_answer()
+{
+  if (!_cached_key.empty())
+  {
+    _cache->invalidate(_cached_key);
+    _cached_key.clear();
+  }
+}
+
+
+/// Uses a cached HSS answer in place of querying the HSS.
+///
+/// @param key           - The cache key of the query.
+///
+/// @return              - Whether a cached answer was found.
+bool ICSCFRouter::use_cached_answer(const std::string& key)
+{
+  HSSAnswerCache::Answer answer;
+
+  if (!_cache->get(key, answer))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Using cached HSS answer");
+  _hss_rsp = answer.caps;
+  _queried_caps = answer.queried_caps;
+  _cached_key = key;
+
+  if (_acr != NULL)
+  {
+    // Pass the server capabilities to the ACR for reporting, as if they had
+    // come from the HSS.
+    _acr->server_capabilities(_hss_rsp);
+  }
+
+  return true;
+}
+
+
+/// Caches the most recently parsed HSS answer.
+void ICSCFRouter::cache_answer(const std::string& key)
+{
+  HSSAnswerCache::Answer answer;
+  answer.caps = _hss_rsp;
+  answer.queried_caps = _queried_caps;
+  _cache->put(key, answer);
+  _cached_key = key;
+}
+
+
 /// Parses the response from the HSS.
 int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps)
 {
@@ -317,8 +398,9 @@ ICSCFUARouter::ICSCFUARouter(HSSConnection* hss,
                              const std::string& impi,
                              const std::string& impu,
                              const std::string& visited_network,
-                             const std::string& auth_type) :
-  ICSCFRouter(hss, scscf_selector, trail, acr, port),
+                             const std::string& auth_type,
+                             HSSAnswerCache* cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, port, cache),
   _impi(impi),
   _impu(impu),
   _visited_network(visited_network),
@@ -340,6 +422,18 @@ int ICSCFUARouter::hss_query()
   // capabilities this time.
   std::string auth_type = (_hss_rsp.scscf.empty()) ? _auth_type : "CAPAB";
 
+  // Answers to queries which force capabilities are never cached, as these
+  // are only made when retrying after an S-CSCF has failed.
+  std::string key;
+  if ((_cache != NULL) && (auth_type != "CAPAB"))
+  {
+    key = HSSAnswerCache::uar_key(_impi, _impu, _visited_network, auth_type);
+    if (use_cached_answer(key))
+    {
+      return PJSIP_SC_OK;
+    }
+  }
+
   TRC_DEBUG("Perform UAR - impi %s, impu %s, vn %s, auth_type %s",
             _impi.c_str(), _impu.c_str(),
             _visited_network.c_str(), auth_type.c_str());
@@ -378,6 +472,10 @@ int ICSCFUARouter::hss_query()
       // REGISTER requests.
       status_code = PJSIP_SC_FORBIDDEN;
     }
+    else if ((status_code == PJSIP_SC_OK) && (!key.empty()))
+    {
+      cache_answer(key);
+    }
   }
 
   delete rsp;
@@ -392,8 +490,9 @@ ICSCFLIRouter::ICSCFLIRouter(HSSConnection* hss,
                              ACR* acr,
                              int port,
                              const std::string& impu,
-                             bool originating) :
-  ICSCFRouter(hss, scscf_selector, trail, acr, port),
+                             bool originating,
+                             HSSAnswerCache* cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, port, cache),
   _impu(impu),
   _originating(originating)
 {
@@ -414,6 +513,18 @@ int ICSCFLIRouter::hss_query()
   // capabilities this time.
   std::string auth_type = (_hss_rsp.scscf.empty()) ? "" : "CAPAB";
 
+  // Answers to queries which force capabilities are never cached, as these
+  // are only made when retrying after an S-CSCF has failed.
+  std::string key;
+  if ((_cache != NULL) && (auth_type.empty()))
+  {
+    key = HSSAnswerCache::lir_key(_impu, _originating);
+    if (use_cached_answer(key))
+    {
+      return PJSIP_SC_OK;
+    }
+  }
+
   TRC_DEBUG("Perform LIR - impu %s, originating %s, auth_type %s",
             _impu.c_str(),
             (_originating) ? "true" : "false",
@@ -443,6 +554,11 @@ int ICSCFLIRouter::hss_query()
   {
     // HSS returned a well-formed response, so parse it.
     status_code = parse_hss_response(rsp, auth_type == "CAPAB");
+
+    if ((status_code == PJSIP_SC_OK) && (!key.empty()))
+    {
+      cache_answer(key);
+    }
   }
 
   delete rsp;
@@ -57,6 +57,7 @@ extern "C" {
 #include "constants.h"
 #include "uri_classifier.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
+#include "sharded_stats.h"
 
 /// Define a constant for the maximum number of ENUM lookups
 /// we want to do in I-CSCF termination processing.
@@ -70,7 +71,8 @@ ICSCFSproutlet::ICSCFSproutlet(const std::string& icscf_name,
                                ACRFactory* acr_factory,
                                SCSCFSelector* scscf_selector,
                                EnumService* enum_service,
-                               bool override_npdi) :
+                               bool override_npdi,
+                               int hss_cache_ttl_ms) :
   Sproutlet(icscf_name, port),
   _bgcf_uri(NULL),
   _hss(hss),
@@ -78,12 +80,33 @@ ICSCFSproutlet::ICSCFSproutlet(const std::string& icscf_name,
   _acr_factory(acr_factory),
   _enum_service(enum_service),
   _override_npdi(override_npdi),
+  _hss_cache(NULL),
+  _hss_cache_hits_tbl(NULL),
+  _hss_cache_misses_tbl(NULL),
+  _hss_cache_invalidations_tbl(NULL),
   _bgcf_uri_str(bgcf_uri)
 {
-  _incoming_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("icscf_incoming_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.18");
-  _outgoing_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("icscf_outgoing_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.19");
+  _incoming_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("icscf_incoming_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.18"));
+  _outgoing_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("icscf_outgoing_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.19"));
+
+  if (hss_cache_ttl_ms > 0)
+  {
+    _hss_cache_hits_tbl = SNMP::CounterTable::create("icscf_hss_cache_hits",
+                                                     "1.2.826.0.1.1578918.9.3.40");
+    _hss_cache_misses_tbl = SNMP::CounterTable::create("icscf_hss_cache_misses",
+                                                       "1.2.826.0.1.1578918.9.3.41");
+    _hss_cache_invalidations_tbl = SNMP::CounterTable::create("icscf_hss_cache_invalidations",
+                                                              "1.2.826.0.1.1578918.9.3.42");
+    _hss_cache = new HSSAnswerCache(hss_cache_ttl_ms,
+                                    HSSAnswerCache::DEFAULT_MAX_ENTRIES,
+                                    _hss_cache_hits_tbl,
+                                    _hss_cache_misses_tbl,
+                                    _hss_cache_invalidations_tbl);
+  }
 }
 
 
@@ -92,6 +115,10 @@ ICSCFSproutlet::~ICSCFSproutlet()
 {
   delete _incoming_sip_transactions_tbl;
   delete _outgoing_sip_transactions_tbl;
+  delete _hss_cache;
+  delete _hss_cache_hits_tbl;
+  delete _hss_cache_misses_tbl;
+  delete _hss_cache_invalidations_tbl;
 }
 
 bool ICSCFSproutlet::init()
@@ -262,9 +289,22 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
                                             impi,
                                             impu,
                                             visited_network,
-                                            auth_type);
+                                            auth_type,
+                                            _icscf->get_hss_cache());
+
+  // Query the HSS without holding up the worker thread.  Nothing else uses
+  // the router until the query completes, so it's safe to use it from
+  // another thread.
+  ICSCFRouter* router = _router;
+  run_async((void*)req, [router]() { router->query_hss(); });
+}
 
-  // We have a router, query it for an S-CSCF to use.
+
+void ICSCFSproutletRegTsx::on_async_complete(void* context)
+{
+  pjsip_msg* req = (pjsip_msg*)context;
+
+  // The HSS has been queried, so query the router for an S-CSCF to use.
   pjsip_sip_uri* scscf_sip_uri = NULL;
   pjsip_status_code status_code =
     (pjsip_status_code)_router->get_scscf(get_pool(req), scscf_sip_uri);
@@ -335,6 +375,10 @@ void ICSCFSproutletRegTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
     event.add_var_param(st_code);
     SAS::report_event(event);
 
+    // The HSS answer which selected this S-CSCF may be out of date, so make
+    // sure later requests don't use it.
+    _router->invalidate_cached_answer();
+
     // Now we can simply reuse the UA router we made on the initial request.
     pjsip_sip_uri* scscf_sip_uri = NULL;
     pjsip_msg* req = original_request();
@@ -549,7 +593,8 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
                                             _acr,
                                             _icscf->port(),
                                             impu,
-                                            _originating);
+                                            _originating,
+                                            _icscf->get_hss_cache());
 
   pjsip_sip_uri* scscf_sip_uri = NULL;
 
@@ -730,6 +775,10 @@ void ICSCFSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
     event.add_var_param(st_code);
     SAS::report_event(event);
 
+    // The HSS answer which selected this S-CSCF may be out of date, so make
+    // sure later requests don't use it.
+    _router->invalidate_cached_answer();
+
     // Now we can simply reuse the UA router we made on the initial request.
     pjsip_sip_uri* scscf_sip_uri = NULL;
     pjsip_msg* req = original_request();
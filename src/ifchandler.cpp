@@ -686,9 +686,98 @@ AsInvocation Ifc::as_invocation() const
 }
 
 
+/// Adds a string to a running FNV-1a fingerprint.
+static uint64_t fingerprint_add(uint64_t hash, const char* str, size_t len)
+{
+  for (size_t ii = 0; ii < len; ++ii)
+  {
+    hash ^= (unsigned char)str[ii];
+    hash *= 0x100000001b3ULL;
+  }
+
+  // Separate this string from the next.
+  hash ^= 0xff;
+  hash *= 0x100000001b3ULL;
+
+  return hash;
+}
+
+
+/// Adds an XML node, its attributes and its children to a running FNV-1a
+/// fingerprint.
+static uint64_t fingerprint_node(uint64_t hash, xml_node<>* node)
+{
+  hash = fingerprint_add(hash, node->name(), node->name_size());
+  hash = fingerprint_add(hash, node->value(), node->value_size());
+
+  for (rapidxml::xml_attribute<>* attr = node->first_attribute();
+       attr;
+       attr = attr->next_attribute())
+  {
+    hash = fingerprint_add(hash, attr->name(), attr->name_size());
+    hash = fingerprint_add(hash, attr->value(), attr->value_size());
+  }
+
+  for (xml_node<>* child = node->first_node();
+       child;
+       child = child->next_sibling())
+  {
+    hash = fingerprint_node(hash, child);
+  }
+
+  // Mark the end of this node's children.
+  hash ^= 0xfe;
+  hash *= 0x100000001b3ULL;
+
+  return hash;
+}
+
+
+/// Adds this iFC to a running FNV-1a fingerprint.  The fingerprint covers
+/// the whole iFC, including its priority and application server details.
+uint64_t Ifc::fingerprint(uint64_t hash) const
+{
+  return fingerprint_node(hash, _ifc);
+}
+
+
+/// Checks whether any service point trigger in this iFC looks at the
+/// contents of the message.  Method and SessionCase triggers are fixed for
+/// third-party registration (the method is always REGISTER and the session
+/// case always originating registered), so don't count.
+bool Ifc::register_match_uses_message() const
+{
+  xml_node<>* trigger = _ifc->first_node("TriggerPoint");
+
+  if (trigger == NULL)
+  {
+    return false;
+  }
+
+  for (xml_node<>* spt = trigger->first_node("SPT");
+       spt;
+       spt = spt->next_sibling("SPT"))
+  {
+    if ((spt->first_node("SIPHeader") != NULL) ||
+        (spt->first_node("RequestURI") != NULL) ||
+        (spt->first_node("SessionDescription") != NULL))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+const uint64_t Ifcs::FINGERPRINT_BASIS;
+
+
 /// Construct an empty set of iFCs.
 Ifcs::Ifcs() :
-  _ifc_doc(NULL)
+  _ifc_doc(NULL),
+  _fingerprint(FINGERPRINT_BASIS),
+  _register_match_uses_message(false)
 {
 }
 
@@ -697,7 +786,9 @@ Ifcs::Ifcs() :
 //
 // If there are any errors, yields an empty iFC doc (but does not fail).
 Ifcs::Ifcs(std::shared_ptr<xml_document<> > ifc_doc, xml_node<>* sp) :
-  _ifc_doc(ifc_doc)
+  _ifc_doc(ifc_doc),
+  _fingerprint(FINGERPRINT_BASIS),
+  _register_match_uses_message(false)
 {
   // List sorted by priority (smallest should be handled first).
   // Priority is xs:int restricted to be positive, i.e., 0..2147483647.
@@ -727,11 +818,16 @@ Ifcs::Ifcs(std::shared_ptr<xml_document<> > ifc_doc, xml_node<>* sp) :
       }
     }
 
+    // Work out the fingerprint and whether REGISTER matching looks at the
+    // message now, rather than on every third-party registration.
     for (std::multimap<int32_t, Ifc>::iterator it = ifc_map.begin();
          it != ifc_map.end();
          ++it)
     {
       _ifcs.push_back(it->second);
+      _fingerprint = it->second.fingerprint(_fingerprint);
+      _register_match_uses_message = (_register_match_uses_message ||
+                                      it->second.register_match_uses_message());
     }
   }
   else
@@ -0,0 +1,318 @@
+/**
+ * @file latency_breakdown.cpp Breaks down message processing latency by phase.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "log.h"
+#include "sproutsasevent.h"
+#include "latency_breakdown.h"
+
+const int LatencyHistogram::SUB_BUCKET_BITS;
+const int LatencyHistogram::SUB_BUCKETS;
+const int LatencyHistogram::NUM_BUCKETS;
+
+LatencyHistogram::LatencyHistogram() :
+  _count(0),
+  _sum_us(0),
+  _max_us(0)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _counts[ii] = 0;
+  }
+}
+
+
+int LatencyHistogram::bucket_index(unsigned long value_us)
+{
+  if (value_us > 0xFFFFFFFFul)
+  {
+    value_us = 0xFFFFFFFFul;
+  }
+
+  if (value_us < (unsigned long)SUB_BUCKETS)
+  {
+    return value_us;
+  }
+
+  // Find the power of two, then use the next bits down to pick the
+  // sub-bucket.
+  int exponent = 63 - __builtin_clzl(value_us);
+  int shift = exponent - SUB_BUCKET_BITS;
+  int sub_bucket = (value_us >> shift) & (SUB_BUCKETS - 1);
+  return SUB_BUCKETS + shift * SUB_BUCKETS + sub_bucket;
+}
+
+
+unsigned long LatencyHistogram::bucket_max(int index)
+{
+  if (index < SUB_BUCKETS)
+  {
+    return index;
+  }
+
+  int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+  int sub_bucket = (index - SUB_BUCKETS) % SUB_BUCKETS;
+  unsigned long lower = (unsigned long)(SUB_BUCKETS + sub_bucket) << shift;
+  return lower + (1ul << shift) - 1;
+}
+
+
+void LatencyHistogram::record(unsigned long value_us)
+{
+  _counts[bucket_index(value_us)]++;
+  _count++;
+  _sum_us += value_us;
+
+  unsigned long max_us = _max_us.load();
+  while ((value_us > max_us) &&
+         (!_max_us.compare_exchange_weak(max_us, value_us)))
+  {
+    // max_us has been updated with the current value, so try again.
+  }
+}
+
+
+uint64_t LatencyHistogram::count() const
+{
+  return _count.load();
+}
+
+
+unsigned long LatencyHistogram::mean() const
+{
+  uint64_t count = _count.load();
+  return (count > 0) ? (_sum_us.load() / count) : 0;
+}
+
+
+unsigned long LatencyHistogram::max() const
+{
+  return _max_us.load();
+}
+
+
+unsigned long LatencyHistogram::percentile(double percent) const
+{
+  uint64_t count = _count.load();
+
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  uint64_t target = (uint64_t)ceil(count * percent / 100.0);
+  target = (target == 0) ? 1 : target;
+  uint64_t seen = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += _counts[ii].load();
+
+    if (seen >= target)
+    {
+      return std::min(bucket_max(ii), max());
+    }
+  }
+
+  // The buckets are updated separately from the count, so we can get here
+  // while a value is being recorded.
+  return max(); // LCOV_EXCL_LINE
+}
+
+
+/// The phases accumulated for the unit of work this thread is processing.
+struct PhaseTimes
+{
+  bool active;
+  unsigned long phase_us[LatencyBreakdown::NUM_PHASES];
+};
+
+static thread_local PhaseTimes phase_times = {false, {0}};
+
+LatencyBreakdown* LatencyBreakdown::_instance = NULL;
+
+LatencyBreakdown::LatencyBreakdown(const std::vector<SNMP::EventAccumulatorTable*>& phase_tbls,
+                                   unsigned long slow_request_threshold_us) :
+  _phase_tbls(phase_tbls),
+  _slow_request_threshold_us(slow_request_threshold_us)
+{
+  _phase_tbls.resize(NUM_PHASES, NULL);
+  _instance = this;
+}
+
+
+LatencyBreakdown::~LatencyBreakdown()
+{
+  _instance = NULL;
+}
+
+
+void LatencyBreakdown::start_message()
+{
+  if (_instance == NULL)
+  {
+    return;
+  }
+
+  phase_times.active = true;
+
+  for (int ii = 0; ii < NUM_PHASES; ++ii)
+  {
+    phase_times.phase_us[ii] = 0;
+  }
+}
+
+
+void LatencyBreakdown::end_message(unsigned long total_us, SAS::TrailId trail)
+{
+  if ((_instance == NULL) || (!phase_times.active))
+  {
+    return;
+  }
+
+  phase_times.active = false;
+
+  for (int ii = 0; ii < NUM_PHASES; ++ii)
+  {
+    if (phase_times.phase_us[ii] != 0)
+    {
+      _instance->record((Phase)ii, phase_times.phase_us[ii]);
+    }
+  }
+
+  if ((trail != 0) &&
+      (_instance->_slow_request_threshold_us != 0) &&
+      (total_us >= _instance->_slow_request_threshold_us))
+  {
+    TRC_DEBUG("Slow request took %luus", total_us);
+    SAS::Event event(trail, SASEvent::SLOW_REQUEST, 0);
+    event.add_static_param(total_us);
+
+    for (int ii = 0; ii < NUM_PHASES; ++ii)
+    {
+      event.add_static_param(phase_times.phase_us[ii]);
+    }
+
+    SAS::report_event(event);
+  }
+}
+
+
+void LatencyBreakdown::add(Phase phase, unsigned long elapsed_us)
+{
+  if (_instance == NULL)
+  {
+    return;
+  }
+
+  if (phase_times.active)
+  {
+    phase_times.phase_us[phase] += elapsed_us;
+  }
+  else
+  {
+    _instance->record(phase, elapsed_us);
+  }
+}
+
+
+void LatencyBreakdown::add_span(Phase phase, unsigned long elapsed_us)
+{
+  if (_instance != NULL)
+  {
+    _instance->record(phase, elapsed_us);
+  }
+}
+
+
+const char* LatencyBreakdown::phase_name(Phase phase)
+{
+  static const char* const names[NUM_PHASES] =
+    {"queue", "store", "hss", "xdm", "enum", "dns", "ifc", "as"};
+  return names[phase];
+}
+
+
+std::string LatencyBreakdown::to_json() const
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String("phases");
+  writer.StartObject();
+
+  for (int ii = 0; ii < NUM_PHASES; ++ii)
+  {
+    const LatencyHistogram& h = _histograms[ii];
+    writer.String(phase_name((Phase)ii));
+    writer.StartObject();
+    writer.String("count");
+    writer.Uint64(h.count());
+    writer.String("mean_us");
+    writer.Uint64(h.mean());
+    writer.String("p50_us");
+    writer.Uint64(h.percentile(50));
+    writer.String("p90_us");
+    writer.Uint64(h.percentile(90));
+    writer.String("p99_us");
+    writer.Uint64(h.percentile(99));
+    writer.String("p999_us");
+    writer.Uint64(h.percentile(99.9));
+    writer.String("max_us");
+    writer.Uint64(h.max());
+    writer.EndObject();
+  }
+
+  writer.EndObject();
+  writer.EndObject();
+  return sb.GetString();
+}
+
+
+void LatencyBreakdown::record(Phase phase, unsigned long elapsed_us)
+{
+  _histograms[phase].record(elapsed_us);
+
+  if (_phase_tbls[phase] != NULL)
+  {
+    _phase_tbls[phase]->accumulate(elapsed_us);
+  }
+}
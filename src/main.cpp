@@ -76,6 +76,7 @@ extern "C" {
 #include "mmtel.h"
 #include "subscription.h"
 #include "registrar.h"
+#include "registration_utils.h"
 #include "authentication.h"
 #include "options.h"
 #include "dnsresolver.h"
@@ -89,6 +90,10 @@ extern "C" {
 #include "scscfselector.h"
 #include "chronosconnection.h"
 #include "handlers.h"
+#include "aor_expiry_manager.h"
+#include "latency_breakdown.h"
+#include "sharded_stats.h"
+#include "aor_write_serializer.h"
 #include "httpstack.h"
 #include "sproutlet.h"
 #include "sproutletproxy.h"
@@ -148,6 +153,25 @@ enum OptionTypes
   SPROUTLET_MACRO(SPROUTLET_OPTION_TYPES)
   OPT_IMPI_STORE_MODE,
   OPT_NONCE_COUNT_SUPPORTED,
+  OPT_WEBRTC_THREADS,
+  OPT_SUPPRESS_THIRD_PARTY_REGISTER_REFRESHES,
+  OPT_OUTLIER_EJECTION,
+  OPT_REQUEST_HEDGING,
+  OPT_ASYNC_REMOTE_REPLICATION,
+  OPT_SAS_LOG_THREADS,
+  OPT_SAS_SAMPLE_RATES,
+  OPT_PEER_FAIR_SHARE,
+  OPT_PEER_WEIGHTS,
+  OPT_ICSCF_HSS_CACHE_TTL,
+  OPT_ASYNC_IO_THREADS,
+  OPT_LOCAL_AOR_EXPIRY,
+  OPT_SEPARATE_REG_SUBSCRIPTIONS,
+  OPT_DNS_PREFETCH,
+  OPT_LATENCY_BREAKDOWN,
+  OPT_SLOW_REQUEST_THRESHOLD,
+  OPT_STATELESS_IN_DIALOG,
+  OPT_DEFERRED_ACRS,
+  OPT_WARM_START_SNAPSHOT,
 };
 
 
@@ -226,6 +250,25 @@ const static struct pj_getopt_option long_opt[] =
   SPROUTLET_MACRO(SPROUTLET_CFG_PJ_STRUCT)
   { "impi-store-mode",              required_argument, 0, OPT_IMPI_STORE_MODE},
   { "nonce-count-supported",        no_argument,       0, OPT_NONCE_COUNT_SUPPORTED},
+  { "webrtc-threads",               required_argument, 0, OPT_WEBRTC_THREADS},
+  { "suppress-3pr-refreshes",       no_argument,       0, OPT_SUPPRESS_THIRD_PARTY_REGISTER_REFRESHES},
+  { "outlier-ejection",             no_argument,       0, OPT_OUTLIER_EJECTION},
+  { "request-hedging",              no_argument,       0, OPT_REQUEST_HEDGING},
+  { "async-remote-replication",     no_argument,       0, OPT_ASYNC_REMOTE_REPLICATION},
+  { "sas-log-threads",              required_argument, 0, OPT_SAS_LOG_THREADS},
+  { "sas-sample-rates",             required_argument, 0, OPT_SAS_SAMPLE_RATES},
+  { "peer-fair-share",              no_argument,       0, OPT_PEER_FAIR_SHARE},
+  { "peer-weights",                 required_argument, 0, OPT_PEER_WEIGHTS},
+  { "icscf-hss-cache-ttl",          required_argument, 0, OPT_ICSCF_HSS_CACHE_TTL},
+  { "async-io-threads",             required_argument, 0, OPT_ASYNC_IO_THREADS},
+  { "local-aor-expiry",             no_argument,       0, OPT_LOCAL_AOR_EXPIRY},
+  { "separate-reg-subscriptions",   no_argument,       0, OPT_SEPARATE_REG_SUBSCRIPTIONS},
+  { "dns-prefetch",                 no_argument,       0, OPT_DNS_PREFETCH},
+  { "latency-breakdown",            no_argument,       0, OPT_LATENCY_BREAKDOWN},
+  { "slow-request-threshold",       required_argument, 0, OPT_SLOW_REQUEST_THRESHOLD},
+  { "stateless-in-dialog",          no_argument,       0, OPT_STATELESS_IN_DIALOG},
+  { "deferred-acrs",                no_argument,       0, OPT_DEFERRED_ACRS},
+  { "warm-start-snapshot",          required_argument, 0, OPT_WARM_START_SNAPSHOT},
   { NULL,                           0,                 0, 0}
 };
 
@@ -252,6 +295,7 @@ static void usage(void)
        " -s, --scscf <port>         Enable S-CSCF function on the specified port\n"
        " -w, --webrtc-port N        Set local WebRTC listener port to N\n"
        "                            If not specified WebRTC support will be disabled\n"
+       "     --webrtc-threads N     Number of WebRTC (WebSocket) I/O threads (default: 1)\n"
        " -l, --localhost [<hostname>|<private hostname>,<public hostname>]\n"
        "                            Override the local host name with the specified\n"
        "                            hostname(s) or IP address(es).  If one name/address\n"
@@ -406,6 +450,69 @@ static void usage(void)
        "     --force-3pr-body       Always include the original REGISTER and 200 OK in the body of\n"
        "                            third-party REGISTER messages to application servers, even if the\n"
        "                            User-Data doesn't specify it\n"
+       "     --suppress-3pr-refreshes\n"
+       "                            Don't pass re-REGISTERs that change nothing an application server\n"
+       "                            can see on to it as third-party REGISTERs, and instead refresh\n"
+       "                            third-party registrations shortly before they would expire\n"
+       "     --outlier-ejection     Track the latency and error rate of downstream SIP servers, and\n"
+       "                            temporarily move persistently slow or failing servers to the back\n"
+       "                            of the list of servers to try\n"
+       "     --request-hedging      If a downstream server is slow to respond to an OPTIONS request,\n"
+       "                            send a copy to an alternate server and use whichever response\n"
+       "                            arrives first\n"
+       "     --async-remote-replication\n"
+       "                            Write registration data to the remote site's store in the\n"
+       "                            background, rather than before responding to each request\n"
+       "     --sas-log-threads N    Number of threads used to compress SIP messages and log them to\n"
+       "                            SAS.  If 0, messages are logged on the transport threads\n"
+       "                            (default: 0)\n"
+       "     --sas-sample-rates <method>=<N>[,<method>=<N>...]\n"
+       "                            Only log one in N transactions with the given CSeq method to\n"
+       "                            SAS, e.g. OPTIONS=100,REGISTER=10\n"
+       "     --peer-fair-share      When overloaded, share capacity fairly between the peers\n"
+       "                            sending requests, and always admit in-dialog and emergency\n"
+       "                            requests\n"
+       "     --peer-weights <IP address>=<weight>[,<IP address>=<weight>...]\n"
+       "                            Relative shares of capacity for particular peers, e.g. trunks\n"
+       "                            (default: 1)\n"
+       "     --icscf-hss-cache-ttl <milliseconds>\n"
+       "                            How long the I-CSCF caches the S-CSCF names and capabilities\n"
+       "                            returned by the HSS.  If 0, the HSS is queried for every\n"
+       "                            request (default: 0)\n"
+       "     --async-io-threads N   Number of threads that run blocking HSS, XDM, ENUM and store\n"
+       "                            queries for sproutlets, so the worker threads don't wait for\n"
+       "                            them.  If 0, the queries are run on the worker threads\n"
+       "                            (default: 0)\n"
+       "     --local-aor-expiry\n"
+       "                            Track when registrations and subscriptions expire on a local\n"
+       "                            timer wheel, with one Chronos timer per batch of AoRs as a\n"
+       "                            backstop, instead of one Chronos timer per AoR\n"
+       "     --separate-reg-subscriptions\n"
+       "                            Store reg-event subscriptions in a separate record from the\n"
+       "                            AoR's bindings, so that SUBSCRIBEs and REGISTERs for the same\n"
+       "                            subscriber contend less.  Existing records are split the next\n"
+       "                            time they are written\n"
+       "     --dns-prefetch\n"
+       "                            Keep the DNS records for configured next hops (the I-CSCF,\n"
+       "                            S-CSCFs, BGCF routes and application servers in use) warm by\n"
+       "                            re-resolving them in the background as they expire\n"
+       "     --latency-breakdown    Break down the time spent on each message into phases (queueing,\n"
+       "                            store, HSS, XDM, ENUM, DNS, iFC evaluation and application\n"
+       "                            server round trips), reported over SNMP and at\n"
+       "                            /latency-breakdown on the HTTP interface\n"
+       "     --slow-request-threshold N\n"
+       "                            If latency breakdown is enabled, log the breakdown of messages\n"
+       "                            that take at least N milliseconds to SAS.  If 0, no messages are\n"
+       "                            logged (default: 0)\n"
+       "     --stateless-in-dialog  When running as an edge proxy, forward in-dialog requests other\n"
+       "                            than INVITE, BYE and UPDATE statelessly.  Ignored if Rf billing\n"
+       "                            is enabled, as the ACRs need the responses\n"
+       "     --deferred-acrs        Capture the messages for Rf ACRs on the worker threads, but\n"
+       "                            extract and encode the ACR fields on the Ralf threads\n"
+       "     --warm-start-snapshot <filename>\n"
+       "                            Save the contents of the HSS answer, register AS and DNS prefetch\n"
+       "                            caches to this file when Sprout has quiesced, and reload them when\n"
+       "                            it next starts.  If not specified, caches start empty\n"
        "     --impi-store-mode (av-impi|impi)\n"
        "                            Whether to run the IMPI store in AV and IMPI mode (historical) or\n"
        "                            IMPI-only (forward-looking) mode\n"
@@ -1083,6 +1190,107 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       options->nonce_count_supported = true;
       break;
 
+    case OPT_WEBRTC_THREADS:
+      options->webrtc_threads = atoi(pj_optarg);
+      TRC_INFO("Number of WebRTC threads set to %d",
+               options->webrtc_threads);
+      break;
+
+    case OPT_SUPPRESS_THIRD_PARTY_REGISTER_REFRESHES:
+      TRC_INFO("Suppressing unchanged third-party REGISTER refreshes");
+      options->suppress_third_party_register_refreshes = true;
+      break;
+
+    case OPT_OUTLIER_EJECTION:
+      TRC_INFO("Outlier ejection enabled");
+      options->outlier_ejection = true;
+      break;
+
+    case OPT_REQUEST_HEDGING:
+      TRC_INFO("Request hedging enabled");
+      options->request_hedging = true;
+      break;
+
+    case OPT_ASYNC_REMOTE_REPLICATION:
+      TRC_INFO("Asynchronous remote replication enabled");
+      options->async_remote_replication = true;
+      break;
+
+    case OPT_SAS_LOG_THREADS:
+      options->sas_log_threads = atoi(pj_optarg);
+      TRC_INFO("Number of SAS logging threads set to %d",
+               options->sas_log_threads);
+      break;
+
+    case OPT_SAS_SAMPLE_RATES:
+      options->sas_sample_rates = std::string(pj_optarg);
+      TRC_INFO("SAS sample rates set to %s", pj_optarg);
+      break;
+
+    case OPT_PEER_FAIR_SHARE:
+      TRC_INFO("Per-peer fair-share admission control enabled");
+      options->peer_fair_share = true;
+      break;
+
+    case OPT_PEER_WEIGHTS:
+      options->peer_weights = std::string(pj_optarg);
+      TRC_INFO("Peer weights set to %s", pj_optarg);
+      break;
+
+    case OPT_ICSCF_HSS_CACHE_TTL:
+      options->icscf_hss_cache_ttl_ms = atoi(pj_optarg);
+      TRC_INFO("I-CSCF HSS cache TTL set to %d ms",
+               options->icscf_hss_cache_ttl_ms);
+      break;
+
+    case OPT_ASYNC_IO_THREADS:
+      options->async_io_threads = atoi(pj_optarg);
+      TRC_INFO("Number of asynchronous I/O threads set to %d",
+               options->async_io_threads);
+      break;
+
+    case OPT_LOCAL_AOR_EXPIRY:
+      TRC_INFO("Tracking AoR expiry locally");
+      options->local_aor_expiry = true;
+      break;
+
+    case OPT_SEPARATE_REG_SUBSCRIPTIONS:
+      TRC_INFO("Storing reg-event subscriptions separately from bindings");
+      options->separate_reg_subscriptions = true;
+      break;
+
+    case OPT_DNS_PREFETCH:
+      TRC_INFO("Prefetching DNS records for configured next hops");
+      options->dns_prefetch = true;
+      break;
+
+    case OPT_LATENCY_BREAKDOWN:
+      TRC_INFO("Latency breakdown enabled");
+      options->latency_breakdown = true;
+      break;
+
+    case OPT_SLOW_REQUEST_THRESHOLD:
+      options->slow_request_threshold_ms = atoi(pj_optarg);
+      TRC_INFO("Slow request threshold set to %d ms",
+               options->slow_request_threshold_ms);
+      break;
+
+    case OPT_STATELESS_IN_DIALOG:
+      TRC_INFO("Stateless forwarding of in-dialog requests enabled");
+      options->stateless_in_dialog = true;
+      break;
+
+    case OPT_DEFERRED_ACRS:
+      TRC_INFO("Deferring ACR encoding to the Ralf threads");
+      options->deferred_acrs = true;
+      break;
+
+    case OPT_WARM_START_SNAPSHOT:
+      options->warm_start_snapshot = std::string(pj_optarg);
+      TRC_INFO("Warm-start snapshot file set to %s",
+               options->warm_start_snapshot.c_str());
+      break;
+
     case 'N':
       {
         std::vector<std::string> fields;
@@ -1231,6 +1439,13 @@ class QuiesceCompleteHandler : public QuiesceCompletionInterface
 public:
   void quiesce_complete()
   {
+    if (stack_data.warm_start_snapshot != NULL)
+    {
+      // We have finished processing traffic, so the caches won't change
+      // any further.  Save them so we start warm.
+      stack_data.warm_start_snapshot->save();
+    }
+
     sem_post(&term_sem);
   }
 };
@@ -1310,12 +1525,18 @@ int main(int argc, char* argv[])
   SIPResolver* sip_resolver = NULL;
   Store* remote_data_store = NULL;
   ImpiStore* impi_store = NULL;
+  RegistrationUtils::ThirdPartyRegRefresher* third_party_reg_refresher = NULL;
+  ThirdPartyRegTracker* third_party_reg_tracker = NULL;
+  AoRReplicator* aor_replicator = NULL;
   HttpConnection* ralf_connection = NULL;
   ChronosConnection* chronos_connection = NULL;
   ACRFactory* pcscf_acr_factory = NULL;
   pj_bool_t websockets_enabled = PJ_FALSE;
   AccessLogger* access_logger = NULL;
   SproutletProxy* sproutlet_proxy = NULL;
+  AsyncIOPool* async_io_pool = NULL;
+  AoRExpiryManager* aor_expiry_manager = NULL;
+  AoRWriteSerializer* aor_write_serializer = NULL;
   std::list<Sproutlet*> sproutlets;
   CommunicationMonitor* chronos_comm_monitor = NULL;
   CommunicationMonitor* enum_comm_monitor = NULL;
@@ -1338,6 +1559,7 @@ int main(int argc, char* argv[])
   opt.pcscf_untrusted_port = 0;
   opt.upstream_proxy_port = 0;
   opt.webrtc_port = 0;
+  opt.webrtc_threads = 1;
   opt.ibcf = PJ_FALSE;
   opt.external_icscf_uri = "";
   opt.auth_enabled = PJ_FALSE;
@@ -1388,6 +1610,24 @@ int main(int argc, char* argv[])
   opt.ralf_threads = 25;
   opt.non_register_auth_mode = NonRegisterAuthentication::NEVER;
   opt.force_third_party_register_body = false;
+  opt.suppress_third_party_register_refreshes = false;
+  opt.outlier_ejection = false;
+  opt.request_hedging = false;
+  opt.async_remote_replication = false;
+  opt.sas_log_threads = 0;
+  opt.sas_sample_rates = "";
+  opt.peer_fair_share = false;
+  opt.peer_weights = "";
+  opt.icscf_hss_cache_ttl_ms = 0;
+  opt.async_io_threads = 0;
+  opt.local_aor_expiry = false;
+  opt.separate_reg_subscriptions = false;
+  opt.dns_prefetch = false;
+  opt.latency_breakdown = false;
+  opt.slow_request_threshold_ms = 0;
+  opt.stateless_in_dialog = false;
+  opt.deferred_acrs = false;
+  opt.warm_start_snapshot = "";
   opt.listen_port = 0;
   SPROUTLET_MACRO(SPROUTLET_CFG_OPTIONS_DEFAULT_VALUES)
   opt.impi_store_mode = ImpiStore::Mode::READ_IMPI_WRITE_IMPI;
@@ -1579,6 +1819,8 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorTable* queue_size_table;
   SNMP::CounterTable* requests_counter;
   SNMP::CounterTable* overload_counter;
+  SNMP::CounterTable* sas_msgs_dropped_counter;
+  SNMP::IPCountTable* peer_rejected_tbl;
 
   SNMP::IPCountTable* homestead_cxn_count = NULL;
 
@@ -1594,31 +1836,57 @@ int main(int argc, char* argv[])
   SNMP::U32Scalar* penalties_scalar = NULL;
   SNMP::U32Scalar* token_rate_scalar = NULL;
 
+  SNMP::CounterTable* third_party_reg_sent_tbl = NULL;
+  SNMP::CounterTable* third_party_reg_suppressed_tbl = NULL;
+  SNMP::EventAccumulatorTable* remote_replication_lag_tbl = NULL;
+  SNMP::EventAccumulatorTable* remote_replication_backlog_tbl = NULL;
+  SNMP::EventAccumulatorTable* aor_write_retries_tbl = NULL;
+  SNMP::CounterTable* dns_prefetch_hits_tbl = NULL;
+  SNMP::CounterTable* dns_prefetch_misses_tbl = NULL;
+  SNMP::CounterTable* dns_prefetch_refreshes_tbl = NULL;
+  std::vector<SNMP::EventAccumulatorTable*> latency_breakdown_tbls;
+
   SNMP::RegistrationStatsTables reg_stats_tbls;
   SNMP::RegistrationStatsTables third_party_reg_stats_tbls;
   SNMP::AuthenticationStatsTables auth_stats_tbls;
 
   if (opt.pcscf_enabled)
   {
-    latency_table = SNMP::EventAccumulatorTable::create("bono_latency",
-                                                   ".1.2.826.0.1.1578918.9.2.2");
-    queue_size_table = SNMP::EventAccumulatorTable::create("bono_queue_size",
-                                                      ".1.2.826.0.1.1578918.9.2.6");
-    requests_counter = SNMP::CounterTable::create("bono_incoming_requests",
-                                                  ".1.2.826.0.1.1578918.9.2.4");
-    overload_counter = SNMP::CounterTable::create("bono_rejected_overload",
-                                                  ".1.2.826.0.1.1578918.9.2.5");
+    latency_table = new ShardedEventAccumulatorTable(
+                      SNMP::EventAccumulatorTable::create("bono_latency",
+                                                          ".1.2.826.0.1.1578918.9.2.2"));
+    queue_size_table = new ShardedEventAccumulatorTable(
+                      SNMP::EventAccumulatorTable::create("bono_queue_size",
+                                                          ".1.2.826.0.1.1578918.9.2.6"));
+    requests_counter = new ShardedCounterTable(
+                      SNMP::CounterTable::create("bono_incoming_requests",
+                                                 ".1.2.826.0.1.1578918.9.2.4"));
+    overload_counter = new ShardedCounterTable(
+                      SNMP::CounterTable::create("bono_rejected_overload",
+                                                 ".1.2.826.0.1.1578918.9.2.5"));
+    sas_msgs_dropped_counter = SNMP::CounterTable::create("bono_sas_msgs_dropped",
+                                                          ".1.2.826.0.1.1578918.9.2.7");
+    peer_rejected_tbl = SNMP::IPCountTable::create("bono_peer_rejected_overload",
+                                                   ".1.2.826.0.1.1578918.9.2.8");
   }
   else
   {
-    latency_table = SNMP::EventAccumulatorTable::create("sprout_latency",
-                                                   ".1.2.826.0.1.1578918.9.3.1");
-    queue_size_table = SNMP::EventAccumulatorTable::create("sprout_queue_size",
-                                                      ".1.2.826.0.1.1578918.9.3.8");
-    requests_counter = SNMP::CounterTable::create("sprout_incoming_requests",
-                                                  ".1.2.826.0.1.1578918.9.3.6");
-    overload_counter = SNMP::CounterTable::create("sprout_rejected_overload",
-                                                  ".1.2.826.0.1.1578918.9.3.7");
+    latency_table = new ShardedEventAccumulatorTable(
+                      SNMP::EventAccumulatorTable::create("sprout_latency",
+                                                          ".1.2.826.0.1.1578918.9.3.1"));
+    queue_size_table = new ShardedEventAccumulatorTable(
+                      SNMP::EventAccumulatorTable::create("sprout_queue_size",
+                                                          ".1.2.826.0.1.1578918.9.3.8"));
+    requests_counter = new ShardedCounterTable(
+                      SNMP::CounterTable::create("sprout_incoming_requests",
+                                                 ".1.2.826.0.1.1578918.9.3.6"));
+    overload_counter = new ShardedCounterTable(
+                      SNMP::CounterTable::create("sprout_rejected_overload",
+                                                 ".1.2.826.0.1.1578918.9.3.7"));
+    sas_msgs_dropped_counter = SNMP::CounterTable::create("sprout_sas_msgs_dropped",
+                                                          ".1.2.826.0.1.1578918.9.3.38");
+    peer_rejected_tbl = SNMP::IPCountTable::create("sprout_peer_rejected_overload",
+                                                   ".1.2.826.0.1.1578918.9.3.39");
 
     homestead_cxn_count = SNMP::IPCountTable::create("sprout_homestead_cxn_count",
                                                      ".1.2.826.0.1.1578918.9.3.3.1");
@@ -1665,8 +1933,42 @@ int main(int argc, char* argv[])
                                                       ".1.2.826.0.1.1578918.9.3.30");
     token_rate_scalar = new SNMP::U32Scalar("sprout_current_token_rate",
                                                       ".1.2.826.0.1.1578918.9.3.31");
+
+    third_party_reg_sent_tbl = SNMP::CounterTable::create("third_party_reg_sent",
+                                                          ".1.2.826.0.1.1578918.9.3.34");
+    third_party_reg_suppressed_tbl = SNMP::CounterTable::create("third_party_reg_suppressed",
+                                                                ".1.2.826.0.1.1578918.9.3.35");
+    remote_replication_lag_tbl = SNMP::EventAccumulatorTable::create("remote_replication_lag",
+                                                                     ".1.2.826.0.1.1578918.9.3.36");
+    remote_replication_backlog_tbl = SNMP::EventAccumulatorTable::create("remote_replication_backlog",
+                                                                         ".1.2.826.0.1.1578918.9.3.37");
+    aor_write_retries_tbl = SNMP::EventAccumulatorTable::create("aor_write_retries",
+                                                                ".1.2.826.0.1.1578918.9.3.43");
+    dns_prefetch_hits_tbl = SNMP::CounterTable::create("dns_prefetch_hits",
+                                                       ".1.2.826.0.1.1578918.9.3.44");
+    dns_prefetch_misses_tbl = SNMP::CounterTable::create("dns_prefetch_misses",
+                                                         ".1.2.826.0.1.1578918.9.3.45");
+    dns_prefetch_refreshes_tbl = SNMP::CounterTable::create("dns_prefetch_refreshes",
+                                                            ".1.2.826.0.1.1578918.9.3.46");
+
+    if (opt.latency_breakdown)
+    {
+      for (int ii = 0; ii < LatencyBreakdown::NUM_PHASES; ++ii)
+      {
+        std::string phase = LatencyBreakdown::phase_name((LatencyBreakdown::Phase)ii);
+        latency_breakdown_tbls.push_back(
+          SNMP::EventAccumulatorTable::create("sprout_latency_" + phase,
+                                              ".1.2.826.0.1.1578918.9.3.47." +
+                                                std::to_string(ii + 1)));
+      }
+    }
   }
 
+  // The hot-path tables are updated per thread, so merge them into the SNMP
+  // tables once a second.
+  ShardedStatsFlusher* stats_flusher = new ShardedStatsFlusher();
+  stats_flusher->start();
+
   if (opt.enabled_icscf || opt.enabled_scscf)
   {
     // Create Sprout's alarm objects.
@@ -1770,6 +2072,56 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if ((opt.outlier_ejection) || (opt.request_hedging))
+  {
+    // Track the health of downstream destinations so slow or failing servers
+    // can be avoided.
+    stack_data.destination_health = new DestinationHealth(opt.outlier_ejection,
+                                                          opt.request_hedging);
+  }
+
+  if ((opt.dns_prefetch) && (!opt.pcscf_enabled))
+  {
+    // Keep the DNS records for our configured next hops warm.  The
+    // sproutlet plug-ins add their own next hops when they are loaded.
+    stack_data.dns_prefetcher = new DnsPrefetcher(sip_resolver,
+                                                  stack_data.addr_family,
+                                                  dns_prefetch_hits_tbl,
+                                                  dns_prefetch_misses_tbl,
+                                                  dns_prefetch_refreshes_tbl);
+    std::vector<std::string> next_hops = {opt.uri_scscf,
+                                          opt.uri_icscf,
+                                          opt.uri_bgcf,
+                                          opt.external_icscf_uri};
+    stack_data.dns_prefetcher->add_source([next_hops]() { return next_hops; });
+    stack_data.dns_prefetcher->start();
+  }
+
+  if (!opt.warm_start_snapshot.empty())
+  {
+    // Sections are added for each of the caches that are enabled.  The
+    // sproutlet plug-ins add their own caches when they are loaded.
+    stack_data.warm_start_snapshot = new WarmStartSnapshot(opt.warm_start_snapshot);
+
+    if (stack_data.dns_prefetcher != NULL)
+    {
+      stack_data.warm_start_snapshot->add_section(
+                   WarmStartSnapshot::SECTION_DNS_TARGETS,
+                   std::bind(&DnsPrefetcher::save,
+                             stack_data.dns_prefetcher,
+                             std::placeholders::_1),
+                   std::bind(&DnsPrefetcher::restore,
+                             stack_data.dns_prefetcher,
+                             std::placeholders::_1,
+                             std::placeholders::_2));
+    }
+
+    if (opt.enabled_scscf)
+    {
+      RegistrationUtils::add_to_warm_start_snapshot(stack_data.warm_start_snapshot);
+    }
+  }
+
   // Initialize the semaphore that unblocks the quiesce thread, and the thread
   // itself. This must happen after init_stack is called, because this
   // calls init_pjsip, which calls pj_init, which sets up the
@@ -1872,7 +2224,9 @@ int main(int argc, char* argv[])
   {
     // Create an ACR factory for the P-CSCF.
     pcscf_acr_factory = (ralf_processor != NULL) ?
-                (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::PCSCF) :
+                (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                ACR::PCSCF,
+                                                opt.deferred_acrs) :
                 new ACRFactory();
 
     // Launch stateful proxy as P-CSCF.
@@ -1900,7 +2254,9 @@ int main(int argc, char* argv[])
                                  NULL,
                                  opt.enabled_icscf,
                                  opt.enabled_scscf,
-                                 opt.emerg_reg_accepted);
+                                 opt.emerg_reg_accepted,
+                                 opt.stateless_in_dialog &&
+                                   (ralf_processor == NULL));
     if (status != PJ_SUCCESS)
     {
       TRC_ERROR("Failed to enable P-CSCF edge proxy");
@@ -1910,7 +2266,8 @@ int main(int argc, char* argv[])
     pj_bool_t websockets_enabled = (opt.webrtc_port != 0);
     if (websockets_enabled)
     {
-      status = init_websockets((unsigned short)opt.webrtc_port);
+      status = init_websockets((unsigned short)opt.webrtc_port,
+                               opt.webrtc_threads);
       if (status != PJ_SUCCESS)
       {
         TRC_ERROR("Error initializing websockets, %s",
@@ -1924,7 +2281,9 @@ int main(int argc, char* argv[])
   if (opt.enabled_scscf)
   {
     scscf_acr_factory = (ralf_processor != NULL) ?
-                      (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::SCSCF) :
+                      (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                      ACR::SCSCF,
+                                                      opt.deferred_acrs) :
                       new ACRFactory();
 
     if (opt.store_servers != "")
@@ -1991,6 +2350,15 @@ int main(int argc, char* argv[])
                                           deserializers,
                                           chronos_connection,
                                           true);
+    local_sdm->set_separate_subscriptions(opt.separate_reg_subscriptions);
+
+    // Serialize this node's writes to each AoR, so that concurrent requests
+    // for the same subscriber queue rather than contending in memcached.
+    aor_write_serializer = new AoRWriteSerializer(AoRWriteSerializer::DEFAULT_STRIPES,
+                                                  AoRWriteSerializer::DEFAULT_MIN_BACKOFF_US,
+                                                  AoRWriteSerializer::DEFAULT_MAX_BACKOFF_US,
+                                                  aor_write_retries_tbl);
+    local_sdm->set_write_serializer(aor_write_serializer);
 
     if (remote_data_store != NULL)
     {
@@ -2002,6 +2370,36 @@ int main(int argc, char* argv[])
                                              deserializers,
                                              chronos_connection,
                                              false);
+      remote_sdm->set_separate_subscriptions(opt.separate_reg_subscriptions);
+
+      if (opt.async_remote_replication)
+      {
+        // Replicate to the remote store in the background, so that requests
+        // aren't held up waiting for the remote site.
+        aor_replicator = new AoRReplicator(remote_sdm,
+                                           AoRReplicator::DEFAULT_THREADS,
+                                           AoRReplicator::DEFAULT_MAX_BACKLOG,
+                                           remote_replication_lag_tbl,
+                                           remote_replication_backlog_tbl);
+        aor_replicator->start();
+      }
+    }
+
+    if (opt.local_aor_expiry)
+    {
+      // Track AoR expiry on a local timer wheel, processing expired AoRs in
+      // batches on the manager's thread.
+      aor_expiry_manager = new AoRExpiryManager(chronos_connection,
+        [=](const std::vector<std::string>& aor_ids, SAS::TrailId trail)
+        {
+          AoRTimeoutTask::Config config(local_sdm,
+                                        remote_sdm,
+                                        hss_connection,
+                                        aor_replicator);
+          AoRTimeoutTask::expire_aors(&config, aor_ids, trail);
+        });
+      local_sdm->set_expiry_manager(aor_expiry_manager);
+      aor_expiry_manager->start();
     }
 
     // Start the HTTP stack early as plugins might need to register handlers
@@ -2043,6 +2441,13 @@ int main(int argc, char* argv[])
                                    expiry_for_binding);
     }
 
+    if (opt.suppress_third_party_register_refreshes)
+    {
+      third_party_reg_refresher = new RegistrationUtils::ThirdPartyRegRefresher();
+      third_party_reg_tracker = new ThirdPartyRegTracker(third_party_reg_refresher);
+      third_party_reg_tracker->start();
+    }
+
     // Launch the registrar.
     status = init_registrar(local_sdm,
                             remote_sdm,
@@ -2052,7 +2457,11 @@ int main(int argc, char* argv[])
                             opt.reg_max_expires,
                             opt.force_third_party_register_body,
                             &reg_stats_tbls,
-                            &third_party_reg_stats_tbls);
+                            &third_party_reg_stats_tbls,
+                            third_party_reg_tracker,
+                            third_party_reg_sent_tbl,
+                            third_party_reg_suppressed_tbl,
+                            aor_replicator);
 
     if (status != PJ_SUCCESS)
     {
@@ -2067,7 +2476,8 @@ int main(int argc, char* argv[])
                                hss_connection,
                                scscf_acr_factory,
                                analytics_logger,
-                               opt.sub_max_expires);
+                               opt.sub_max_expires,
+                               aor_replicator);
 
     if (status != PJ_SUCCESS)
     {
@@ -2088,6 +2498,13 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if (stack_data.warm_start_snapshot != NULL)
+  {
+    // Reload the caches saved when we last quiesced, now that all the
+    // plug-ins have added their sections, and before we take any traffic.
+    stack_data.warm_start_snapshot->load();
+  }
+
   // Must happen after all SNMP tables have been registered.
   if (opt.pcscf_enabled)
   {
@@ -2110,12 +2527,21 @@ int main(int argc, char* argv[])
     host_aliases.insert(stack_data.aliases.begin(),
                         stack_data.aliases.end());
 
+    if (opt.async_io_threads > 0)
+    {
+      // Sproutlets' blocking operations complete on the worker threads.
+      async_io_pool = new AsyncIOPool(opt.async_io_threads,
+                                      &add_callback_to_queue);
+      async_io_pool->start();
+    }
+
     sproutlet_proxy = new SproutletProxy(stack_data.endpt,
                                          PJSIP_MOD_PRIORITY_UA_PROXY_LAYER+3,
                                          opt.sprout_hostname,
                                          host_aliases,
                                          sproutlets,
-                                         opt.stateless_proxies);
+                                         opt.stateless_proxies,
+                                         async_io_pool);
     if (sproutlet_proxy == NULL)
     {
       TRC_ERROR("Failed to create SproutletProxy");
@@ -2123,10 +2549,46 @@ int main(int argc, char* argv[])
     }
   }
 
+  // Create the SAS message logger, and start its threads before the
+  // transport threads can give it any work.
+  SasMsgLogger* sas_msg_logger = new SasMsgLogger(opt.sas_log_threads,
+                                                  SasMsgLogger::DEFAULT_MAX_QUEUE,
+                                                  sas_msgs_dropped_counter);
+
+  if (!sas_msg_logger->set_sample_rates(opt.sas_sample_rates))
+  {
+    TRC_ERROR("Invalid --sas-sample-rates option, logging all messages to SAS");
+  }
+
+  sas_msg_logger->start();
+
+  PeerAdmission* peer_admission = NULL;
+
+  if (opt.peer_fair_share)
+  {
+    peer_admission = new PeerAdmission(PeerAdmission::DEFAULT_MIN_PEER_RATE,
+                                       peer_rejected_tbl);
+
+    if (!peer_admission->set_weights(opt.peer_weights))
+    {
+      TRC_ERROR("Invalid --peer-weights option, giving all peers equal weight");
+    }
+  }
+
   init_common_sip_processing(load_monitor,
                              requests_counter,
                              overload_counter,
-                             hc);
+                             hc,
+                             sas_msg_logger,
+                             peer_admission);
+
+  LatencyBreakdown* latency_breakdown = NULL;
+
+  if ((opt.latency_breakdown) && (!opt.pcscf_enabled))
+  {
+    latency_breakdown = new LatencyBreakdown(latency_breakdown_tbls,
+                                             opt.slow_request_threshold_ms * 1000);
+  }
 
   init_thread_dispatcher(opt.worker_threads,
                          latency_table,
@@ -2151,13 +2613,29 @@ int main(int argc, char* argv[])
     return 1;
   }
 
-  AoRTimeoutTask::Config aor_timeout_config(local_sdm, remote_sdm, hss_connection);
+  AoRTimeoutTask::Config aor_timeout_config(local_sdm,
+                                            remote_sdm,
+                                            hss_connection,
+                                            aor_replicator);
   AuthTimeoutTask::Config auth_timeout_config(impi_store, hss_connection);
+  // Bulk deregistrations share a single pool of threads, so that
+  // concurrent requests can't start an unbounded number of threads between
+  // them.  The deregistration interface is only offered by the S-CSCF.
+  AsyncIOPool* deregistration_pool = NULL;
+
+  if (opt.enabled_scscf)
+  {
+    deregistration_pool =
+      new AsyncIOPool(DeregistrationTask::Config::DEFAULT_MAX_WORKERS);
+    deregistration_pool->start();
+  }
   DeregistrationTask::Config deregistration_config(local_sdm,
                                                    remote_sdm,
                                                    hss_connection,
                                                    sip_resolver,
-                                                   impi_store);
+                                                   impi_store,
+                                                   aor_replicator,
+                                                   deregistration_pool);
 
   // The AoRTimeoutTask and AuthTimeoutTask both handle
   // chronos requests, so use the ChronosHandler.
@@ -2165,6 +2643,8 @@ int main(int argc, char* argv[])
   ChronosHandler<AuthTimeoutTask, AuthTimeoutTask::Config> auth_timeout_handler(&auth_timeout_config);
   HttpStackUtils::SpawningHandler<DeregistrationTask, DeregistrationTask::Config> deregistration_handler(&deregistration_config);
   HttpStackUtils::PingHandler ping_handler;
+  LatencyBreakdownTask::Config latency_breakdown_config(latency_breakdown);
+  HttpStackUtils::SpawningHandler<LatencyBreakdownTask, LatencyBreakdownTask::Config> latency_breakdown_handler(&latency_breakdown_config);
 
   if (opt.enabled_scscf)
   {
@@ -2178,6 +2658,11 @@ int main(int argc, char* argv[])
                                    &auth_timeout_handler);
       http_stack->register_handler("^/registrations?*$",
                                    &deregistration_handler);
+      if (latency_breakdown != NULL)
+      {
+        http_stack->register_handler("^/latency-breakdown$",
+                                     &latency_breakdown_handler);
+      }
       http_stack->start(&reg_httpthread_with_pjsip);
     }
     catch (HttpStack::Exception& e)
@@ -2207,6 +2692,9 @@ int main(int argc, char* argv[])
     }
   }
 
+  // The HTTP stack has stopped, so no more bulk deregistrations can start.
+  delete deregistration_pool;
+
   // Terminate the PJSIP thread and the worker threads to exit.  We kill
   // the PJSIP thread first - if we killed the worker threads first the
   // rx_msg_q will stop getting serviced so could fill up blocking
@@ -2214,6 +2702,16 @@ int main(int argc, char* argv[])
   stop_pjsip_thread();
   stop_worker_threads();
 
+  // The worker threads can start blocking operations until they stop, so
+  // only stop the I/O threads now.  Any operations still queued are run, but
+  // the transactions that started them aren't continued.
+  delete async_io_pool;
+
+  // Stop expiring AoRs locally.  The expiry manager brings the Chronos bucket
+  // timers up to date as it goes, so any AoRs that are due are picked up by
+  // them.
+  delete aor_expiry_manager;
+
   // We must call stop_stack here because this terminates the
   // transaction layer, which can otherwise generate work for other modules
   // after they have unregistered.
@@ -2222,6 +2720,12 @@ int main(int argc, char* argv[])
   unregister_thread_dispatcher();
   unregister_common_processing_module();
 
+  delete latency_breakdown;
+
+  // Deleting the logger waits for queued messages to be logged.
+  delete sas_msg_logger;
+  delete peer_admission;
+
   // Destroy the Sproutlet Proxy.
   delete sproutlet_proxy;
 
@@ -2231,6 +2735,9 @@ int main(int argc, char* argv[])
 
   if (opt.enabled_scscf)
   {
+    // Stop refreshing third-party registrations before the stack goes.
+    delete third_party_reg_tracker;
+    delete third_party_reg_refresher;
     destroy_subscription();
     destroy_registrar();
     if (opt.auth_enabled)
@@ -2252,11 +2759,28 @@ int main(int argc, char* argv[])
   destroy_options();
   destroy_stack();
 
+  // The plug-ins removed their sections when they were unloaded.  This
+  // must go before the caches it saves.
+  delete stack_data.warm_start_snapshot;
+  stack_data.warm_start_snapshot = NULL;
+
+  delete stack_data.destination_health;
+  stack_data.destination_health = NULL;
+
+  // The prefetcher's sources were removed when the plug-ins were unloaded.
+  delete stack_data.dns_prefetcher;
+  stack_data.dns_prefetcher = NULL;
+
   delete hss_connection;
   delete quiescing_mgr;
   delete exception_handler;
   delete load_monitor;
+
+  // Deleting the replicator waits for queued AoRs to be written, so it must
+  // go before the stores.
+  delete aor_replicator;
   delete local_sdm;
+  delete aor_write_serializer;
   delete remote_sdm;
   delete impi_store;
   delete local_data_store;
@@ -2289,10 +2813,13 @@ int main(int argc, char* argv[])
     delete remote_vbucket_alarm;
   }
 
+  delete stats_flusher;
   delete latency_table;
   delete queue_size_table;
   delete requests_counter;
   delete overload_counter;
+  delete sas_msgs_dropped_counter;
+  delete peer_rejected_tbl;
 
   delete homestead_cxn_count;
 
@@ -2308,6 +2835,23 @@ int main(int argc, char* argv[])
   delete penalties_scalar;
   delete token_rate_scalar;
 
+  delete third_party_reg_sent_tbl;
+  delete third_party_reg_suppressed_tbl;
+  delete remote_replication_lag_tbl;
+  delete remote_replication_backlog_tbl;
+  delete aor_write_retries_tbl;
+  delete dns_prefetch_hits_tbl;
+  delete dns_prefetch_misses_tbl;
+  delete dns_prefetch_refreshes_tbl;
+
+  for (std::vector<SNMP::EventAccumulatorTable*>::iterator it =
+         latency_breakdown_tbls.begin();
+       it != latency_breakdown_tbls.end();
+       ++it)
+  {
+    delete *it;
+  }
+
   if (!opt.pcscf_enabled)
   {
     delete reg_stats_tbls.init_reg_tbl;
@@ -0,0 +1,377 @@
+/**
+ * @file peer_admission.cpp Per-peer fair-share admission control.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <functional>
+#include <vector>
+
+#include "log.h"
+#include "utils.h"
+#include "pjutils.h"
+#include "peer_admission.h"
+
+PeerAdmission::PeerAdmission(int min_peer_rate,
+                             SNMP::IPCountTable* rejected_tbl) :
+  _min_peer_rate(min_peer_rate),
+  _rejected_tbl(rejected_tbl),
+  _weights(),
+  _epoch(0),
+  _contended_until_ms(0)
+{
+  _active_weight[0] = 0;
+  _active_weight[1] = 0;
+
+  for (int ii = 0; ii < NUM_STRIPES; ++ii)
+  {
+    pthread_mutex_init(&_stripes[ii].lock, NULL);
+    _stripes[ii].last_sweep_ms = 0;
+  }
+}
+
+
+PeerAdmission::~PeerAdmission()
+{
+  for (int ii = 0; ii < NUM_STRIPES; ++ii)
+  {
+    pthread_mutex_destroy(&_stripes[ii].lock);
+  }
+}
+
+
+bool PeerAdmission::set_weights(const std::string& weights)
+{
+  std::map<std::string, int> parsed_weights;
+  std::vector<std::string> entries;
+  Utils::split_string(weights, ',', entries, 0, true);
+
+  for (std::vector<std::string>::const_iterator it = entries.begin();
+       it != entries.end();
+       ++it)
+  {
+    size_t eq = it->find('=');
+    int weight = (eq != std::string::npos) ? atoi(it->c_str() + eq + 1) : 0;
+
+    if ((eq == 0) || (weight <= 0))
+    {
+      TRC_ERROR("Invalid peer weight: %s", it->c_str());
+      _weights.clear();
+      return false;
+    }
+
+    parsed_weights[it->substr(0, eq)] = weight;
+  }
+
+  _weights = parsed_weights;
+  return true;
+}
+
+
+bool PeerAdmission::admit_request(const std::string& peer_id,
+                                  LoadMonitor* load_monitor)
+{
+  unsigned long now = now_ms();
+  float rate_limit = load_monitor->get_rate_limit();
+  bool admit;
+
+  Stripe& s = stripe(peer_id);
+  pthread_mutex_lock(&s.lock);
+
+  Peer& peer = find_peer(s, peer_id, now);
+  note_active(peer, now);
+  refill(peer, rate_limit, now);
+
+  bool within_share = (peer.tokens >= 1.0);
+
+  if (within_share)
+  {
+    peer.tokens -= 1.0;
+  }
+
+  if ((!within_share) && (now < _contended_until_ms))
+  {
+    // The peer is over its share and others are being turned away, so
+    // reject the request without taking a token from the load monitor.
+    TRC_DEBUG("Rejecting request from %s, which is over its fair share",
+              peer_id.c_str());
+    admit = false;
+  }
+  else
+  {
+    admit = load_monitor->admit_request();
+
+    if (!admit)
+    {
+      _contended_until_ms = now + CONTENTION_PERIOD_MS;
+    }
+  }
+
+  if (!admit)
+  {
+    reject(peer_id, peer);
+  }
+
+  if (now - s.last_sweep_ms >= PEER_IDLE_TIMEOUT_MS / 4)
+  {
+    sweep(s, now);
+  }
+
+  pthread_mutex_unlock(&s.lock);
+
+  return admit;
+}
+
+
+bool PeerAdmission::is_high_priority(pjsip_msg* msg)
+{
+  if (msg->type != PJSIP_REQUEST_MSG)
+  {
+    return true;
+  }
+
+  pjsip_method_e method = msg->line.req.method.id;
+
+  if ((method == PJSIP_ACK_METHOD) ||
+      (method == PJSIP_BYE_METHOD) ||
+      (method == PJSIP_CANCEL_METHOD))
+  {
+    return true;
+  }
+
+  // Requests in an existing dialog.
+  pjsip_to_hdr* to_hdr = PJSIP_MSG_TO_HDR(msg);
+
+  if ((to_hdr != NULL) && (to_hdr->tag.slen != 0))
+  {
+    return true;
+  }
+
+  // Emergency registrations.
+  if (method == PJSIP_REGISTER_METHOD)
+  {
+    pjsip_contact_hdr* contact_hdr =
+      (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
+
+    while (contact_hdr != NULL)
+    {
+      if (PJUtils::is_emergency_registration(contact_hdr))
+      {
+        return true;
+      }
+
+      contact_hdr = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg,
+                                                           PJSIP_H_CONTACT,
+                                                           contact_hdr->next);
+    }
+  }
+
+  // Emergency calls, which are addressed to urn:service:sos (RFC 5031).
+  pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(msg->line.req.uri);
+
+  if ((!PJSIP_URI_SCHEME_IS_SIP(uri)) && (!PJSIP_URI_SCHEME_IS_SIPS(uri)))
+  {
+    static const char SOS_URN[] = "urn:service:sos";
+    char buf[64];
+    int len = pjsip_uri_print(PJSIP_URI_IN_REQ_URI, uri, buf, sizeof(buf) - 1);
+
+    if ((len >= (int)(sizeof(SOS_URN) - 1)) &&
+        (strncasecmp(buf, SOS_URN, sizeof(SOS_URN) - 1) == 0))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+size_t PeerAdmission::num_peers()
+{
+  size_t num_peers = 0;
+
+  for (int ii = 0; ii < NUM_STRIPES; ++ii)
+  {
+    pthread_mutex_lock(&_stripes[ii].lock);
+    num_peers += _stripes[ii].peers.size();
+    pthread_mutex_unlock(&_stripes[ii].lock);
+  }
+
+  return num_peers;
+}
+
+
+PeerAdmission::Stripe& PeerAdmission::stripe(const std::string& peer)
+{
+  return _stripes[std::hash<std::string>()(peer) % NUM_STRIPES];
+}
+
+
+/// Finds a peer's state, creating it if this is the peer's first request.
+/// Must be called with the stripe's lock held.
+PeerAdmission::Peer& PeerAdmission::find_peer(Stripe& stripe,
+                                              const std::string& peer_id,
+                                              unsigned long now_ms)
+{
+  std::map<std::string, Peer>::iterator it = stripe.peers.find(peer_id);
+
+  if (it == stripe.peers.end())
+  {
+    Peer peer;
+
+    // Start with a full bucket.
+    peer.tokens = 0;
+    peer.last_refill_ms = now_ms - 1000;
+    peer.last_request_ms = now_ms;
+    peer.epoch = 0;
+    peer.rejected = false;
+
+    std::map<std::string, int>::const_iterator weight = _weights.find(peer_id);
+    peer.weight = (weight != _weights.end()) ? weight->second : 1;
+
+    it = stripe.peers.insert(std::make_pair(peer_id, peer)).first;
+  }
+
+  it->second.last_request_ms = now_ms;
+  return it->second;
+}
+
+
+/// Refills a peer's bucket at its share of the rate limit.  The bucket holds
+/// one second's worth of tokens.
+void PeerAdmission::refill(Peer& peer, float rate_limit, unsigned long now_ms)
+{
+  int active_weight = _active_weight[0];
+
+  if (_active_weight[1] > active_weight)
+  {
+    active_weight = _active_weight[1];
+  }
+
+  if (active_weight < peer.weight)
+  {
+    active_weight = peer.weight;
+  }
+
+  float rate = rate_limit * peer.weight / active_weight;
+
+  if (rate < _min_peer_rate)
+  {
+    rate = _min_peer_rate;
+  }
+
+  peer.tokens += rate * (now_ms - peer.last_refill_ms) / 1000.0;
+  peer.last_refill_ms = now_ms;
+
+  if (peer.tokens > rate)
+  {
+    peer.tokens = rate;
+  }
+}
+
+
+/// Adds a peer's weight to the active weight the first time it sends a
+/// request in an epoch.
+void PeerAdmission::note_active(Peer& peer, unsigned long now_ms)
+{
+  unsigned long epoch = now_ms / EPOCH_MS;
+  unsigned long current_epoch = _epoch;
+
+  if ((epoch > current_epoch) &&
+      (_epoch.compare_exchange_strong(current_epoch, epoch)))
+  {
+    // This is a new epoch, so start counting afresh.  If no requests
+    // arrived in the previous epoch, forget the one before it too.
+    if (epoch > current_epoch + 1)
+    {
+      _active_weight[(epoch + 1) % 2] = 0;
+    }
+
+    _active_weight[epoch % 2] = 0;
+  }
+
+  if (peer.epoch != epoch)
+  {
+    peer.epoch = epoch;
+    _active_weight[epoch % 2] += peer.weight;
+  }
+}
+
+
+/// Forgets peers that haven't sent a request for a while.  Must be called
+/// with the stripe's lock held.
+void PeerAdmission::sweep(Stripe& stripe, unsigned long now_ms)
+{
+  stripe.last_sweep_ms = now_ms;
+
+  std::map<std::string, Peer>::iterator it = stripe.peers.begin();
+
+  while (it != stripe.peers.end())
+  {
+    if (now_ms - it->second.last_request_ms >= PEER_IDLE_TIMEOUT_MS)
+    {
+      if ((it->second.rejected) && (_rejected_tbl != NULL))
+      {
+        _rejected_tbl->remove(it->first);
+      }
+
+      stripe.peers.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+
+/// Counts a rejected request.  Must be called with the stripe's lock held.
+void PeerAdmission::reject(const std::string& peer_id, Peer& peer)
+{
+  if (_rejected_tbl != NULL)
+  {
+    _rejected_tbl->get(peer_id)->increment();
+    peer.rejected = true;
+  }
+}
+
+
+unsigned long PeerAdmission::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
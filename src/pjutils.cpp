@@ -58,6 +58,8 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "enumservice.h"
 #include "uri_classifier.h"
+#include "utils.h"
+#include "latency_breakdown.h"
 
 
 static const int DEFAULT_RETRIES = 5;
@@ -924,6 +926,9 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
     retries = DEFAULT_RETRIES;
   }
 
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
+
   stack_data.sipresolver->resolve(name,
                                   stack_data.addr_family,
                                   port,
@@ -932,10 +937,28 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
                                   servers,
                                   trail);
 
+  unsigned long elapsed_us = 0;
+  if (stopWatch.read(elapsed_us))
+  {
+    LatencyBreakdown::add(LatencyBreakdown::DNS, elapsed_us);
+  }
+
+  if (stack_data.dns_prefetcher != NULL)
+  {
+    stack_data.dns_prefetcher->record_lookup(name, port, transport);
+  }
+
   TRC_INFO("Resolved destination URI %s to %d servers",
            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
                                   (pjsip_uri*)next_hop).c_str(),
            servers.size());
+
+  if (stack_data.destination_health != NULL)
+  {
+    // Move any servers that are currently ejected as outliers to the end of
+    // the list, so they are only used if everything else fails.
+    stack_data.destination_health->reorder_servers(servers);
+  }
 }
 
 
@@ -1018,6 +1041,11 @@ struct StatefulSendState
   std::vector<AddrInfo> servers;
   int current_server;
 
+  // Time the request was sent to the current server, and whether the outcome
+  // has been reported to the destination health tracker.
+  unsigned long send_time_ms;
+  bool health_recorded;
+
   void* user_token;
   pjsip_endpt_send_callback user_cb;
 };
@@ -1041,6 +1069,30 @@ static void on_tsx_state(pjsip_transaction* tsx, pjsip_event* event)
     return;
   }
 
+  if ((!sss->servers.empty()) &&
+      (stack_data.destination_health != NULL) &&
+      (!sss->health_recorded))
+  {
+    // Report the latency of the final response from this server, or the
+    // failure if it errored or didn't respond.
+    DestinationHealth* health = stack_data.destination_health;
+    AddrInfo& server = sss->servers[sss->current_server];
+
+    if ((event->body.tsx_state.type == PJSIP_EVENT_TIMER) ||
+        (event->body.tsx_state.type == PJSIP_EVENT_TRANSPORT_ERROR) ||
+        (PJSIP_IS_STATUS_IN_CLASS(tsx->status_code, 500)))
+    {
+      health->record_failure(server);
+      sss->health_recorded = true;
+    }
+    else if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+             (tsx->status_code >= 200))
+    {
+      health->record_response(server, health->now_ms() - sss->send_time_ms);
+      sss->health_recorded = true;
+    }
+  }
+
   if (!sss->servers.empty())
   {
     // The target for the request came from the resolver, so check to see
@@ -1125,6 +1177,12 @@ static void on_tsx_state(pjsip_transaction* tsx, pjsip_event* event)
               // invoked again for the previous transaction.
               tsx->mod_data[mod_sprout_util.id] = NULL;
               retrying = true;
+
+              if (stack_data.destination_health != NULL)
+              {
+                sss->send_time_ms = stack_data.destination_health->now_ms();
+                sss->health_recorded = false;
+              }
             }
           }
         }
@@ -1172,6 +1230,8 @@ pj_status_t PJUtils::send_request(pjsip_tx_data* tdata,
   // Store the user supplied callback and token.
   sss->user_token = token;
   sss->user_cb = cb;
+  sss->send_time_ms = 0;
+  sss->health_recorded = false;
 
   if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
   {
@@ -1183,6 +1243,11 @@ pj_status_t PJUtils::send_request(pjsip_tx_data* tdata,
       // Set up the destination information for the first server.
       sss->current_server = 0;
       set_dest_info(tdata, sss->servers[sss->current_server]);
+
+      if (stack_data.destination_health != NULL)
+      {
+        sss->send_time_ms = stack_data.destination_health->now_ms();
+      }
     }
     else
     {
@@ -2197,6 +2262,7 @@ static std::string query_enum(pjsip_msg* req,
       pj_str_t pj_user = PJUtils::user_from_uri(uri);
       user = PJUtils::pj_str_to_string(&pj_user);
       TRC_DEBUG("Performing ENUM lookup for user %s", user.c_str());
+      LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::ENUM);
       new_uri = enum_service->lookup_uri_from_user(user, trail);
     }
   }
@@ -35,6 +35,7 @@
  */
 #include "ralf_processor.h"
 #include "exception_handler.h"
+#include "acr.h"
 
 /// Constructor.
 RalfProcessor::RalfProcessor(HttpConnection* ralf_connection,
@@ -68,6 +69,29 @@ void RalfProcessor::send_request_to_ralf(RalfRequest* rr)
 // Send the ACR to Ralf
 void RalfProcessor::Pool::process_work(RalfProcessor::RalfRequest*& rr)
 {
+  if (rr->acr != NULL)
+  {
+    // The ACR was deferred, so build the request from it now.  This uses
+    // PJSIP, so the thread must be registered with it.
+    if (!pj_thread_is_registered())
+    {
+      // The descriptor must last as long as the thread.
+      static thread_local pj_thread_desc desc;
+      pj_thread_t* thread;
+      pj_bzero(desc, sizeof(pj_thread_desc));
+      pj_thread_register("ralf", desc, &thread);
+    }
+
+    bool send = rr->acr->build_request(rr, rr->timestamp);
+    delete rr->acr; rr->acr = NULL;
+
+    if (!send)
+    {
+      delete rr; rr = NULL;
+      return;
+    }
+  }
+
   // Send the request using HTTPConnection, which adds penalties via
   // the load monitor if the request fails
   std::map<std::string, std::string> headers;
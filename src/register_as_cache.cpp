@@ -0,0 +1,196 @@
+/**
+ * @file register_as_cache.cpp Cache of the application servers selected for third-party REGISTERs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "log.h"
+#include "register_as_cache.h"
+
+RegisterAsCache::RegisterAsCache(size_t max_entries) :
+  _max_entries(max_entries),
+  _cache()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+RegisterAsCache::~RegisterAsCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+RegisterAsCache::Key RegisterAsCache::make_key(uint64_t fingerprint,
+                                               bool is_initial_registration,
+                                               bool is_deregistration)
+{
+  return Key(fingerprint,
+             (is_initial_registration ? 1 : 0) | (is_deregistration ? 2 : 0));
+}
+
+
+bool RegisterAsCache::get(uint64_t fingerprint,
+                          bool is_initial_registration,
+                          bool is_deregistration,
+                          std::vector<AsInvocation>& as_list)
+{
+  bool found = false;
+  Key key = make_key(fingerprint, is_initial_registration, is_deregistration);
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<Key, std::vector<AsInvocation>>::const_iterator it = _cache.find(key);
+  if (it != _cache.end())
+  {
+    as_list = it->second;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("Application servers for iFCs %lx (%s, %s) %s in cache",
+            fingerprint,
+            is_initial_registration ? "initial" : "not initial",
+            is_deregistration ? "deregistration" : "registration",
+            found ? "found" : "not found");
+
+  return found;
+}
+
+
+void RegisterAsCache::put(uint64_t fingerprint,
+                          bool is_initial_registration,
+                          bool is_deregistration,
+                          const std::vector<AsInvocation>& as_list)
+{
+  Key key = make_key(fingerprint, is_initial_registration, is_deregistration);
+
+  pthread_mutex_lock(&_lock);
+
+  if ((_cache.size() >= _max_entries) &&
+      (_cache.find(key) == _cache.end()))
+  {
+    // The cache is full.  The number of distinct service profiles is
+    // normally small, so this only happens if they are changing frequently,
+    // in which case most entries are stale anyway.  Start again.
+    TRC_DEBUG("Register AS cache full, clearing");
+    _cache.clear();
+  }
+
+  _cache[key] = as_list;
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t RegisterAsCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _cache.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void RegisterAsCache::save(WarmStartSnapshot::Writer& writer)
+{
+  pthread_mutex_lock(&_lock);
+
+  writer.put_u32(_cache.size());
+
+  for (std::map<Key, std::vector<AsInvocation>>::const_iterator i = _cache.begin();
+       i != _cache.end();
+       ++i)
+  {
+    writer.put_u64(i->first.first);
+    writer.put_u32(i->first.second);
+    writer.put_u32(i->second.size());
+
+    for (std::vector<AsInvocation>::const_iterator as = i->second.begin();
+         as != i->second.end();
+         ++as)
+    {
+      writer.put_string(as->server_name);
+      writer.put_u32(as->default_handling);
+      writer.put_string(as->service_info);
+      writer.put_u32((as->include_register_request ? 1 : 0) |
+                     (as->include_register_response ? 2 : 0));
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void RegisterAsCache::restore(WarmStartSnapshot::Reader& reader, int age_s)
+{
+  size_t restored = 0;
+  uint32_t count = reader.get_u32();
+
+  pthread_mutex_lock(&_lock);
+
+  for (uint32_t i = 0; (i < count) && (!reader.failed()); ++i)
+  {
+    Key key;
+    key.first = reader.get_u64();
+    key.second = reader.get_u32();
+
+    std::vector<AsInvocation> as_list;
+    uint32_t num_as = reader.get_u32();
+
+    for (uint32_t j = 0; (j < num_as) && (!reader.failed()); ++j)
+    {
+      AsInvocation as;
+      as.server_name = reader.get_string();
+      as.default_handling = (reader.get_u32() == SESSION_TERMINATED) ?
+                              SESSION_TERMINATED : SESSION_CONTINUED;
+      as.service_info = reader.get_string();
+      uint32_t flags = reader.get_u32();
+      as.include_register_request = ((flags & 1) != 0);
+      as.include_register_response = ((flags & 2) != 0);
+      as_list.push_back(as);
+    }
+
+    if ((!reader.failed()) && (_cache.size() < _max_entries))
+    {
+      _cache[key] = as_list;
+      ++restored;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_STATUS("Restored %ld of %u register AS cache entries from warm-start snapshot",
+             restored, count);
+}
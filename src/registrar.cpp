@@ -55,6 +55,7 @@ extern "C" {
 #include "pjutils.h"
 #include "stack.h"
 #include "memcachedstore.h"
+#include "aor_write_serializer.h"
 #include "hssconnection.h"
 #include "registrar.h"
 #include "registration_utils.h"
@@ -68,6 +69,10 @@ extern "C" {
 static SubscriberDataManager* sdm;
 static SubscriberDataManager* remote_sdm;
 
+// Replicates AoRs to the remote store in the background.  NULL if AoRs are
+// written to the remote store synchronously.
+static AoRReplicator* replicator;
+
 // Connection to the HSS service for retrieving associated public URIs.
 static HSSConnection* hss;
 
@@ -81,6 +86,11 @@ static int max_expires;
 // Pre-constructed Service Route header added to REGISTER responses.
 static pjsip_routing_hdr* service_route;
 
+// A REGISTER that refreshes existing bindings without otherwise changing them
+// isn't written to the store if it would extend each binding's expiry by less
+// than this percentage of the requested expiry.
+static const int REFRESH_DEFER_PERCENT = 10;
+
 //
 // mod_registrar is the module to receive SIP REGISTER requests.  This
 // must get invoked before the proxy UA module.
@@ -209,6 +219,192 @@ bool get_private_id(pjsip_rx_data* rdata, std::string& id)
   return success;
 }
 
+/// Get the Path headers from a REGISTER, splitting any comma-separated lists.
+static void get_path_headers(pjsip_msg* msg,
+                             std::list<std::string>& path_headers)
+{
+  path_headers.clear();
+  pjsip_routing_hdr* path_hdr = (pjsip_routing_hdr*)
+                      pjsip_msg_find_hdr_by_name(msg, &STR_PATH, NULL);
+
+  while (path_hdr)
+  {
+    std::string path = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                              path_hdr->name_addr.uri);
+    TRC_DEBUG("Path header %s", path.c_str());
+
+    // Extract all the paths from this header.
+    Utils::split_string(path, ',', path_headers, 0, true);
+
+    // Look for the next header.
+    path_hdr = (pjsip_routing_hdr*)
+            pjsip_msg_find_hdr_by_name(msg, &STR_PATH, path_hdr->next);
+  }
+}
+
+/// Get the parameters of a Contact header that are stored on the binding.
+static void get_contact_params(pjsip_contact_hdr* contact,
+                               std::map<std::string, std::string>& params)
+{
+  params.clear();
+  pjsip_param* p = contact->other_param.next;
+
+  while ((p != NULL) && (p != &contact->other_param))
+  {
+    std::string pname = PJUtils::pj_str_to_string(&p->name);
+    std::string pvalue = PJUtils::pj_str_to_string(&p->value);
+    // Skip parameters that must not be user-specified
+    if (pname != "pub-gruu")
+    {
+      params[pname] = pvalue;
+    }
+    p = p->next;
+  }
+}
+
+/// Determines whether a REGISTER is a pure refresh of existing bindings.
+/// This is the case if every contact refers to an existing binding that the
+/// REGISTER wouldn't change other than to push its expiry time out, and
+/// nothing in the AoR expired when it was read.
+///
+/// The refresh doesn't need to be written to the store at all (so can be
+/// deferred) if it would push every expiry time out by less than
+/// REFRESH_DEFER_PERCENT of the requested expiry.  The bindings keep their
+/// stored expiry times, which are never later than the UE asked for, and
+/// the UE learns them from the Contact headers on the 200 OK.
+static bool is_binding_refresh(SubscriberDataManager::AoRPair* aor_pair,
+                               pjsip_msg* msg,
+                               const std::string& cid,
+                               int cseq,
+                               int now,
+                               pjsip_expires_hdr* expires,
+                               const std::string& private_id,
+                               bool& deferrable,
+                               int& expiry)
+{
+  SubscriberDataManager::AoR* aor_data = aor_pair->get_current();
+  pjsip_contact_hdr* contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
+
+  if ((contact == NULL) ||
+      (aor_data->bindings().size() != aor_pair->get_orig()->bindings().size()) ||
+      (aor_data->subscriptions().size() != aor_pair->get_orig()->subscriptions().size()))
+  {
+    return false;
+  }
+
+  deferrable = true;
+
+  std::list<std::string> path_headers;
+  get_path_headers(msg, path_headers);
+
+  while (contact != NULL)
+  {
+    int contact_expiry = expiry_for_binding(contact, expires);
+
+    if ((contact->star) || (contact_expiry == 0))
+    {
+      return false;
+    }
+
+    pjsip_uri* uri = (contact->uri != NULL) ?
+                         (pjsip_uri*)pjsip_uri_get_uri(contact->uri) :
+                         NULL;
+
+    if ((uri == NULL) ||
+        (!PJSIP_URI_SCHEME_IS_SIP(uri)))
+    {
+      return false;
+    }
+
+    std::string contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
+    std::string binding_id = get_binding_id(contact);
+
+    if (binding_id == "")
+    {
+      binding_id = contact_uri;
+    }
+
+    SubscriberDataManager::AoR::Bindings::const_iterator i =
+                                          aor_data->bindings().find(binding_id);
+
+    if (i == aor_data->bindings().end())
+    {
+      return false;
+    }
+
+    SubscriberDataManager::AoR::Binding* binding = i->second;
+    int margin = (contact_expiry * REFRESH_DEFER_PERCENT) / 100;
+
+    if ((cid != binding->_cid) ||
+        (cseq <= binding->_cseq) ||
+        (binding->_emergency_registration) ||
+        (PJUtils::is_emergency_registration(contact)) ||
+        (binding->_expires > now + contact_expiry) ||
+        (binding->_uri != contact_uri) ||
+        (binding->_priority != contact->q1000) ||
+        (binding->_private_id != private_id) ||
+        (binding->_path_headers != path_headers))
+    {
+      return false;
+    }
+
+    std::map<std::string, std::string> params;
+    get_contact_params(contact, params);
+
+    if (binding->_params != params)
+    {
+      return false;
+    }
+
+    if (binding->_expires < now + contact_expiry - margin)
+    {
+      deferrable = false;
+    }
+
+    expiry = contact_expiry;
+    contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, contact->next);
+  }
+
+  return true;
+}
+
+/// Applies a REGISTER that is_binding_refresh has found to be a pure refresh
+/// to the bindings it refreshes, updating just their expiry times and CSeqs.
+static void refresh_bindings(const std::string& aor,
+                             SubscriberDataManager::AoR* aor_data,
+                             pjsip_msg* msg,
+                             int cseq,
+                             int now,
+                             pjsip_expires_hdr* expires)
+{
+  pjsip_contact_hdr* contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
+
+  while (contact != NULL)
+  {
+    int contact_expiry = expiry_for_binding(contact, expires);
+    pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(contact->uri);
+    std::string contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
+    std::string binding_id = get_binding_id(contact);
+
+    if (binding_id == "")
+    {
+      binding_id = contact_uri;
+    }
+
+    SubscriberDataManager::AoR::Binding* binding = aor_data->get_binding(binding_id);
+    binding->_cseq = cseq;
+    binding->_expires = now + contact_expiry;
+
+    if (analytics != NULL)
+    {
+      // Generate an analytics log for this binding update.
+      analytics->registration(aor, binding_id, contact_uri, contact_expiry);
+    }
+
+    contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, contact->next);
+  }
+}
+
 /// Write to the registration store.
 SubscriberDataManager::AoRPair* write_to_store(
                    SubscriberDataManager* primary_sdm,         ///<store to write to
@@ -217,6 +413,7 @@ SubscriberDataManager::AoRPair* write_to_store(
                    int now,                                    ///<time now
                    int& expiry,                                ///<[out] longest expiry time
                    bool& out_is_initial_registration,
+                   bool& out_refresh_deferred,                 ///<[out] whether the store write was skipped
                    SubscriberDataManager::AoRPair* backup_aor, ///<backup data if no entry in store
                    SubscriberDataManager* backup_sdm,          ///<backup store to read from if no entry in store and no backup data
                    std::string private_id,                     ///<private id that the binding was registered with
@@ -237,8 +434,12 @@ SubscriberDataManager::AoRPair* write_to_store(
   bool backup_aor_alloced = false;
   bool is_initial_registration = true;
   bool all_bindings_expired = false;
+  bool refresh_deferred = false;
   Store::Status set_rc;
 
+  // Queue behind any other writes to this AoR on this node.
+  AoRWriteSerializer::Write write(primary_sdm->write_serializer(), aor);
+
   do
   {
     // delete NULL is safe, so we can do this on every iteration.
@@ -296,6 +497,44 @@ SubscriberDataManager::AoRPair* write_to_store(
 
     is_initial_registration = is_initial_registration && aor_pair->get_current()->bindings().empty();
 
+    // If the REGISTER only refreshes the existing bindings, and only by a
+    // little, leave the stored AoR (and so its Chronos timer and any
+    // subscribers) alone.  If it refreshes them by more, just update their
+    // expiry times, which subscribers aren't told about.
+    bool deferrable = false;
+
+    if (is_binding_refresh(aor_pair,
+                           msg,
+                           cid,
+                           cseq,
+                           now,
+                           expires,
+                           private_id,
+                           deferrable,
+                           expiry))
+    {
+      if (deferrable)
+      {
+        TRC_DEBUG("REGISTER for %s only refreshes existing bindings - not writing to the store",
+                  aor.c_str());
+        refresh_deferred = true;
+        set_rc = Store::OK;
+        break;
+      }
+
+      TRC_DEBUG("REGISTER for %s only refreshes existing bindings - updating expiry times",
+                aor.c_str());
+      refresh_bindings(aor, aor_pair->get_current(), msg, cseq, now, expires);
+      set_rc = primary_sdm->refresh_aor_data(aor, aor_pair, trail);
+
+      if (set_rc != Store::OK)
+      {
+        delete aor_pair; aor_pair = NULL;
+      }
+
+      continue;
+    }
+
     // Now loop through all the contacts.  If there are multiple contacts in
     // the contact header in the SIP message, pjsip parses them to separate
     // contact header structures.
@@ -350,41 +589,13 @@ SubscriberDataManager::AoRPair* write_to_store(
           // rejecting a request with a Path header if there is no corresponding
           // "path" entry in the Supported header but we don't do so on the assumption
           // that the edge proxy knows what it's doing.
-          binding->_path_headers.clear();
-          pjsip_routing_hdr* path_hdr = (pjsip_routing_hdr*)
-                              pjsip_msg_find_hdr_by_name(msg, &STR_PATH, NULL);
-
-          while (path_hdr)
-          {
-            std::string path = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                                      path_hdr->name_addr.uri);
-            TRC_DEBUG("Path header %s", path.c_str());
-
-            // Extract all the paths from this header.
-            Utils::split_string(path, ',', binding->_path_headers, 0, true);
-
-            // Look for the next header.
-            path_hdr = (pjsip_routing_hdr*)
-                    pjsip_msg_find_hdr_by_name(msg, &STR_PATH, path_hdr->next);
-          }
+          get_path_headers(msg, binding->_path_headers);
 
           binding->_cid = cid;
           binding->_cseq = cseq;
           binding->_priority = contact->q1000;
-          binding->_params.clear();
-          pjsip_param* p = contact->other_param.next;
-
-          while ((p != NULL) && (p != &contact->other_param))
-          {
-            std::string pname = PJUtils::pj_str_to_string(&p->name);
-            std::string pvalue = PJUtils::pj_str_to_string(&p->value);
-            // Skip parameters that must not be user-specified
-            if (pname != "pub-gruu")
-            {
-              binding->_params[pname] = pvalue;
-            }
-            p = p->next;
-          }
+          get_contact_params(contact, binding->_params);
+          binding->parse_features();
 
           binding->_private_id = private_id;
           binding->_emergency_registration = PJUtils::is_emergency_registration(contact);
@@ -419,7 +630,9 @@ SubscriberDataManager::AoRPair* write_to_store(
       delete aor_pair; aor_pair = NULL;
     }
   }
-  while (set_rc == Store::DATA_CONTENTION);
+  while (write.retry(set_rc));
+
+  write.finish();
 
   // If we allocated the backup AoR, tidy up.
   if (backup_aor_alloced)
@@ -434,6 +647,7 @@ SubscriberDataManager::AoRPair* write_to_store(
   }
 
   out_is_initial_registration = is_initial_registration;
+  out_refresh_deferred = refresh_deferred;
 
   return aor_pair;
 }
@@ -448,6 +662,7 @@ void process_register_request(pjsip_rx_data* rdata)
   int now = time(NULL);
   int expiry = 0;
   bool is_initial_registration;
+  bool refresh_deferred;
 
   // Loop through headers as early as possible so that we know the expiry time
   // and which registration statistics to update.
@@ -696,6 +911,7 @@ void process_register_request(pjsip_rx_data* rdata)
                                                 now,
                                                 expiry,
                                                 is_initial_registration,
+                                                refresh_deferred,
                                                 NULL,
                                                 remote_sdm,
                                                 private_id_for_binding,
@@ -707,8 +923,17 @@ void process_register_request(pjsip_rx_data* rdata)
     log_bindings(aor, aor_pair->get_current());
 
     // If we have a remote store, try to store this there too.  We don't worry
-    // about failures in this case.
-    if ((remote_sdm != NULL) && remote_sdm->has_servers())
+    // about failures in this case.  There's nothing to replicate if the
+    // local write was skipped.
+    if (refresh_deferred)
+    {
+      TRC_DEBUG("Bindings unchanged - not replicating to the remote store");
+    }
+    else if (replicator != NULL)
+    {
+      replicator->replicate(aor, aor_pair, trail);
+    }
+    else if ((remote_sdm != NULL) && remote_sdm->has_servers())
     {
       int tmp_expiry = 0;
       bool ignored;
@@ -719,6 +944,7 @@ void process_register_request(pjsip_rx_data* rdata)
                                                      now,
                                                      tmp_expiry,
                                                      ignored,
+                                                     ignored,
                                                      aor_pair,
                                                      NULL,
                                                      private_id_for_binding,
@@ -1032,6 +1258,7 @@ void process_register_request(pjsip_rx_data* rdata)
                                                          expiry,
                                                          is_initial_registration,
                                                          public_id,
+                                                         RegistrationUtils::bindings_hash(aor_pair->get_current()),
                                                          trail);
   }
 
@@ -1087,12 +1314,17 @@ pj_status_t init_registrar(SubscriberDataManager* reg_sdm,
                            int cfg_max_expires,
                            bool force_original_register_inclusion,
                            SNMP::RegistrationStatsTables* reg_stats_tbls,
-                           SNMP::RegistrationStatsTables* third_party_reg_stats_tbls)
+                           SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
+                           ThirdPartyRegTracker* third_party_reg_tracker,
+                           SNMP::CounterTable* third_party_reg_sent_tbl,
+                           SNMP::CounterTable* third_party_reg_suppressed_tbl,
+                           AoRReplicator* aor_replicator)
 {
   pj_status_t status;
 
   sdm = reg_sdm;
   remote_sdm = reg_remote_sdm;
+  replicator = aor_replicator;
   hss = hss_connection;
   analytics = analytics_logger;
   max_expires = cfg_max_expires;
@@ -1100,7 +1332,12 @@ pj_status_t init_registrar(SubscriberDataManager* reg_sdm,
   reg_stats_tables = reg_stats_tbls;
   third_party_reg_stats_tables = third_party_reg_stats_tbls;
 
-  RegistrationUtils::init(third_party_reg_stats_tbls, force_original_register_inclusion);
+  RegistrationUtils::init(third_party_reg_stats_tbls,
+                          force_original_register_inclusion,
+                          third_party_reg_tracker,
+                          third_party_reg_sent_tbl,
+                          third_party_reg_suppressed_tbl,
+                          aor_replicator);
 
   // Construct a Service-Route header pointing at the S-CSCF ready to be added
   // to REGISTER 200 OK response.
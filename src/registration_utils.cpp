@@ -44,6 +44,8 @@ extern "C" {
 
 #include <string>
 #include <cassert>
+#include <functional>
+#include <time.h>
 #include "constants.h"
 #include "ifchandler.h"
 #include "pjutils.h"
@@ -54,6 +56,8 @@ extern "C" {
 #include <boost/lexical_cast.hpp>
 #include "sproutsasevent.h"
 #include "snmp_success_fail_count_table.h"
+#include "register_as_cache.h"
+#include "aor_write_serializer.h"
 
 #define MAX_SIP_MSG_SIZE 65535
 
@@ -63,11 +67,26 @@ static SNMP::RegistrationStatsTables* third_party_reg_stats_tables;
 // messages to application servers, even if the iFCs don't tell us to?
 static bool force_third_party_register_body;
 
+// Tracks third-party registrations so that unchanged re-REGISTERs need not
+// be passed on to application servers.  NULL if this is disabled.
+static ThirdPartyRegTracker* third_party_reg_tracker;
+static SNMP::CounterTable* third_party_reg_sent_tbl;
+static SNMP::CounterTable* third_party_reg_suppressed_tbl;
+
+// The application servers selected by each set of iFCs for REGISTERs, where
+// this doesn't depend on the REGISTER itself.
+static RegisterAsCache register_as_cache;
+
+// Replicates AoRs to the remote store after bindings are removed.  NULL if
+// removals are not replicated.
+static AoRReplicator* replicator;
+
 /// Temporary data structure maintained while transmitting a third-party
 /// REGISTER to an application server.
 struct ThirdPartyRegData
 {
   std::string public_id;
+  std::string server_name;
   DefaultHandling default_handling;
   SAS::TrailId trail;
   int expires;
@@ -83,10 +102,102 @@ void send_register_to_as(pjsip_rx_data* received_register,
                          SAS::TrailId);
 
 void RegistrationUtils::init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-                             bool force_third_party_register_body_arg)
+                             bool force_third_party_register_body_arg,
+                             ThirdPartyRegTracker* third_party_reg_tracker_arg,
+                             SNMP::CounterTable* third_party_reg_sent_tbl_arg,
+                             SNMP::CounterTable* third_party_reg_suppressed_tbl_arg,
+                             AoRReplicator* replicator_arg)
 {
   third_party_reg_stats_tables = third_party_reg_stats_tables_arg;
   force_third_party_register_body = force_third_party_register_body_arg;
+  third_party_reg_tracker = third_party_reg_tracker_arg;
+  third_party_reg_sent_tbl = third_party_reg_sent_tbl_arg;
+  third_party_reg_suppressed_tbl = third_party_reg_suppressed_tbl_arg;
+  replicator = replicator_arg;
+}
+
+void RegistrationUtils::add_to_warm_start_snapshot(WarmStartSnapshot* snapshot)
+{
+  snapshot->add_section(WarmStartSnapshot::SECTION_REGISTER_AS,
+                        std::bind(&RegisterAsCache::save,
+                                  &register_as_cache,
+                                  std::placeholders::_1),
+                        std::bind(&RegisterAsCache::restore,
+                                  &register_as_cache,
+                                  std::placeholders::_1,
+                                  std::placeholders::_2));
+}
+
+void RegistrationUtils::ThirdPartyRegRefresher::send_refresh(const std::string& served_user,
+                                                             const AsInvocation& as,
+                                                             int expires)
+{
+  // Refreshes are sent from the tracker's own thread, which PJSIP doesn't
+  // know about yet.
+  if (!pj_thread_is_registered())
+  {
+    pj_thread_desc* desc = (pj_thread_desc*)malloc(sizeof(pj_thread_desc));
+    pj_bzero(desc, sizeof(pj_thread_desc));
+    pj_thread_t* thread;
+    pj_thread_register("3pr-refresh", *desc, &thread);
+  }
+
+  if (third_party_reg_stats_tables != NULL)
+  {
+    third_party_reg_stats_tables->re_reg_tbl->increment_attempts();
+  }
+
+  if (third_party_reg_sent_tbl != NULL)
+  {
+    third_party_reg_sent_tbl->increment();
+  }
+
+  // Refreshes aren't triggered by a message, so start a new trail for each.
+  SAS::TrailId trail = SAS::new_trail(1u);
+
+  AsInvocation as_copy = as;
+  send_register_to_as(NULL, NULL, as_copy, expires, false, served_user, trail);
+}
+
+uint64_t RegistrationUtils::bindings_hash(SubscriberDataManager::AoR* aor_data)
+{
+  // FNV-1a over the hashes of the individual fields.
+  uint64_t hash = 14695981039346656037ULL;
+  std::hash<std::string> hash_fn;
+
+  if (aor_data == NULL)
+  {
+    return hash;
+  }
+
+  for (SubscriberDataManager::AoR::Bindings::const_iterator i =
+         aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    SubscriberDataManager::AoR::Binding* b = i->second;
+    std::vector<std::string> fields;
+    fields.push_back(i->first);
+    fields.push_back(b->_uri);
+    fields.insert(fields.end(), b->_path_headers.begin(), b->_path_headers.end());
+
+    for (std::map<std::string, std::string>::const_iterator p = b->_params.begin();
+         p != b->_params.end();
+         ++p)
+    {
+      fields.push_back(p->first + "=" + p->second);
+    }
+
+    for (std::vector<std::string>::const_iterator f = fields.begin();
+         f != fields.end();
+         ++f)
+    {
+      hash ^= hash_fn(*f);
+      hash *= 1099511628211ULL;
+    }
+  }
+
+  return hash;
 }
 
 void RegistrationUtils::deregister_with_application_servers(Ifcs& ifcs,
@@ -101,6 +212,7 @@ void RegistrationUtils::deregister_with_application_servers(Ifcs& ifcs,
                                                        0,
                                                        false,
                                                        served_user,
+                                                       0,
                                                        trail);
 }
 
@@ -111,6 +223,7 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
                                                           int expires,
                                                           bool is_initial_registration,
                                                           const std::string& served_user,
+                                                          uint64_t bindings_hash,
                                                           SAS::TrailId trail)
 {
   // Function preconditions
@@ -132,6 +245,35 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
   // See 3GPP TS 23.218 s5.2.1 note 2: "REGISTER is considered part of the UE-originating".
 
   if (received_register == NULL)
+  {
+    SAS::Event event(trail, SASEvent::REGISTER_AS_START, 0);
+    event.add_var_param(served_user);
+    SAS::report_event(event);
+  }
+
+  // If the iFCs don't look at the contents of the REGISTER, the application
+  // servers they select depend only on the iFCs and the registration type,
+  // so can be cached.  Deregistration triggers use the expiry in the
+  // REGISTER, which defaults to non-zero if there is no REGISTER.
+  bool cacheable = !ifcs.register_match_uses_message();
+  uint64_t fingerprint = cacheable ? ifcs.fingerprint() : 0;
+  bool is_deregistration =
+    ((received_register != NULL) &&
+     (PJUtils::max_expires(received_register->msg_info.msg, 3600) == 0));
+
+  if (ifcs.size() == 0)
+  {
+    TRC_DEBUG("No iFCs for %s", served_user.c_str());
+  }
+  else if ((cacheable) &&
+           (register_as_cache.get(fingerprint,
+                                  is_initial_registration,
+                                  is_deregistration,
+                                  as_list)))
+  {
+    TRC_DEBUG("Using cached Application Servers for %s", served_user.c_str());
+  }
+  else if (received_register == NULL)
   {
     pj_status_t status;
     pjsip_method method;
@@ -143,10 +285,6 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
 
     TRC_INFO("Generating a fake REGISTER to send to IfcHandler using AOR %s", served_user.c_str());
 
-    SAS::Event event(trail, SASEvent::REGISTER_AS_START, 0);
-    event.add_var_param(served_user);
-    SAS::report_event(event);
-
     status = pjsip_endpt_create_request(stack_data.endpt,
                                         &method,               // Method
                                         &stack_data.scscf_uri, // Target
@@ -169,6 +307,14 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
                      as_list,
                      trail);
       pjsip_tx_data_dec_ref(tdata);
+
+      if (cacheable)
+      {
+        register_as_cache.put(fingerprint,
+                              is_initial_registration,
+                              is_deregistration,
+                              as_list);
+      }
     }
     else
     {
@@ -182,15 +328,57 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
   else
   {
     ifcs.interpret(SessionCase::Originating, true, is_initial_registration, received_register->msg_info.msg, as_list, trail);
+
+    if (cacheable)
+    {
+      register_as_cache.put(fingerprint,
+                            is_initial_registration,
+                            is_deregistration,
+                            as_list);
+    }
   }
 
   TRC_INFO("Found %d Application Servers", as_list.size());
 
+  int now = time(NULL);
+
   // Loop through the as_list
   for (std::vector<AsInvocation>::iterator as_iter = as_list.begin();
        as_iter != as_list.end();
        as_iter++)
   {
+    // Third-party REGISTERs that carry the UE's REGISTER or the 200 OK must
+    // follow every REGISTER, but any others can be left to the tracker if
+    // nothing the AS can see has changed.
+    if ((third_party_reg_tracker != NULL) &&
+        (!as_iter->include_register_request) &&
+        (!as_iter->include_register_response) &&
+        (!force_third_party_register_body))
+    {
+      if (!third_party_reg_tracker->should_send(served_user,
+                                                *as_iter,
+                                                expires,
+                                                is_initial_registration,
+                                                bindings_hash,
+                                                now))
+      {
+        TRC_DEBUG("Third-party REGISTER to %s not needed",
+                  as_iter->server_name.c_str());
+
+        if (third_party_reg_suppressed_tbl != NULL)
+        {
+          third_party_reg_suppressed_tbl->increment();
+        }
+
+        continue;
+      }
+    }
+
+    if (third_party_reg_sent_tbl != NULL)
+    {
+      third_party_reg_sent_tbl->increment();
+    }
+
     if (third_party_reg_stats_tables != NULL)
     {
       if (expires == 0)
@@ -228,6 +416,16 @@ static void send_register_cb(void* token, pjsip_event *event)
 
     third_party_register_failed(tsxdata->public_id, tsxdata->trail);
   }
+
+  if ((third_party_reg_tracker != NULL) &&
+      (tsxdata->expires != 0) &&
+      (!PJSIP_IS_STATUS_IN_CLASS(tsx->status_code, 200)))
+  {
+    // The tracker assumed the REGISTER would succeed.  The AS may not hold
+    // a registration now, so don't suppress the next one.
+    third_party_reg_tracker->send_failed(tsxdata->public_id,
+                                         tsxdata->server_name);
+  }
   
   if (third_party_reg_stats_tables != NULL)
   {
@@ -323,6 +521,13 @@ void send_register_to_as(pjsip_rx_data *received_register,
 
     // Copy P-Charging-Function-Addresses from the OK response.
     PJUtils::clone_header(&STR_P_C_F_A, ok_response->msg, tdata->msg, tdata->pool);
+  }
+
+  // Refreshes sent by the third-party registration tracker have no
+  // REGISTER to copy, but still carry the service info.
+  if ((received_register && ok_response) ||
+      ((expires != 0) && (!as.service_info.empty())))
+  {
 
     // Generate a message body based on Filter Criteria values
     char buf[MAX_SIP_MSG_SIZE];
@@ -352,7 +557,8 @@ void send_register_to_as(pjsip_rx_data *received_register,
                                xml_part);
     }
 
-    if (as.include_register_request || force_third_party_register_body)
+    if ((received_register != NULL) &&
+        (as.include_register_request || force_third_party_register_body))
     {
       pjsip_multipart_part *request_part = pjsip_multipart_create_part(tdata->pool);
       pjsip_msg_print(received_register->msg_info.msg, buf, sizeof(buf));
@@ -365,7 +571,8 @@ void send_register_to_as(pjsip_rx_data *received_register,
                                request_part);
     }
 
-    if (as.include_register_response || force_third_party_register_body)
+    if ((ok_response != NULL) &&
+        (as.include_register_response || force_third_party_register_body))
     {
       pjsip_multipart_part *response_part = pjsip_multipart_create_part(tdata->pool);
       pjsip_msg_print(ok_response->msg, buf, sizeof(buf));
@@ -404,6 +611,7 @@ void send_register_to_as(pjsip_rx_data *received_register,
   tsxdata->default_handling = as.default_handling;
   tsxdata->trail = trail;
   tsxdata->public_id = served_user;
+  tsxdata->server_name = as.server_name;
   tsxdata->expires = expires;
   tsxdata->is_initial_registration = is_initial_registration;
   pj_status_t resolv_status = PJUtils::send_request(tdata, 0, tsxdata, &send_register_cb);
@@ -428,6 +636,7 @@ static bool expire_bindings(SubscriberDataManager *sdm,
   // We need the retry loop to handle the store's compare-and-swap.
   bool all_bindings_expired = false;
   Store::Status set_rc;
+  AoRWriteSerializer::Write write(sdm->write_serializer(), aor);
 
   do
   {
@@ -453,6 +662,12 @@ static bool expire_bindings(SubscriberDataManager *sdm,
     }
 
     set_rc = sdm->set_aor_data(aor, aor_pair, trail, all_bindings_expired);
+
+    if ((set_rc == Store::OK) && (replicator != NULL))
+    {
+      replicator->replicate(aor, aor_pair, trail);
+    }
+
     delete aor_pair; aor_pair = NULL;
 
     // We can only say for sure that the bindings were expired if we were able
@@ -460,7 +675,7 @@ static bool expire_bindings(SubscriberDataManager *sdm,
     all_bindings_expired = (all_bindings_expired && (set_rc == Store::OK));
 
   }
-  while (set_rc == Store::DATA_CONTENTION);
+  while (write.retry(set_rc));
 
   return all_bindings_expired;
 }
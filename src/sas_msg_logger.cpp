@@ -0,0 +1,352 @@
+/**
+ * @file sas_msg_logger.cpp Logging of SIP messages to SAS, optionally on a pool of threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+#include "pjutils.h"
+#include "stack.h"
+#include "sproutsasevent.h"
+#include "sas_msg_logger.h"
+
+SasMsgLogger::SasMsgLogger(int num_threads,
+                           size_t max_queue,
+                           SNMP::CounterTable* dropped_tbl) :
+  _num_threads(num_threads),
+  _max_queue(max_queue),
+  _dropped_tbl(dropped_tbl),
+  _sample_rates(),
+  _queue(),
+  _threads(),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+SasMsgLogger::~SasMsgLogger()
+{
+  // Let the threads drain the queue and exit.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void SasMsgLogger::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &log_thread, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start SAS logging thread: %s", strerror(rc));
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    _threads.push_back(thread);
+  }
+}
+
+
+bool SasMsgLogger::set_sample_rates(const std::string& sample_rates)
+{
+  std::map<std::string, int> rates;
+  std::vector<std::string> entries;
+  Utils::split_string(sample_rates, ',', entries, 0, true);
+
+  for (std::vector<std::string>::const_iterator it = entries.begin();
+       it != entries.end();
+       ++it)
+  {
+    size_t eq = it->find('=');
+    int rate = (eq != std::string::npos) ? atoi(it->c_str() + eq + 1) : 0;
+
+    if ((eq == 0) || (rate <= 0))
+    {
+      TRC_ERROR("Invalid SAS sample rate: %s", it->c_str());
+      _sample_rates.clear();
+      return false;
+    }
+
+    rates[it->substr(0, eq)] = rate;
+  }
+
+  _sample_rates = rates;
+  return true;
+}
+
+
+bool SasMsgLogger::should_log(SAS::TrailId trail,
+                              const pjsip_method* method) const
+{
+  if (_sample_rates.empty())
+  {
+    return true;
+  }
+
+  std::map<std::string, int>::const_iterator it =
+    _sample_rates.find(PJUtils::pj_str_to_string(&method->name));
+
+  if (it == _sample_rates.end())
+  {
+    return true;
+  }
+
+  // Trail IDs are allocated sequentially, so mix them up before choosing
+  // which to log.
+  uint64_t hash = (uint64_t)trail * 0x9E3779B97F4A7C15ULL;
+  return (((hash >> 32) % it->second) == 0);
+}
+
+
+void SasMsgLogger::log_rx_msg(SAS::TrailId trail, pjsip_rx_data* rdata)
+{
+  if (_threads.empty())
+  {
+    PJUtils::report_sas_to_from_markers(trail, rdata->msg_info.msg);
+
+    pjsip_cid_hdr* cid = (pjsip_cid_hdr*)rdata->msg_info.cid;
+    PJUtils::mark_sas_call_branch_ids(trail, cid, rdata->msg_info.msg);
+
+    SAS::Event event(trail, SASEvent::RX_SIP_MSG, 0);
+    event.add_static_param(pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag));
+    event.add_static_param(rdata->pkt_info.src_port);
+    event.add_var_param(rdata->pkt_info.src_name);
+    event.add_compressed_param(rdata->msg_info.len, rdata->msg_info.msg_buf, &SASEvent::PROFILE_SIP);
+    SAS::report_event(event);
+    return;
+  }
+
+  // The transport reuses the receive buffer, so take a copy.
+  Msg msg;
+  msg.trail = trail;
+  msg.rx = true;
+  msg.transport_type = pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag);
+  msg.port = rdata->pkt_info.src_port;
+  msg.name = rdata->pkt_info.src_name;
+  msg.buf.assign(rdata->msg_info.msg_buf, rdata->msg_info.len);
+  queue_msg(msg);
+}
+
+
+void SasMsgLogger::log_tx_msg(SAS::TrailId trail, pjsip_tx_data* tdata)
+{
+  if (_threads.empty())
+  {
+    PJUtils::report_sas_to_from_markers(trail, tdata->msg);
+
+    PJUtils::mark_sas_call_branch_ids(trail, NULL, tdata->msg);
+
+    SAS::Event event(trail, SASEvent::TX_SIP_MSG, 0);
+    event.add_static_param(pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag));
+    event.add_static_param(tdata->tp_info.dst_port);
+    event.add_var_param(tdata->tp_info.dst_name);
+    event.add_compressed_param((int)(tdata->buf.cur - tdata->buf.start),
+                               tdata->buf.start,
+                               &SASEvent::PROFILE_SIP);
+    SAS::report_event(event);
+    return;
+  }
+
+  // The buffer may be reprinted if the message is changed and resent, so
+  // take a copy.
+  Msg msg;
+  msg.trail = trail;
+  msg.rx = false;
+  msg.transport_type = pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag);
+  msg.port = tdata->tp_info.dst_port;
+  msg.name = tdata->tp_info.dst_name;
+  msg.buf.assign(tdata->buf.start, tdata->buf.cur - tdata->buf.start);
+  queue_msg(msg);
+}
+
+
+size_t SasMsgLogger::queue_size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t queue_size = _queue.size();
+  pthread_mutex_unlock(&_lock);
+  return queue_size;
+}
+
+
+void SasMsgLogger::queue_msg(Msg& msg)
+{
+  bool queued = false;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_queue.size() < _max_queue)
+  {
+    // Swap the buffer into the queue rather than copying it again.
+    _queue.push_back(Msg());
+    Msg& queued_msg = _queue.back();
+    queued_msg.trail = msg.trail;
+    queued_msg.rx = msg.rx;
+    queued_msg.transport_type = msg.transport_type;
+    queued_msg.port = msg.port;
+    queued_msg.name.swap(msg.name);
+    queued_msg.buf.swap(msg.buf);
+    pthread_cond_signal(&_cond);
+    queued = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!queued)
+  {
+    TRC_DEBUG("SAS logging queue full, dropping message for trail %llu",
+              msg.trail);
+
+    if (_dropped_tbl != NULL)
+    {
+      _dropped_tbl->increment();
+    }
+  }
+}
+
+
+/// Logs a queued message, parsing it again to find the markers.
+void SasMsgLogger::log_msg(Msg& msg, pj_pool_t* pool)
+{
+  // The parser needs a null-terminated buffer it can own.
+  char* buf = (char*)pj_pool_alloc(pool, msg.buf.size() + 1);
+  memcpy(buf, msg.buf.data(), msg.buf.size());
+  buf[msg.buf.size()] = '\0';
+  pjsip_msg* parsed_msg = pjsip_parse_msg(pool, buf, msg.buf.size(), NULL);
+
+  if (parsed_msg != NULL)
+  {
+    PJUtils::report_sas_to_from_markers(msg.trail, parsed_msg);
+
+    // The Call-ID is only marked on received messages.
+    pjsip_cid_hdr* cid = msg.rx ?
+      (pjsip_cid_hdr*)pjsip_msg_find_hdr(parsed_msg, PJSIP_H_CALL_ID, NULL) :
+      NULL;
+    PJUtils::mark_sas_call_branch_ids(msg.trail, cid, parsed_msg);
+  }
+  else
+  {
+    TRC_DEBUG("Failed to reparse message for trail %llu", msg.trail); // LCOV_EXCL_LINE
+  }
+
+  SAS::Event event(msg.trail,
+                   msg.rx ? SASEvent::RX_SIP_MSG : SASEvent::TX_SIP_MSG,
+                   0);
+  event.add_static_param(msg.transport_type);
+  event.add_static_param(msg.port);
+  event.add_var_param(msg.name);
+  event.add_compressed_param(msg.buf, &SASEvent::PROFILE_SIP);
+  SAS::report_event(event);
+}
+
+
+void SasMsgLogger::log_loop()
+{
+  // Parsing uses PJSIP, which needs to know about this thread.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pj_bzero(desc, sizeof(pj_thread_desc));
+  pj_thread_register("sas-logger", desc, &thread);
+
+  pj_pool_t* pool = pj_pool_create(&stack_data.cp.factory,
+                                   "sas-logger",
+                                   4096,
+                                   4096,
+                                   NULL);
+
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((_queue.empty()) && (!_terminated))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_queue.empty())
+    {
+      // Terminated, and there's nothing left to log.
+      break;
+    }
+
+    Msg msg;
+    msg.trail = _queue.front().trail;
+    msg.rx = _queue.front().rx;
+    msg.transport_type = _queue.front().transport_type;
+    msg.port = _queue.front().port;
+    msg.name.swap(_queue.front().name);
+    msg.buf.swap(_queue.front().buf);
+    _queue.pop_front();
+
+    pthread_mutex_unlock(&_lock);
+
+    log_msg(msg, pool);
+    pj_pool_reset(pool);
+
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  pj_pool_release(pool);
+}
+
+
+void* SasMsgLogger::log_thread(void* p)
+{
+  ((SasMsgLogger*)p)->log_loop();
+  return NULL;
+}
@@ -50,6 +50,7 @@
 
 SCSCFSelector::SCSCFSelector(std::string configuration) :
   _configuration(configuration),
+  _capability_words(0),
   _updater(NULL)
 {
   // create an updater
@@ -148,9 +149,71 @@ void SCSCFSelector::update_scscf()
       }
     }
 
+    // Sort the S-CSCFs by priority, so that selection can consider the best
+    // priority first.
+    std::stable_sort(new_scscfs.begin(),
+                     new_scscfs.end(),
+                     [](const scscf_t& a, const scscf_t& b)
+                     {
+                       return a.priority < b.priority;
+                     });
+
+    // Assign a bit to each capability offered by any S-CSCF, and convert each
+    // S-CSCF's capabilities to a bitset.
+    std::map<int, size_t> capability_bits;
+    for (std::vector<scscf_t>::const_iterator it = new_scscfs.begin();
+         it != new_scscfs.end();
+         ++it)
+    {
+      for (std::vector<int>::const_iterator cap = it->capabilities.begin();
+           cap != it->capabilities.end();
+           ++cap)
+      {
+        capability_bits.insert(std::make_pair(*cap, capability_bits.size()));
+      }
+    }
+
+    size_t capability_words = (capability_bits.size() + 63) / 64;
+    std::vector<priority_group_t> priority_groups;
+
+    for (size_t ii = 0; ii < new_scscfs.size(); ++ii)
+    {
+      scscf_t& new_scscf = new_scscfs[ii];
+      new_scscf.capability_bits.assign(capability_words, 0);
+
+      for (std::vector<int>::const_iterator cap = new_scscf.capabilities.begin();
+           cap != new_scscf.capabilities.end();
+           ++cap)
+      {
+        size_t bit = capability_bits[*cap];
+        new_scscf.capability_bits[bit / 64] |= ((uint64_t)1 << (bit % 64));
+      }
+
+      // Group the S-CSCFs by priority, and total up the weights in each
+      // group for weighted selection.
+      if ((priority_groups.empty()) ||
+          (new_scscfs[priority_groups.back().begin].priority != new_scscf.priority))
+      {
+        priority_group_t group;
+        group.begin = ii;
+        group.end = ii;
+        group.total_weight = 0;
+        priority_groups.push_back(group);
+      }
+
+      priority_group_t& group = priority_groups.back();
+      group.end = ii + 1;
+      group.total_weight += new_scscf.weight;
+      new_scscf.group = priority_groups.size() - 1;
+      new_scscf.cumulative_weight = group.total_weight;
+    }
+
     // Take a write lock on the mutex in RAII style
     boost::lock_guard<boost::shared_mutex> write_lock(_scscfs_rw_lock);
     _scscfs = new_scscfs;
+    _priority_groups = priority_groups;
+    _capability_bits = capability_bits;
+    _capability_words = capability_words;
   }
   catch (JsonFormatError err)
   {
@@ -166,6 +229,57 @@ SCSCFSelector::~SCSCFSelector()
   _updater = NULL;
 }
 
+bool SCSCFSelector::capabilities_to_bits(const std::vector<int>& capabilities,
+                                         std::vector<uint64_t>& bits)
+{
+  bool all_offered = true;
+  bits.assign(_capability_words, 0);
+
+  for (std::vector<int>::const_iterator cap = capabilities.begin();
+       cap != capabilities.end();
+       ++cap)
+  {
+    std::map<int, size_t>::const_iterator bit = _capability_bits.find(*cap);
+
+    if (bit != _capability_bits.end())
+    {
+      bits[bit->second / 64] |= ((uint64_t)1 << (bit->second % 64));
+    }
+    else
+    {
+      all_offered = false;
+    }
+  }
+
+  return all_offered;
+}
+
+// Builds a string listing a set of capabilities (sorted, without duplicates)
+// for SAS logging.
+static std::string capabilities_str(const std::vector<int>& capabilities)
+{
+  std::vector<int> caps = capabilities;
+  std::sort(caps.begin(), caps.end());
+  caps.erase(unique(caps.begin(), caps.end()), caps.end());
+  std::string str;
+  for (std::vector<int>::const_iterator ii = caps.begin(); ii != caps.end(); ++ii)
+  {
+    str = str + std::to_string(*ii) + ";";
+  }
+  return str;
+}
+
+// Builds a string listing the rejected S-CSCFs for SAS logging.
+static std::string rejects_str(const std::vector<std::string>& rejects)
+{
+  std::string str;
+  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
+  {
+    str = str + *ii + ";";
+  }
+  return str;
+}
+
 std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
                                      const std::vector<int> &optional,
                                      const std::vector<std::string> &rejects,
@@ -186,141 +300,177 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
     return std::string();
   }
 
-  // There's at least one S-CSCF, so check if any match the capabilities requested
-  std::string reject_str;
-  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
-  {
-    reject_str = reject_str + *ii + ";";
-  }
+  // There's at least one S-CSCF, so check if any match the capabilities
+  // requested.  If any mandatory capability isn't offered by any S-CSCF, none
+  // can match.
+  std::vector<uint64_t> mandatory_bits;
+  std::vector<uint64_t> optional_bits;
+  bool mandatory_offered = capabilities_to_bits(mandatory, mandatory_bits);
+  capabilities_to_bits(optional, optional_bits);
+
+  // Find all S-CSCFs that have all the mandatory capabilities, the highest
+  // possible number of optional capabilities, and the highest priority
+  // (closest to 0).  The S-CSCFs are sorted by priority, so the first one
+  // found with a given number of optional capabilities has the best
+  // priority for that number.
+  std::vector<size_t> matches;
+  int max_optional = -1;
+  int priority = 0;
 
-  // Sort the mandatory capabilities, and remove duplicates.
-  std::vector<int> mandatory_cap = mandatory;
-  std::sort(mandatory_cap.begin(), mandatory_cap.end());
-  mandatory_cap.erase(unique(mandatory_cap.begin(), mandatory_cap.end()), mandatory_cap.end());
-  std::string mandatory_str;
-  for (std::vector<int>::const_iterator ii = mandatory_cap.begin(); ii != mandatory_cap.end(); ++ii)
+  for (size_t ii = 0; (mandatory_offered) && (ii < _scscfs.size()); ++ii)
   {
-    mandatory_str = mandatory_str + std::to_string(*ii) + ";";
-  }
+    const scscf_t& candidate = _scscfs[ii];
 
-  // Sort the optional capabilities, and remove duplicates.
-  std::vector<int> optional_cap = optional;
-  std::sort(optional_cap.begin(), optional_cap.end());
-  optional_cap.erase(unique(optional_cap.begin(), optional_cap.end()), optional_cap.end());
-  std::string optional_str;
-  for (std::vector<int>::const_iterator ii = optional_cap.begin(); ii != optional_cap.end(); ++ii)
-  {
-    optional_str = optional_str + std::to_string(*ii) + ";";
-  }
+    // Only include the S-CSCF if its name isn't in the list of S-CSCFs to
+    // reject and it has all of the mandatory capabilities.
+    if (std::find(rejects.begin(), rejects.end(), candidate.server) != rejects.end())
+    {
+      continue;
+    }
 
-  // Find all S-CSCFs that have all the mandatory capabilities, the highest possible number
-  // of optional capabilities, and the highest priority (closest to 0).
-  // Also sum up the weights of the valid S-CSCFs as part of the iteration
-  std::vector<scscf> matches;
-  u_int max_size = 0;
-  int priority = 0;
-  int sum = 0;
+    bool has_mandatory = true;
+    int optional_count = 0;
 
-  for (std::vector<scscf>::iterator it=_scscfs.begin(); it!=_scscfs.end(); ++it)
-  {
-    // Only include the S-CSCF if its name isn't in the list of S-CSCFs to reject and it has all of
-    // the mandatory capabilities
-    if ((std::find(rejects.begin(), rejects.end(), it->server) == rejects.end()) &&
-        (std::includes(it->capabilities.begin(), it->capabilities.end(), mandatory_cap.begin(), mandatory_cap.end())))
+    for (size_t word = 0; word < _capability_words; ++word)
     {
-      std::vector<int> intersection;
-      std::set_intersection(it->capabilities.begin(), it->capabilities.end(),
-                            optional_cap.begin(), optional_cap.end(),
-                            std::back_inserter(intersection));
+      uint64_t caps = candidate.capability_bits[word];
 
-      if (intersection.size() > max_size ||
-          matches.size() == 0)
-      {
-        matches.clear();
-        matches.push_back(*it);
-        max_size = intersection.size();
-        priority = it->priority;
-        sum = it->weight;
-      }
-      else if (intersection.size() == max_size)
+      if ((caps & mandatory_bits[word]) != mandatory_bits[word])
       {
-        if (it->priority == priority)
-        {
-          matches.push_back(*it);
-          sum += it->weight;
-        }
-        else if (it->priority < priority)
-        {
-          matches.clear();
-          matches.push_back(*it);
-          priority = it->priority;
-          sum = it->weight;
-        }
+        has_mandatory = false;
+        break;
       }
+
+      optional_count += __builtin_popcountll(caps & optional_bits[word]);
+    }
+
+    if (!has_mandatory)
+    {
+      continue;
+    }
+
+    if (optional_count > max_optional)
+    {
+      matches.clear();
+      matches.push_back(ii);
+      max_optional = optional_count;
+      priority = candidate.priority;
+    }
+    else if ((optional_count == max_optional) &&
+             (candidate.priority == priority))
+    {
+      matches.push_back(ii);
     }
   }
 
   // If there are no matches, return an empty string (there will only be no matches
   // if no S-CSCFs had all the requested mandatory capabilities).
-  // If there's only one match, then return its name.
   if (matches.empty())
   {
+    std::string mandatory_str = capabilities_str(mandatory);
     TRC_WARNING("There are no configured S-CSCFs that have the requested mandatory capabilities (%s)",
                 mandatory_str.c_str());
 
-    SAS::Event event(trail, SASEvent::SCSCF_NONE_VALID, 0);
-    event.add_var_param(mandatory_str);
-    event.add_var_param(optional_str);
-    event.add_var_param(reject_str);
-    SAS::report_event(event);
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SCSCF_NONE_VALID, 0);
+      event.add_var_param(mandatory_str);
+      std::string optional_str = capabilities_str(optional);
+      std::string reject_str = rejects_str(rejects);
+      event.add_var_param(optional_str);
+      event.add_var_param(reject_str);
+      SAS::report_event(event);
+    }
 
     return std::string();
   }
-  else if (matches.size() == 1)
+
+  // If there's only one match, then return its name.  Otherwise there are
+  // multiple S-CSCFs that match on all mandatory capabilities, the highest
+  // number of optional capabilities, and the highest priority, so select one
+  // using a weighted random choice.
+  size_t index = matches[0];
+
+  if (matches.size() > 1)
   {
-    TRC_DEBUG("Selected S-CSCF is %s",  matches[0].server.c_str());
+    const priority_group_t& group = _priority_groups[_scscfs[index].group];
 
+    if (matches.size() == group.end - group.begin)
+    {
+      // Every S-CSCF at this priority matched, so use the precomputed
+      // cumulative weights.
+      if (group.total_weight > 0)
+      {
+        srand(time(NULL));
+        int random = rand() % group.total_weight;
+        index = std::upper_bound(_scscfs.begin() + group.begin,
+                                 _scscfs.begin() + group.end,
+                                 random,
+                                 [](int value, const scscf_t& s)
+                                 {
+                                   return value < s.cumulative_weight;
+                                 }) - _scscfs.begin();
+      }
+    }
+    else
+    {
+      std::vector<int> cumulative_weights;
+      int sum = 0;
+
+      for (std::vector<size_t>::const_iterator ii = matches.begin();
+           ii != matches.end();
+           ++ii)
+      {
+        sum += _scscfs[*ii].weight;
+        cumulative_weights.push_back(sum);
+      }
+
+      if (sum > 0)
+      {
+        srand(time(NULL));
+        int random = rand() % sum;
+        index = matches[std::upper_bound(cumulative_weights.begin(),
+                                         cumulative_weights.end(),
+                                         random) - cumulative_weights.begin()];
+      }
+    }
+  }
+
+  TRC_DEBUG("Selected S-CSCF is %s",  _scscfs[index].server.c_str());
+
+  if (trail != 0)
+  {
     SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-    event.add_var_param(matches[0].server);
+    event.add_var_param(_scscfs[index].server);
+    std::string mandatory_str = capabilities_str(mandatory);
+    std::string optional_str = capabilities_str(optional);
     event.add_var_param(mandatory_str);
     event.add_var_param(optional_str);
-    std::string priority_str = std::to_string(matches[0].priority);
-    std::string weight_str = std::to_string(matches[0].weight);
+    std::string priority_str = std::to_string(_scscfs[index].priority);
+    std::string weight_str = std::to_string(_scscfs[index].weight);
     event.add_var_param(priority_str);
     event.add_var_param(weight_str);
+    std::string reject_str = rejects_str(rejects);
     event.add_var_param(reject_str);
     SAS::report_event(event);
-
-    return matches[0].server.c_str();
   }
 
-  // There are multiple S-CSCFs that match on all mandatory capabilities, the highest number of optional
-  // capabilities, and the highest priority. Select one using a weighted random choice.
-  srand(time(NULL));
-  int random;
-  random = rand() % sum;
+  return _scscfs[index].server;
+}
+
+
+std::vector<std::string> SCSCFSelector::get_all_scscfs()
+{
+  boost::shared_lock<boost::shared_mutex> read_lock(_scscfs_rw_lock);
 
-  int index = 0;
-  int accumulator = matches[index].weight;
+  std::vector<std::string> servers;
 
-  while (accumulator <= random)
+  for (std::vector<scscf>::const_iterator it = _scscfs.begin();
+       it != _scscfs.end();
+       ++it)
   {
-    index++;
-    accumulator +=  matches[index].weight;
+    servers.push_back(it->server);
   }
 
-  TRC_DEBUG("Selected S-CSCF is %s",  matches[index].server.c_str());
-
-  SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-  event.add_var_param(matches[index].server);
-  event.add_var_param(mandatory_str);
-  event.add_var_param(optional_str);
-  std::string priority_str = std::to_string(matches[index].priority);
-  std::string weight_str = std::to_string(matches[index].weight);
-  event.add_var_param(priority_str);
-  event.add_var_param(weight_str);
-  event.add_var_param(reject_str);
-  SAS::report_event(event);
-
-  return matches[index].server;
+  return servers;
 }
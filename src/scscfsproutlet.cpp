@@ -49,6 +49,7 @@
 #include "registration_utils.h"
 #include "scscfsproutlet.h"
 #include "uri_classifier.h"
+#include "sharded_stats.h"
 
 // Constant indicating there is no served user for a request.
 const char* NO_SERVED_USER = "";
@@ -90,10 +91,12 @@ SCSCFSproutlet::SCSCFSproutlet(const std::string& scscf_name,
   _sess_term_as_tracker(sess_term_as_tracker),
   _sess_cont_as_tracker(sess_cont_as_tracker)
 {
-  _incoming_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("scscf_incoming_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.20");
-  _outgoing_sip_transactions_tbl = SNMP::SuccessFailCountByRequestTypeTable::create("scscf_outgoing_sip_transactions",
-                                                                                    "1.2.826.0.1.1578918.9.3.21");
+  _incoming_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("scscf_incoming_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.20"));
+  _outgoing_sip_transactions_tbl = new ShardedSuccessFailCountByRequestTypeTable(
+      SNMP::SuccessFailCountByRequestTypeTable::create("scscf_outgoing_sip_transactions",
+                                                       "1.2.826.0.1.1578918.9.3.21"));
   _routed_by_preloaded_route_tbl = SNMP::CounterTable::create("scscf_routed_by_preloaded_route",
                                                               "1.2.826.0.1.1578918.9.3.26");
   _invites_cancelled_before_1xx_tbl = SNMP::CounterTable::create("invites_cancelled_before_1xx",
@@ -351,6 +354,7 @@ SCSCFSproutletTsx::SCSCFSproutletTsx(SproutletTsxHelper* helper,
   SproutletTsx(helper),
   _scscf(scscf),
   _cancelled(false),
+  _cancel_status(0),
   _session_case(NULL),
   _as_chain_link(),
   _hss_data_cached(false),
@@ -361,7 +365,14 @@ SCSCFSproutletTsx::SCSCFSproutletTsx(SproutletTsxHelper* helper,
   _failed_ood_acr(NULL),
   _target_aor(),
   _target_bindings(),
+  _async_op(ASYNC_NONE),
+  _ue_public_id(),
+  _ue_registered(false),
+  _ue_aor(),
+  _ue_aor_pair(NULL),
   _liveness_timer(0),
+  _as_stop_watch(),
+  _as_timing(false),
   _record_routed(false),
   _req_type(req_type),
   _seen_1xx(false),
@@ -406,6 +417,8 @@ SCSCFSproutletTsx::~SCSCFSproutletTsx()
   }
 
   _target_bindings.clear();
+
+  delete _ue_aor_pair; _ue_aor_pair = NULL;
 }
 
 
@@ -413,8 +426,6 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 {
   TRC_INFO("S-CSCF received initial request");
 
-  pjsip_status_code status_code = PJSIP_SC_OK;
-
   _se_helper.process_request(req, get_pool(req), trail());
 
   // Work out if we should be auto-registering the user based on this
@@ -438,9 +449,45 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     }
   }
 
-  // Determine the session case and the served user.  This will link to
-  // an AsChain object (creating it if necessary), if we need to provide
-  // services.
+  // Work out the session case, and find the AsChain if this request is
+  // returning from an application server.
+  retrieve_odi_and_sesscase(req);
+
+  // Work out which subscriber we need HSS data for.  That's the served user
+  // if we're starting a new AS chain, or the served user of the existing
+  // chain if we might need to check for a retarget.
+  std::string public_id;
+  if (!_as_chain_link.is_set())
+  {
+    public_id = served_user_from_msg(req);
+  }
+  else if (_session_case->is_terminating())
+  {
+    public_id = _as_chain_link.served_user();
+  }
+
+  if (!public_id.empty())
+  {
+    // Query the HSS without holding up this thread.  Processing continues in
+    // on_async_complete once the data is cached.
+    _async_op = ASYNC_HSS_QUERY;
+    SCSCFSproutletTsx* tsx = this;
+    run_async((void*)req,
+              [tsx, public_id]() { tsx->get_data_from_hss(public_id); });
+  }
+  else
+  {
+    continue_initial_request(req);
+  }
+}
+
+
+void SCSCFSproutletTsx::continue_initial_request(pjsip_msg* req)
+{
+  pjsip_status_code status_code = PJSIP_SC_OK;
+
+  // Determine the served user.  This will link to an AsChain object
+  // (creating it if necessary), if we need to provide services.
   status_code = determine_served_user(req);
 
   // Pass the received request to the ACR.
@@ -554,6 +601,17 @@ void SCSCFSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
 
   int st_code = rsp->line.status.code;
 
+  if ((_as_timing) && (st_code != PJSIP_SC_TRYING))
+  {
+    // This is the application server's first response.
+    unsigned long as_us = 0;
+    if (_as_stop_watch.read(as_us))
+    {
+      LatencyBreakdown::add_span(LatencyBreakdown::AS, as_us);
+    }
+    _as_timing = false;
+  }
+
   if (st_code == SIP_STATUS_FLOW_FAILED)
   {
     // The edge proxy / P-CSCF has reported that this flow has failed.
@@ -687,6 +745,7 @@ void SCSCFSproutletTsx::on_rx_cancel(int status_code, pjsip_msg* cancel_req)
   }
 
   _cancelled = true;
+  _cancel_status = status_code;
 
   if ((status_code == PJSIP_SC_REQUEST_TERMINATED) &&
       (cancel_req != NULL))
@@ -738,10 +797,11 @@ void SCSCFSproutletTsx::retrieve_odi_and_sesscase(pjsip_msg* req)
     {
       // This is one of our original dialog identifier (ODI) tokens.
       // See 3GPP TS 24.229 s5.4.3.4.
-      std::string odi_token = std::string(uri->user.ptr + STR_ODI_PREFIX.slen,
-                                          uri->user.slen - STR_ODI_PREFIX.slen);
-      TRC_DEBUG("Found ODI token %s", odi_token.c_str());
-      _as_chain_link = _scscf->as_chain_table()->lookup(odi_token);
+      const char* odi_token = uri->user.ptr + STR_ODI_PREFIX.slen;
+      size_t odi_token_len = uri->user.slen - STR_ODI_PREFIX.slen;
+      TRC_DEBUG("Found ODI token %.*s", (int)odi_token_len, odi_token);
+      _as_chain_link = _scscf->as_chain_table()->lookup(odi_token,
+                                                        odi_token_len);
 
       if (_as_chain_link.is_set())
       {
@@ -753,7 +813,8 @@ void SCSCFSproutletTsx::retrieve_odi_and_sesscase(pjsip_msg* req)
       else
       {
         // The ODI token is invalid or expired.  Treat call as OOTB.
-        TRC_INFO("Expired ODI token %s so handle as OOTB request", odi_token.c_str());
+        TRC_INFO("Expired ODI token %.*s so handle as OOTB request",
+                 (int)odi_token_len, odi_token);
         SAS::Event event(trail(), SASEvent::SCSCF_ODI_INVALID, 0);
         event.add_var_param(PJUtils::pj_str_to_string(&uri->user));
         SAS::report_event(event);
@@ -840,8 +901,6 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
 {
   pjsip_status_code status_code = PJSIP_SC_OK;
 
-  retrieve_odi_and_sesscase(req);
-
   if (_as_chain_link.is_set())
   {
     bool retargeted = false;
@@ -1326,6 +1385,12 @@ void SCSCFSproutletTsx::route_to_as(pjsip_msg* req, const std::string& server_na
     // Forward the request.
     send_request(req);
 
+    if (LatencyBreakdown::enabled())
+    {
+      _as_stop_watch.start();
+      _as_timing = true;
+    }
+
     // Start the liveness timer for the AS.
     int timeout = ((_as_chain_link.default_handling() == SESSION_CONTINUED) ?
                    _scscf->_session_continued_timeout_ms :
@@ -1466,10 +1531,23 @@ void SCSCFSproutletTsx::route_to_ue_bindings(pjsip_msg* req)
                                                         &called_party_id);
   pjsip_msg_add_hdr(req, hdr);
 
-  TargetList targets;
-  std::string aor;
+  // Look up the bindings without holding up this thread.  Routing continues
+  // in on_async_complete.
+  _async_op = ASYNC_GET_BINDINGS;
+  SCSCFSproutletTsx* tsx = this;
+  run_async((void*)req,
+            [tsx, public_id]() { tsx->get_ue_bindings(public_id); });
+}
+
 
-  if (is_user_registered(public_id))
+/// Works out the AoR for the public ID and reads its bindings from the
+/// registration store.
+void SCSCFSproutletTsx::get_ue_bindings(const std::string& public_id)
+{
+  _ue_public_id = public_id;
+  _ue_registered = is_user_registered(public_id);
+
+  if (_ue_registered)
   {
     // User is registered, so look up bindings.  Determine the canonical public
     // ID, and look up the set of associated URIs on the HSS.
@@ -1481,7 +1559,7 @@ void SCSCFSproutletTsx::route_to_ue_bindings(pjsip_msg* req)
         (std::find(uris.begin(), uris.end(), public_id) != uris.end()))
     {
       // Take the first associated URI as the AOR.
-      aor = uris.front();
+      _ue_aor = uris.front();
     }
     else
     {
@@ -1490,27 +1568,38 @@ void SCSCFSproutletTsx::route_to_ue_bindings(pjsip_msg* req)
       // fail, but we'll never misroute the call.
       TRC_WARNING("Invalid Homestead response - a user is registered but has no list of "
                   "associated URIs, or is not in its own list of associated URIs");
-      aor = public_id;
+      _ue_aor = public_id;
     }
 
-    // Get the bindings from the store and filter/sort them for the request.
-    SubscriberDataManager::AoRPair* aor_pair = NULL;
-    _scscf->get_bindings(aor, &aor_pair, trail());
+    // Get the bindings from the store.
+    _scscf->get_bindings(_ue_aor, &_ue_aor_pair, trail());
+  }
+}
 
-    if ((aor_pair != NULL) &&
-        (aor_pair->get_current() != NULL) &&
-        (!aor_pair->get_current()->bindings().empty()))
+
+/// Route the request to the bindings read by get_ue_bindings.
+void SCSCFSproutletTsx::route_to_ue_targets(pjsip_msg* req)
+{
+  pj_pool_t* pool = get_pool(req);
+  TargetList targets;
+  std::string aor = _ue_aor;
+  const std::string& public_id = _ue_public_id;
+
+  if (_ue_registered)
+  {
+    if ((_ue_aor_pair != NULL) &&
+        (_ue_aor_pair->get_current() != NULL) &&
+        (!_ue_aor_pair->get_current()->bindings().empty()))
     {
       // Retrieved bindings from the store so filter them to an ordered list
       // of targets.
       filter_bindings_to_targets(aor,
-                                 aor_pair->get_current(),
+                                 _ue_aor_pair->get_current(),
                                  req,
                                  pool,
                                  MAX_FORKING,
                                  targets,
                                  trail());
-      delete aor_pair; aor_pair = NULL;
     }
     else
     {
@@ -1523,6 +1612,8 @@ void SCSCFSproutletTsx::route_to_ue_bindings(pjsip_msg* req)
       event.add_var_param(public_id);
       SAS::report_event(event);
     }
+
+    delete _ue_aor_pair; _ue_aor_pair = NULL;
   }
   else
   {
@@ -1831,6 +1922,35 @@ void SCSCFSproutletTsx::on_timer_expiry(void* context)
   }
 }
 
+void SCSCFSproutletTsx::on_async_complete(void* context)
+{
+  pjsip_msg* req = (pjsip_msg*)context;
+  AsyncOp op = _async_op;
+  _async_op = ASYNC_NONE;
+
+  if (_cancelled)
+  {
+    // The request was cancelled while the HSS or store was being queried, so
+    // don't route it any further.
+    TRC_DEBUG("Request cancelled during blocking operation");
+    delete _ue_aor_pair; _ue_aor_pair = NULL;
+    if (_cancel_status == PJSIP_SC_REQUEST_TERMINATED)
+    {
+      pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+      send_response(rsp);
+    }
+    free_msg(req);
+  }
+  else if (op == ASYNC_HSS_QUERY)
+  {
+    continue_initial_request(req);
+  }
+  else
+  {
+    route_to_ue_targets(req);
+  }
+}
+
 /// Adds a second P-Asserted-Identity header to a message when required.
 ///
 /// We only add the header to messages for which all of the following is true:
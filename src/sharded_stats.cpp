@@ -0,0 +1,462 @@
+/**
+ * @file sharded_stats.cpp Per-thread sharding for hot-path SNMP statistics.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <set>
+
+#include "log.h"
+#include "sharded_stats.h"
+
+const int ShardedStats::NUM_SHARDS;
+const int ShardedStats::CACHE_LINE_SIZE;
+const int ShardedEventAccumulatorTable::BATCH_SIZE;
+const int ShardedSuccessFailCountByRequestTypeTable::MAX_REQUEST_TYPES;
+const int ShardedStatsFlusher::FLUSH_INTERVAL_MS;
+
+/// The tables to flush.  The lock is held while the tables are flushed, so
+/// once a table has unregistered it won't be flushed again.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::set<ShardedStats*>& registry()
+{
+  static std::set<ShardedStats*> tables;
+  return tables;
+}
+
+static std::atomic<int> next_shard(0);
+static thread_local int thread_shard = -1;
+
+ShardedStats::ShardedStats() :
+  _registered(false)
+{
+}
+
+
+ShardedStats::~ShardedStats()
+{
+  unregister_table();
+}
+
+
+int ShardedStats::shard_index()
+{
+  if (thread_shard == -1)
+  {
+    thread_shard = next_shard++ % NUM_SHARDS;
+  }
+
+  return thread_shard;
+}
+
+
+void* ShardedStats::operator new(size_t size)
+{
+  void* p = NULL;
+
+  if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0)
+  {
+    // LCOV_EXCL_START
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+
+  return p;
+}
+
+
+void ShardedStats::operator delete(void* p)
+{
+  free(p);
+}
+
+
+void ShardedStats::register_table()
+{
+  pthread_mutex_lock(&registry_lock);
+  registry().insert(this);
+  _registered = true;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+
+void ShardedStats::unregister_table()
+{
+  if (_registered)
+  {
+    pthread_mutex_lock(&registry_lock);
+    registry().erase(this);
+    _registered = false;
+    pthread_mutex_unlock(&registry_lock);
+  }
+}
+
+
+void ShardedStats::flush_all()
+{
+  pthread_mutex_lock(&registry_lock);
+
+  for (std::set<ShardedStats*>::const_iterator it = registry().begin();
+       it != registry().end();
+       ++it)
+  {
+    (*it)->flush();
+  }
+
+  pthread_mutex_unlock(&registry_lock);
+}
+
+
+ShardedCounterTable::ShardedCounterTable(SNMP::CounterTable* table) :
+  _table(table)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _shards[ii].count = 0;
+  }
+
+  register_table();
+}
+
+
+ShardedCounterTable::~ShardedCounterTable()
+{
+  unregister_table();
+  flush();
+  delete _table;
+}
+
+
+void ShardedCounterTable::increment()
+{
+  _shards[shard_index()].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void ShardedCounterTable::flush()
+{
+  // Total the shards before touching the underlying table, so it is
+  // updated in a single pass per flush.
+  uint64_t total = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    total += _shards[ii].count.exchange(0, std::memory_order_relaxed);
+  }
+
+  // SNMP::CounterTable only supports adding one at a time.
+  for (; total > 0; --total)
+  {
+    _table->increment();
+  }
+}
+
+
+ShardedEventAccumulatorTable::ShardedEventAccumulatorTable(
+                                       SNMP::EventAccumulatorTable* table) :
+  _table(table)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+    _shards[ii].count = 0;
+  }
+
+  register_table();
+}
+
+
+ShardedEventAccumulatorTable::~ShardedEventAccumulatorTable()
+{
+  unregister_table();
+  flush();
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+
+  delete _table;
+}
+
+
+void ShardedEventAccumulatorTable::accumulate(uint32_t sample)
+{
+  // The lock is only contended while the shard is being flushed, or if
+  // threads are sharing the shard.
+  Shard& shard = _shards[shard_index()];
+  uint32_t batch[BATCH_SIZE];
+  int count = 0;
+
+  pthread_mutex_lock(&shard.lock);
+  shard.samples[shard.count++] = sample;
+
+  if (shard.count == BATCH_SIZE)
+  {
+    memcpy(batch, shard.samples, sizeof(batch));
+    count = shard.count;
+    shard.count = 0;
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  accumulate_batch(batch, count);
+}
+
+
+void ShardedEventAccumulatorTable::flush()
+{
+  uint32_t batch[BATCH_SIZE];
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _shards[ii];
+
+    pthread_mutex_lock(&shard.lock);
+    int count = shard.count;
+    memcpy(batch, shard.samples, count * sizeof(uint32_t));
+    shard.count = 0;
+    pthread_mutex_unlock(&shard.lock);
+
+    accumulate_batch(batch, count);
+  }
+}
+
+
+void ShardedEventAccumulatorTable::accumulate_batch(const uint32_t* samples,
+                                                    int count)
+{
+  for (int ii = 0; ii < count; ++ii)
+  {
+    _table->accumulate(samples[ii]);
+  }
+}
+
+
+ShardedSuccessFailCountByRequestTypeTable::ShardedSuccessFailCountByRequestTypeTable(
+                              SNMP::SuccessFailCountByRequestTypeTable* table) :
+  _table(table)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    for (int type = 0; type < MAX_REQUEST_TYPES; ++type)
+    {
+      for (int outcome = 0; outcome < NUM_OUTCOMES; ++outcome)
+      {
+        _shards[ii].counts[type][outcome] = 0;
+      }
+    }
+  }
+
+  register_table();
+}
+
+
+ShardedSuccessFailCountByRequestTypeTable::~ShardedSuccessFailCountByRequestTypeTable()
+{
+  unregister_table();
+  flush();
+  delete _table;
+}
+
+
+void ShardedSuccessFailCountByRequestTypeTable::increment_attempts(
+                                                   SNMP::SIPRequestTypes type)
+{
+  increment(type, ATTEMPT);
+}
+
+
+void ShardedSuccessFailCountByRequestTypeTable::increment_successes(
+                                                   SNMP::SIPRequestTypes type)
+{
+  increment(type, SUCCESS);
+}
+
+
+void ShardedSuccessFailCountByRequestTypeTable::increment_failures(
+                                                   SNMP::SIPRequestTypes type)
+{
+  increment(type, FAILURE);
+}
+
+
+void ShardedSuccessFailCountByRequestTypeTable::increment(
+                                                   SNMP::SIPRequestTypes type,
+                                                   Outcome outcome)
+{
+  int index = (int)type;
+
+  if ((index < 0) || (index >= MAX_REQUEST_TYPES))
+  {
+    // LCOV_EXCL_START - all request types fit.
+    switch (outcome)
+    {
+      case ATTEMPT:
+        _table->increment_attempts(type);
+        break;
+      case SUCCESS:
+        _table->increment_successes(type);
+        break;
+      default:
+        _table->increment_failures(type);
+        break;
+    }
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _shards[shard_index()].counts[index][outcome].fetch_add(
+                                                  1, std::memory_order_relaxed);
+}
+
+
+void ShardedSuccessFailCountByRequestTypeTable::flush()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    for (int type = 0; type < MAX_REQUEST_TYPES; ++type)
+    {
+      std::atomic<uint32_t>* counts = _shards[ii].counts[type];
+      SNMP::SIPRequestTypes request_type = (SNMP::SIPRequestTypes)type;
+
+      for (uint32_t n = counts[ATTEMPT].exchange(0, std::memory_order_relaxed);
+           n > 0;
+           --n)
+      {
+        _table->increment_attempts(request_type);
+      }
+
+      for (uint32_t n = counts[SUCCESS].exchange(0, std::memory_order_relaxed);
+           n > 0;
+           --n)
+      {
+        _table->increment_successes(request_type);
+      }
+
+      for (uint32_t n = counts[FAILURE].exchange(0, std::memory_order_relaxed);
+           n > 0;
+           --n)
+      {
+        _table->increment_failures(request_type);
+      }
+    }
+  }
+}
+
+
+ShardedStatsFlusher::ShardedStatsFlusher() :
+  _terminated(false),
+  _started(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+ShardedStatsFlusher::~ShardedStatsFlusher()
+{
+  if (_started)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+  }
+
+  ShardedStats::flush_all();
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void ShardedStatsFlusher::start()
+{
+  int rc = pthread_create(&_thread, NULL, &flush_thread, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start statistics flush thread: %s", strerror(rc));
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _started = true;
+}
+
+
+void ShardedStatsFlusher::flush_loop()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += FLUSH_INTERVAL_MS / 1000;
+    wake.tv_nsec += (FLUSH_INTERVAL_MS % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000)
+    {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&_cond, &_lock, &wake);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    ShardedStats::flush_all();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* ShardedStatsFlusher::flush_thread(void* p)
+{
+  ((ShardedStatsFlusher*)p)->flush_loop();
+  return NULL;
+}
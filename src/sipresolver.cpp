@@ -74,8 +74,22 @@ void SIPResolver::resolve(const std::string& name,
                           int retries,
                           std::vector<AddrInfo>& targets,
                           SAS::TrailId trail)
+{
+  int ttl = 0;
+  resolve(name, af, port, transport, retries, targets, ttl, trail);
+}
+
+void SIPResolver::resolve(const std::string& name,
+                          int af,
+                          int port,
+                          int transport,
+                          int retries,
+                          std::vector<AddrInfo>& targets,
+                          int& ttl,
+                          SAS::TrailId trail)
 {
   int dummy_ttl = 0;
+  ttl = 0;
   targets.clear();
 
   // First determine the transport following the process in RFC3263 section
@@ -289,7 +303,7 @@ void SIPResolver::resolve(const std::string& name,
         SAS::report_event(event);
       }
 
-      srv_resolve(srv_name, af, transport, retries, targets, dummy_ttl, trail);
+      srv_resolve(srv_name, af, transport, retries, targets, ttl, trail);
     }
     else
     {
@@ -307,7 +321,7 @@ void SIPResolver::resolve(const std::string& name,
         SAS::report_event(event);
       }
 
-      a_resolve(a_name, af, port, transport, retries, targets, dummy_ttl, trail);
+      a_resolve(a_name, af, port, transport, retries, targets, ttl, trail);
     }
   }
 }
@@ -330,19 +330,20 @@ SproutletTsx* SproutletAppServerShim::get_tsx(SproutletTsxHelper* helper,
   // Create the helper for the AppServer layer.
   SproutletAppServerTsxHelper* shim_helper = new SproutletAppServerTsxHelper(helper);
 
-  // Ask the AppServer for a Tsx.
-  AppServerTsx* app_tsx = _app->get_app_tsx(shim_helper, req);
-  if (app_tsx == NULL)
+  // Ask the AppServer for a Tsx.  AppServers may query subscriber data when
+  // creating a Tsx (for example the MMTEL AS fetches simservs from the XDMS),
+  // so for initial requests this is done on an I/O thread once the request
+  // has been received.
+  AppServerTsx* app_tsx = NULL;
+  if (PJSIP_MSG_TO_HDR(req)->tag.slen != 0)
   {
-    // Create a default AppServerTsx to simply forward requests and responses
-    // transparently.  We have to do this (rather than return NULL) as we
-    // still need to manipulate Route headers to avoid looping.
-    app_tsx = new AppServerTsx((AppServerTsxHelper*)shim_helper);
+    app_tsx = SproutletAppServerShimTsx::create_app_tsx(_app, shim_helper, req);
   }
 
   tsx = new SproutletAppServerShimTsx(helper,
                                       shim_helper,
-                                      app_tsx);
+                                      app_tsx,
+                                      _app);
 
   return tsx;
 }
@@ -350,10 +351,13 @@ SproutletTsx* SproutletAppServerShim::get_tsx(SproutletTsxHelper* helper,
 /// Constructor.
 SproutletAppServerShimTsx::SproutletAppServerShimTsx(SproutletTsxHelper* sproutlet_helper,
                                                      SproutletAppServerTsxHelper*& app_server_helper,
-                                                     AppServerTsx* app_tsx) :
+                                                     AppServerTsx* app_tsx,
+                                                     AppServer* app) :
   SproutletTsx(sproutlet_helper),
   _app_server_helper(app_server_helper),
-  _app_tsx(app_tsx)
+  _app_tsx(app_tsx),
+  _app(app),
+  _cancel_status(0)
 {
   app_server_helper = NULL;
 }
@@ -373,7 +377,24 @@ SproutletAppServerShimTsx::~SproutletAppServerShimTsx()
 void SproutletAppServerShimTsx::on_rx_initial_request(pjsip_msg* req)
 {
   _app_server_helper->store_onward_route(req);
-  _app_tsx->on_initial_request(req);
+
+  if (_app_tsx != NULL)
+  {
+    _app_tsx->on_initial_request(req);
+  }
+  else
+  {
+    // Create the AppServerTsx without holding up this thread, and pass it the
+    // request once it's ready.
+    SproutletAppServerShimTsx* tsx = this;
+    run_async((void*)req,
+              [tsx, req]()
+              {
+                tsx->_app_tsx = create_app_tsx(tsx->_app,
+                                               tsx->_app_server_helper,
+                                               req);
+              });
+  }
 }
 
 /// Called for an in-dialog request with the original received request for
@@ -400,7 +421,16 @@ void SproutletAppServerShimTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
 /// CANCEL request or an error on the inbound transport).
 void SproutletAppServerShimTsx::on_rx_cancel(int status_code, pjsip_msg* cancel_req)
 {
-  _app_tsx->on_cancel(status_code);
+  if (_app_tsx != NULL)
+  {
+    _app_tsx->on_cancel(status_code);
+  }
+  else
+  {
+    // The AppServerTsx is still being created, so deal with the cancel once
+    // it's ready.
+    _cancel_status = status_code;
+  }
 }
 
 /// Called when a programmed timer expires.
@@ -408,3 +438,44 @@ void SproutletAppServerShimTsx::on_timer_expiry(void* context)
 {
   _app_tsx->on_timer_expiry(context);
 }
+
+/// Called once the AppServerTsx has been created for an initial request.
+void SproutletAppServerShimTsx::on_async_complete(void* context)
+{
+  pjsip_msg* req = (pjsip_msg*)context;
+
+  if (_cancel_status == 0)
+  {
+    _app_tsx->on_initial_request(req);
+  }
+  else
+  {
+    // The request was cancelled while the AppServerTsx was being created, so
+    // don't pass it on.
+    TRC_DEBUG("Request cancelled before AppServer invoked");
+    if (_cancel_status == PJSIP_SC_REQUEST_TERMINATED)
+    {
+      pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+      send_response(rsp);
+    }
+    free_msg(req);
+  }
+}
+
+/// Asks the AppServer for a Tsx, falling back to one that simply forwards
+/// requests and responses.
+AppServerTsx* SproutletAppServerShimTsx::create_app_tsx(AppServer* app,
+                                                        SproutletAppServerTsxHelper* helper,
+                                                        pjsip_msg* req)
+{
+  AppServerTsx* app_tsx = app->get_app_tsx(helper, req);
+  if (app_tsx == NULL)
+  {
+    // Create a default AppServerTsx to simply forward requests and responses
+    // transparently.  We have to do this (rather than return NULL) as we
+    // still need to manipulate Route headers to avoid looping.
+    app_tsx = new AppServerTsx((AppServerTsxHelper*)helper);
+  }
+
+  return app_tsx;
+}
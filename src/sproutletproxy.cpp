@@ -66,7 +66,8 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                const std::string& root_uri,
                                const std::unordered_set<std::string>& host_aliases,
                                const std::list<Sproutlet*>& sproutlets,
-                               const std::set<std::string>& stateless_proxies) :
+                               const std::set<std::string>& stateless_proxies,
+                               AsyncIOPool* async_io_pool) :
   BasicProxy(endpt,
              "mod-sproutlet-controller",
              priority,
@@ -74,7 +75,8 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
              stateless_proxies),
   _root_uri(NULL),
   _host_aliases(host_aliases),
-  _sproutlets(sproutlets)
+  _sproutlets(sproutlets),
+  _async_io_pool(async_io_pool)
 {
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
   TRC_DEBUG("Root Record-Route URI = %s", root_uri.c_str());
@@ -461,7 +463,8 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _pending_req_q(),
   _sproutlet_proxy(proxy),
   _timers(),
-  _pending_timers()
+  _pending_timers(),
+  _pending_async(0)
 {
   TRC_VERBOSE("Sproutlet Proxy transaction (%p) created", this);
 }
@@ -928,6 +931,52 @@ void SproutletProxy::UASTsx::process_timer_pop(pj_timer_entry* tentry)
 }
 
 
+void SproutletProxy::UASTsx::run_async(SproutletWrapper* tsx,
+                                       void* context,
+                                       const std::function<void()>& work)
+{
+  AsyncIOPool* pool = _sproutlet_proxy->_async_io_pool;
+
+  if (pool != NULL)
+  {
+    // Run the operation on an I/O thread, then continue processing the
+    // transaction on a worker thread.
+    TRC_DEBUG("Run blocking operation on I/O thread");
+    _pending_async++;
+    UASTsx* uas_tsx = this;
+    pool->run(work,
+              [uas_tsx, tsx, context]()
+              {
+                uas_tsx->process_async_complete(tsx, context);
+              });
+  }
+  else
+  {
+    // There are no I/O threads, so run the operation now.  The wrapper passes
+    // the result to the Sproutlet once its current callback has returned.
+    TRC_DEBUG("Run blocking operation on worker thread");
+    work();
+    tsx->_completed_async.push_back(context);
+  }
+}
+
+
+void SproutletProxy::UASTsx::process_async_complete(SproutletWrapper* tsx,
+                                                    void* context)
+{
+  enter_context();
+
+  _pending_async--;
+  tsx->on_async_complete(context);
+  schedule_requests();
+
+  // Check to see if the UASTsx can be destroyed.
+  check_destroy();
+
+  exit_context();
+}
+
+
 void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
                                          pjsip_tx_data* rsp)
 {
@@ -1037,6 +1086,7 @@ void SproutletProxy::UASTsx::check_destroy()
       (_umap.empty()) &&
       (_pending_req_q.empty()) &&
       (_pending_timers.empty()) &&
+      (_pending_async == 0) &&
       (_tsx == NULL))
   {
     // UAS transaction has been destroyed and all Sproutlets are complete.
@@ -1074,6 +1124,8 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _process_actions_entered(0),
   _forks(),
   _pending_timers(),
+  _pending_async(0),
+  _completed_async(),
   _trail_id(trail_id)
 {
   _req_type = SNMP::string_to_request_type(_req->msg->line.req.method.name.ptr,
@@ -1492,6 +1544,13 @@ bool SproutletWrapper::timer_running(TimerID id)
   return _proxy_tsx->timer_running(id);
 }
 
+void SproutletWrapper::run_async(void* context,
+                                 const std::function<void()>& work)
+{
+  _pending_async++;
+  _proxy_tsx->run_async(this, context, work);
+}
+
 SAS::TrailId SproutletWrapper::trail() const
 {
   return _trail_id;
@@ -1688,6 +1747,14 @@ void SproutletWrapper::on_timer_pop(TimerID id, void* context)
   process_actions(false);
 }
 
+void SproutletWrapper::on_async_complete(void* context)
+{
+  TRC_DEBUG("Blocking operation complete");
+  _pending_async--;
+  _sproutlet_tsx->on_async_complete(context);
+  process_actions(false);
+}
+
 void SproutletWrapper::register_tdata(pjsip_tx_data* tdata)
 {
   TRC_DEBUG("Adding message %p => txdata %p mapping",
@@ -1713,6 +1780,17 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   // SproutletWrapper if so.
   _process_actions_entered++;
 
+  // Pass the results of any blocking operations which were run synchronously
+  // to the Sproutlet.  The Sproutlet may start more, so keep going until
+  // there are none left.
+  while (!_completed_async.empty())
+  {
+    void* context = _completed_async.front();
+    _completed_async.pop_front();
+    _pending_async--;
+    _sproutlet_tsx->on_async_complete(context);
+  }
+
   // First increment the pending sends count by the number of requests waiting
   // to be sent.  This must happen first to avoid the response aggregation
   // code incorrectly triggering on the count of error responses.
@@ -1780,10 +1858,12 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   if ((_complete) &&
       (_pending_responses == 0) &&
       (_pending_timers.empty()) &&
+      (_pending_async == 0) &&
       (_process_actions_entered == 0))
   {
     // Sproutlet has sent a final response, has no downstream forks waiting
-    // a response, and has no pending timers, so should destroy itself.
+    // a response, and has no pending timers or blocking operations, so should
+    // destroy itself.
     TRC_VERBOSE("%s suiciding", _id.c_str());
     delete this;
   }
@@ -62,9 +62,11 @@ extern "C" {
 #include "stack.h"
 #include "pjutils.h"
 #include "chronosconnection.h"
+#include "aor_expiry_manager.h"
 #include "sproutsasevent.h"
 #include "constants.h"
 #include "json_parse_utils.h"
+#include "latency_breakdown.h"
 #include "rapidjson/error/en.h"
 
 /// SubscriberDataManager Methods
@@ -74,6 +76,8 @@ SubscriberDataManager::SubscriberDataManager(Store* data_store,
                                              std::vector<SerializerDeserializer*>& deserializers,
                                              ChronosConnection* chronos_connection,
                                              bool is_primary) :
+  _expiry_manager(NULL),
+  _write_serializer(NULL),
   _primary_sdm(is_primary)
 {
   _connector = new Connector(data_store, serializer, deserializers);
@@ -85,6 +89,8 @@ SubscriberDataManager::SubscriberDataManager(Store* data_store,
 SubscriberDataManager::SubscriberDataManager(Store* data_store,
                                              ChronosConnection* chronos_connection,
                                              bool is_primary) :
+  _expiry_manager(NULL),
+  _write_serializer(NULL),
   _primary_sdm(is_primary)
 {
   SerializerDeserializer* serializer = new JsonSerializerDeserializer();
@@ -191,21 +197,37 @@ Store::Status SubscriberDataManager::set_aor_data(
   TRC_DEBUG("Set AoR data for %s, CAS=%ld, expiry = %d",
             aor_id.c_str(), aor_pair->get_current()->_cas, max_expires);
 
-  // Set the chronos timers
+  // Set the chronos timers, or schedule the AoR on the local expiry wheel.
   if (_primary_sdm)
   {
-    _chronos_timer_request_sender->send_timers(aor_id, aor_pair, now, trail);
+    if (_expiry_manager != NULL)
+    {
+      schedule_local_expiry(aor_id, aor_pair, trail);
+    }
+    else
+    {
+      _chronos_timer_request_sender->send_timers(aor_id, aor_pair, now, trail);
+    }
   }
 
   // Update the Notify CSeq, and write to store. We always update the cseq
   // as it's safe to increment it unnecessarily, and if we wait to find out
   // how many NOTIFYs we're going to send then we'll have to write back to
   // memcached again
-  aor_pair->get_current()->_notify_cseq++;
-  Store::Status rc = _connector->set_aor_data(aor_id,
-                                              aor_pair->get_current(),
-                                              max_expires - now,
-                                              trail);
+  Store::Status rc;
+
+  if (_connector->_separate_subscriptions)
+  {
+    rc = set_separate_aor_data(aor_id, aor_pair, max_expires - now, trail);
+  }
+  else
+  {
+    aor_pair->get_current()->_notify_cseq++;
+    rc = _connector->set_aor_data(aor_id,
+                                  aor_pair->get_current(),
+                                  max_expires - now,
+                                  trail);
+  }
 
   if (rc != Store::Status::OK)
   {
@@ -234,6 +256,250 @@ Store::Status SubscriberDataManager::set_aor_data(
   return Store::Status::OK;
 }
 
+/// Update the data for an address of record whose bindings have only been
+/// refreshed.  Returns the same codes as set_aor_data.
+///
+/// @param aor_id     The SIP Address of Record for the registration
+/// @param aor_pair   The registration data record.
+/// @param trail      The SAS trail
+Store::Status SubscriberDataManager::refresh_aor_data(const std::string& aor_id,
+                                                      AoRPair* aor_pair,
+                                                      SAS::TrailId trail)
+{
+  AoR* aor = aor_pair->get_current();
+  size_t num_bindings = aor->bindings().size();
+  size_t num_subscriptions = aor->subscriptions().size();
+
+  int now = time(NULL);
+  int max_expires = expire_aor_members(aor_pair, now) + 10;
+
+  if ((aor->bindings().size() != num_bindings) ||
+      (aor->subscriptions().size() != num_subscriptions))
+  {
+    // Something has expired since the AoR was read, so subscribers need to
+    // hear about it.
+    TRC_DEBUG("AoR %s has expired members - writing in full", aor_id.c_str());
+    return set_aor_data(aor_id, aor_pair, trail);
+  }
+
+  TRC_DEBUG("Refresh AoR data for %s, CAS=%ld, expiry = %d",
+            aor_id.c_str(), aor->_cas, max_expires);
+
+  if (_primary_sdm)
+  {
+    if (_expiry_manager != NULL)
+    {
+      schedule_local_expiry(aor_id, aor_pair, trail);
+    }
+    else
+    {
+      _chronos_timer_request_sender->send_timers(aor_id, aor_pair, now, trail);
+    }
+  }
+
+  if ((_connector->_separate_subscriptions) &&
+      (aor->_legacy_subscriptions))
+  {
+    // The subscriptions still need moving into their own record.
+    return set_separate_aor_data(aor_id, aor_pair, max_expires - now, trail);
+  }
+
+  return _connector->set_aor_data(aor_id, aor, max_expires - now, trail);
+}
+
+Store::Status SubscriberDataManager::set_separate_aor_data(
+                                                 const std::string& aor_id,
+                                                 AoRPair* aor_pair,
+                                                 int expiry,
+                                                 SAS::TrailId trail)
+{
+  AoR* orig = aor_pair->get_orig();
+  AoR* current = aor_pair->get_current();
+
+  // Write the bindings record first, as that is the one the caller has to
+  // redo its update for if it's been changed under it.  If the record still
+  // holds subscriptions from before they were stored separately, rewrite it
+  // without them.
+  if ((current->_cas == 0) ||
+      (current->_legacy_subscriptions) ||
+      (_connector->serialize_bindings(orig) !=
+                                     _connector->serialize_bindings(current)))
+  {
+    Store::Status rc = _connector->set_aor_data(aor_id,
+                                                current,
+                                                expiry,
+                                                trail);
+    if (rc != Store::Status::OK)
+    {
+      return rc;
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Bindings for %s unchanged - not writing them", aor_id.c_str());
+  }
+
+  // Every write of an AoR that has subscriptions sends NOTIFYs to them, so
+  // needs a new NOTIFY CSeq.  Otherwise only write the subscriptions record
+  // if it has changed.
+  if ((current->_subscriptions.empty()) &&
+      (_connector->serialize_subscriptions(orig) ==
+                                _connector->serialize_subscriptions(current)))
+  {
+    return Store::Status::OK;
+  }
+
+  while (true)
+  {
+    current->_notify_cseq = orig->_notify_cseq + 1;
+    Store::Status rc = _connector->set_subscriptions_data(aor_id,
+                                                          current,
+                                                          expiry,
+                                                          trail);
+    if (rc != Store::Status::DATA_CONTENTION)
+    {
+      return rc;
+    }
+
+    // Someone else has changed the subscriptions since we read them.  The
+    // bindings have already been written, so rather than have the caller
+    // redo its whole update, reread the subscriptions and apply our changes
+    // on top.  Each subscription belongs to a single dialog, so changes made
+    // by different writers don't conflict.
+    TRC_DEBUG("Contention writing subscriptions for %s - merging",
+              aor_id.c_str());
+    AoR latest(aor_id);
+    rc = _connector->get_subscriptions_data(aor_id, &latest, trail);
+
+    if (rc == Store::Status::NOT_FOUND)
+    {
+      // LCOV_EXCL_START - the record can only vanish if it expires
+      latest._subscriptions_cas = 0;
+      // LCOV_EXCL_STOP
+    }
+    else if (rc != Store::Status::OK)
+    {
+      return Store::Status::ERROR;
+    }
+
+    merge_subscriptions(aor_pair, &latest);
+  }
+}
+
+static bool subscriptions_equal(const SubscriberDataManager::AoR::Subscription* s1,
+                                const SubscriberDataManager::AoR::Subscription* s2)
+{
+  return ((s1->_req_uri == s2->_req_uri) &&
+          (s1->_from_uri == s2->_from_uri) &&
+          (s1->_from_tag == s2->_from_tag) &&
+          (s1->_to_uri == s2->_to_uri) &&
+          (s1->_to_tag == s2->_to_tag) &&
+          (s1->_cid == s2->_cid) &&
+          (s1->_route_uris == s2->_route_uris) &&
+          (s1->_expires == s2->_expires) &&
+          (s1->_timer_id == s2->_timer_id));
+}
+
+void SubscriberDataManager::merge_subscriptions(AoRPair* aor_pair,
+                                                AoR* latest)
+{
+  AoR* orig = aor_pair->get_orig();
+  AoR* current = aor_pair->get_current();
+  AoR::Subscriptions merged;
+
+  for (AoR::Subscriptions::const_iterator i = latest->_subscriptions.begin();
+       i != latest->_subscriptions.end();
+       ++i)
+  {
+    // Keep the subscriptions we haven't removed.  If someone else has
+    // changed a subscription we've removed (for example, refreshed one we
+    // think has expired) their change wins.
+    AoR::Subscriptions::const_iterator j = orig->_subscriptions.find(i->first);
+
+    if ((j == orig->_subscriptions.end()) ||
+        (current->_subscriptions.find(i->first) != current->_subscriptions.end()) ||
+        (!subscriptions_equal(j->second, i->second)))
+    {
+      merged[i->first] = new AoR::Subscription(*i->second);
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator i = current->_subscriptions.begin();
+       i != current->_subscriptions.end();
+       ++i)
+  {
+    // Apply the subscriptions we've added or changed.
+    AoR::Subscriptions::const_iterator j = orig->_subscriptions.find(i->first);
+
+    if ((j == orig->_subscriptions.end()) ||
+        (!subscriptions_equal(j->second, i->second)))
+    {
+      AoR::Subscriptions::iterator k = merged.find(i->first);
+
+      if (k != merged.end())
+      {
+        delete k->second;
+      }
+
+      merged[i->first] = new AoR::Subscription(*i->second);
+    }
+  }
+
+  // The subscriptions as now stored become the original ones, so that
+  // NOTIFYs go out for the merged set with the latest CSeq.
+  for (AoR::Subscriptions::iterator i = orig->_subscriptions.begin();
+       i != orig->_subscriptions.end();
+       ++i)
+  {
+    delete i->second;
+  }
+  orig->_subscriptions.clear();
+  std::swap(orig->_subscriptions, latest->_subscriptions);
+  orig->_notify_cseq = latest->_notify_cseq;
+
+  for (AoR::Subscriptions::iterator i = current->_subscriptions.begin();
+       i != current->_subscriptions.end();
+       ++i)
+  {
+    delete i->second;
+  }
+  current->_subscriptions.clear();
+  std::swap(current->_subscriptions, merged);
+  current->_subscriptions_cas = latest->_subscriptions_cas;
+}
+
+void SubscriberDataManager::schedule_local_expiry(const std::string& aor_id,
+                                                  AoRPair* aor_pair,
+                                                  SAS::TrailId trail)
+{
+  AoR* aor = aor_pair->get_current();
+
+  // The AoR doesn't need its own Chronos timer, so take over any left over
+  // from before local expiry was enabled.
+  std::string old_timer_id = aor->_timer_id;
+  aor->_timer_id = "";
+
+  std::map<std::string, uint32_t> tags;
+  int next_expires = 0;
+
+  if (aor->get_bindings_count() != 0)
+  {
+    _chronos_timer_request_sender->build_tag_info(aor, tags);
+    next_expires = aor->get_next_expires();
+  }
+  else if (old_timer_id != "")
+  {
+    // There's nothing left to expire, so the old timer can go now.
+    _chronos_timer_request_sender->_chronos_conn->send_delete(old_timer_id,
+                                                              trail);
+    old_timer_id = "";
+  }
+
+  // The expiry manager deletes the old timer once the AoR's bucket timer has
+  // been set.
+  _expiry_manager->aor_updated(aor_id, next_expires, tags, old_timer_id);
+}
+
 int SubscriberDataManager::expire_aor_members(AoRPair* aor_pair,
                                               int now)
 {
@@ -331,6 +597,7 @@ SubscriberDataManager::Connector::Connector(Store* data_store,
                                SerializerDeserializer*& serializer,
                                std::vector<SerializerDeserializer*>& deserializers) :
   _data_store(data_store),
+  _separate_subscriptions(false),
   _serializer(serializer),
   _deserializers(deserializers)
 {
@@ -359,6 +626,7 @@ SubscriberDataManager::AoR* SubscriberDataManager::Connector::get_aor_data(
                                                  const std::string& aor_id,
                                                  SAS::TrailId trail)
 {
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::STORE);
   TRC_DEBUG("Get AoR data for %s", aor_id.c_str());
   AoR* aor_data = NULL;
 
@@ -375,6 +643,8 @@ SubscriberDataManager::AoR* SubscriberDataManager::Connector::get_aor_data(
     if (aor_data != NULL)
     {
       aor_data->_cas = cas;
+      aor_data->_legacy_subscriptions = (_separate_subscriptions &&
+                                         !aor_data->_subscriptions.empty());
 
       SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
       event.add_var_param(aor_id);
@@ -409,16 +679,111 @@ SubscriberDataManager::AoR* SubscriberDataManager::Connector::get_aor_data(
     SAS::report_event(event);
   }
 
+  if ((aor_data != NULL) && (_separate_subscriptions))
+  {
+    // Pick up the subscriptions from their own record.  If there isn't one,
+    // either the AoR has no subscriptions or it was written before they
+    // were stored separately, in which case we use the ones we've just read.
+    status = get_subscriptions_data(aor_id, aor_data, trail);
+
+    if ((status != Store::Status::OK) &&
+        (status != Store::Status::NOT_FOUND))
+    {
+      delete aor_data; aor_data = NULL;
+    }
+  }
+
   return aor_data;
 }
 
+Store::Status SubscriberDataManager::Connector::get_subscriptions_data(
+                                                 const std::string& aor_id,
+                                                 AoR* aor_data,
+                                                 SAS::TrailId trail)
+{
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::STORE);
+  TRC_DEBUG("Get subscriptions for %s", aor_id.c_str());
+  std::string data;
+  uint64_t cas;
+  Store::Status status = _data_store->get_data("reg_subs", aor_id, data, cas, trail);
+
+  if (status == Store::Status::OK)
+  {
+    AoR* subs_data = deserialize_aor(aor_id, data);
+
+    if (subs_data == NULL)
+    {
+      TRC_INFO("Failed to deserialize subscriptions record");
+      SAS::Event event(trail, SASEvent::REGSTORE_DESERIALIZATION_FAILED, 0);
+      event.add_var_param(aor_id);
+      event.add_var_param(data);
+      SAS::report_event(event);
+      return Store::Status::ERROR;
+    }
+
+    for (AoR::Subscriptions::iterator i = aor_data->_subscriptions.begin();
+         i != aor_data->_subscriptions.end();
+         ++i)
+    {
+      delete i->second;
+    }
+    aor_data->_subscriptions.clear();
+    std::swap(aor_data->_subscriptions, subs_data->_subscriptions);
+    aor_data->_notify_cseq = subs_data->_notify_cseq;
+    aor_data->_subscriptions_cas = cas;
+    delete subs_data;
+  }
+  else if (status == Store::Status::NOT_FOUND)
+  {
+    aor_data->_subscriptions_cas = 0;
+  }
+  else
+  {
+    SAS::Event event(trail, SASEvent::REGSTORE_GET_FAILURE, 0);
+    event.add_var_param(aor_id);
+    SAS::report_event(event);
+  }
+
+  return status;
+}
+
+Store::Status SubscriberDataManager::Connector::set_subscriptions_data(
+                                                const std::string& aor_id,
+                                                AoR* aor_data,
+                                                int expiry,
+                                                SAS::TrailId trail)
+{
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::STORE);
+  std::string data = serialize_subscriptions(aor_data);
+
+  Store::Status status = _data_store->set_data("reg_subs",
+                                               aor_id,
+                                               data,
+                                               aor_data->_subscriptions_cas,
+                                               expiry,
+                                               trail);
+
+  TRC_DEBUG("Data store set_data for subscriptions returned %d", status);
+
+  if (status != Store::Status::OK)
+  {
+    SAS::Event event(trail, SASEvent::REGSTORE_SET_FAILURE, 0);
+    event.add_var_param(aor_id);
+    SAS::report_event(event);
+  }
+
+  return status;
+}
+
 Store::Status SubscriberDataManager::Connector::set_aor_data(
                                                 const std::string& aor_id,
                                                 AoR* aor_data,
                                                 int expiry,
                                                 SAS::TrailId trail)
 {
-  std::string data = serialize_aor(aor_data);
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::STORE);
+  std::string data = _separate_subscriptions ?
+                       serialize_bindings(aor_data) : serialize_aor(aor_data);
 
   SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
   event.add_var_param(aor_id);
@@ -455,6 +820,36 @@ std::string SubscriberDataManager::Connector::serialize_aor(AoR* aor_data)
   return _serializer->serialize_aor(aor_data);
 }
 
+/// Serialize an AoR's bindings, without its subscriptions.
+std::string SubscriberDataManager::Connector::serialize_bindings(AoR* aor_data)
+{
+  AoR::Subscriptions subscriptions;
+  int notify_cseq = aor_data->_notify_cseq;
+  std::swap(subscriptions, aor_data->_subscriptions);
+  aor_data->_notify_cseq = 1;
+
+  std::string data = serialize_aor(aor_data);
+
+  std::swap(subscriptions, aor_data->_subscriptions);
+  aor_data->_notify_cseq = notify_cseq;
+  return data;
+}
+
+/// Serialize an AoR's subscriptions, without its bindings.
+std::string SubscriberDataManager::Connector::serialize_subscriptions(AoR* aor_data)
+{
+  AoR::Bindings bindings;
+  std::string timer_id;
+  std::swap(bindings, aor_data->_bindings);
+  std::swap(timer_id, aor_data->_timer_id);
+
+  std::string data = serialize_aor(aor_data);
+
+  std::swap(bindings, aor_data->_bindings);
+  std::swap(timer_id, aor_data->_timer_id);
+  return data;
+}
+
 /// Deserialize the contents of an AoR
 SubscriberDataManager::AoR* SubscriberDataManager::Connector::deserialize_aor(
                                                    const std::string& aor_id,
@@ -497,6 +892,8 @@ SubscriberDataManager::AoR::AoR(std::string sip_uri) :
   _bindings(),
   _subscriptions(),
   _cas(0),
+  _subscriptions_cas(0),
+  _legacy_subscriptions(false),
   _uri(sip_uri)
 {
 }
@@ -548,6 +945,8 @@ void SubscriberDataManager::AoR::common_constructor(const AoR& other)
   _notify_cseq = other._notify_cseq;
   _timer_id = other._timer_id;
   _cas = other._cas;
+  _subscriptions_cas = other._subscriptions_cas;
+  _legacy_subscriptions = other._legacy_subscriptions;
   _uri = other._uri;
 }
 
@@ -830,6 +1229,7 @@ SubscriberDataManager::AoR* SubscriberDataManager::BinarySerializerDeserializer:
       getline(iss, pvalue, '\0');
       b->_params[pname] = pvalue;
     }
+    b->parse_features();
 
     int num_paths = 0;
     iss.read((char *)&num_paths, sizeof(int));
@@ -1054,6 +1454,7 @@ SubscriberDataManager::AoR* SubscriberDataManager::JsonSerializerDeserializer::
         JSON_ASSERT_STRING(params_it->value);
         b->_params[params_it->name.GetString()] = params_it->value.GetString();
       }
+      b->parse_features();
 
       JSON_ASSERT_CONTAINS(b_obj, JSON_PATHS);
       JSON_ASSERT_ARRAY(b_obj[JSON_PATHS]);
@@ -49,6 +49,7 @@ extern "C" {
 #include "pjutils.h"
 #include "stack.h"
 #include "memcachedstore.h"
+#include "aor_write_serializer.h"
 #include "hssconnection.h"
 #include "subscription.h"
 #include "log.h"
@@ -61,6 +62,10 @@ extern "C" {
 static SubscriberDataManager* sdm;
 static SubscriberDataManager* remote_sdm;
 
+// Replicates AoRs to the remote store in the background.  NULL if AoRs are
+// written to the remote store synchronously.
+static AoRReplicator* replicator;
+
 // Connection to the HSS service for retrieving associated public URIs.
 static HSSConnection* hss;
 
@@ -156,6 +161,9 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
   std::string subscription_contact;
   std::string subscription_id;
 
+  // Queue behind any other writes to this AoR on this node.
+  AoRWriteSerializer::Write write(primary_sdm->write_serializer(), aor);
+
   do
   {
     // delete NULL is safe, so we can do this on every iteration.
@@ -335,7 +343,9 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
       delete aor_pair; aor_pair = NULL;
     }
   }
-  while (set_rc == Store::DATA_CONTENTION);
+  while (write.retry(set_rc));
+
+  write.finish();
 
   if (analytics != NULL)
   {
@@ -535,7 +545,11 @@ void process_subscription_request(pjsip_rx_data* rdata)
 
     // If we have a remote store, try to store this there too.  We don't worry
     // about failures in this case.
-    if ((remote_sdm != NULL) && remote_sdm->has_servers())
+    if (replicator != NULL)
+    {
+      replicator->replicate(aor, aor_pair, trail);
+    }
+    else if ((remote_sdm != NULL) && remote_sdm->has_servers())
     {
       SubscriberDataManager::AoRPair* remote_aor_pair =
          write_subscriptions_to_store(remote_sdm,
@@ -754,12 +768,14 @@ pj_status_t init_subscription(SubscriberDataManager* reg_sdm,
                               HSSConnection* hss_connection,
                               ACRFactory* rfacr_factory,
                               AnalyticsLogger* analytics_logger,
-                              int cfg_max_expires)
+                              int cfg_max_expires,
+                              AoRReplicator* aor_replicator)
 {
   pj_status_t status;
 
   sdm = reg_sdm;
   remote_sdm = reg_remote_sdm;
+  replicator = aor_replicator;
   hss = hss_connection;
   acr_factory = rfacr_factory;
   analytics = analytics_logger;
@@ -0,0 +1,344 @@
+/**
+ * @file third_party_reg_tracker.cpp Tracking and refresh scheduling of third-party registrations.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "log.h"
+#include "third_party_reg_tracker.h"
+
+ThirdPartyRegTracker::ThirdPartyRegTracker(RefreshSender* sender) :
+  _sender(sender),
+  _registrations(),
+  _wheel(WHEEL_SLOTS),
+  _last_tick(0),
+  _thread_started(false),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+ThirdPartyRegTracker::~ThirdPartyRegTracker()
+{
+  if (_thread_started)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void ThirdPartyRegTracker::start()
+{
+  int rc = pthread_create(&_thread, NULL, &refresh_thread, (void*)this);
+
+  if (rc == 0)
+  {
+    _thread_started = true;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start third-party registration refresh thread: %d", rc);
+    // LCOV_EXCL_STOP
+  }
+}
+
+
+bool ThirdPartyRegTracker::should_send(const std::string& served_user,
+                                       const AsInvocation& as,
+                                       int expires,
+                                       bool is_initial_registration,
+                                       uint64_t bindings_hash,
+                                       int now)
+{
+  bool send = true;
+
+  pthread_mutex_lock(&_lock);
+
+  if (expires == 0)
+  {
+    // Deregistrations are always sent, and there's nothing left to refresh.
+    forget(served_user, as.server_name);
+  }
+  else
+  {
+    Registration& reg = _registrations[served_user][as.server_name];
+
+    if ((!is_initial_registration) &&
+        (reg.refresh_at > now) &&
+        (reg.bindings_hash == bindings_hash) &&
+        (reg.as.service_info == as.service_info) &&
+        (reg.as.default_handling == as.default_handling))
+    {
+      // The AS already holds a registration and nothing it can see has
+      // changed, so just note how long the UE's registration now lasts.
+      // The refresh timer extends the AS registration if the UE is still
+      // registered when it pops.
+      TRC_DEBUG("Suppress third-party REGISTER to %s for %s",
+                as.server_name.c_str(), served_user.c_str());
+      reg.ue_expires = now + expires;
+      send = false;
+    }
+    else
+    {
+      reg.as = as;
+      reg.bindings_hash = bindings_hash;
+      reg.ue_expires = now + expires;
+      reg.as_expires = now + expires;
+      reg.refresh_at = refresh_time(now, expires);
+      schedule(served_user, as.server_name, reg.refresh_at);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return send;
+}
+
+
+void ThirdPartyRegTracker::tick(int now)
+{
+  std::vector<Refresh> refreshes;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_last_tick == 0)
+  {
+    _last_tick = now - 1;
+  }
+
+  // Process each slot we have passed since the last tick, bounded by a
+  // single revolution of the wheel.
+  int start = std::max(_last_tick + 1, now - WHEEL_SLOTS + 1);
+
+  for (int t = start; t <= now; t++)
+  {
+    process_slot(t % WHEEL_SLOTS, now, refreshes);
+  }
+
+  _last_tick = now;
+
+  pthread_mutex_unlock(&_lock);
+
+  // Send the refreshes without holding the lock - sending them can call
+  // back into should_send.
+  for (std::vector<Refresh>::const_iterator r = refreshes.begin();
+       r != refreshes.end();
+       ++r)
+  {
+    TRC_DEBUG("Refresh third-party registration with %s for %s, expires %d",
+              r->as.server_name.c_str(), r->served_user.c_str(), r->expires);
+    _sender->send_refresh(r->served_user, r->as, r->expires);
+  }
+}
+
+
+void ThirdPartyRegTracker::send_failed(const std::string& served_user,
+                                       const std::string& server_name)
+{
+  TRC_DEBUG("Third-party REGISTER to %s for %s failed",
+            server_name.c_str(), served_user.c_str());
+
+  pthread_mutex_lock(&_lock);
+  forget(served_user, server_name);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t ThirdPartyRegTracker::size()
+{
+  size_t count = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::unordered_map<std::string, std::map<std::string, Registration>>::const_iterator user =
+         _registrations.begin();
+       user != _registrations.end();
+       ++user)
+  {
+    count += user->second.size();
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return count;
+}
+
+
+/// Stops tracking a registration.  Any refresh timer for it is discarded
+/// when it pops.  Must be called with the lock held.
+void ThirdPartyRegTracker::forget(const std::string& served_user,
+                                  const std::string& server_name)
+{
+  std::unordered_map<std::string, std::map<std::string, Registration>>::iterator user =
+    _registrations.find(served_user);
+
+  if (user != _registrations.end())
+  {
+    user->second.erase(server_name);
+
+    if (user->second.empty())
+    {
+      _registrations.erase(user);
+    }
+  }
+}
+
+
+int ThirdPartyRegTracker::refresh_time(int now, int expires)
+{
+  int percent = MIN_REFRESH_MARGIN_PERCENT +
+    (rand() % (MAX_REFRESH_MARGIN_PERCENT - MIN_REFRESH_MARGIN_PERCENT + 1));
+  int margin = std::max(1, (expires * percent) / 100);
+
+  return now + std::max(1, expires - margin);
+}
+
+
+void ThirdPartyRegTracker::schedule(const std::string& served_user,
+                                    const std::string& server_name,
+                                    int due)
+{
+  Timer timer;
+  timer.served_user = served_user;
+  timer.server_name = server_name;
+  timer.due = due;
+  _wheel[due % WHEEL_SLOTS].push_back(timer);
+}
+
+
+void ThirdPartyRegTracker::process_slot(int slot,
+                                        int now,
+                                        std::vector<Refresh>& refreshes)
+{
+  std::list<Timer>& timers = _wheel[slot];
+  std::list<Timer>::iterator timer = timers.begin();
+
+  while (timer != timers.end())
+  {
+    if (timer->due > now)
+    {
+      // Not due until a later revolution of the wheel.
+      ++timer;
+      continue;
+    }
+
+    std::unordered_map<std::string, std::map<std::string, Registration>>::iterator user =
+      _registrations.find(timer->served_user);
+
+    if (user != _registrations.end())
+    {
+      std::map<std::string, Registration>::iterator reg =
+        user->second.find(timer->server_name);
+
+      // Timers are not removed when a registration is updated, so ignore
+      // any timer that doesn't match the current refresh time.
+      if ((reg != user->second.end()) &&
+          (reg->second.refresh_at == timer->due))
+      {
+        if (reg->second.ue_expires > reg->second.as_expires)
+        {
+          // The UE has re-registered since the AS registration was last
+          // refreshed, so extend the AS registration to match.
+          Refresh refresh;
+          refresh.served_user = timer->served_user;
+          refresh.as = reg->second.as;
+          refresh.expires = reg->second.ue_expires - now;
+          refreshes.push_back(refresh);
+
+          reg->second.as_expires = reg->second.ue_expires;
+          reg->second.refresh_at = refresh_time(now, refresh.expires);
+          schedule(timer->served_user,
+                   timer->server_name,
+                   reg->second.refresh_at);
+        }
+        else
+        {
+          // The UE hasn't re-registered, so let the AS registration expire
+          // along with the UE's.
+          user->second.erase(reg);
+
+          if (user->second.empty())
+          {
+            _registrations.erase(user);
+          }
+        }
+      }
+    }
+
+    timer = timers.erase(timer);
+  }
+}
+
+
+void ThirdPartyRegTracker::refresh_loop()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += 1;
+    pthread_cond_timedwait(&_cond, &_lock, &wake);
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+      tick(time(NULL));
+      pthread_mutex_lock(&_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* ThirdPartyRegTracker::refresh_thread(void* p)
+{
+  ((ThirdPartyRegTracker*)p)->refresh_loop();
+  return NULL;
+}
@@ -55,6 +55,7 @@ extern "C" {
 #include <list>
 #include <queue>
 #include <string>
+#include <functional>
 
 #include "constants.h"
 #include "eventq.h"
@@ -75,14 +76,17 @@ extern "C" {
 #include "sprout_pd_definitions.h"
 #include "exception_handler.h"
 #include "snmp_event_accumulator_table.h"
+#include "latency_breakdown.h"
 
 static std::vector<pj_thread_t*> worker_threads;
 
-// Queue for incoming messages.
+// Queue for incoming messages.  The queue also carries callbacks, which
+// continue processing that was suspended waiting for I/O.
 struct rx_msg_qe
 {
   pjsip_rx_data* rdata;    // received message
   Utils::StopWatch stop_watch;    // stop watch for tracking message latency
+  std::function<void()>* callback;    // callback to run (if rdata is NULL)
 };
 eventq<struct rx_msg_qe> rx_msg_q;
 
@@ -148,6 +152,16 @@ static int worker_thread(void* p)
     {
       TRC_DEBUG("Worker thread dequeue message %p", rdata);
 
+      if (LatencyBreakdown::enabled())
+      {
+        unsigned long queue_us = 0;
+        LatencyBreakdown::start_message();
+        if (qe.stop_watch.read(queue_us))
+        {
+          LatencyBreakdown::add(LatencyBreakdown::QUEUE, queue_us);
+        }
+      }
+
       CW_TRY
       {
         pjsip_endpt_process_rx_data(stack_data.endpt, rdata, &rp, NULL);
@@ -191,6 +205,7 @@ static int worker_thread(void* p)
       CW_END
 
       TRC_DEBUG("Worker thread completed processing message %p", rdata);
+      SAS::TrailId trail = get_trail(rdata);
       pjsip_rx_data_free_cloned(rdata);
 
       unsigned long latency_us = 0;
@@ -199,12 +214,49 @@ static int worker_thread(void* p)
         TRC_DEBUG("Request latency = %ldus", latency_us);
         latency_table->accumulate(latency_us);
         load_monitor->request_complete(latency_us);
+        LatencyBreakdown::end_message(latency_us, trail);
       }
       else
       {
         TRC_ERROR("Failed to get done timestamp: %s", strerror(errno));
       }
     }
+    else if (qe.callback)
+    {
+      TRC_DEBUG("Worker thread running callback %p", qe.callback);
+
+      Utils::StopWatch callback_stop_watch;
+      if (LatencyBreakdown::enabled())
+      {
+        LatencyBreakdown::start_message();
+        callback_stop_watch.start();
+      }
+
+      CW_TRY
+      {
+        (*qe.callback)();
+      }
+      CW_EXCEPT(exception_handler)
+      {
+        TRC_ERROR("Exception running callback %p", qe.callback);
+
+        if (num_worker_threads == 1)
+        {
+          // There's only one worker thread, so we can't sensibly proceed.
+          exit(1);
+        }
+      }
+      CW_END
+
+      if (LatencyBreakdown::enabled())
+      {
+        unsigned long callback_us = 0;
+        callback_stop_watch.read(callback_us);
+        LatencyBreakdown::end_message(callback_us, 0);
+      }
+
+      delete qe.callback;
+    }
   }
 
   TRC_DEBUG("Worker thread ended");
@@ -252,6 +304,7 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
 
   TRC_DEBUG("Queuing cloned received message %p for worker threads", clone_rdata);
   qe.rdata = clone_rdata;
+  qe.callback = NULL;
 
   // Track the current queue size
   queue_size_table->accumulate(rx_msg_q.size());
@@ -261,6 +314,16 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   return PJ_TRUE;
 }
 
+void add_callback_to_queue(const std::function<void()>& callback)
+{
+  struct rx_msg_qe qe;
+  qe.rdata = NULL;
+  qe.callback = new std::function<void()>(callback);
+
+  TRC_DEBUG("Queuing callback %p for worker threads", qe.callback);
+  rx_msg_q.push(qe);
+}
+
 pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::EventAccumulatorTable* latency_table_arg,
                                    SNMP::EventAccumulatorTable* queue_size_table_arg,
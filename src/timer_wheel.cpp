@@ -0,0 +1,169 @@
+/**
+ * @file timer_wheel.cpp Hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(int now) :
+  _now(now),
+  _timers()
+{
+}
+
+void TimerWheel::set(const std::string& id, int expiry)
+{
+  std::unordered_map<std::string, Timer>::iterator i = _timers.find(id);
+
+  if (i != _timers.end())
+  {
+    if (i->second.expiry == expiry)
+    {
+      // Nothing has changed, so leave the timer where it is.
+      return;
+    }
+
+    _slots[i->second.level][i->second.slot].erase(id);
+  }
+  else
+  {
+    i = _timers.insert(std::make_pair(id, Timer())).first;
+  }
+
+  i->second.expiry = expiry;
+  insert(id, i->second, _now + 1);
+}
+
+void TimerWheel::cancel(const std::string& id)
+{
+  std::unordered_map<std::string, Timer>::iterator i = _timers.find(id);
+
+  if (i != _timers.end())
+  {
+    _slots[i->second.level][i->second.slot].erase(id);
+    _timers.erase(i);
+  }
+}
+
+int TimerWheel::expiry(const std::string& id) const
+{
+  std::unordered_map<std::string, Timer>::const_iterator i = _timers.find(id);
+  return (i != _timers.end()) ? i->second.expiry : 0;
+}
+
+void TimerWheel::advance(int now, std::vector<std::string>& expired)
+{
+  if (_timers.empty())
+  {
+    // There's nothing to pop, so skip straight to the new time.
+    if (now > _now)
+    {
+      _now = now;
+    }
+    return;
+  }
+
+  while (_now < now)
+  {
+    _now++;
+
+    // When the bottom level wraps, cascade the next slot down from each level
+    // above it that has also wrapped.
+    for (int level = 1; level < LEVELS; level++)
+    {
+      int shift = level * SLOT_BITS;
+
+      if ((_now & ((1 << shift) - 1)) != 0)
+      {
+        break;
+      }
+
+      cascade(level, (_now >> shift) & (SLOTS - 1));
+    }
+
+    std::unordered_set<std::string>& slot = _slots[0][_now & (SLOTS - 1)];
+
+    for (std::unordered_set<std::string>::const_iterator i = slot.begin();
+         i != slot.end();
+         ++i)
+    {
+      expired.push_back(*i);
+      _timers.erase(*i);
+    }
+
+    slot.clear();
+  }
+}
+
+void TimerWheel::insert(const std::string& id, Timer& timer, int first)
+{
+  // A timer that is already due pops in the first slot to be processed.
+  int expiry = (timer.expiry > first) ? timer.expiry : first;
+  int delta = expiry - first;
+  int level = 0;
+
+  while ((level < LEVELS - 1) &&
+         (delta >= (1 << ((level + 1) * SLOT_BITS))))
+  {
+    level++;
+  }
+
+  // Timers beyond the range of the wheel are parked in the furthest slot
+  // of the top level.
+  int range = 1 << (LEVELS * SLOT_BITS);
+
+  if (delta >= range)
+  {
+    expiry = first + range - 1;
+  }
+
+  timer.level = level;
+  timer.slot = (expiry >> (level * SLOT_BITS)) & (SLOTS - 1);
+  _slots[timer.level][timer.slot].insert(id);
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+  std::unordered_set<std::string> ids;
+  ids.swap(_slots[level][slot]);
+
+  for (std::unordered_set<std::string>::const_iterator i = ids.begin();
+       i != ids.end();
+       ++i)
+  {
+    // The current second hasn't been processed yet, so timers can still be
+    // filed in its slot.
+    insert(*i, _timers[*i], _now);
+  }
+}
@@ -39,6 +39,8 @@ extern "C" {
 }
 
 #include <string>
+#include <atomic>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -51,6 +53,9 @@ extern "C" {
 #include "pjutils.h"
 #include "stack.h"
 #include "acr.h"
+#include "constants.h"
+#include "ralf_processor.h"
+#include "mockhttpconnection.h"
 
 #include "rapidjson/error/en.h"
 
@@ -60,6 +65,11 @@ using testing::ElementsAre;
 using testing::MatchesRegex;
 using testing::HasSubstr;
 using testing::Not;
+using testing::_;
+using testing::DoAll;
+using testing::SaveArg;
+using testing::InvokeWithoutArgs;
+using testing::Return;
 
 /// Fixture for ACRTest.
 class ACRTest : public SipTest
@@ -343,6 +353,119 @@ TEST_F(ACRTest, CancelledACR)
   delete acr;
 }
 
+TEST_F(ACRTest, SCSCFRegisterDeferred)
+{
+  // Tests that a deferred ACR captures copies of the messages, and generates
+  // the same Rf message as the equivalent immediate ACR.
+  pj_time_val ts;
+  ACR* acr;
+  std::string acr_message;
+
+  // Create a Ralf ACR factory for deferred S-CSCF ACRs.
+  RalfACRFactory f(NULL, ACR::SCSCF, true);
+
+  // Create an ACR instance for the ACR[EVENT] triggered by the REGISTER.
+  acr = f.get_acr(0, ACR::CALLING_PARTY, ACR::NODE_ROLE_ORIGINATING);
+
+  // Build the original REGISTER request.
+  SIPRequest reg("REGISTER");
+  reg._requri = "sip:homedomain";
+  reg._routes = "Route: <sip:sprout.homedomain:5054;transport=TCP;orig;lr>\r\n";
+  reg._from = "\"6505550000\" <sip:6505550000@homedomain>";   // Strip tag.
+  reg._to = "\"6505550000\" <sip:6505550000@homedomain>";   // Strip tag.
+  reg._extra_hdrs = "Contact: <sip:6505550000@10.83.18.38:36530;transport=TCP>;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"\r\n";
+  reg._extra_hdrs += "Expires: 300\r\n";
+  reg._extra_hdrs += "P-Charging-Vector: icid-value=1234bc9876e;icid-generated-at=10.83.18.28;orig-ioi=homedomain\r\n";
+  reg._extra_hdrs += "P-Charging-Function-Addresses: ccf=192.1.1.1;ccf=192.1.1.2;ecf=192.1.1.3;ecf=192.1.1.4\r\n";
+
+  // Pass the request to the ACR as a received request.
+  ts.sec = 1;
+  ts.msec = 0;
+  pjsip_msg* req = parse_msg(reg.get());
+  acr->rx_request(req, ts);
+
+  // Modify the original request after it has been passed to the ACR.  This
+  // must not affect the ACR.
+  pj_list_erase(pjsip_msg_find_hdr_by_name(req, &STR_P_C_F_A, NULL));
+  pjsip_msg_find_remove_hdr(req, PJSIP_H_EXPIRES, NULL);
+
+  // Now build a 200 OK response.
+  SIPResponse reg200ok(200, "REGISTER");
+  reg200ok._extra_hdrs = "P-Associated-URI: <sip:6505550000@homedomain>, <tel:6505550000>\r\n";
+
+  // Pass the response to ACR as a transmitted response.
+  ts.msec = 25;
+  acr->tx_response(parse_msg(reg200ok.get()), ts);
+
+  // Build and checked the resulting Rf ACR message.
+  acr_message = acr->get_message(ts);
+  EXPECT_TRUE(compare_acr(acr_message, "acr_scscfregister.json"));
+  delete acr;
+}
+
+TEST_F(ACRTest, SCSCFRegisterDeferredSentByRalf)
+{
+  // Tests that a deferred ACR is detached when it is sent, and that the
+  // Ralf thread pool builds and sends the same Rf message as the equivalent
+  // immediate ACR.
+  pj_time_val ts;
+  ACR* acr;
+  std::string acr_message;
+  std::atomic<bool> sent(false);
+
+  MockHttpConnection* ralf_connection = new MockHttpConnection();
+  RalfProcessor* ralf = new RalfProcessor(ralf_connection, NULL, 1);
+
+  // Create a Ralf ACR factory for deferred S-CSCF ACRs.
+  RalfACRFactory f(ralf, ACR::SCSCF, true);
+
+  // Create an ACR instance for the ACR[EVENT] triggered by the REGISTER.
+  acr = f.get_acr(0, ACR::CALLING_PARTY, ACR::NODE_ROLE_ORIGINATING);
+
+  // Build the original REGISTER request.
+  SIPRequest reg("REGISTER");
+  reg._requri = "sip:homedomain";
+  reg._routes = "Route: <sip:sprout.homedomain:5054;transport=TCP;orig;lr>\r\n";
+  reg._from = "\"6505550000\" <sip:6505550000@homedomain>";   // Strip tag.
+  reg._to = "\"6505550000\" <sip:6505550000@homedomain>";   // Strip tag.
+  reg._extra_hdrs = "Contact: <sip:6505550000@10.83.18.38:36530;transport=TCP>;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"\r\n";
+  reg._extra_hdrs += "Expires: 300\r\n";
+  reg._extra_hdrs += "P-Charging-Vector: icid-value=1234bc9876e;icid-generated-at=10.83.18.28;orig-ioi=homedomain\r\n";
+  reg._extra_hdrs += "P-Charging-Function-Addresses: ccf=192.1.1.1;ccf=192.1.1.2;ecf=192.1.1.3;ecf=192.1.1.4\r\n";
+
+  // Pass the request to the ACR as a received request.
+  ts.sec = 1;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(reg.get()), ts);
+
+  // Now build a 200 OK response and pass it to the ACR as a transmitted
+  // response.
+  SIPResponse reg200ok(200, "REGISTER");
+  reg200ok._extra_hdrs = "P-Associated-URI: <sip:6505550000@homedomain>, <tel:6505550000>\r\n";
+  ts.msec = 25;
+  acr->tx_response(parse_msg(reg200ok.get()), ts);
+
+  // Send the ACR.  The message is built on the Ralf thread, so the ACR can
+  // be deleted straight away.
+  EXPECT_CALL(*ralf_connection, send_post(_, _, _, _, _))
+    .WillOnce(DoAll(SaveArg<2>(&acr_message),
+                    InvokeWithoutArgs([&sent]() { sent = true; }),
+                    Return(200)));
+  acr->send(ts);
+  delete acr;
+
+  for (int ii = 0; (ii < 100) && (!sent); ++ii)
+  {
+    usleep(10000);
+  }
+
+  delete ralf;
+  delete ralf_connection;
+
+  ASSERT_TRUE(sent);
+  EXPECT_TRUE(compare_acr(acr_message, "acr_scscfregister.json"));
+}
+
 TEST_F(ACRTest, SCSCFOrigCall)
 {
   // Tests mainline Rf message generation for a successful originating call
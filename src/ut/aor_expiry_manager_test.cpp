@@ -0,0 +1,237 @@
+/**
+ * @file aor_expiry_manager_test.cpp UT for local expiry of registrations and subscriptions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "aor_expiry_manager.h"
+#include "mock_chronos_connection.h"
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::Return;
+using ::testing::SaveArg;
+using ::testing::SetArgReferee;
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+class AoRExpiryManagerTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  AoRExpiryManagerTest()
+  {
+    _chronos = new MockChronosConnection("chronos");
+    _mgr = new AoRExpiryManager(_chronos,
+                                [this](const std::vector<std::string>& aor_ids,
+                                       SAS::TrailId trail)
+                                {
+                                  _batches.push_back(aor_ids);
+                                });
+
+    // Start tests at the beginning of a bucket, a little in the future.
+    _now = time(NULL);
+    _base = ((_now / AoRExpiryManager::DEFAULT_BUCKET_S) + 2) *
+            AoRExpiryManager::DEFAULT_BUCKET_S;
+  }
+
+  ~AoRExpiryManagerTest()
+  {
+    delete _mgr; _mgr = NULL;
+    delete _chronos; _chronos = NULL;
+  }
+
+  MockChronosConnection* _chronos;
+  AoRExpiryManager* _mgr;
+  std::vector<std::vector<std::string>> _batches;
+  int _now;
+  int _base;
+};
+
+// AoRs are popped in a batch when they are due, and not before.
+TEST_F(AoRExpiryManagerTest, ExpiresInBatches)
+{
+  std::map<std::string, uint32_t> tags;
+  _mgr->aor_updated("sip:a@homedomain", _base + 10, tags);
+  _mgr->aor_updated("sip:b@homedomain", _base + 10, tags);
+  _mgr->aor_updated("sip:c@homedomain", _base + 100, tags);
+  EXPECT_EQ(3u, _mgr->size());
+
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .Times(2)
+    .WillRepeatedly(DoAll(SetArgReferee<0>("TIMER_ID"), Return(HTTP_OK)));
+  _mgr->tick(_now);
+
+  _mgr->tick(_base + 9);
+  EXPECT_TRUE(_batches.empty());
+
+  _mgr->tick(_base + 10);
+  ASSERT_EQ(1u, _batches.size());
+  EXPECT_EQ(2u, _batches[0].size());
+  EXPECT_EQ(1u, _mgr->size());
+
+  // Once all AoRs in a bucket have been popped, its Chronos timer is deleted.
+  EXPECT_CALL(*_chronos, send_delete("TIMER_ID", _)).Times(1);
+  _mgr->tick(_base + AoRExpiryManager::DEFAULT_BUCKET_S);
+}
+
+// Each bucket has a single Chronos timer, carrying its AoRs and the sum of
+// their tags, which is updated when the bucket changes.
+TEST_F(AoRExpiryManagerTest, BucketTimers)
+{
+  std::map<std::string, uint32_t> tags_a = {{"REG", 1}, {"BIND", 1}};
+  std::map<std::string, uint32_t> tags_b = {{"REG", 1}, {"BIND", 2}};
+  _mgr->aor_updated("sip:a@homedomain", _base + 10, tags_a);
+  _mgr->aor_updated("sip:b@homedomain", _base + 20, tags_b);
+
+  std::string opaque;
+  std::map<std::string, uint32_t> tags;
+  uint32_t interval = 0;
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&interval),
+                    SaveArg<3>(&opaque),
+                    SaveArg<5>(&tags),
+                    SetArgReferee<0>("TIMER_ID"),
+                    Return(HTTP_OK)));
+  _mgr->tick(_now);
+
+  EXPECT_THAT(opaque, HasSubstr("sip:a@homedomain"));
+  EXPECT_THAT(opaque, HasSubstr("sip:b@homedomain"));
+  EXPECT_EQ(2u, tags["REG"]);
+  EXPECT_EQ(3u, tags["BIND"]);
+
+  // The safety net pops a bucket's span after the bucket is due.
+  EXPECT_EQ((uint32_t)(_base + 2 * AoRExpiryManager::DEFAULT_BUCKET_S - _now),
+            interval);
+
+  // Rewriting an AoR without changing its bucket doesn't touch Chronos.
+  _mgr->aor_updated("sip:b@homedomain", _base + 20, tags_b);
+  _mgr->tick(_now + AoRExpiryManager::DEFAULT_FLUSH_INTERVAL_S);
+
+  // Removing an AoR updates the bucket's timer on the next flush.
+  _mgr->aor_updated("sip:a@homedomain", 0, tags_a);
+  EXPECT_EQ(1u, _mgr->size());
+
+  EXPECT_CALL(*_chronos, send_put("TIMER_ID", _, "/timers", _, _, _))
+    .WillOnce(DoAll(SaveArg<3>(&opaque),
+                    SaveArg<5>(&tags),
+                    Return(HTTP_OK)));
+  _mgr->tick(_now + 2 * AoRExpiryManager::DEFAULT_FLUSH_INTERVAL_S);
+
+  EXPECT_THAT(opaque, Not(HasSubstr("sip:a@homedomain")));
+  EXPECT_THAT(opaque, HasSubstr("sip:b@homedomain"));
+  EXPECT_EQ(1u, tags["REG"]);
+  EXPECT_EQ(2u, tags["BIND"]);
+
+  // Moving the last AoR to another bucket deletes the old bucket's timer.
+  _mgr->aor_updated("sip:b@homedomain",
+                    _base + AoRExpiryManager::DEFAULT_BUCKET_S + 20,
+                    tags_b);
+
+  EXPECT_CALL(*_chronos, send_delete("TIMER_ID", _)).Times(1);
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("TIMER_ID2"), Return(HTTP_OK)));
+  _mgr->tick(_now + 3 * AoRExpiryManager::DEFAULT_FLUSH_INTERVAL_S);
+}
+
+// A bucket whose timer couldn't be set is retried on the next flush.
+TEST_F(AoRExpiryManagerTest, TimerFailureRetried)
+{
+  std::map<std::string, uint32_t> tags;
+  _mgr->aor_updated("sip:a@homedomain", _base + 10, tags);
+
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .WillOnce(Return(HTTP_SERVER_UNAVAILABLE))
+    .WillOnce(DoAll(SetArgReferee<0>("TIMER_ID"), Return(HTTP_OK)));
+  _mgr->tick(_now);
+
+  // Not time to flush yet.
+  _mgr->tick(_now + 1);
+
+  _mgr->tick(_now + AoRExpiryManager::DEFAULT_FLUSH_INTERVAL_S);
+}
+
+// An AoR's own Chronos timer is only deleted once its bucket's timer has been
+// set.
+TEST_F(AoRExpiryManagerTest, OldTimerDeletedAfterBucketTimer)
+{
+  std::map<std::string, uint32_t> tags;
+  _mgr->aor_updated("sip:a@homedomain", _base + 10, tags, "OLD_TIMER_ID");
+
+  // The bucket timer can't be set, so the old timer is kept.
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .WillOnce(Return(HTTP_SERVER_UNAVAILABLE));
+  EXPECT_CALL(*_chronos, send_delete(_, _)).Times(0);
+  _mgr->tick(_now);
+  ::testing::Mock::VerifyAndClearExpectations(_chronos);
+
+  {
+    ::testing::InSequence seq;
+    EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+      .WillOnce(DoAll(SetArgReferee<0>("TIMER_ID"), Return(HTTP_OK)));
+    EXPECT_CALL(*_chronos, send_delete("OLD_TIMER_ID", _)).Times(1);
+  }
+  _mgr->tick(_now + AoRExpiryManager::DEFAULT_FLUSH_INTERVAL_S);
+}
+
+// Buckets that have changed since the last flush get their timers when the
+// manager is destroyed.
+TEST_F(AoRExpiryManagerTest, FlushedOnDestruction)
+{
+  std::map<std::string, uint32_t> tags;
+  _mgr->aor_updated("sip:a@homedomain", _base + 10, tags);
+
+  std::string opaque;
+  EXPECT_CALL(*_chronos, send_post(_, _, "/timers", _, _, _))
+    .WillOnce(DoAll(SaveArg<3>(&opaque),
+                    SetArgReferee<0>("TIMER_ID"),
+                    Return(HTTP_OK)));
+  delete _mgr; _mgr = NULL;
+
+  EXPECT_THAT(opaque, HasSubstr("sip:a@homedomain"));
+}
@@ -0,0 +1,204 @@
+/**
+ * @file aor_replicator_test.cpp UT for the asynchronous replication of AoRs to a remote site.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "subscriber_data_manager.h"
+#include "aor_replicator.h"
+#include "fakechronosconnection.hpp"
+
+/// Fixture for AoRReplicatorTest.  The local and remote stores are both
+/// backed by local stores.
+class AoRReplicatorTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  AoRReplicatorTest()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _local_datastore = new LocalStore();
+    _remote_datastore = new LocalStore();
+    _local_sdm = new SubscriberDataManager(_local_datastore,
+                                           _chronos_connection,
+                                           true);
+    _remote_sdm = new SubscriberDataManager(_remote_datastore,
+                                            _chronos_connection,
+                                            false);
+    _replicator = new AoRReplicator(_remote_sdm, 2);
+  }
+
+  virtual ~AoRReplicatorTest()
+  {
+    delete _replicator; _replicator = NULL;
+    delete _remote_sdm; _remote_sdm = NULL;
+    delete _local_sdm; _local_sdm = NULL;
+    delete _remote_datastore; _remote_datastore = NULL;
+    delete _local_datastore; _local_datastore = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Adds a binding to an AoR in the local store and replicates it.
+  void add_binding(const std::string& aor_id, const std::string& binding_id)
+  {
+    SubscriberDataManager::AoRPair* aor_pair = _local_sdm->get_aor_data(aor_id, 0);
+    ASSERT_TRUE(aor_pair != NULL);
+    SubscriberDataManager::AoR::Binding* binding =
+      aor_pair->get_current()->get_binding(binding_id);
+    binding->_uri = "sip:" + binding_id + "@192.91.191.29:59934;transport=tcp";
+    binding->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    binding->_cseq = 17038;
+    binding->_expires = time(NULL) + 300;
+    binding->_priority = 0;
+    binding->_private_id = "6505550231@homedomain";
+    binding->_emergency_registration = false;
+    EXPECT_EQ(Store::OK, _local_sdm->set_aor_data(aor_id, aor_pair, 0));
+    _replicator->replicate(aor_id, aor_pair, 0);
+    delete aor_pair;
+  }
+
+  /// Removes a binding from an AoR in the local store and replicates it.
+  void remove_binding(const std::string& aor_id, const std::string& binding_id)
+  {
+    SubscriberDataManager::AoRPair* aor_pair = _local_sdm->get_aor_data(aor_id, 0);
+    ASSERT_TRUE(aor_pair != NULL);
+    aor_pair->get_current()->remove_binding(binding_id);
+    EXPECT_EQ(Store::OK, _local_sdm->set_aor_data(aor_id, aor_pair, 0));
+    _replicator->replicate(aor_id, aor_pair, 0);
+    delete aor_pair;
+  }
+
+  /// Returns the number of bindings the AoR has in the remote store.
+  int remote_bindings(const std::string& aor_id)
+  {
+    SubscriberDataManager::AoRPair* aor_pair = _remote_sdm->get_aor_data(aor_id, 0);
+    int num_bindings = aor_pair->get_current()->bindings().size();
+    delete aor_pair;
+    return num_bindings;
+  }
+
+  /// Waits for all queued AoRs to be written to the remote store, by
+  /// deleting the replicator.
+  void drain()
+  {
+    delete _replicator; _replicator = NULL;
+  }
+
+  FakeChronosConnection* _chronos_connection;
+  LocalStore* _local_datastore;
+  LocalStore* _remote_datastore;
+  SubscriberDataManager* _local_sdm;
+  SubscriberDataManager* _remote_sdm;
+  AoRReplicator* _replicator;
+};
+
+// With no replication threads running, AoRs are written to the remote store
+// straight away.
+TEST_F(AoRReplicatorTest, Synchronous)
+{
+  add_binding("sip:6505550231@homedomain", "binding1");
+  EXPECT_EQ(0u, _replicator->backlog());
+  EXPECT_EQ(1, remote_bindings("sip:6505550231@homedomain"));
+}
+
+TEST_F(AoRReplicatorTest, Asynchronous)
+{
+  _replicator->start();
+  add_binding("sip:6505550231@homedomain", "binding1");
+  add_binding("sip:6505550232@homedomain", "binding1");
+  add_binding("sip:6505550232@homedomain", "binding2");
+  drain();
+
+  EXPECT_EQ(1, remote_bindings("sip:6505550231@homedomain"));
+  EXPECT_EQ(2, remote_bindings("sip:6505550232@homedomain"));
+}
+
+// Bindings removed locally are removed remotely, including when the
+// removal is coalesced with the write that added them.
+TEST_F(AoRReplicatorTest, RemovedBindings)
+{
+  _replicator->start();
+  add_binding("sip:6505550231@homedomain", "binding1");
+  add_binding("sip:6505550231@homedomain", "binding2");
+  remove_binding("sip:6505550231@homedomain", "binding1");
+  drain();
+
+  SubscriberDataManager::AoRPair* aor_pair =
+    _remote_sdm->get_aor_data("sip:6505550231@homedomain", 0);
+  EXPECT_EQ(1u, aor_pair->get_current()->bindings().size());
+  EXPECT_TRUE(aor_pair->get_current()->bindings().find("binding2") !=
+              aor_pair->get_current()->bindings().end());
+  delete aor_pair;
+}
+
+// Bindings that only exist in the remote store are left alone.
+TEST_F(AoRReplicatorTest, RemoteOnlyBindingsKept)
+{
+  SubscriberDataManager::AoRPair* aor_pair =
+    _remote_sdm->get_aor_data("sip:6505550231@homedomain", 0);
+  SubscriberDataManager::AoR::Binding* binding =
+    aor_pair->get_current()->get_binding("remote");
+  binding->_uri = "sip:remote@192.91.191.30:59934;transport=tcp";
+  binding->_expires = time(NULL) + 300;
+  EXPECT_EQ(Store::OK,
+            _remote_sdm->set_aor_data("sip:6505550231@homedomain", aor_pair, 0));
+  delete aor_pair;
+
+  add_binding("sip:6505550231@homedomain", "binding1");
+  EXPECT_EQ(2, remote_bindings("sip:6505550231@homedomain"));
+}
+
+// When the backlog is full, AoRs are written synchronously.
+TEST_F(AoRReplicatorTest, BacklogFull)
+{
+  delete _replicator;
+  _replicator = new AoRReplicator(_remote_sdm, 1, 0);
+  _replicator->start();
+
+  add_binding("sip:6505550231@homedomain", "binding1");
+  EXPECT_EQ(0u, _replicator->backlog());
+  EXPECT_EQ(1, remote_bindings("sip:6505550231@homedomain"));
+}
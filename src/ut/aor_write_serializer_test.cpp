@@ -0,0 +1,167 @@
+/**
+ * @file aor_write_serializer_test.cpp UT for AoRWriteSerializer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "fakesnmp.hpp"
+#include "aor_write_serializer.h"
+
+/// Records the samples accumulated.
+class RecordingAccumulatorTable : public SNMP::FakeEventAccumulatorTable
+{
+public:
+  void accumulate(uint32_t sample) { _samples.push_back(sample); }
+  std::vector<uint32_t> _samples;
+};
+
+TEST(AoRWriteSerializerTest, RetryOnContention)
+{
+  RecordingAccumulatorTable retries;
+  AoRWriteSerializer serializer(16, 10, 100, &retries);
+
+  {
+    AoRWriteSerializer::Write write(&serializer, "sip:alice@example.com");
+    EXPECT_TRUE(write.retry(Store::DATA_CONTENTION));
+    EXPECT_TRUE(write.retry(Store::DATA_CONTENTION));
+    EXPECT_FALSE(write.retry(Store::OK));
+  }
+
+  {
+    AoRWriteSerializer::Write write(&serializer, "sip:alice@example.com");
+    EXPECT_FALSE(write.retry(Store::ERROR));
+    write.finish();
+  }
+
+  // The number of retries for each write is recorded once.
+  ASSERT_EQ(2u, retries._samples.size());
+  EXPECT_EQ(2u, retries._samples[0]);
+  EXPECT_EQ(0u, retries._samples[1]);
+}
+
+TEST(AoRWriteSerializerTest, NoSerializer)
+{
+  AoRWriteSerializer::Write write(NULL, "sip:alice@example.com");
+  EXPECT_TRUE(write.retry(Store::DATA_CONTENTION));
+  EXPECT_FALSE(write.retry(Store::OK));
+}
+
+TEST(AoRWriteSerializerTest, WritesToSameAoRSerialized)
+{
+  AoRWriteSerializer serializer;
+  std::atomic<int> writing(0);
+  std::atomic<int> max_writing(0);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&]()
+    {
+      for (int jj = 0; jj < 10; ++jj)
+      {
+        AoRWriteSerializer::Write write(&serializer, "sip:alice@example.com");
+        int now_writing = ++writing;
+        max_writing = std::max(max_writing.load(), now_writing);
+        usleep(100);
+        --writing;
+      }
+    }));
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  EXPECT_EQ(1, max_writing);
+}
+
+TEST(AoRWriteSerializerTest, WritesToDifferentAoRsConcurrent)
+{
+  // Writes to AoRs that hash to different locks don't block each other.
+  AoRWriteSerializer serializer(2);
+  std::string aor1 = "sip:alice@example.com";
+  std::string aor2;
+
+  for (int ii = 0; aor2.empty(); ++ii)
+  {
+    std::string candidate = "sip:bob" + std::to_string(ii) + "@example.com";
+    if (serializer.lock_for(candidate) != serializer.lock_for(aor1))
+    {
+      aor2 = candidate;
+    }
+  }
+
+  AoRWriteSerializer::Write write1(&serializer, aor1);
+  std::atomic<bool> done(false);
+  std::thread t([&]()
+  {
+    AoRWriteSerializer::Write write2(&serializer, aor2);
+    done = true;
+  });
+  t.join();
+
+  EXPECT_TRUE(done);
+}
+
+TEST(AoRWriteSerializerTest, LockReleasedDuringBackoff)
+{
+  // With a single lock every AoR shares it, so a write held up by contention
+  // must let other writes in while it backs off.
+  AoRWriteSerializer serializer(1, 10000, 10000);
+
+  AoRWriteSerializer::Write write1(&serializer, "sip:alice@example.com");
+  std::atomic<bool> done(false);
+  std::thread t([&]()
+  {
+    AoRWriteSerializer::Write write2(&serializer, "sip:bob@example.com");
+    done = true;
+  });
+
+  for (int ii = 0; (ii < 100) && (!done); ++ii)
+  {
+    write1.retry(Store::DATA_CONTENTION);
+  }
+
+  write1.finish();
+  t.join();
+
+  EXPECT_TRUE(done);
+}
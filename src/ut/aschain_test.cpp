@@ -180,6 +180,68 @@ TEST_F(AsChainTest, AsInvocation)
   EXPECT_EQ(server_name, "sip:pancommunicon.cw-ngv.com");
 }
 
+// ODI tokens stop working once their chain is destroyed, even if the slot
+// is reused.
+TEST_F(AsChainTest, StaleTokenRejected)
+{
+  std::string token;
+
+  {
+    Ifcs ifcs = simple_ifcs(1, "sip:pancommunicon.cw-ngv.com");
+    AsChain as_chain(_as_chain_table, SessionCase::Originating, "sip:5755550011@homedomain", true, 0, ifcs, NULL);
+    AsChainLink as_chain_link(&as_chain, 0u);
+    token = as_chain_link.next_odi_token();
+  }
+
+  EXPECT_FALSE(_as_chain_table->lookup(token).is_set());
+
+  Ifcs ifcs = simple_ifcs(1, "sip:pancommunicon.cw-ngv.com");
+  AsChain as_chain(_as_chain_table, SessionCase::Originating, "sip:5755550011@homedomain", true, 0, ifcs, NULL);
+  AsChainLink as_chain_link(&as_chain, 0u);
+
+  // The new chain reuses the slot, but with a new generation.
+  EXPECT_EQ(token.substr(0, 6), as_chain_link.next_odi_token().substr(0, 6));
+  EXPECT_NE(token, as_chain_link.next_odi_token());
+  EXPECT_FALSE(_as_chain_table->lookup(token).is_set());
+  EXPECT_TRUE(_as_chain_table->lookup(as_chain_link.next_odi_token()).is_set());
+}
+
+// Tokens that weren't issued by the table are rejected.
+TEST_F(AsChainTest, ForgedTokenRejected)
+{
+  Ifcs ifcs = simple_ifcs(1, "sip:pancommunicon.cw-ngv.com");
+  AsChain as_chain(_as_chain_table, SessionCase::Originating, "sip:5755550011@homedomain", true, 0, ifcs, NULL);
+  AsChainLink as_chain_link(&as_chain, 0u);
+  std::string token = as_chain_link.next_odi_token();
+  EXPECT_THAT(token, MatchesRegex("[0-9a-f]{34}"));
+
+  // Wrong length or not hex.
+  EXPECT_FALSE(_as_chain_table->lookup("").is_set());
+  EXPECT_FALSE(_as_chain_table->lookup("12345678").is_set());
+  EXPECT_FALSE(_as_chain_table->lookup(token + "0").is_set());
+  EXPECT_FALSE(_as_chain_table->lookup(std::string(34, 'g')).is_set());
+
+  // Wrong nonce.
+  std::string forged = token;
+  forged[33] = (forged[33] == '0') ? '1' : '0';
+  EXPECT_FALSE(_as_chain_table->lookup(forged).is_set());
+
+  // Step beyond the end of the chain, and the initial step (which is never
+  // handed out).
+  forged = token;
+  forged.replace(14, 4, "0005");
+  EXPECT_FALSE(_as_chain_table->lookup(forged).is_set());
+  forged.replace(14, 4, "0000");
+  EXPECT_FALSE(_as_chain_table->lookup(forged).is_set());
+
+  // Slot that has never been allocated.
+  forged = token;
+  forged.replace(0, 6, "0fffff");
+  EXPECT_FALSE(_as_chain_table->lookup(forged).is_set());
+  forged.replace(0, 6, "ffffff");
+  EXPECT_FALSE(_as_chain_table->lookup(forged).is_set());
+}
+
 // ++@@@ aschain.to_string
 // @@@ initial request: has MMTEL, orig and term
 // ++@@@ has ASs but URI is invalid.
@@ -0,0 +1,135 @@
+/**
+ * @file async_io_pool_test.cpp UT for the pool of threads for blocking I/O.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "async_io_pool.h"
+
+using namespace std;
+
+class AsyncIOPoolTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+};
+
+// Operations run on the I/O threads, and their completion callbacks are
+// passed to the dispatcher.
+TEST_F(AsyncIOPoolTest, Dispatch)
+{
+  std::mutex lock;
+  std::vector<AsyncIOPool::Callback> dispatched;
+  pthread_t caller = pthread_self();
+  std::atomic<int> other_thread(0);
+
+  AsyncIOPool* pool = new AsyncIOPool(2,
+                                      [&](const AsyncIOPool::Callback& done)
+                                      {
+                                        std::lock_guard<std::mutex> guard(lock);
+                                        dispatched.push_back(done);
+                                      });
+  pool->start();
+
+  int completed = 0;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    pool->run([&]()
+              {
+                if (!pthread_equal(pthread_self(), caller))
+                {
+                  other_thread++;
+                }
+              },
+              [&]() { completed++; });
+  }
+
+  // Deleting the pool waits for the operations to run.
+  delete pool;
+
+  EXPECT_EQ(10, other_thread.load());
+  ASSERT_EQ(10u, dispatched.size());
+  EXPECT_EQ(0, completed);
+
+  // Run the completion callbacks, as the worker threads would.
+  for (size_t ii = 0; ii < dispatched.size(); ++ii)
+  {
+    dispatched[ii]();
+  }
+  EXPECT_EQ(10, completed);
+}
+
+// Without a dispatcher, completion callbacks run on the I/O thread straight
+// after the operation.
+TEST_F(AsyncIOPoolTest, NoDispatcher)
+{
+  std::atomic<int> worked(0);
+  std::atomic<int> completed(0);
+  std::atomic<bool> in_order(true);
+
+  AsyncIOPool* pool = new AsyncIOPool(1);
+  pool->start();
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    pool->run([&]() { worked++; },
+              [&]()
+              {
+                if (worked.load() <= completed.load())
+                {
+                  in_order = false;
+                }
+                completed++;
+              });
+  }
+
+  delete pool;
+
+  EXPECT_EQ(5, worked.load());
+  EXPECT_EQ(5, completed.load());
+  EXPECT_TRUE(in_order.load());
+}
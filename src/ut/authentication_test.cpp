@@ -56,6 +56,7 @@ extern "C" {
 #include "test_interposer.hpp"
 #include "md5.h"
 #include "fakesnmp.hpp"
+#include "mock_impi_store.h"
 
 using namespace std;
 using namespace std;
@@ -64,6 +65,9 @@ using testing::ElementsAre;
 using testing::MatchesRegex;
 using testing::HasSubstr;
 using testing::Not;
+using testing::NiceMock;
+using testing::Invoke;
+using testing::_;
 
 int get_binding_expiry(pjsip_contact_hdr* contact, pjsip_expires_hdr* expires)
 {
@@ -267,6 +271,61 @@ class AuthenticationNonceCountDisabledTest : public BaseAuthenticationTest
 };
 
 
+/// Runs the authentication module against a mock IMPI store that passes
+/// calls through to the real store, so that tests can check when the store
+/// is read.
+class AuthenticationMockStoreTest : public BaseAuthenticationTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    BaseAuthenticationTest::SetUpTestCase();
+    _mock_impi_store = new NiceMock<MockImpiStore>();
+    pj_status_t ret = init_authentication("homedomain",
+                                          _mock_impi_store,
+                                          _hss_connection,
+                                          _chronos_connection,
+                                          _acr_factory,
+                                          NonRegisterAuthentication::NEVER,
+                                          _analytics,
+                                          &SNMP::FAKE_AUTHENTICATION_STATS_TABLES,
+                                          true,
+                                          get_binding_expiry);
+
+    ASSERT_EQ(PJ_SUCCESS, ret);
+  }
+
+  static void TearDownTestCase()
+  {
+    destroy_authentication();
+    delete _mock_impi_store; _mock_impi_store = NULL;
+    BaseAuthenticationTest::TearDownTestCase();
+  }
+
+  AuthenticationMockStoreTest()
+  {
+    ON_CALL(*_mock_impi_store, set_impi(_, _))
+      .WillByDefault(Invoke(_impi_store, &ImpiStore::set_impi));
+    ON_CALL(*_mock_impi_store, get_impi(_, _))
+      .WillByDefault(Invoke(_impi_store, &ImpiStore::get_impi));
+    ON_CALL(*_mock_impi_store, get_impi_with_nonce(_, _, _))
+      .WillByDefault(Invoke(_impi_store, &ImpiStore::get_impi_with_nonce));
+    ON_CALL(*_mock_impi_store, delete_impi(_, _))
+      .WillByDefault(Invoke(_impi_store, &ImpiStore::delete_impi));
+  }
+
+  ~AuthenticationMockStoreTest()
+  {
+    testing::Mock::VerifyAndClear(_mock_impi_store);
+  }
+
+protected:
+  static MockImpiStore* _mock_impi_store;
+};
+
+MockImpiStore* AuthenticationMockStoreTest::_mock_impi_store;
+
+
 class AuthenticationMessage
 {
 public:
@@ -1279,6 +1338,209 @@ TEST_F(AuthenticationTest, DigestChallengeExpired)
   _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
 }
 
+TEST_F(AuthenticationMockStoreTest, DigestForgedNonce)
+{
+  // Test that a response using a nonce that has been tampered with is
+  // re-challenged without reading the IMPI store.
+  pjsip_tx_data* tdata;
+
+  // Set up the HSS response for the AV query using a default private user identity.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  // Send in a REGISTER request with no authentication header.  This triggers
+  // Digest authentication.
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  // Expect a 401 Not Authorized response.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  // Extract the nonce, nc, cnonce and qop fields from the WWW-Authenticate header.
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_NE("", auth_params["nonce"]);
+  free_txdata();
+
+  // Send a new REGISTER request with a correct response, but using the nonce
+  // for a different IMPI.
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._auth_user = "6505550002@homedomain";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  _hss_connection->set_result("/impi/6505550002%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+  EXPECT_CALL(*_mock_impi_store, get_impi_with_nonce(_, _, _)).Times(0);
+  inject_msg(msg2.get());
+
+  // The authentication module has generated a fresh challenge.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  std::string new_auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> new_auth_params;
+  parse_www_authenticate(new_auth, new_auth_params);
+  EXPECT_EQ("true", new_auth_params["stale"]);
+  EXPECT_NE(auth_params["nonce"], new_auth_params["nonce"]);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+  _hss_connection->delete_result("/impi/6505550002%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+
+TEST_F(AuthenticationMockStoreTest, DigestNonceExpired)
+{
+  // Test that a first response to a challenge that has expired is
+  // re-challenged without reading the IMPI store.
+  pjsip_tx_data* tdata;
+
+  // Set up the HSS response for the AV query using a default private user identity.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  // Send in a REGISTER request with no authentication header.  This triggers
+  // Digest authentication.
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  // Expect a 401 Not Authorized response.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  // Extract the nonce, nc, cnonce and qop fields from the WWW-Authenticate header.
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_NE("", auth_params["nonce"]);
+  free_txdata();
+
+  // Advance time past the expiry of the challenge.
+  cwtest_advance_time_ms(41 * 1000);
+
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  EXPECT_CALL(*_mock_impi_store, get_impi_with_nonce(_, _, _)).Times(0);
+  inject_msg(msg2.get());
+
+  // The authentication module has generated a fresh challenge.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  std::string new_auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> new_auth_params;
+  parse_www_authenticate(new_auth, new_auth_params);
+  EXPECT_EQ("true", new_auth_params["stale"]);
+  EXPECT_NE(auth_params["nonce"], new_auth_params["nonce"]);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST_F(AuthenticationMockStoreTest, DigestNonceCountReplayed)
+{
+  // Test that a REGISTER reusing a nonce count this node has already
+  // accepted is re-challenged without reading the IMPI store, even if it
+  // isn't the latest count.
+  pjsip_tx_data* tdata;
+
+  // Set up the HSS response for the AV query using a default private user identity.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  // Send in a REGISTER request with no authentication header.  This triggers
+  // Digest authentication.
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  // Expect a 401 Not Authorized response.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_NE("", auth_params["nonce"]);
+  free_txdata();
+
+  // Authenticate with nonce counts 1 and 2.
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  inject_msg(msg2.get());
+  ASSERT_EQ(0, txdata_count());
+
+  AuthenticationMessage msg3("REGISTER");
+  msg3._algorithm = "MD5";
+  msg3._key = "12345678123456781234567812345678";
+  msg3._nonce = auth_params["nonce"];
+  msg3._opaque = auth_params["opaque"];
+  msg3._nc = "00000002";
+  msg3._cnonce = "8765432187654321";
+  msg3._qop = "auth";
+  msg3._integ_prot = "ip-assoc-pending";
+  inject_msg(msg3.get());
+  ASSERT_EQ(0, txdata_count());
+
+  // Replay the first REGISTER.  This is rejected by this node's window of
+  // accepted nonce counts, without reading the store.
+  EXPECT_CALL(*_mock_impi_store, get_impi_with_nonce(_, _, _)).Times(0);
+  inject_msg(msg2.get());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  std::string new_auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> new_auth_params;
+  parse_www_authenticate(new_auth, new_auth_params);
+  EXPECT_EQ("true", new_auth_params["stale"]);
+  EXPECT_NE(auth_params["nonce"], new_auth_params["nonce"]);
+  free_txdata();
+  testing::Mock::VerifyAndClearExpectations(_mock_impi_store);
+
+  // A later nonce count is still checked against the store and accepted.
+  AuthenticationMessage msg4("REGISTER");
+  msg4._algorithm = "MD5";
+  msg4._key = "12345678123456781234567812345678";
+  msg4._nonce = auth_params["nonce"];
+  msg4._opaque = auth_params["opaque"];
+  msg4._nc = "00000003";
+  msg4._cnonce = "8765432187654321";
+  msg4._qop = "auth";
+  msg4._integ_prot = "ip-assoc-pending";
+  EXPECT_CALL(*_mock_impi_store, get_impi_with_nonce(_, _, _));
+  inject_msg(msg4.get());
+  ASSERT_EQ(0, txdata_count());
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
 TEST_F(AuthenticationTest, AKAAuthSuccess)
 {
   // Test a successful AKA authentication flow.
@@ -255,7 +255,8 @@ public:
                             bool icscf_enabled = false,
                             bool scscf_enabled = false,
                             const string& icscf_uri_str = "",
-                            bool emerg_reg_enabled = false)
+                            bool emerg_reg_enabled = false,
+                            bool stateless_in_dialog = false)
   {
     SipTest::SetUpTestCase(false);
 
@@ -306,7 +307,8 @@ public:
                                           _scscf_selector,
                                           _icscf,
                                           _scscf,
-                                          _emerg_reg);
+                                          _emerg_reg,
+                                          stateless_in_dialog);
     ASSERT_EQ(PJ_SUCCESS, ret) << PjStatus(ret);
 
     // Schedule timers.
@@ -552,6 +554,31 @@ public:
 protected:
 };
 
+class StatefulEdgeProxyStatelessTest : public StatefulEdgeProxyTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    StatefulProxyTestBase::SetUpTestCase("upstreamnode", "", "", "", false, false, false, "", false, true);
+    add_host_mapping("upstreamnode", "10.6.6.8");
+  }
+
+  static void TearDownTestCase()
+  {
+    StatefulProxyTestBase::TearDownTestCase();
+  }
+
+  StatefulEdgeProxyStatelessTest()
+  {
+  }
+
+  ~StatefulEdgeProxyStatelessTest()
+  {
+  }
+
+protected:
+};
+
 using SP::Message;
 
 // Test flows into Sprout (S-CSCF), in particular for header stripping.
@@ -2291,3 +2318,71 @@ TEST_F(StatefulEdgeProxyTest, TestSessionExpires)
 
   delete tp; tp = NULL;
 }
+
+// Test that in-dialog non-INVITE requests are forwarded statelessly when
+// enabled, and that their responses are forwarded back.
+TEST_F(StatefulEdgeProxyStatelessTest, StatelessInDialogRequest)
+{
+  SCOPED_TRACE("");
+
+  // Register client.
+  TransportFlow tp(TransportFlow::Protocol::TCP, stack_data.pcscf_untrusted_port, "10.83.18.38", 36530);
+  string token;
+  string baretoken;
+  doRegisterEdge(&tp, token, baretoken);
+
+  // In-dialog MESSAGE from Sprout via bono to the client.
+  Message msg;
+  msg._method = "MESSAGE";
+  msg._todomain = "10.83.18.38:36530;transport=tcp";
+  msg._via = "10.99.88.11:12345";
+  msg._route = string("Route: ").append(token);
+  msg._in_dialog = true;
+
+  unsigned tsx_count = pjsip_tsx_layer_get_tsx_count();
+  inject_msg(msg.get_request());
+
+  // The request goes straight out over the client flow, without any
+  // transactions being created.
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* tdata = current_txdata();
+  ReqMatcher("MESSAGE").matches(tdata->msg);
+  tp.expect_target(tdata);
+  EXPECT_EQ("", get_headers(tdata->msg, "Route"));
+  EXPECT_EQ(tsx_count, pjsip_tsx_layer_get_tsx_count());
+
+  pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+  ASSERT_TRUE(via != NULL);
+  std::string branch = str_pj(via->branch_param);
+  EXPECT_THAT(branch, HasSubstr("z9hG4bK"));
+
+  // The client's response is forwarded back towards Sprout.
+  inject_msg(respond_to_current_txdata(200), &tp);
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+
+  // A retransmission of the request is forwarded with the same branch, so
+  // the client matches it to the same transaction.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("MESSAGE").matches(tdata->msg);
+  via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+  ASSERT_TRUE(via != NULL);
+  EXPECT_EQ(branch, str_pj(via->branch_param));
+  free_txdata();
+
+  // In-dialog BYEs still need a transaction for dialog tracking.
+  msg._method = "BYE";
+  msg._unique++;
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  ReqMatcher("BYE").matches(current_txdata()->msg);
+  EXPECT_LT(tsx_count, pjsip_tsx_layer_get_tsx_count());
+
+  inject_msg(respond_to_current_txdata(200), &tp);
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+}
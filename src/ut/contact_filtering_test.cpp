@@ -288,6 +288,37 @@ TEST_F(ContactFilteringMatchFeatureTest, SubstringMatch)
   EXPECT_EQ(NO, match_feature(matcher, matchee));
 }
 
+class ContactFilteringParseFeatureTest : public ContactFilteringTest {};
+
+TEST_F(ContactFilteringParseFeatureTest, ParseTypes)
+{
+  ContactFeature boolean("");
+  EXPECT_EQ(ContactFeature::TOKENS, boolean._type);
+  ASSERT_EQ(1u, boolean._tokens.size());
+  EXPECT_EQ("true", boolean._tokens[0]);
+
+  ContactFeature tokens("\"INVITE, !Options\"");
+  EXPECT_EQ(ContactFeature::TOKENS, tokens._type);
+  ASSERT_EQ(2u, tokens._tokens.size());
+  EXPECT_EQ("invite", tokens._tokens[0]);
+  EXPECT_EQ("!options", tokens._tokens[1]);
+
+  ContactFeature string("\"<Hello>\"");
+  EXPECT_EQ(ContactFeature::STRING, string._type);
+  EXPECT_EQ("<Hello>", string._literal);
+
+  ContactFeature numeric("#1.5:2.5");
+  EXPECT_EQ(ContactFeature::NUMERIC, numeric._type);
+  EXPECT_TRUE(numeric._valid);
+  EXPECT_EQ(1.5, numeric._minimum);
+  EXPECT_EQ(2.5, numeric._maximum);
+
+  ContactFeature bad_numeric("#2.5:1.5");
+  EXPECT_EQ(ContactFeature::NUMERIC, bad_numeric._type);
+  EXPECT_FALSE(bad_numeric._valid);
+  EXPECT_THROW(match_feature("+sip.num", bad_numeric, numeric), FeatureParseError);
+}
+
 class ContactFilteringPrebuiltHeadersFixture : public ContactFilteringTest
 {
 public:
@@ -913,6 +944,46 @@ TEST_F(ContactFilteringFullStackTest, RejectFilteringMatch)
 
   delete aor_data;
 }
+// Bindings read from the store have their features parsed in advance, and
+// filtering uses those rather than the raw parameters.
+TEST_F(ContactFilteringFullStackTest, RejectFilteringMatchPreParsed)
+{
+  SubscriberDataManager::AoR* aor_data = new SubscriberDataManager::AoR(aor);
+  SubscriberDataManager::AoR::Binding* binding = aor_data->get_binding("<sip:user@10.1.2.3>");
+  create_binding(*binding);
+  binding->parse_features();
+  EXPECT_TRUE(binding->_features_parsed);
+  EXPECT_EQ(binding->_params.size(), binding->_features.size());
+
+  msg->line.req.method.name = pj_str((char*)"INVITE");
+
+  // Add a Reject-Contact header that matches the binding.
+  pj_str_t header_name = pj_str((char*)"Reject-Contact");
+  char* header_value = (char*)"*;+sip.string=\"<hello>\";methods=\"INVITE\"";
+  pjsip_reject_contact_hdr* reject_hdr = (pjsip_reject_contact_hdr*)
+    pjsip_parse_hdr(pool,
+                    &header_name,
+                    header_value,
+                    strlen(header_value),
+                    NULL);
+  ASSERT_NE((pjsip_reject_contact_hdr*)NULL, reject_hdr);
+  pjsip_msg_add_hdr(msg, (pjsip_hdr*)reject_hdr);
+
+  TargetList targets;
+
+  filter_bindings_to_targets(aor,
+                             aor_data,
+                             msg,
+                             pool,
+                             5,
+                             targets,
+                             1);
+
+  EXPECT_EQ((unsigned)0, targets.size());
+
+  delete aor_data;
+}
+
 TEST_F(ContactFilteringFullStackTest, RejectFilteringNoMatch)
 {
   SubscriberDataManager::AoR* aor_data = new SubscriberDataManager::AoR(aor);
@@ -0,0 +1,270 @@
+/**
+ * @file destination_health_test.cpp UT for downstream destination health tracking.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "gtest/gtest.h"
+
+#include "destination_health.h"
+
+/// DestinationHealth with a controllable clock and random numbers.
+class TestDestinationHealth : public DestinationHealth
+{
+public:
+  TestDestinationHealth(bool outlier_ejection, bool hedging) :
+    DestinationHealth(outlier_ejection, hedging, 1000),
+    _now(1000000),
+    _random(0.5)
+  {}
+
+  unsigned long now_ms() { return _now; }
+  double random() { return _random; }
+
+  unsigned long _now;
+  double _random;
+};
+
+class DestinationHealthTest : public ::testing::Test
+{
+public:
+  DestinationHealthTest() : _health(true, true)
+  {
+    _servers.push_back(make_server("10.0.0.1"));
+    _servers.push_back(make_server("10.0.0.2"));
+    _servers.push_back(make_server("10.0.0.3"));
+  }
+
+  static AddrInfo make_server(const char* ip)
+  {
+    AddrInfo ai;
+    ai.address.af = AF_INET;
+    inet_pton(AF_INET, ip, &ai.address.addr.ipv4);
+    ai.port = 5060;
+    ai.transport = IPPROTO_TCP;
+    return ai;
+  }
+
+  static bool same(const AddrInfo& lhs, const AddrInfo& rhs)
+  {
+    return !(lhs < rhs) && !(rhs < lhs);
+  }
+
+  static bool same_order(const std::vector<AddrInfo>& lhs,
+                         const std::vector<AddrInfo>& rhs)
+  {
+    if (lhs.size() != rhs.size())
+    {
+      return false;
+    }
+
+    for (size_t ii = 0; ii < lhs.size(); ++ii)
+    {
+      if (!same(lhs[ii], rhs[ii]))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Gives every server a history of healthy responses.
+  void all_healthy()
+  {
+    for (int ii = 0; ii < 50; ++ii)
+    {
+      for (size_t jj = 0; jj < _servers.size(); ++jj)
+      {
+        _health.record_response(_servers[jj], 20);
+      }
+    }
+  }
+
+  TestDestinationHealth _health;
+  std::vector<AddrInfo> _servers;
+};
+
+// Healthy servers are left in the order the resolver chose.
+TEST_F(DestinationHealthTest, HealthyOrderUnchanged)
+{
+  all_healthy();
+
+  std::vector<AddrInfo> servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same_order(servers, _servers));
+}
+
+// A failing server is moved to the end of the list, and is gradually
+// reintroduced once its ejection expires.
+TEST_F(DestinationHealthTest, FailingServerEjected)
+{
+  all_healthy();
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _health.record_failure(_servers[0]);
+  }
+
+  std::vector<AddrInfo> servers = _servers;
+  _health.reorder_servers(servers);
+  ASSERT_EQ(3u, servers.size());
+  EXPECT_TRUE(same(servers[0], _servers[1]));
+  EXPECT_TRUE(same(servers[1], _servers[2]));
+  EXPECT_TRUE(same(servers[2], _servers[0]));
+
+  // Part way through reintroduction the server gets a partial share of
+  // the traffic.
+  _health._now += 10000 + 15000;
+  _health._random = 0.4;
+  servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same(servers[0], _servers[0]));
+
+  _health._random = 0.6;
+  servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same(servers[2], _servers[0]));
+
+  // Once reintroduced it gets its full share.
+  _health._now += 15000;
+  servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same_order(servers, _servers));
+}
+
+// A slow server is ejected, and consecutive ejections last longer.
+TEST_F(DestinationHealthTest, SlowServerEjected)
+{
+  all_healthy();
+
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    _health.record_response(_servers[1], 2000);
+  }
+
+  std::vector<AddrInfo> servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same(servers[2], _servers[1]));
+
+  // Wait for reintroduction, then stay slow.
+  _health._now += 10000 + 30000;
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _health.record_response(_servers[1], 2000);
+  }
+
+  // The second ejection lasts 20s rather than 10s.
+  _health._now += 15000;
+  servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same(servers[2], _servers[1]));
+}
+
+// No more than half the servers are ejected at once.
+TEST_F(DestinationHealthTest, EjectionLimited)
+{
+  all_healthy();
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    for (size_t jj = 0; jj < _servers.size(); ++jj)
+    {
+      _health.record_failure(_servers[jj]);
+    }
+  }
+
+  std::vector<AddrInfo> servers = _servers;
+  _health.reorder_servers(servers);
+  EXPECT_TRUE(same(servers[0], _servers[1]));
+  EXPECT_TRUE(same(servers[1], _servers[2]));
+}
+
+// Nothing is reordered when outlier ejection is disabled.
+TEST_F(DestinationHealthTest, EjectionDisabled)
+{
+  TestDestinationHealth health(false, true);
+
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    health.record_failure(_servers[0]);
+  }
+
+  std::vector<AddrInfo> servers = _servers;
+  health.reorder_servers(servers);
+  EXPECT_TRUE(same_order(servers, _servers));
+}
+
+// The hedge delay tracks the latency distribution of a server.
+TEST_F(DestinationHealthTest, HedgeDelay)
+{
+  // Nothing known yet.
+  EXPECT_EQ(0u, _health.hedge_delay_ms(_servers[0]));
+
+  // Constant latency gives a delay close to that latency.
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    _health.record_response(_servers[0], 100);
+  }
+  EXPECT_EQ(100u, _health.hedge_delay_ms(_servers[0]));
+
+  // Variable latency gives a longer delay.
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    _health.record_response(_servers[0], (ii % 2 == 0) ? 50 : 150);
+  }
+  EXPECT_GT(_health.hedge_delay_ms(_servers[0]), 150u);
+  EXPECT_LE(_health.hedge_delay_ms(_servers[0]), 2000u);
+}
+
+// Destinations that haven't been used for a while are forgotten.
+TEST_F(DestinationHealthTest, IdleDestinationsPruned)
+{
+  all_healthy();
+  EXPECT_EQ(3u, _health.size());
+
+  // Keep using the first server only.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _health._now += 60000;
+    _health.record_response(_servers[0], 20);
+  }
+
+  EXPECT_EQ(1u, _health.size());
+  EXPECT_NE(0u, _health.hedge_delay_ms(_servers[0]));
+  EXPECT_EQ(0u, _health.hedge_delay_ms(_servers[1]));
+}
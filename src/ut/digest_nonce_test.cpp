@@ -0,0 +1,163 @@
+/**
+ * @file digest_nonce_test.cpp UT for digest nonce signing and nonce count tracking.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "digest_nonce.h"
+
+TEST(DigestNonceSignerTest, MintAndCheck)
+{
+  DigestNonceSigner signer("key");
+  std::string nonce = signer.mint("alice@example.com", 1000);
+
+  EXPECT_EQ(DigestNonceSigner::NONCE_LENGTH, nonce.length());
+  EXPECT_EQ(DigestNonceSigner::VALID, signer.check(nonce, "alice@example.com", 1000));
+
+  // Nonces are random.
+  EXPECT_NE(nonce, signer.mint("alice@example.com", 1000));
+}
+
+TEST(DigestNonceSignerTest, Expired)
+{
+  DigestNonceSigner signer("key");
+  std::string nonce = signer.mint("alice@example.com", 1000);
+
+  EXPECT_EQ(DigestNonceSigner::EXPIRED, signer.check(nonce, "alice@example.com", 1001));
+}
+
+TEST(DigestNonceSignerTest, Forged)
+{
+  DigestNonceSigner signer("key");
+  std::string nonce = signer.mint("alice@example.com", 1000);
+
+  // Used by a different IMPI.
+  EXPECT_EQ(DigestNonceSigner::FORGED, signer.check(nonce, "bob@example.com", 1000));
+
+  // Expiry extended.
+  std::string extended = nonce;
+  extended[23] = (extended[23] == 'f') ? '0' : 'f';
+  EXPECT_EQ(DigestNonceSigner::FORGED, signer.check(extended, "alice@example.com", 1000));
+
+  // HMAC changed.
+  std::string tampered = nonce;
+  tampered[47] = (tampered[47] == 'f') ? '0' : 'f';
+  EXPECT_EQ(DigestNonceSigner::FORGED, signer.check(tampered, "alice@example.com", 1000));
+}
+
+TEST(DigestNonceSignerTest, Unknown)
+{
+  DigestNonceSigner signer("key");
+  DigestNonceSigner other_signer("other key");
+  std::string nonce = other_signer.mint("alice@example.com", 1000);
+
+  // Minted with another key.
+  EXPECT_EQ(DigestNonceSigner::UNKNOWN, signer.check(nonce, "alice@example.com", 1000));
+
+  // Not in our format (for example, an AKA nonce or a nonce from an older
+  // release).
+  EXPECT_EQ(DigestNonceSigner::UNKNOWN, signer.check("abcdefabcdefabcdefabcdefabcdef", "alice@example.com", 1000));
+  EXPECT_EQ(DigestNonceSigner::UNKNOWN, signer.check(std::string(48, 'x'), "alice@example.com", 1000));
+}
+
+TEST(DigestNonceSignerTest, RandomKey)
+{
+  DigestNonceSigner signer1;
+  DigestNonceSigner signer2;
+  std::string nonce = signer1.mint("alice@example.com", 1000);
+
+  EXPECT_EQ(DigestNonceSigner::VALID, signer1.check(nonce, "alice@example.com", 1000));
+  EXPECT_EQ(DigestNonceSigner::UNKNOWN, signer2.check(nonce, "alice@example.com", 1000));
+}
+
+TEST(NonceCountWindowTest, Replays)
+{
+  NonceCountWindow window;
+  uint32_t next_count = 0;
+
+  EXPECT_EQ(NonceCountWindow::UNKNOWN, window.check("nonce", 1, 100, next_count));
+  window.record("nonce", 1, 200);
+
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 1, 100, next_count));
+  EXPECT_EQ(2u, next_count);
+  EXPECT_EQ(NonceCountWindow::NEW, window.check("nonce", 2, 100, next_count));
+
+  // Skip some counts.  Those skipped can still be used, but not those that
+  // have been accepted.
+  window.record("nonce", 5, 200);
+  EXPECT_EQ(NonceCountWindow::NEW, window.check("nonce", 3, 100, next_count));
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 5, 100, next_count));
+  EXPECT_EQ(6u, next_count);
+  window.record("nonce", 3, 200);
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 3, 100, next_count));
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 1, 100, next_count));
+
+  // Counts that have dropped out of the window are treated as replays.
+  window.record("nonce", 100, 200);
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 6, 100, next_count));
+  EXPECT_EQ(NonceCountWindow::NEW, window.check("nonce", 99, 100, next_count));
+}
+
+TEST(NonceCountWindowTest, Expiry)
+{
+  NonceCountWindow window;
+  uint32_t next_count = 0;
+
+  window.record("nonce", 1, 200);
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce", 1, 200, next_count));
+
+  // Once the challenge has expired the nonce is forgotten.
+  EXPECT_EQ(NonceCountWindow::UNKNOWN, window.check("nonce", 1, 201, next_count));
+  EXPECT_EQ(0u, window.size());
+}
+
+TEST(NonceCountWindowTest, Eviction)
+{
+  NonceCountWindow window(2);
+  uint32_t next_count = 0;
+
+  window.record("nonce1", 1, 200);
+  window.record("nonce2", 1, 200);
+
+  // Use nonce1, so that nonce2 is evicted.
+  window.check("nonce1", 2, 100, next_count);
+  window.record("nonce3", 1, 200);
+
+  EXPECT_EQ(2u, window.size());
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce1", 1, 100, next_count));
+  EXPECT_EQ(NonceCountWindow::UNKNOWN, window.check("nonce2", 1, 100, next_count));
+  EXPECT_EQ(NonceCountWindow::REPLAYED, window.check("nonce3", 1, 100, next_count));
+}
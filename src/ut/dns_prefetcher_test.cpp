@@ -0,0 +1,204 @@
+/**
+ * @file dns_prefetcher_test.cpp UT for the DNS prefetcher.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include "gtest/gtest.h"
+
+#include "test_interposer.hpp"
+#include "fakesnmp.hpp"
+#include "dns_prefetcher.h"
+
+/// Prefetcher that records the targets it resolves rather than querying DNS.
+class TestDnsPrefetcher : public DnsPrefetcher
+{
+public:
+  TestDnsPrefetcher(SNMP::CounterTable* hits_tbl,
+                    SNMP::CounterTable* misses_tbl,
+                    SNMP::CounterTable* refreshes_tbl) :
+    DnsPrefetcher(NULL, AF_INET, hits_tbl, misses_tbl, refreshes_tbl)
+  {
+  }
+
+  std::map<std::string, int> _ttls;
+  std::vector<std::string> _resolved;
+
+protected:
+  int resolve(const std::string& name, int port, int transport)
+  {
+    _resolved.push_back(name);
+    std::map<std::string, int>::const_iterator i = _ttls.find(name);
+    return (i != _ttls.end()) ? i->second : -1;
+  }
+};
+
+class DnsPrefetcherTest : public ::testing::Test
+{
+public:
+  SNMP::FakeCounterTable _hits;
+  SNMP::FakeCounterTable _misses;
+  SNMP::FakeCounterTable _refreshes;
+
+  DnsPrefetcherTest() :
+    _prefetcher(&_hits, &_misses, &_refreshes),
+    _now(time(NULL))
+  {
+  }
+
+  void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
+  TestDnsPrefetcher _prefetcher;
+  int _now;
+};
+
+// Targets are parsed out of SIP URIs, with the port and transport.
+TEST_F(DnsPrefetcherTest, ParseTarget)
+{
+  std::string name;
+  int port;
+  int transport;
+
+  EXPECT_TRUE(DnsPrefetcher::parse_target("sip:bgcf.homedomain", name, port, transport));
+  EXPECT_EQ("bgcf.homedomain", name);
+  EXPECT_EQ(0, port);
+  EXPECT_EQ(-1, transport);
+
+  EXPECT_TRUE(DnsPrefetcher::parse_target("<sip:user@as1.homedomain:5070;transport=TCP;lr>",
+                                          name, port, transport));
+  EXPECT_EQ("as1.homedomain", name);
+  EXPECT_EQ(5070, port);
+  EXPECT_EQ(IPPROTO_TCP, transport);
+
+  EXPECT_TRUE(DnsPrefetcher::parse_target("sip:[2001:db8::1]:5060;transport=udp",
+                                          name, port, transport));
+  EXPECT_EQ("2001:db8::1", name);
+  EXPECT_EQ(5060, port);
+  EXPECT_EQ(IPPROTO_UDP, transport);
+
+  EXPECT_FALSE(DnsPrefetcher::parse_target("tel:+16505551234", name, port, transport));
+  EXPECT_FALSE(DnsPrefetcher::parse_target("", name, port, transport));
+}
+
+// Configured targets are resolved straight away, then again when their
+// records expire.  Failed lookups are retried sooner.
+TEST_F(DnsPrefetcherTest, RefreshesAtExpiry)
+{
+  std::vector<std::string> uris = {"sip:scscf1.homedomain;transport=tcp",
+                                   "sip:scscf2.homedomain",
+                                   "sip:10.0.0.1:5060"};
+  _prefetcher.add_source([&uris]() { return uris; });
+  _prefetcher._ttls["scscf1.homedomain"] = 30;
+
+  _prefetcher.tick(_now);
+  EXPECT_EQ(2u, _prefetcher.size());
+  EXPECT_EQ(2u, _prefetcher._resolved.size());
+  EXPECT_EQ(2, _refreshes._count);
+
+  _prefetcher._resolved.clear();
+  _prefetcher._ttls["scscf2.homedomain"] = 300;
+  _prefetcher.tick(_now + DnsPrefetcher::FAILURE_RETRY_S);
+  ASSERT_EQ(1u, _prefetcher._resolved.size());
+  EXPECT_EQ("scscf2.homedomain", _prefetcher._resolved[0]);
+
+  _prefetcher._resolved.clear();
+  _prefetcher.tick(_now + 29);
+  EXPECT_EQ(0u, _prefetcher._resolved.size());
+  _prefetcher.tick(_now + 30);
+  ASSERT_EQ(1u, _prefetcher._resolved.size());
+  EXPECT_EQ("scscf1.homedomain", _prefetcher._resolved[0]);
+}
+
+// Lookups of tracked targets are counted as hits while the records from the
+// last prefetch are still in the resolver's cache, and misses otherwise.
+// Other lookups are ignored.
+TEST_F(DnsPrefetcherTest, CountsLookups)
+{
+  _prefetcher.learn_uri("sip:as1.homedomain:5060");
+  _prefetcher._ttls["as1.homedomain"] = 30;
+
+  // Not prefetched yet.
+  _prefetcher.record_lookup("as1.homedomain", 5060, -1);
+  EXPECT_EQ(0, _hits._count);
+  EXPECT_EQ(1, _misses._count);
+
+  _prefetcher.tick(_now);
+  _prefetcher.record_lookup("AS1.homedomain", 5060, -1);
+  _prefetcher.record_lookup("as2.homedomain", 5060, -1);
+  _prefetcher.record_lookup("as1.homedomain", 0, -1);
+  EXPECT_EQ(1, _hits._count);
+  EXPECT_EQ(1, _misses._count);
+
+  // The records have expired from the cache.
+  cwtest_advance_time_ms(31000);
+  _prefetcher.record_lookup("as1.homedomain", 5060, -1);
+  EXPECT_EQ(1, _hits._count);
+  EXPECT_EQ(2, _misses._count);
+
+  // A failed prefetch leaves nothing in the cache.
+  _prefetcher._ttls.erase("as1.homedomain");
+  _prefetcher.tick(_now + 31);
+  _prefetcher.record_lookup("as1.homedomain", 5060, -1);
+  EXPECT_EQ(1, _hits._count);
+  EXPECT_EQ(3, _misses._count);
+}
+
+// Learned targets are dropped once they haven't been used for a while, but
+// configured ones aren't, and removing a source stops its targets being
+// treated as configured.
+TEST_F(DnsPrefetcherTest, LearnedTargetsExpire)
+{
+  std::vector<std::string> uris = {"sip:bgcf.homedomain"};
+  int id = _prefetcher.add_source([&uris]() { return uris; });
+  _prefetcher.learn_uri("sip:as1.homedomain");
+  _prefetcher.learn_uri("sip:as1.homedomain");
+  _prefetcher.learn_uri("sip:192.168.0.1");
+  _prefetcher.tick(_now);
+  EXPECT_EQ(2u, _prefetcher.size());
+
+  int later = _now + DnsPrefetcher::IDLE_EXPIRY_S;
+  _prefetcher.tick(later);
+  EXPECT_EQ(1u, _prefetcher.size());
+
+  _prefetcher.remove_source(id);
+  _prefetcher.tick(later + 1);
+  EXPECT_EQ(1u, _prefetcher.size());
+  _prefetcher.tick(later + 1 + DnsPrefetcher::IDLE_EXPIRY_S);
+  EXPECT_EQ(0u, _prefetcher.size());
+}
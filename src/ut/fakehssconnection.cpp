@@ -51,12 +51,14 @@ FakeHSSConnection::FakeHSSConnection() : HSSConnection("localhost",
                                                        &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
                                                        NULL)
 {
+  pthread_mutex_init(&_calls_lock, NULL);
 }
 
 
 FakeHSSConnection::~FakeHSSConnection()
 {
   flush_all();
+  pthread_mutex_destroy(&_calls_lock);
 }
 
 
@@ -134,7 +136,9 @@ long FakeHSSConnection::get_json_object(const std::string& path,
                                         rapidjson::Document*& object,
                                         SAS::TrailId trail)
 {
+  pthread_mutex_lock(&_calls_lock);
   _calls.insert(UrlBody(path, ""));
+  pthread_mutex_unlock(&_calls_lock);
   HTTPCode http_code = HTTP_NOT_FOUND;
 
   std::map<UrlBody, std::string>::const_iterator i = _results.find(UrlBody(path, ""));
@@ -186,7 +190,9 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
                                        rapidxml::xml_document<>*& root,
                                        SAS::TrailId trail)
 {
+  pthread_mutex_lock(&_calls_lock);
   _calls.insert(UrlBody(path, body));
+  pthread_mutex_unlock(&_calls_lock);
   HTTPCode http_code = HTTP_NOT_FOUND;
 
   std::map<UrlBody, std::string>::const_iterator i = _results.find(UrlBody(path, body));
@@ -38,6 +38,7 @@
 
 #include <set>
 #include <string>
+#include <pthread.h>
 #include "log.h"
 #include "sas.h"
 #include "hssconnection.h"
@@ -73,4 +74,7 @@ private:
   std::map<UrlBody, std::string> _results;
   std::map<std::string, long> _rcs;
   std::set<UrlBody> _calls;
+
+  // Some code under test queries the HSS from several threads at once.
+  pthread_mutex_t _calls_lock;
 };
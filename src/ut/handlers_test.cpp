@@ -354,6 +354,35 @@ TEST_F(AoRTimeoutTasksTest, NullAoRTest)
   EXPECT_TRUE(log.contains("Failed to get AoR binding for"));
 }
 
+// Test a bucket timer pop from the local expiry wheel.  AoRs that are due
+// are expired, and AoRs that have been refreshed since are left alone.
+TEST_F(AoRTimeoutTasksTest, BucketTimerTest)
+{
+  std::string body = "{\"aor_ids\": [\"sip:6505550231@homedomain\", \"sip:6505550232@homedomain\"]}";
+  build_timeout_request(body, htp_method_POST);
+
+  // The first AoR has a binding that has expired, the second doesn't.
+  std::string due_aor_id = "sip:6505550231@homedomain";
+  SubscriberDataManager::AoRPair* due_aor = build_aor(due_aor_id);
+  due_aor->get_current()->bindings().begin()->second->_expires = time(NULL) - 1;
+
+  std::string aor_id = "sip:6505550232@homedomain";
+  SubscriberDataManager::AoRPair* aor = build_aor(aor_id);
+
+  {
+    InSequence s;
+      EXPECT_CALL(*stack, send_reply(_, 200, _));
+      EXPECT_CALL(*store, get_aor_data(due_aor_id, _)).WillOnce(Return(due_aor));
+      EXPECT_CALL(*store, set_aor_data(due_aor_id, due_aor, _, _, _, _)).WillOnce(Return(Store::OK));
+      EXPECT_CALL(*remote_store, has_servers()).WillOnce(Return(false));
+      EXPECT_CALL(*store, get_aor_data(aor_id, _)).WillOnce(Return(aor));
+  }
+
+  EXPECT_CALL(*store, set_aor_data(aor_id, _, _, _, _, _)).Times(0);
+
+  handler->run();
+}
+
 class AoRTimeoutTasksMockStoreTest : public SipTest
 {
   FakeChronosConnection* chronos_connection;
@@ -449,7 +478,8 @@ class DeregistrationTaskTest : public SipTest
   // Build the deregistration request
   void build_dereg_request(std::string body,
                            std::string notify = "true",
-                           htp_method method = htp_method_DELETE)
+                           htp_method method = htp_method_DELETE,
+                           AsyncIOPool* worker_pool = NULL)
   {
     _req = new MockHttpStack::Request(_httpstack,
          "/registrations?send-notifications=" + notify,
@@ -461,7 +491,9 @@ class DeregistrationTaskTest : public SipTest
                                           NULL,
                                           _hss,
                                           NULL,
-                                          _impi_store);
+                                          _impi_store,
+                                          NULL,
+                                          worker_pool);
     _task = new DeregistrationTask(*_req, _cfg, 0);
   }
 
@@ -598,7 +630,8 @@ TEST_F(DeregistrationTaskTest, InvalidIMPUTest)
   EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
   _task->run();
 
-  EXPECT_TRUE(log.contains("Unable to create third party registration"));
+  // The subscriber has no iFCs, so no third-party REGISTER is built.
+  EXPECT_FALSE(log.contains("Generating a fake REGISTER"));
   _hss->flush_all();
 }
 
@@ -664,6 +697,81 @@ TEST_F(DeregistrationTaskTest, SubscriberDataManagerWritesFail)
   _task->run();
 }
 
+// Test that a failure to deregister one AoR doesn't stop the others being
+// deregistered, and that the IMPIs of the deregistered bindings are still
+// deleted.
+TEST_F(DeregistrationTaskTest, PartialFailureTest)
+{
+  // Build the request
+  std::string body = "{\"registrations\": [{\"primary-impu\": \"sip:6505550231@homedomain\"}, {\"primary-impu\": \"sip:6505550232@homedomain\"}, {\"primary-impu\": \"sip:6505550233@homedomain\"}]}";
+  build_dereg_request(body, "false");
+
+  int now = time(NULL);
+
+  // The first AoR has a binding, the second can't be read from the store
+  // and the third is empty.
+  std::string aor_id = "sip:6505550231@homedomain";
+  SubscriberDataManager::AoR* aor = new SubscriberDataManager::AoR(aor_id);
+  SubscriberDataManager::AoR::Binding* b1 = aor->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1"));
+  b1->_expires = now + 300;
+  b1->_emergency_registration = false;
+  b1->_private_id = "impi1";
+  SubscriberDataManager::AoR* backup_aor = new SubscriberDataManager::AoR(*aor);
+  SubscriberDataManager::AoRPair* aor_pair = new SubscriberDataManager::AoRPair(aor, backup_aor);
+
+  std::string aor_id2 = "sip:6505550232@homedomain";
+
+  std::string aor_id3 = "sip:6505550233@homedomain";
+  SubscriberDataManager::AoR* aor3 = new SubscriberDataManager::AoR(aor_id3);
+  SubscriberDataManager::AoR* backup_aor3 = new SubscriberDataManager::AoR(*aor3);
+  SubscriberDataManager::AoRPair* aor_pair3 = new SubscriberDataManager::AoRPair(aor3, backup_aor3);
+
+  std::vector<std::string> aor_ids = {aor_id, aor_id2, aor_id3};
+  std::vector<SubscriberDataManager::AoRPair*> aors = {aor_pair, NULL, aor_pair3};
+  expect_sdm_updates(aor_ids, aors);
+
+  // The IMPI of the deregistered binding is deleted.
+  ImpiStore::Impi* impi1 = new ImpiStore::Impi("impi1");
+  EXPECT_CALL(*_impi_store, get_impi("impi1", _)).WillOnce(Return(impi1));
+  EXPECT_CALL(*_impi_store, delete_impi(impi1, _)).WillOnce(Return(Store::OK));
+
+  // Run the task.  The response lists the AoR that couldn't be deregistered,
+  // so the HSS can retry it.
+  EXPECT_CALL(*_httpstack, send_reply(_, 500, _));
+  _task->run();
+  EXPECT_EQ("{\"processed\":3,\"failed\":[{\"primary-impu\":\"sip:6505550232@homedomain\"}]}",
+            _req->content());
+}
+
+// AoRs are processed on the shared worker pool, and the task waits for all
+// of them before replying.
+TEST_F(DeregistrationTaskTest, WorkerPoolTest)
+{
+  AsyncIOPool pool(2);
+  pool.start();
+
+  std::string body = "{\"registrations\": [{\"primary-impu\": \"sip:6505550231@homedomain\"}, {\"primary-impu\": \"sip:6505550232@homedomain\"}, {\"primary-impu\": \"sip:6505550233@homedomain\"}]}";
+  build_dereg_request(body, "false", htp_method_DELETE, &pool);
+
+  std::vector<std::string> aor_ids = {"sip:6505550231@homedomain",
+                                      "sip:6505550232@homedomain",
+                                      "sip:6505550233@homedomain"};
+  std::vector<SubscriberDataManager::AoRPair*> aors;
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    SubscriberDataManager::AoR* aor = new SubscriberDataManager::AoR(aor_ids[ii]);
+    SubscriberDataManager::AoR* backup_aor = new SubscriberDataManager::AoR(*aor);
+    aors.push_back(new SubscriberDataManager::AoRPair(aor, backup_aor));
+  }
+
+  expect_sdm_updates(aor_ids, aors);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _task->run();
+  EXPECT_EQ("{\"processed\":3,\"failed\":[]}", _req->content());
+}
+
 TEST_F(DeregistrationTaskTest, ImpiNotClearedWhenBindingNotDeregistered)
 {
   // Build a request that will not deregister any bindings.
@@ -1022,3 +1130,32 @@ TEST_F(AuthTimeoutTest, BadJSON)
 
   ASSERT_EQ(status, 400);
 }
+
+class LatencyBreakdownTaskTest : public ::testing::Test
+{
+  MockHttpStack stack;
+
+  void run_request(htp_method method, int expected_status)
+  {
+    std::vector<SNMP::EventAccumulatorTable*> tbls;
+    LatencyBreakdown breakdown(tbls);
+    LatencyBreakdownTask::Config cfg(&breakdown);
+    MockHttpStack::Request req(&stack, "/", "latency-breakdown", "", "", method);
+    LatencyBreakdownTask* task = new LatencyBreakdownTask(req, &cfg, 0);
+
+    EXPECT_CALL(stack, send_reply(_, expected_status, _));
+    task->run();
+  }
+};
+
+// The statistics are returned for a GET.
+TEST_F(LatencyBreakdownTaskTest, Get)
+{
+  run_request(htp_method_GET, 200);
+}
+
+// Other methods are rejected.
+TEST_F(LatencyBreakdownTaskTest, InvalidMethod)
+{
+  run_request(htp_method_POST, 405);
+}
@@ -0,0 +1,158 @@
+/**
+ * @file hss_answer_cache_test.cpp UT for the HSS answer cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "test_interposer.hpp"
+#include "fakesnmp.hpp"
+#include "hss_answer_cache.h"
+
+class HSSAnswerCacheTest : public ::testing::Test
+{
+public:
+  SNMP::FakeCounterTable _hits;
+  SNMP::FakeCounterTable _misses;
+  SNMP::FakeCounterTable _invalidations;
+
+  void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
+  static HSSAnswerCache::Answer make_answer(const std::string& scscf)
+  {
+    HSSAnswerCache::Answer answer;
+    answer.caps.scscf = scscf;
+    answer.caps.mandatory_caps = {1, 2};
+    answer.queried_caps = true;
+    return answer;
+  }
+};
+
+// Answers are cached by key, and lookups are counted.
+TEST_F(HSSAnswerCacheTest, GetAndPut)
+{
+  HSSAnswerCache cache(30000, 100, &_hits, &_misses, &_invalidations);
+  HSSAnswerCache::Answer answer;
+  std::string lir = HSSAnswerCache::lir_key("sip:6505551234@homedomain", false);
+  std::string uar = HSSAnswerCache::uar_key("6505551234@homedomain",
+                                            "sip:6505551234@homedomain",
+                                            "homedomain",
+                                            "REG");
+
+  EXPECT_FALSE(cache.get(lir, answer));
+
+  cache.put(lir, make_answer("sip:scscf1.homedomain"));
+  cache.put(uar, make_answer("sip:scscf2.homedomain"));
+
+  ASSERT_TRUE(cache.get(lir, answer));
+  EXPECT_EQ("sip:scscf1.homedomain", answer.caps.scscf);
+  EXPECT_EQ(2u, answer.caps.mandatory_caps.size());
+  EXPECT_TRUE(answer.queried_caps);
+
+  ASSERT_TRUE(cache.get(uar, answer));
+  EXPECT_EQ("sip:scscf2.homedomain", answer.caps.scscf);
+
+  // The originating and terminating answers are different.
+  EXPECT_FALSE(cache.get(HSSAnswerCache::lir_key("sip:6505551234@homedomain",
+                                                 true),
+                         answer));
+
+  EXPECT_EQ(2, _hits._count);
+  EXPECT_EQ(2, _misses._count);
+}
+
+// Answers expire after the TTL.
+TEST_F(HSSAnswerCacheTest, Expiry)
+{
+  HSSAnswerCache cache(30000, 100, &_hits, &_misses, &_invalidations);
+  HSSAnswerCache::Answer answer;
+
+  cache.put("key1", make_answer("sip:scscf1.homedomain"));
+  cwtest_advance_time_ms(20000);
+  cache.put("key2", make_answer("sip:scscf2.homedomain"));
+  cwtest_advance_time_ms(1000);
+
+  // Replacing an answer restarts its TTL.
+  cache.put("key1", make_answer("sip:scscf3.homedomain"));
+  cwtest_advance_time_ms(19000);
+
+  ASSERT_TRUE(cache.get("key1", answer));
+  EXPECT_EQ("sip:scscf3.homedomain", answer.caps.scscf);
+  EXPECT_TRUE(cache.get("key2", answer));
+
+  cwtest_advance_time_ms(10000);
+  EXPECT_FALSE(cache.get("key2", answer));
+  EXPECT_TRUE(cache.get("key1", answer));
+  EXPECT_EQ(1u, cache.size());
+
+  cwtest_advance_time_ms(10000);
+  EXPECT_FALSE(cache.get("key1", answer));
+  EXPECT_EQ(0u, cache.size());
+}
+
+// Invalidated answers are discarded and counted.
+TEST_F(HSSAnswerCacheTest, Invalidate)
+{
+  HSSAnswerCache cache(30000, 100, &_hits, &_misses, &_invalidations);
+  HSSAnswerCache::Answer answer;
+
+  cache.put("key1", make_answer("sip:scscf1.homedomain"));
+  cache.invalidate("key1");
+  EXPECT_FALSE(cache.get("key1", answer));
+  EXPECT_EQ(1, _invalidations._count);
+
+  // Invalidating an answer which isn't cached isn't counted.
+  cache.invalidate("key1");
+  EXPECT_EQ(1, _invalidations._count);
+}
+
+// When the cache is full, the oldest answer is discarded.
+TEST_F(HSSAnswerCacheTest, Full)
+{
+  HSSAnswerCache cache(30000, 2);
+  HSSAnswerCache::Answer answer;
+
+  cache.put("key1", make_answer("sip:scscf1.homedomain"));
+  cache.put("key2", make_answer("sip:scscf2.homedomain"));
+  cache.put("key3", make_answer("sip:scscf3.homedomain"));
+
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_FALSE(cache.get("key1", answer));
+  EXPECT_TRUE(cache.get("key2", answer));
+  EXPECT_TRUE(cache.get("key3", answer));
+}
@@ -0,0 +1,183 @@
+/**
+ * @file http_request_coalescer_test.cpp UT for HttpRequestCoalescer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "http_request_coalescer.h"
+
+class HttpRequestCoalescerTest : public ::testing::Test
+{
+public:
+  HttpRequestCoalescer _coalescer;
+  std::atomic<int> _sent;
+  std::atomic<bool> _release;
+
+  HttpRequestCoalescerTest() : _sent(0), _release(false) {}
+
+  /// A request that blocks until the test releases it.
+  HTTPCode blocking_request(std::string& response, HTTPCode rc)
+  {
+    ++_sent;
+
+    while (!_release)
+    {
+      usleep(1000);
+    }
+
+    response = "response " + std::to_string(_sent);
+    return rc;
+  }
+
+  /// Waits until the coalescer has queued the given number of requests
+  /// behind in-flight ones.
+  void wait_for_coalesced(uint64_t count)
+  {
+    for (int ii = 0; (ii < 5000) && (_coalescer.coalesced_count() < count); ++ii)
+    {
+      usleep(1000);
+    }
+    EXPECT_EQ(count, _coalescer.coalesced_count());
+  }
+};
+
+TEST_F(HttpRequestCoalescerTest, SingleRequest)
+{
+  std::string response;
+  HTTPCode rc = _coalescer.send("GET /impu/sip:alice@example.com",
+                                [](std::string& rsp)
+                                {
+                                  rsp = "body";
+                                  return (HTTPCode)HTTP_OK;
+                                },
+                                response);
+  EXPECT_EQ(HTTP_OK, rc);
+  EXPECT_EQ("body", response);
+  EXPECT_EQ(0u, _coalescer.coalesced_count());
+}
+
+TEST_F(HttpRequestCoalescerTest, IdenticalRequestsCoalesced)
+{
+  const int NUM_THREADS = 4;
+  std::vector<std::thread> threads;
+  std::vector<std::string> responses(NUM_THREADS);
+  std::vector<HTTPCode> rcs(NUM_THREADS);
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([this, ii, &responses, &rcs]()
+    {
+      rcs[ii] = _coalescer.send("GET /impu/sip:alice@example.com",
+                                [this](std::string& rsp)
+                                {
+                                  return blocking_request(rsp, HTTP_NOT_FOUND);
+                                },
+                                responses[ii]);
+    }));
+  }
+
+  // All but one of the requests wait for the one that is sent.
+  wait_for_coalesced(NUM_THREADS - 1);
+  _release = true;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].join();
+    EXPECT_EQ(HTTP_NOT_FOUND, rcs[ii]);
+    EXPECT_EQ("response 1", responses[ii]);
+  }
+
+  EXPECT_EQ(1, _sent);
+}
+
+TEST_F(HttpRequestCoalescerTest, DifferentRequestsNotCoalesced)
+{
+  std::string response1;
+  std::string response2;
+
+  std::thread t1([this, &response1]()
+  {
+    _coalescer.send("GET /impu/sip:alice@example.com",
+                    [this](std::string& rsp)
+                    {
+                      return blocking_request(rsp, HTTP_OK);
+                    },
+                    response1);
+  });
+
+  // Wait for the first request to be sent, then send a different one, which
+  // must not wait for the first.
+  while (_sent == 0)
+  {
+    usleep(1000);
+  }
+
+  HTTPCode rc = _coalescer.send("GET /impu/sip:bob@example.com",
+                                [](std::string& rsp)
+                                {
+                                  rsp = "bob";
+                                  return (HTTPCode)HTTP_OK;
+                                },
+                                response2);
+  EXPECT_EQ(HTTP_OK, rc);
+  EXPECT_EQ("bob", response2);
+
+  _release = true;
+  t1.join();
+  EXPECT_EQ("response 1", response1);
+  EXPECT_EQ(0u, _coalescer.coalesced_count());
+}
+
+TEST_F(HttpRequestCoalescerTest, CompletedRequestsNotReused)
+{
+  std::string response;
+  int sent = 0;
+  HttpRequestCoalescer::Request request = [&sent](std::string& rsp)
+  {
+    rsp = "response " + std::to_string(++sent);
+    return (HTTPCode)HTTP_OK;
+  };
+
+  _coalescer.send("GET /impu/sip:alice@example.com", request, response);
+  EXPECT_EQ("response 1", response);
+  _coalescer.send("GET /impu/sip:alice@example.com", request, response);
+  EXPECT_EQ("response 2", response);
+  EXPECT_EQ(0u, _coalescer.coalesced_count());
+}
@@ -2289,6 +2289,90 @@ TEST_F(IfcHandlerTest, SDPNoEqualsSign)
 }
 
 
+/// Builds an iFC with the specified trigger point and server name, wrapped in
+/// a ServiceProfile.
+static std::string profile_with_ifc(std::string trigger, std::string server)
+{
+  return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<ServiceProfile>\n"
+         "  <InitialFilterCriteria>\n"
+         "    <Priority>1</Priority>\n"
+         + trigger +
+         "  <ApplicationServer>\n"
+         "    <ServerName>" + server + "</ServerName>\n"
+         "    <DefaultHandling>0</DefaultHandling>\n"
+         "  </ApplicationServer>\n"
+         "  </InitialFilterCriteria>\n"
+         "</ServiceProfile>";
+}
+
+static const std::string REGISTER_TRIGGER =
+  "    <TriggerPoint>\n"
+  "    <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+  "    <SPT>\n"
+  "      <ConditionNegated>0</ConditionNegated>\n"
+  "      <Group>0</Group>\n"
+  "      <Method>REGISTER</Method>\n"
+  "      <Extension></Extension>\n"
+  "    </SPT>\n"
+  "  </TriggerPoint>\n";
+
+static const std::string HEADER_TRIGGER =
+  "    <TriggerPoint>\n"
+  "    <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+  "    <SPT>\n"
+  "      <ConditionNegated>0</ConditionNegated>\n"
+  "      <Group>0</Group>\n"
+  "      <SIPHeader><Header>Contact</Header></SIPHeader>\n"
+  "      <Extension></Extension>\n"
+  "    </SPT>\n"
+  "  </TriggerPoint>\n";
+
+/// Parses a ServiceProfile into a set of iFCs, returning the fingerprint and
+/// whether REGISTER matching uses the message.
+static void check_ifcs(std::string profile,
+                       uint64_t& fingerprint,
+                       bool& uses_message)
+{
+  std::shared_ptr<rapidxml::xml_document<> > root (new rapidxml::xml_document<>);
+  char* cstr_ifc = strdup(profile.c_str());
+  root->parse<0>(cstr_ifc);
+  Ifcs ifcs(root, root->first_node("ServiceProfile"));
+  fingerprint = ifcs.fingerprint();
+  uses_message = ifcs.register_match_uses_message();
+  free(cstr_ifc);
+}
+
+TEST_F(IfcHandlerTest, Fingerprint)
+{
+  uint64_t fp1;
+  uint64_t fp2;
+  uint64_t fp3;
+  bool uses_message;
+
+  // The same iFCs give the same fingerprint, different ones don't.
+  check_ifcs(profile_with_ifc(REGISTER_TRIGGER, "sip:1.2.3.4"), fp1, uses_message);
+  check_ifcs(profile_with_ifc(REGISTER_TRIGGER, "sip:1.2.3.4"), fp2, uses_message);
+  check_ifcs(profile_with_ifc(REGISTER_TRIGGER, "sip:1.2.3.5"), fp3, uses_message);
+  EXPECT_EQ(fp1, fp2);
+  EXPECT_NE(fp1, fp3);
+}
+
+TEST_F(IfcHandlerTest, RegisterMatchUsesMessage)
+{
+  uint64_t fingerprint;
+  bool uses_message;
+
+  check_ifcs(profile_with_ifc(REGISTER_TRIGGER, "sip:1.2.3.4"), fingerprint, uses_message);
+  EXPECT_FALSE(uses_message);
+
+  check_ifcs(profile_with_ifc("", "sip:1.2.3.4"), fingerprint, uses_message);
+  EXPECT_FALSE(uses_message);
+
+  check_ifcs(profile_with_ifc(HEADER_TRIGGER, "sip:1.2.3.4"), fingerprint, uses_message);
+  EXPECT_TRUE(uses_message);
+}
+
 // @@@ iFC XML parse error
 // @@@ lookup_ifcs gets no served user
 // @@@ lookup_ifcs finds empty iFCs
@@ -0,0 +1,135 @@
+/**
+ * @file latency_breakdown_test.cpp UT for the latency breakdown.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "latency_breakdown.h"
+
+class LatencyBreakdownTest : public ::testing::Test
+{
+public:
+  LatencyBreakdownTest() :
+    _tbls(),
+    _breakdown(_tbls)
+  {
+  }
+
+  std::vector<SNMP::EventAccumulatorTable*> _tbls;
+  LatencyBreakdown _breakdown;
+};
+
+// Small values have their own buckets, and larger values share a bucket
+// with values within 12.5% of them.
+TEST_F(LatencyBreakdownTest, HistogramBuckets)
+{
+  for (unsigned long value = 0; value < 8; ++value)
+  {
+    EXPECT_EQ(value, LatencyHistogram::bucket_max(LatencyHistogram::bucket_index(value)));
+  }
+
+  EXPECT_EQ(8, LatencyHistogram::bucket_index(8));
+  EXPECT_EQ(LatencyHistogram::bucket_index(96), LatencyHistogram::bucket_index(103));
+  EXPECT_NE(LatencyHistogram::bucket_index(103), LatencyHistogram::bucket_index(104));
+  EXPECT_EQ(103ul, LatencyHistogram::bucket_max(LatencyHistogram::bucket_index(100)));
+
+  // Huge values go in the last bucket.
+  EXPECT_EQ(LatencyHistogram::NUM_BUCKETS - 1,
+            LatencyHistogram::bucket_index(0xFFFFFFFFFFul));
+}
+
+// Percentiles are reported as the top of the bucket they fall in, capped at
+// the largest value recorded.
+TEST_F(LatencyBreakdownTest, HistogramPercentiles)
+{
+  LatencyHistogram h;
+  EXPECT_EQ(0ul, h.percentile(50));
+
+  for (unsigned long value = 1; value <= 100; ++value)
+  {
+    h.record(value * 100);
+  }
+
+  EXPECT_EQ(100u, h.count());
+  EXPECT_EQ(5050ul, h.mean());
+  EXPECT_EQ(10000ul, h.max());
+
+  unsigned long p50 = h.percentile(50);
+  EXPECT_GE(p50, 5000ul);
+  EXPECT_LE(p50, 5000ul * 9 / 8);
+  EXPECT_EQ(10000ul, h.percentile(100));
+}
+
+// Phases timed while a message is being processed are summed for the
+// message, and phases timed outside a message are recorded on their own.
+TEST_F(LatencyBreakdownTest, PerMessagePhases)
+{
+  LatencyBreakdown::start_message();
+  LatencyBreakdown::add(LatencyBreakdown::QUEUE, 100);
+  LatencyBreakdown::add(LatencyBreakdown::STORE, 1000);
+  LatencyBreakdown::add(LatencyBreakdown::STORE, 2000);
+  EXPECT_EQ(0u, _breakdown.histogram(LatencyBreakdown::STORE).count());
+  LatencyBreakdown::end_message(5000, 0);
+
+  EXPECT_EQ(1u, _breakdown.histogram(LatencyBreakdown::QUEUE).count());
+  EXPECT_EQ(1u, _breakdown.histogram(LatencyBreakdown::STORE).count());
+  EXPECT_EQ(3000ul, _breakdown.histogram(LatencyBreakdown::STORE).max());
+  EXPECT_EQ(0u, _breakdown.histogram(LatencyBreakdown::HSS).count());
+
+  LatencyBreakdown::add(LatencyBreakdown::HSS, 4000);
+  LatencyBreakdown::add_span(LatencyBreakdown::AS, 20000);
+  EXPECT_EQ(1u, _breakdown.histogram(LatencyBreakdown::HSS).count());
+  EXPECT_EQ(1u, _breakdown.histogram(LatencyBreakdown::AS).count());
+
+  {
+    LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::IFC);
+  }
+  EXPECT_EQ(1u, _breakdown.histogram(LatencyBreakdown::IFC).count());
+
+  std::string json = _breakdown.to_json();
+  EXPECT_NE(std::string::npos, json.find("\"store\":{\"count\":1,\"mean_us\":3000"));
+}
+
+// Nothing is recorded once the breakdown is destroyed.
+TEST(LatencyBreakdownDisabledTest, Disabled)
+{
+  EXPECT_FALSE(LatencyBreakdown::enabled());
+  LatencyBreakdown::start_message();
+  LatencyBreakdown::add(LatencyBreakdown::QUEUE, 100);
+  LatencyBreakdown::end_message(100, 0);
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::STORE);
+}
@@ -54,6 +54,9 @@ public:
                                            bool& all_bindings_expired,
                                            pjsip_rx_data* extra_message_rdata,
                                            pjsip_tx_data* extra_message_tdata));
+  MOCK_METHOD3(refresh_aor_data, Store::Status(const std::string& aor_id,
+                                               AoRPair* data,
+                                               SAS::TrailId trail));
   MOCK_METHOD0(has_servers, bool());
 };
 
@@ -0,0 +1,173 @@
+/**
+ * @file peer_admission_test.cpp UT for per-peer fair-share admission control.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "test_interposer.hpp"
+#include "fakesnmp.hpp"
+#include "peer_admission.h"
+
+using namespace std;
+
+class PeerAdmissionTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  PeerAdmissionTest()
+  {
+    SNMP::FAKE_IP_COUNT_ROW._count = 0;
+  }
+
+  bool is_high_priority(const string& method,
+                        const string& req_uri,
+                        const string& extra_hdrs = "",
+                        const string& to_tag = "")
+  {
+    string str(method + " " + req_uri + " SIP/2.0\n"
+               "Via: SIP/2.0/TCP 10.0.0.1:5060;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf\n"
+               "Max-Forwards: 70\n"
+               "From: <sip:6505551234@homedomain>;tag=1234\n"
+               "To: <sip:6505554321@homedomain>" + to_tag + "\n"
+               "Call-ID: 1-13919@10.151.20.48\n"
+               "CSeq: 1 " + method + "\n" +
+               extra_hdrs +
+               "Content-Length: 0\n\n");
+    return PeerAdmission::is_high_priority(parse_msg(str));
+  }
+};
+
+TEST_F(PeerAdmissionTest, HighPriority)
+{
+  EXPECT_FALSE(is_high_priority("INVITE", "sip:6505554321@homedomain"));
+  EXPECT_FALSE(is_high_priority("REGISTER", "sip:homedomain",
+                                "Contact: <sip:6505551234@10.0.0.1:5060>\n"));
+  EXPECT_FALSE(is_high_priority("OPTIONS", "sip:homedomain"));
+
+  EXPECT_TRUE(is_high_priority("ACK", "sip:6505554321@homedomain"));
+  EXPECT_TRUE(is_high_priority("BYE", "sip:6505554321@homedomain"));
+  EXPECT_TRUE(is_high_priority("CANCEL", "sip:6505554321@homedomain"));
+
+  // In-dialog requests.
+  EXPECT_TRUE(is_high_priority("INVITE", "sip:6505554321@homedomain", "", ";tag=5678"));
+
+  // Emergency requests.
+  EXPECT_TRUE(is_high_priority("INVITE", "urn:service:sos"));
+  EXPECT_TRUE(is_high_priority("INVITE", "urn:service:sos.police"));
+  EXPECT_TRUE(is_high_priority("REGISTER", "sip:homedomain",
+                               "Contact: <sip:6505551234@10.0.0.1:5060;sos>\n"));
+}
+
+// While the load monitor admits requests, peers may exceed their share.
+TEST_F(PeerAdmissionTest, NoContention)
+{
+  LoadMonitor load_monitor(0, 100, 0, 0);
+  PeerAdmission admission(1);
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_TRUE(admission.admit_request("10.0.0.1", &load_monitor));
+  }
+
+  EXPECT_TRUE(admission.admit_request("10.0.0.2", &load_monitor));
+  EXPECT_EQ(2u, admission.num_peers());
+}
+
+// Once the load monitor rejects a request, peers over their share are
+// rejected without taking tokens from the load monitor.
+TEST_F(PeerAdmissionTest, Contention)
+{
+  LoadMonitor load_monitor(0, 3, 0, 0);
+  SNMP::FakeIPCountTable rejected_tbl;
+  PeerAdmission admission(1, &rejected_tbl);
+
+  // The first peer uses its share, then the load monitor's spare token.
+  EXPECT_TRUE(admission.admit_request("10.0.0.1", &load_monitor));
+  EXPECT_TRUE(admission.admit_request("10.0.0.1", &load_monitor));
+
+  // The second peer is within its share.
+  EXPECT_TRUE(admission.admit_request("10.0.0.2", &load_monitor));
+
+  // The load monitor is now empty, so the first peer is rejected.
+  EXPECT_FALSE(admission.admit_request("10.0.0.1", &load_monitor));
+  EXPECT_EQ(1u, SNMP::FAKE_IP_COUNT_ROW._count);
+
+  // The first peer is over its share, so it's now rejected without asking
+  // the load monitor.
+  EXPECT_FALSE(admission.admit_request("10.0.0.1", &load_monitor));
+  EXPECT_EQ(2u, SNMP::FAKE_IP_COUNT_ROW._count);
+}
+
+// Peers that stop sending requests are forgotten.
+TEST_F(PeerAdmissionTest, IdlePeersForgotten)
+{
+  LoadMonitor load_monitor(0, 100, 0, 0);
+  PeerAdmission admission(1);
+
+  EXPECT_TRUE(admission.admit_request("10.0.0.1", &load_monitor));
+  EXPECT_EQ(1u, admission.num_peers());
+
+  // Peers are swept as other peers in the same stripe send requests, so
+  // send requests from enough peers to hit every stripe.
+  cwtest_advance_time_ms(PeerAdmission::PEER_IDLE_TIMEOUT_MS + 1);
+
+  for (int ii = 2; ii < 1000; ++ii)
+  {
+    admission.admit_request("10.0." + std::to_string(ii / 256) + "." + std::to_string(ii % 256),
+                            &load_monitor);
+  }
+
+  EXPECT_EQ(998u, admission.num_peers());
+}
+
+TEST_F(PeerAdmissionTest, Weights)
+{
+  PeerAdmission admission;
+  EXPECT_TRUE(admission.set_weights("10.0.0.1=4, 10.0.0.2=2"));
+  EXPECT_FALSE(admission.set_weights("10.0.0.1=0"));
+  EXPECT_FALSE(admission.set_weights("10.0.0.1"));
+  EXPECT_FALSE(admission.set_weights("=2"));
+}
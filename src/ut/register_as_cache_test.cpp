@@ -0,0 +1,109 @@
+/**
+ * @file register_as_cache_test.cpp UT for the cache of application servers selected for third-party REGISTERs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+
+#include "register_as_cache.h"
+
+static AsInvocation make_as(const std::string& server_name)
+{
+  AsInvocation as;
+  as.server_name = server_name;
+  as.default_handling = SESSION_CONTINUED;
+  as.service_info = "";
+  as.include_register_request = false;
+  as.include_register_response = false;
+  return as;
+}
+
+// Results are cached against the fingerprint and registration type.
+TEST(RegisterAsCacheTest, GetAndPut)
+{
+  RegisterAsCache cache;
+  std::vector<AsInvocation> as_list;
+
+  EXPECT_FALSE(cache.get(1, true, false, as_list));
+
+  std::vector<AsInvocation> initial = {make_as("sip:as1"), make_as("sip:as2")};
+  std::vector<AsInvocation> rereg = {make_as("sip:as1")};
+  cache.put(1, true, false, initial);
+  cache.put(1, false, false, rereg);
+
+  ASSERT_TRUE(cache.get(1, true, false, as_list));
+  ASSERT_EQ(2u, as_list.size());
+  EXPECT_EQ("sip:as2", as_list[1].server_name);
+
+  as_list.clear();
+  ASSERT_TRUE(cache.get(1, false, false, as_list));
+  ASSERT_EQ(1u, as_list.size());
+  EXPECT_EQ("sip:as1", as_list[0].server_name);
+
+  EXPECT_FALSE(cache.get(1, false, true, as_list));
+  EXPECT_FALSE(cache.get(2, true, false, as_list));
+}
+
+// An empty result is cached like any other.
+TEST(RegisterAsCacheTest, EmptyResult)
+{
+  RegisterAsCache cache;
+  std::vector<AsInvocation> as_list;
+
+  cache.put(1, false, true, as_list);
+
+  as_list.push_back(make_as("sip:as1"));
+  EXPECT_TRUE(cache.get(1, false, true, as_list));
+  EXPECT_TRUE(as_list.empty());
+}
+
+// The cache is bounded.
+TEST(RegisterAsCacheTest, Bounded)
+{
+  RegisterAsCache cache(2);
+  std::vector<AsInvocation> as_list = {make_as("sip:as1")};
+
+  cache.put(1, true, false, as_list);
+  cache.put(2, true, false, as_list);
+  EXPECT_EQ(2u, cache.size());
+
+  // Replacing an existing entry doesn't clear the cache.
+  cache.put(2, true, false, as_list);
+  EXPECT_EQ(2u, cache.size());
+
+  cache.put(3, true, false, as_list);
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_TRUE(cache.get(3, true, false, as_list));
+  EXPECT_FALSE(cache.get(1, true, false, as_list));
+}
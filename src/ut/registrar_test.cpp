@@ -51,6 +51,7 @@
 #include "fakesnmp.hpp"
 #include "rapidxml/rapidxml.hpp"
 
+using ::testing::HasSubstr;
 using ::testing::MatchesRegex;
 using ::testing::_;
 using ::testing::Return;
@@ -82,7 +83,10 @@ public:
                                      300,
                                      false,
                                      &SNMP::FAKE_REGISTRATION_STATS_TABLES,
-                                     &SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES);
+                                     &SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES,
+                                     NULL,
+                                     NULL,
+                                     NULL);
     ASSERT_EQ(PJ_SUCCESS, ret);
 
     _hss_connection->set_impu_result("sip:6505550231@homedomain", "reg", HSSConnection::STATE_REGISTERED, "");
@@ -646,7 +650,7 @@ TEST_F(RegistrarTest, MultipleRegistrations)
   EXPECT_EQ(4,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_REGISTRATION_STATS_TABLES.re_reg_tbl)->_successes); 
   free_txdata();
 
-  // Reregistering again with an updated cseq triggers an update of the binding.
+  // Reregistering again with an updated cseq refreshes the binding.
   msg._cseq = "16568";
   inject_msg(msg.get());
   ASSERT_EQ(1, txdata_count());
@@ -2097,6 +2101,50 @@ TEST_F(RegistrarTest, MultipleEmergencyRegistrations)
 }
 
 
+/// A refresh that would only extend the binding a little isn't written to the
+/// store, and the 200 OK reports the stored expiry.  A later refresh is.
+TEST_F(RegistrarTest, RefreshWithinMarginNotWritten)
+{
+  Message msg;
+  msg._expires = "Expires: 300";
+  msg._contact_params = ";+sip.ice;reg-id=1";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+
+  cwtest_advance_time_ms(10000);
+  msg._cseq = "16568";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_THAT(get_headers(out, "Contact"), HasSubstr(";expires=290;"));
+  EXPECT_EQ(1,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_REGISTRATION_STATS_TABLES.re_reg_tbl)->_successes);
+  free_txdata();
+
+  SubscriberDataManager::AoRPair* aor_data = _sdm->get_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(16567, aor_data->get_current()->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b665231f1213>:1"))->_cseq);
+  delete aor_data; aor_data = NULL;
+
+  // Once the refresh would extend the binding by more than the margin, it's
+  // written as normal.
+  cwtest_advance_time_ms(50000);
+  msg._cseq = "16569";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_THAT(get_headers(out, "Contact"), HasSubstr(";expires=300;"));
+  free_txdata();
+
+  aor_data = _sdm->get_aor_data("sip:6505550231@homedomain", 0);
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(16569, aor_data->get_current()->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b665231f1213>:1"))->_cseq);
+  delete aor_data; aor_data = NULL;
+}
+
 /// Simple correct example with rinstance parameter in Contact URI
 TEST_F(RegistrarTest, RinstanceParameter)
 {
@@ -2168,17 +2216,28 @@ TEST_F(RegistrarTest, RegistrationWithSubscription)
   inject_msg(respond_to_current_txdata(200));
   free_txdata();
 
-  // Extend the registration
+  aor_pair = _sdm->get_aor_data(aor, 0);
+  int notify_cseq = aor_pair->get_current()->_notify_cseq;
+  delete aor_pair; aor_pair = NULL;
+
+  // Extend the registration.  This only changes the binding's expiry time,
+  // so is written to the store without notifying the subscriber.
   msg._expires = "Expires: 300";
   msg._cseq = "16568";
   inject_msg(msg.get());
-  ASSERT_EQ(2, txdata_count());
-  out = pop_txdata()->msg;
-  EXPECT_EQ("NOTIFY", str_pj(out->line.status.reason));
-  check_notify(out, aor, "active", std::make_pair("active", "refreshed"));
-  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_THAT(get_headers(out, "Contact"), HasSubstr(";expires=300;"));
   free_txdata();
 
+  aor_pair = _sdm->get_aor_data(aor, 0);
+  SubscriberDataManager::AoR::Binding* b1 = aor_pair->get_current()->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b665231f1213>:1"));
+  EXPECT_EQ(16568, b1->_cseq);
+  EXPECT_EQ(now + 300, b1->_expires);
+  EXPECT_EQ(notify_cseq, aor_pair->get_current()->_notify_cseq);
+  delete aor_pair; aor_pair = NULL;
+
   // Shorten the registration
   msg._expires = "Expires: 200";
   msg._cseq = "16569";
@@ -2355,7 +2414,10 @@ public:
                                      300,
                                      false,
                                      &SNMP::FAKE_REGISTRATION_STATS_TABLES,
-                                     &SNMP::FAKE_REGISTRATION_STATS_TABLES);
+                                     &SNMP::FAKE_REGISTRATION_STATS_TABLES,
+                                     NULL,
+                                     NULL,
+                                     NULL);
     ASSERT_EQ(PJ_SUCCESS, ret);
 
     _hss_connection->set_impu_result("sip:6505550231@homedomain", "reg", HSSConnection::STATE_REGISTERED, "");
@@ -0,0 +1,159 @@
+/**
+ * @file sas_msg_logger_test.cpp UT for logging SIP messages to SAS.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "fakesnmp.hpp"
+#include "sas_msg_logger.h"
+
+using namespace std;
+
+class SasMsgLoggerTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  /// Count how many of a run of trails would be logged for a method.
+  int count_logged(SasMsgLogger& logger, pjsip_method_e method_id)
+  {
+    pjsip_method method;
+    pjsip_method_set(&method, method_id);
+    int logged = 0;
+
+    for (SAS::TrailId trail = 1; trail <= 10000; ++trail)
+    {
+      if (logger.should_log(trail, &method))
+      {
+        ++logged;
+      }
+    }
+
+    return logged;
+  }
+
+  pjsip_rx_data* build_register()
+  {
+    string str("REGISTER sip:homedomain SIP/2.0\n"
+               "Via: SIP/2.0/TCP 10.0.0.1:5060;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf\n"
+               "Max-Forwards: 70\n"
+               "From: <sip:6505551234@homedomain>;tag=1234\n"
+               "To: <sip:6505551234@homedomain>\n"
+               "Contact: <sip:6505551234@10.0.0.1:5060;transport=TCP;ob>\n"
+               "Call-ID: 1-13919@10.151.20.48\n"
+               "CSeq: 1 REGISTER\n"
+               "Expires: 300\n"
+               "Content-Length: 0\n\n");
+    pjsip_rx_data* rdata = build_rxdata(str);
+    parse_rxdata(rdata);
+    return rdata;
+  }
+};
+
+// Without sample rates, everything is logged.
+TEST_F(SasMsgLoggerTest, NoSampling)
+{
+  SasMsgLogger logger(0);
+  EXPECT_EQ(10000, count_logged(logger, PJSIP_REGISTER_METHOD));
+  EXPECT_EQ(10000, count_logged(logger, PJSIP_OPTIONS_METHOD));
+}
+
+// Only the sampled methods are sampled, at roughly the configured rate.
+TEST_F(SasMsgLoggerTest, Sampling)
+{
+  SasMsgLogger logger(0);
+  EXPECT_TRUE(logger.set_sample_rates("OPTIONS=100, REGISTER=10"));
+
+  int logged = count_logged(logger, PJSIP_REGISTER_METHOD);
+  EXPECT_LT(800, logged);
+  EXPECT_GT(1200, logged);
+
+  logged = count_logged(logger, PJSIP_OPTIONS_METHOD);
+  EXPECT_LT(50, logged);
+  EXPECT_GT(150, logged);
+
+  EXPECT_EQ(10000, count_logged(logger, PJSIP_INVITE_METHOD));
+}
+
+// Invalid sample rates are rejected, leaving everything logged.
+TEST_F(SasMsgLoggerTest, InvalidSampleRates)
+{
+  SasMsgLogger logger(0);
+  EXPECT_FALSE(logger.set_sample_rates("OPTIONS=100,REGISTER"));
+  EXPECT_FALSE(logger.set_sample_rates("OPTIONS=0"));
+  EXPECT_FALSE(logger.set_sample_rates("=10"));
+  EXPECT_EQ(10000, count_logged(logger, PJSIP_OPTIONS_METHOD));
+}
+
+// Messages are logged on the logger's threads.
+TEST_F(SasMsgLoggerTest, LogOnThreads)
+{
+  SNMP::FakeCounterTable dropped_tbl;
+  SasMsgLogger* logger = new SasMsgLogger(1, 10, &dropped_tbl);
+  logger->start();
+
+  pjsip_rx_data* rdata = build_register();
+  logger->log_rx_msg(1, rdata);
+  logger->log_rx_msg(2, rdata);
+
+  // Deleting the logger waits for the queue to drain.
+  delete logger;
+  EXPECT_EQ(0, dropped_tbl._count);
+}
+
+// Messages are dropped if the queue is full.
+TEST_F(SasMsgLoggerTest, QueueFull)
+{
+  SNMP::FakeCounterTable dropped_tbl;
+  SasMsgLogger* logger = new SasMsgLogger(1, 0, &dropped_tbl);
+  logger->start();
+
+  pjsip_rx_data* rdata = build_register();
+  logger->log_rx_msg(1, rdata);
+  EXPECT_EQ(0u, logger->queue_size());
+  EXPECT_EQ(1, dropped_tbl._count);
+
+  delete logger;
+}
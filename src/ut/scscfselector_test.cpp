@@ -139,6 +139,21 @@ TEST_F(SCSCFSelectorTest, SelectWeights)
   ST({654}, {876}, {}, "cw-scscf6.cw-ngv.com").test(scscf_);
 }
 
+TEST_F(SCSCFSelectorTest, UnknownAndDuplicateCapabilities)
+{
+  // Parse a valid file.
+  SCSCFSelector scscf_(string(UT_DIR).append("/test_scscf.json"));
+
+  // Duplicated mandatory capabilities are only required once.
+  ST({123, 432, 345, 345}, {}, {}, "cw-scscf1.cw-ngv.com").test(scscf_);
+
+  // Optional capabilities that no S-CSCF offers are ignored.
+  ST({123, 432}, {654, 9999}, {}, "cw-scscf2.cw-ngv.com").test(scscf_);
+
+  // A mandatory capability that no S-CSCF offers means there's no match.
+  ST({123, 9999}, {654}, {}, "").test(scscf_);
+}
+
 TEST_F(SCSCFSelectorTest, RejectSCSCFs)
 {
   // Parse a valid file.
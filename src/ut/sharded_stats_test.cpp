@@ -0,0 +1,170 @@
+/**
+ * @file sharded_stats_test.cpp UT for the sharded statistics tables.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "fakesnmp.hpp"
+#include "sharded_stats.h"
+
+/// Event accumulator table that records its samples.
+class RecordingEventAccumulatorTable : public SNMP::EventAccumulatorTable
+{
+public:
+  RecordingEventAccumulatorTable(std::vector<uint32_t>& samples) :
+    _samples(samples)
+  {
+  }
+
+  void accumulate(uint32_t sample) { _samples.push_back(sample); }
+
+  std::vector<uint32_t>& _samples;
+};
+
+/// Success/fail count table that counts INVITEs.
+class CountingSuccessFailCountByRequestTypeTable :
+  public SNMP::SuccessFailCountByRequestTypeTable
+{
+public:
+  CountingSuccessFailCountByRequestTypeTable(int* counts) : _counts(counts) {}
+
+  void increment_attempts(SNMP::SIPRequestTypes type) { _counts[0]++; }
+  void increment_successes(SNMP::SIPRequestTypes type) { _counts[1]++; }
+  void increment_failures(SNMP::SIPRequestTypes type) { _counts[2]++; }
+
+  int* _counts;
+};
+
+// Counts from every thread reach the underlying table when it is flushed.
+TEST(ShardedStatsTest, CounterTable)
+{
+  SNMP::FakeCounterTable* fake = new SNMP::FakeCounterTable();
+  ShardedCounterTable* table = new ShardedCounterTable(fake);
+
+  // The table (and so each of its shards) starts on a cache line.
+  EXPECT_EQ(0u, (uintptr_t)table % ShardedStats::CACHE_LINE_SIZE);
+
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([table]()
+    {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        table->increment();
+      }
+    }));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  EXPECT_EQ(0, fake->_count);
+  ShardedStats::flush_all();
+  EXPECT_EQ(4000, fake->_count);
+
+  table->increment();
+  ShardedStats::flush_all();
+  EXPECT_EQ(4001, fake->_count);
+
+  delete table;
+}
+
+// Samples are passed on in batches, and any left over are passed on when
+// the table is flushed or destroyed.
+TEST(ShardedStatsTest, EventAccumulatorTable)
+{
+  std::vector<uint32_t> samples;
+  ShardedEventAccumulatorTable* table =
+    new ShardedEventAccumulatorTable(new RecordingEventAccumulatorTable(samples));
+
+  for (uint32_t ii = 0; ii < ShardedEventAccumulatorTable::BATCH_SIZE - 1; ++ii)
+  {
+    table->accumulate(ii);
+  }
+  EXPECT_EQ(0u, samples.size());
+
+  table->accumulate(100);
+  ASSERT_EQ((size_t)ShardedEventAccumulatorTable::BATCH_SIZE, samples.size());
+  EXPECT_EQ(0u, samples[0]);
+  EXPECT_EQ(100u, samples.back());
+
+  table->accumulate(200);
+  ShardedStats::flush_all();
+  EXPECT_EQ(200u, samples.back());
+
+  table->accumulate(300);
+  delete table;
+  EXPECT_EQ(300u, samples.back());
+}
+
+// Request type counts reach the underlying table when it is flushed.
+TEST(ShardedStatsTest, SuccessFailCountByRequestTypeTable)
+{
+  int counts[3] = {0, 0, 0};
+  ShardedSuccessFailCountByRequestTypeTable* table =
+    new ShardedSuccessFailCountByRequestTypeTable(
+                      new CountingSuccessFailCountByRequestTypeTable(counts));
+
+  table->increment_attempts(SNMP::SIPRequestTypes::INVITE);
+  table->increment_attempts(SNMP::SIPRequestTypes::INVITE);
+  table->increment_successes(SNMP::SIPRequestTypes::INVITE);
+  table->increment_failures(SNMP::SIPRequestTypes::INVITE);
+  EXPECT_EQ(0, counts[0]);
+
+  ShardedStats::flush_all();
+  EXPECT_EQ(2, counts[0]);
+  EXPECT_EQ(1, counts[1]);
+  EXPECT_EQ(1, counts[2]);
+
+  delete table;
+}
+
+// The flusher flushes the tables when it stops.
+TEST(ShardedStatsTest, Flusher)
+{
+  SNMP::FakeCounterTable* fake = new SNMP::FakeCounterTable();
+  ShardedCounterTable table(fake);
+
+  ShardedStatsFlusher* flusher = new ShardedStatsFlusher();
+  flusher->start();
+  table.increment();
+  delete flusher;
+
+  EXPECT_EQ(1, fake->_count);
+}
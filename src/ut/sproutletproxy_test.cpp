@@ -48,6 +48,7 @@
 #include "pjsip_simple.h"
 
 #include <mutex>
+#include <vector>
 
 using namespace std;
 using testing::InSequence;
@@ -156,6 +157,38 @@ public:
   }
 };
 
+class FakeSproutletTsxAsyncForwarder : public SproutletTsx
+{
+public:
+  FakeSproutletTsxAsyncForwarder(SproutletTsxHelper* helper) :
+    SproutletTsx(helper),
+    _looked_up(false)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // Pretend to do a blocking lookup, then forward the request.
+    bool* looked_up = &_looked_up;
+    run_async((void*)req, [looked_up]() { *looked_up = true; });
+  }
+
+  void on_async_complete(void* context)
+  {
+    EXPECT_TRUE(_looked_up);
+    pjsip_msg* req = (pjsip_msg*)context;
+    send_request(req);
+  }
+
+  void on_rx_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+
+private:
+  bool _looked_up;
+};
+
 class FakeSproutletTsxDownstreamRequest : public SproutletTsx
 {
 public:
@@ -620,6 +653,7 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<false> >("fwd", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<true> >("fwdrr", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDownstreamRequest>("dsreq", 0, ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxAsyncForwarder>("asyncfwd", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForker<NUM_FORKS> >("forker", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayRedirect<1> >("delayredirect", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxBad >("bad", 0, ""));
@@ -1089,6 +1123,113 @@ TEST_F(SproutletProxyTest, SimpleSproutletForwarder)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, AsyncSproutletForwarder)
+{
+  // Tests a Sproutlet that runs a blocking operation before forwarding the
+  // request.  There are no I/O threads, so the operation runs synchronously.
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:asyncfwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  // Send a 200 OK response, which is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, AsyncSproutletForwarderIOThreads)
+{
+  // Tests a Sproutlet that runs a blocking operation on an I/O thread before
+  // forwarding the request.  The test plays the part of the worker threads
+  // by running the completion callbacks.
+  pjsip_tx_data* tdata;
+  std::mutex lock;
+  std::vector<AsyncIOPool::Callback> dispatched;
+
+  AsyncIOPool* pool = new AsyncIOPool(1,
+                                      [&](const AsyncIOPool::Callback& done)
+                                      {
+                                        std::lock_guard<std::mutex> guard(lock);
+                                        dispatched.push_back(done);
+                                      });
+  pool->start();
+  _proxy->_async_io_pool = pool;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:asyncfwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Deleting the pool waits for the operation to run.  The request isn't
+  // forwarded until the completion callback runs.
+  delete pool;
+  _proxy->_async_io_pool = NULL;
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+  ASSERT_EQ(0, txdata_count());
+
+  ASSERT_EQ(1u, dispatched.size());
+  dispatched[0]();
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, SimpleSproutletForwarderRR)
 {
   // Tests standard routing of a request through a Sproutlet that simply
@@ -46,6 +46,7 @@
 #include "sas.h"
 #include "localstore.h"
 #include "subscriber_data_manager.h"
+#include "aor_expiry_manager.h"
 #include "test_utils.hpp"
 #include "test_interposer.hpp"
 #include "fakechronosconnection.hpp"
@@ -331,6 +332,63 @@ TYPED_TEST(BasicSubscriberDataManagerTest, SubscriptionTests)
   delete aor_data1; aor_data1 = NULL;
 }
 
+/// Refreshing an AoR writes the new expiry times without bumping the NOTIFY
+/// CSeq.
+TYPED_TEST(BasicSubscriberDataManagerTest, RefreshTests)
+{
+  SubscriberDataManager::AoRPair* aor_data1;
+  SubscriberDataManager::AoR::Binding* b1;
+  SubscriberDataManager::AoR::Subscription* s1;
+  bool rc;
+  int now;
+
+  // Get an initial empty AoR record and add a binding and a subscription.
+  now = time(NULL);
+  aor_data1 = this->_store->get_aor_data(std::string("5102175698@cw-ngv.com"), 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  b1 = aor_data1->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+  b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b1->_cseq = 17038;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_private_id = "5102175698@cw-ngv.com";
+  b1->_emergency_registration = false;
+  s1 = aor_data1->get_current()->get_subscription("1234");
+  s1->_req_uri = std::string("sip:5102175698@192.91.191.29:59934;transport=tcp");
+  s1->_from_uri = std::string("<sip:5102175698@cw-ngv.com>");
+  s1->_from_tag = std::string("4321");
+  s1->_to_uri = std::string("<sip:5102175698@cw-ngv.com>");
+  s1->_to_tag = std::string("1234");
+  s1->_cid = std::string("xyzabc@192.91.191.29");
+  s1->_expires = now + 300;
+  rc = this->_store->set_aor_data(std::string("5102175698@cw-ngv.com"), aor_data1, 0);
+  EXPECT_TRUE(rc);
+  delete aor_data1; aor_data1 = NULL;
+
+  // Refresh the binding.
+  aor_data1 = this->_store->get_aor_data(std::string("5102175698@cw-ngv.com"), 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  int notify_cseq = aor_data1->get_current()->_notify_cseq;
+  b1 = aor_data1->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_cseq = 17039;
+  b1->_expires = now + 600;
+  rc = this->_store->refresh_aor_data(std::string("5102175698@cw-ngv.com"), aor_data1, 0);
+  EXPECT_TRUE(rc);
+  delete aor_data1; aor_data1 = NULL;
+
+  // Read the record back in and check the binding and subscription.
+  aor_data1 = this->_store->get_aor_data(std::string("5102175698@cw-ngv.com"), 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  EXPECT_EQ(1u, aor_data1->get_current()->bindings().size());
+  EXPECT_EQ(1u, aor_data1->get_current()->subscriptions().size());
+  b1 = aor_data1->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  EXPECT_EQ(17039, b1->_cseq);
+  EXPECT_EQ(now + 600, b1->_expires);
+  EXPECT_EQ(notify_cseq, aor_data1->get_current()->_notify_cseq);
+  delete aor_data1; aor_data1 = NULL;
+}
+
 TYPED_TEST(BasicSubscriberDataManagerTest, CopyTests)
 {
   SubscriberDataManager::AoRPair* aor_data1;
@@ -1161,3 +1219,236 @@ TEST_F(SubscriberDataManagerChronosRequestsTest, AoRTimerBadRequestNoIDTest)
 
   delete aor_data1; aor_data1 = NULL;
 }
+
+// Test that with local expiry, AoRs are tracked on the expiry wheel rather
+// than each having a Chronos timer.
+TEST_F(SubscriberDataManagerChronosRequestsTest, LocalExpiryTest)
+{
+  SubscriberDataManager::AoRPair* aor_data1;
+  SubscriberDataManager::AoR::Binding* b1;
+  bool rc;
+  int now;
+
+  AoRExpiryManager expiry_manager(this->_chronos_connection,
+                                  [](const std::vector<std::string>& aor_ids,
+                                     SAS::TrailId trail) {});
+  this->_store->set_expiry_manager(&expiry_manager);
+
+  // Get an initial empty AoR record and add a binding.  Give the AoR a timer
+  // left over from before local expiry was enabled.
+  now = time(NULL);
+  aor_data1 = this->_store->get_aor_data(std::string("5102175698@cw-ngv.com"), 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  aor_data1->get_current()->_timer_id = "OLD_TIMER_ID";
+  b1 = aor_data1->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+  b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b1->_cseq = 17038;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_private_id = "5102175698@cw-ngv.com";
+  b1->_emergency_registration = false;
+
+  // Write the record back to the store.  No timer is set for the AoR, and
+  // the old one is kept until the AoR's bucket has a timer.
+  EXPECT_CALL(*(this->_chronos_connection), send_delete(_, _)).Times(0);
+  EXPECT_CALL(*(this->_chronos_connection), send_post(_, _, _, _, _, _)).Times(0);
+  rc = this->_store->set_aor_data(std::string("5102175698@cw-ngv.com"), aor_data1, 0);
+  EXPECT_TRUE(rc);
+  delete aor_data1; aor_data1 = NULL;
+  EXPECT_EQ(1u, expiry_manager.size());
+  EXPECT_EQ(now + 300, expiry_manager._wheel.expiry("5102175698@cw-ngv.com"));
+  ::testing::Mock::VerifyAndClearExpectations(this->_chronos_connection);
+
+  // The old timer is deleted once the bucket timer has been set.
+  {
+    ::testing::InSequence seq;
+    EXPECT_CALL(*(this->_chronos_connection), send_post(_, _, "/timers", _, _, _))
+      .WillOnce(DoAll(SetArgReferee<0>("BUCKET_TIMER_ID"), Return(HTTP_OK)));
+    EXPECT_CALL(*(this->_chronos_connection), send_delete("OLD_TIMER_ID", _)).Times(1);
+  }
+  expiry_manager.tick(now);
+
+  // Read the record back in and remove the binding.
+  aor_data1 = this->_store->get_aor_data(std::string("5102175698@cw-ngv.com"), 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  EXPECT_EQ("", aor_data1->get_current()->_timer_id);
+  aor_data1->get_current()->remove_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+
+  // The AoR is no longer tracked, and its bucket's timer is deleted when the
+  // expiry manager goes.
+  rc = this->_store->set_aor_data(std::string("5102175698@cw-ngv.com"), aor_data1, 0);
+  EXPECT_TRUE(rc);
+  delete aor_data1; aor_data1 = NULL;
+  EXPECT_EQ(0u, expiry_manager.size());
+
+  EXPECT_CALL(*(this->_chronos_connection), send_delete("BUCKET_TIMER_ID", _)).Times(1);
+  this->_store->set_expiry_manager(NULL);
+}
+
+/// Fixture for tests of storing subscriptions separately from bindings.  The
+/// stores aren't primary, so don't send NOTIFYs or set timers.
+class SeparateSubscriptionsTest : public ::testing::Test
+{
+  void SetUp()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _datastore = new LocalStore();
+    _single_store = new SubscriberDataManager(_datastore,
+                                              _chronos_connection,
+                                              false);
+    _split_store = new SubscriberDataManager(_datastore,
+                                             _chronos_connection,
+                                             false);
+    _split_store->set_separate_subscriptions(true);
+  }
+
+  void TearDown()
+  {
+    delete _split_store; _split_store = NULL;
+    delete _single_store; _single_store = NULL;
+    delete _datastore; _datastore = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  // Write an AoR with one binding and one subscription.
+  void write_aor(SubscriberDataManager* store)
+  {
+    int now = time(NULL);
+    SubscriberDataManager::AoRPair* aor_pair = store->get_aor_data(AOR, 0);
+    ASSERT_TRUE(aor_pair != NULL);
+    SubscriberDataManager::AoR::Binding* b1 =
+      aor_pair->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+    b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+    b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+    b1->_cseq = 17038;
+    b1->_expires = now + 300;
+    b1->_priority = 0;
+    b1->_emergency_registration = false;
+    add_subscription(aor_pair, "1234", now + 300);
+    EXPECT_EQ(Store::OK, store->set_aor_data(AOR, aor_pair, 0));
+    delete aor_pair;
+  }
+
+  void add_subscription(SubscriberDataManager::AoRPair* aor_pair,
+                        const std::string& to_tag,
+                        int expires)
+  {
+    SubscriberDataManager::AoR::Subscription* s1 =
+      aor_pair->get_current()->get_subscription(to_tag);
+    s1->_req_uri = std::string("sip:5102175698@192.91.191.29:59934;transport=tcp");
+    s1->_from_uri = std::string("<sip:5102175698@cw-ngv.com>");
+    s1->_from_tag = std::string("4321");
+    s1->_to_uri = std::string("<sip:5102175698@cw-ngv.com>");
+    s1->_to_tag = to_tag;
+    s1->_cid = std::string("xyzabc@192.91.191.29");
+    s1->_expires = expires;
+  }
+
+  std::string get_record(const std::string& table, uint64_t& cas)
+  {
+    std::string data;
+    _datastore->get_data(table, AOR, data, cas, 0);
+    return data;
+  }
+
+  static const std::string AOR;
+  FakeChronosConnection* _chronos_connection;
+  LocalStore* _datastore;
+  SubscriberDataManager* _single_store;
+  SubscriberDataManager* _split_store;
+};
+
+const std::string SeparateSubscriptionsTest::AOR = "5102175698@cw-ngv.com";
+
+TEST_F(SeparateSubscriptionsTest, SubscriptionsStoredSeparately)
+{
+  write_aor(_split_store);
+
+  uint64_t cas;
+  EXPECT_EQ(std::string::npos, get_record("reg", cas).find("1234"));
+  EXPECT_NE(std::string::npos, get_record("reg_subs", cas).find("1234"));
+
+  SubscriberDataManager::AoRPair* aor_pair = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair != NULL);
+  EXPECT_EQ(1u, aor_pair->get_current()->bindings().size());
+  EXPECT_EQ(1u, aor_pair->get_current()->subscriptions().size());
+  EXPECT_EQ(2, aor_pair->get_current()->_notify_cseq);
+  delete aor_pair;
+}
+
+TEST_F(SeparateSubscriptionsTest, SubscriptionChangeLeavesBindingsRecord)
+{
+  write_aor(_split_store);
+  uint64_t reg_cas;
+  uint64_t subs_cas;
+  get_record("reg", reg_cas);
+  get_record("reg_subs", subs_cas);
+
+  SubscriberDataManager::AoRPair* aor_pair = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair != NULL);
+  aor_pair->get_current()->get_subscription("1234")->_expires += 100;
+  EXPECT_EQ(Store::OK, _split_store->set_aor_data(AOR, aor_pair, 0));
+  delete aor_pair;
+
+  uint64_t new_cas;
+  get_record("reg", new_cas);
+  EXPECT_EQ(reg_cas, new_cas);
+  get_record("reg_subs", new_cas);
+  EXPECT_NE(subs_cas, new_cas);
+}
+
+TEST_F(SeparateSubscriptionsTest, SingleRecordAoRsMigrated)
+{
+  write_aor(_single_store);
+
+  // The subscriptions are read from the single record.
+  SubscriberDataManager::AoRPair* aor_pair = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair != NULL);
+  EXPECT_EQ(1u, aor_pair->get_current()->subscriptions().size());
+  EXPECT_EQ(2, aor_pair->get_current()->_notify_cseq);
+
+  // Writing the AoR back splits it, keeping the NOTIFY CSeq.
+  EXPECT_EQ(Store::OK, _split_store->set_aor_data(AOR, aor_pair, 0));
+  delete aor_pair;
+
+  uint64_t cas;
+  EXPECT_EQ(std::string::npos, get_record("reg", cas).find("1234"));
+  EXPECT_NE(std::string::npos, get_record("reg_subs", cas).find("1234"));
+
+  aor_pair = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair != NULL);
+  EXPECT_EQ(1u, aor_pair->get_current()->subscriptions().size());
+  EXPECT_EQ(3, aor_pair->get_current()->_notify_cseq);
+  delete aor_pair;
+}
+
+TEST_F(SeparateSubscriptionsTest, ContendedSubscriptionWritesMerged)
+{
+  write_aor(_split_store);
+  int now = time(NULL);
+
+  // Two writers read the AoR, then each adds a subscription and removes the
+  // original one.
+  SubscriberDataManager::AoRPair* aor_pair1 = _split_store->get_aor_data(AOR, 0);
+  SubscriberDataManager::AoRPair* aor_pair2 = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair1 != NULL);
+  ASSERT_TRUE(aor_pair2 != NULL);
+  add_subscription(aor_pair1, "aaaa", now + 300);
+  add_subscription(aor_pair2, "bbbb", now + 300);
+  aor_pair2->get_current()->remove_subscription("1234");
+
+  EXPECT_EQ(Store::OK, _split_store->set_aor_data(AOR, aor_pair1, 0));
+  EXPECT_EQ(Store::OK, _split_store->set_aor_data(AOR, aor_pair2, 0));
+  delete aor_pair1;
+  delete aor_pair2;
+
+  // Both writers' changes are kept, and each write got its own NOTIFY CSeq.
+  SubscriberDataManager::AoRPair* aor_pair = _split_store->get_aor_data(AOR, 0);
+  ASSERT_TRUE(aor_pair != NULL);
+  EXPECT_EQ(2u, aor_pair->get_current()->subscriptions().size());
+  EXPECT_EQ(1u, aor_pair->get_current()->subscriptions().count("aaaa"));
+  EXPECT_EQ(1u, aor_pair->get_current()->subscriptions().count("bbbb"));
+  EXPECT_EQ(4, aor_pair->get_current()->_notify_cseq);
+  delete aor_pair;
+}
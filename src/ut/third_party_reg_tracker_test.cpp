@@ -0,0 +1,198 @@
+/**
+ * @file third_party_reg_tracker_test.cpp UT for the third-party registration tracker.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "third_party_reg_tracker.h"
+
+using ::testing::_;
+using ::testing::Field;
+using ::testing::Ge;
+using ::testing::Le;
+using ::testing::AllOf;
+
+class MockRefreshSender : public ThirdPartyRegTracker::RefreshSender
+{
+public:
+  MOCK_METHOD3(send_refresh, void(const std::string& served_user,
+                                  const AsInvocation& as,
+                                  int expires));
+};
+
+class ThirdPartyRegTrackerTest : public ::testing::Test
+{
+public:
+  MockRefreshSender _sender;
+  ThirdPartyRegTracker* _tracker;
+  AsInvocation _as;
+  int _now;
+
+  ThirdPartyRegTrackerTest()
+  {
+    _tracker = new ThirdPartyRegTracker(&_sender);
+    _as.server_name = "sip:as.example.com";
+    _as.default_handling = SESSION_CONTINUED;
+    _as.include_register_request = false;
+    _as.include_register_response = false;
+    _now = 1000000;
+  }
+
+  virtual ~ThirdPartyRegTrackerTest()
+  {
+    delete _tracker; _tracker = NULL;
+  }
+
+  // Run the tracker's clock forward a second at a time.
+  void advance(int seconds)
+  {
+    for (int i = 0; i < seconds; i++)
+    {
+      _now++;
+      _tracker->tick(_now);
+    }
+  }
+};
+
+// The initial registration is always sent, and an unchanged re-REGISTER is
+// suppressed.
+TEST_F(ThirdPartyRegTrackerTest, SuppressUnchangedReregister)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 1, _now + 60));
+  EXPECT_EQ(1u, _tracker->size());
+}
+
+// A change to the bindings or to the iFC forces a third-party REGISTER.
+TEST_F(ThirdPartyRegTrackerTest, SendOnChange)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 2, _now));
+
+  _as.service_info = "banana";
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 2, _now));
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 2, _now));
+
+  // Initial registrations are never suppressed.
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 2, _now));
+}
+
+// Deregistrations are always sent and stop tracking.
+TEST_F(ThirdPartyRegTrackerTest, Deregister)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 0, false, 1, _now));
+  EXPECT_EQ(0u, _tracker->size());
+
+  EXPECT_CALL(_sender, send_refresh(_, _, _)).Times(0);
+  advance(400);
+}
+
+// A failed third-party REGISTER is forgotten, so the next re-REGISTER is
+// passed on rather than suppressed.
+TEST_F(ThirdPartyRegTrackerTest, SendFailed)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  _tracker->send_failed("sip:6505550001@homedomain", _as.server_name);
+  EXPECT_EQ(0u, _tracker->size());
+
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 1, _now + 60));
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 1, _now + 120));
+}
+
+// If the UE has re-registered, the AS registration is refreshed shortly
+// before it expires, for the remainder of the UE's registration.
+TEST_F(ThirdPartyRegTrackerTest, RefreshBeforeExpiry)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  advance(150);
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 1, _now));
+
+  // The refresh is jittered to between 30% and 10% of the registration
+  // period before the AS registration would expire, and lasts until the
+  // UE's registration expires.
+  EXPECT_CALL(_sender, send_refresh("sip:6505550001@homedomain",
+                                    Field(&AsInvocation::server_name, "sip:as.example.com"),
+                                    AllOf(Ge(150), Le(240))));
+  advance(300 - 150 - 30);
+  ::testing::Mock::VerifyAndClearExpectations(&_sender);
+
+  // The UE's registration lapses, so there are no more refreshes and the
+  // tracker forgets the registration.
+  EXPECT_CALL(_sender, send_refresh(_, _, _)).Times(0);
+  advance(300);
+  EXPECT_EQ(0u, _tracker->size());
+}
+
+// If the UE doesn't re-register, the AS registration isn't refreshed.
+TEST_F(ThirdPartyRegTrackerTest, NoRefreshWithoutReregister)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+
+  EXPECT_CALL(_sender, send_refresh(_, _, _)).Times(0);
+  advance(300);
+  EXPECT_EQ(0u, _tracker->size());
+}
+
+// Registrations longer than the timer wheel are refreshed on a later
+// revolution of the wheel.
+TEST_F(ThirdPartyRegTrackerTest, LongRegistration)
+{
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 3600, true, 1, _now));
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 3600, false, 1, _now + 1));
+
+  EXPECT_CALL(_sender, send_refresh(_, _, _)).Times(0);
+  advance(2500);
+  ::testing::Mock::VerifyAndClearExpectations(&_sender);
+
+  EXPECT_CALL(_sender, send_refresh("sip:6505550001@homedomain", _, _)).Times(1);
+  advance(3600 - 2500);
+}
+
+// Each AS is tracked separately.
+TEST_F(ThirdPartyRegTrackerTest, MultipleAS)
+{
+  AsInvocation as2 = _as;
+  as2.server_name = "sip:as2.example.com";
+
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, true, 1, _now));
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", as2, 300, true, 1, _now));
+  EXPECT_EQ(2u, _tracker->size());
+
+  EXPECT_TRUE(_tracker->should_send("sip:6505550001@homedomain", as2, 0, false, 1, _now));
+  EXPECT_FALSE(_tracker->should_send("sip:6505550001@homedomain", _as, 300, false, 1, _now));
+  EXPECT_EQ(1u, _tracker->size());
+}
@@ -0,0 +1,134 @@
+/**
+ * @file timer_wheel_test.cpp UT for the hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "timer_wheel.h"
+
+class TimerWheelTest : public ::testing::Test
+{
+public:
+  // Advances the wheel and returns the timers that popped.
+  static std::vector<std::string> advance(TimerWheel& wheel, int now)
+  {
+    std::vector<std::string> expired;
+    wheel.advance(now, expired);
+    return expired;
+  }
+};
+
+// A timer pops when the wheel reaches its expiry time, and not before.
+TEST_F(TimerWheelTest, PopsAtExpiry)
+{
+  TimerWheel wheel(1000);
+  wheel.set("a", 1005);
+  EXPECT_EQ(1u, wheel.size());
+  EXPECT_EQ(1005, wheel.expiry("a"));
+
+  EXPECT_TRUE(advance(wheel, 1004).empty());
+
+  std::vector<std::string> expired = advance(wheel, 1005);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("a", expired[0]);
+  EXPECT_EQ(0u, wheel.size());
+  EXPECT_EQ(0, wheel.expiry("a"));
+}
+
+// Timers on the higher levels cascade down and pop at exactly the right
+// time, including those beyond the range of the wheel.
+TEST_F(TimerWheelTest, Cascade)
+{
+  int start = 1000;
+  TimerWheel wheel(start);
+  std::vector<int> deltas = {1, 63, 64, 65, 3600, 4096, 4097, 300000, 17000000};
+
+  for (size_t ii = 0; ii < deltas.size(); ++ii)
+  {
+    wheel.set(std::to_string(ii), start + deltas[ii]);
+  }
+
+  for (size_t ii = 0; ii < deltas.size(); ++ii)
+  {
+    EXPECT_TRUE(advance(wheel, start + deltas[ii] - 1).empty());
+
+    std::vector<std::string> expired = advance(wheel, start + deltas[ii]);
+    ASSERT_EQ(1u, expired.size());
+    EXPECT_EQ(std::to_string(ii), expired[0]);
+  }
+
+  EXPECT_EQ(0u, wheel.size());
+}
+
+// Setting a timer again moves it, and cancelled timers don't pop.
+TEST_F(TimerWheelTest, ResetAndCancel)
+{
+  TimerWheel wheel(1000);
+  wheel.set("a", 1010);
+  wheel.set("b", 1010);
+  wheel.set("a", 1200);
+  wheel.cancel("b");
+  wheel.cancel("c");
+  EXPECT_EQ(1u, wheel.size());
+
+  EXPECT_TRUE(advance(wheel, 1199).empty());
+
+  std::vector<std::string> expired = advance(wheel, 1200);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("a", expired[0]);
+}
+
+// Timers in the past pop on the next advance, and many timers in the same
+// slot pop together.
+TEST_F(TimerWheelTest, BatchAndPast)
+{
+  TimerWheel wheel(1000);
+  wheel.set("old", 900);
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    wheel.set("aor" + std::to_string(ii), 1100);
+  }
+
+  std::vector<std::string> expired = advance(wheel, 1001);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("old", expired[0]);
+
+  // Advancing a long way in one go pops everything due in between.
+  EXPECT_EQ(100u, advance(wheel, 5000).size());
+  EXPECT_EQ(0u, wheel.size());
+}
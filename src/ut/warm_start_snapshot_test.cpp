@@ -0,0 +1,338 @@
+/**
+ * @file warm_start_snapshot_test.cpp UT for the warm-start snapshot.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "test_interposer.hpp"
+#include "warm_start_snapshot.h"
+#include "hss_answer_cache.h"
+#include "register_as_cache.h"
+#include "dns_prefetcher.h"
+
+class WarmStartSnapshotTest : public ::testing::Test
+{
+public:
+  WarmStartSnapshotTest() :
+    _filename("/tmp/warm_start_snapshot_test." + std::to_string(getpid()))
+  {
+  }
+
+  void TearDown()
+  {
+    unlink(_filename.c_str());
+    cwtest_reset_time();
+  }
+
+  /// Adds a section for an HSS answer cache to a snapshot.
+  static void add_hss_section(WarmStartSnapshot& snapshot,
+                              HSSAnswerCache& cache)
+  {
+    snapshot.add_section(WarmStartSnapshot::SECTION_HSS_ANSWERS,
+                         std::bind(&HSSAnswerCache::save,
+                                   &cache,
+                                   std::placeholders::_1),
+                         std::bind(&HSSAnswerCache::restore,
+                                   &cache,
+                                   std::placeholders::_1,
+                                   std::placeholders::_2));
+  }
+
+  static HSSAnswerCache::Answer make_answer(const std::string& scscf)
+  {
+    HSSAnswerCache::Answer answer;
+    answer.caps.scscf = scscf;
+    answer.caps.mandatory_caps = {1, 2};
+    answer.caps.optional_caps = {3};
+    answer.queried_caps = true;
+    return answer;
+  }
+
+  /// Reads the whole snapshot file.
+  std::string read_file()
+  {
+    std::ifstream f(_filename.c_str(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f),
+                       std::istreambuf_iterator<char>());
+  }
+
+  void write_file(const std::string& data)
+  {
+    std::ofstream f(_filename.c_str(), std::ios::binary);
+    f << data;
+  }
+
+  std::string _filename;
+};
+
+// Writers and readers round-trip values, and readers fail on overruns.
+TEST_F(WarmStartSnapshotTest, ReaderAndWriter)
+{
+  WarmStartSnapshot::Writer writer;
+  writer.put_u32(7);
+  writer.put_u64(0x123456789abcdefULL);
+  writer.put_string("hello");
+  writer.put_string("");
+
+  WarmStartSnapshot::Reader reader(writer.data().data(), writer.data().length());
+  EXPECT_EQ(7u, reader.get_u32());
+  EXPECT_EQ(0x123456789abcdefULL, reader.get_u64());
+  EXPECT_EQ("hello", reader.get_string());
+  EXPECT_EQ("", reader.get_string());
+  EXPECT_TRUE(reader.at_end());
+  EXPECT_FALSE(reader.failed());
+
+  EXPECT_EQ(0u, reader.get_u32());
+  EXPECT_TRUE(reader.failed());
+
+  // A string whose length overruns the data fails the reader.
+  WarmStartSnapshot::Reader short_reader(writer.data().data(), 16);
+  short_reader.get_u32();
+  short_reader.get_u64();
+  EXPECT_EQ("", short_reader.get_string());
+  EXPECT_TRUE(short_reader.failed());
+}
+
+// Each cache is saved and restored, and the snapshot is deleted once it has
+// been loaded.
+TEST_F(WarmStartSnapshotTest, SaveAndLoad)
+{
+  HSSAnswerCache hss_cache(30000);
+  RegisterAsCache as_cache;
+  DnsPrefetcher prefetcher(NULL, AF_INET);
+
+  std::string lir = HSSAnswerCache::lir_key("sip:6505551234@homedomain", false);
+  hss_cache.put(lir, make_answer("sip:scscf1.homedomain"));
+
+  AsInvocation as;
+  as.server_name = "sip:as1.homedomain";
+  as.default_handling = SESSION_TERMINATED;
+  as.service_info = "info";
+  as.include_register_request = false;
+  as.include_register_response = true;
+  as_cache.put(0x1234, true, false, {as});
+
+  prefetcher.learn_uri("sip:as1.homedomain;transport=tcp");
+
+  {
+    WarmStartSnapshot snapshot(_filename);
+    add_hss_section(snapshot, hss_cache);
+    snapshot.add_section(WarmStartSnapshot::SECTION_REGISTER_AS,
+                         std::bind(&RegisterAsCache::save,
+                                   &as_cache,
+                                   std::placeholders::_1),
+                         std::bind(&RegisterAsCache::restore,
+                                   &as_cache,
+                                   std::placeholders::_1,
+                                   std::placeholders::_2));
+    snapshot.add_section(WarmStartSnapshot::SECTION_DNS_TARGETS,
+                         std::bind(&DnsPrefetcher::save,
+                                   &prefetcher,
+                                   std::placeholders::_1),
+                         std::bind(&DnsPrefetcher::restore,
+                                   &prefetcher,
+                                   std::placeholders::_1,
+                                   std::placeholders::_2));
+    EXPECT_TRUE(snapshot.save());
+  }
+
+  HSSAnswerCache new_hss_cache(30000);
+  RegisterAsCache new_as_cache;
+  DnsPrefetcher new_prefetcher(NULL, AF_INET);
+
+  WarmStartSnapshot snapshot(_filename);
+  add_hss_section(snapshot, new_hss_cache);
+  snapshot.add_section(WarmStartSnapshot::SECTION_REGISTER_AS,
+                       std::bind(&RegisterAsCache::save,
+                                 &new_as_cache,
+                                 std::placeholders::_1),
+                       std::bind(&RegisterAsCache::restore,
+                                 &new_as_cache,
+                                 std::placeholders::_1,
+                                 std::placeholders::_2));
+  snapshot.add_section(WarmStartSnapshot::SECTION_DNS_TARGETS,
+                       std::bind(&DnsPrefetcher::save,
+                                 &new_prefetcher,
+                                 std::placeholders::_1),
+                       std::bind(&DnsPrefetcher::restore,
+                                 &new_prefetcher,
+                                 std::placeholders::_1,
+                                 std::placeholders::_2));
+  EXPECT_TRUE(snapshot.load());
+
+  HSSAnswerCache::Answer answer;
+  ASSERT_TRUE(new_hss_cache.get(lir, answer));
+  EXPECT_EQ("sip:scscf1.homedomain", answer.caps.scscf);
+  EXPECT_EQ(std::vector<int>({1, 2}), answer.caps.mandatory_caps);
+  EXPECT_EQ(std::vector<int>({3}), answer.caps.optional_caps);
+  EXPECT_TRUE(answer.queried_caps);
+
+  std::vector<AsInvocation> as_list;
+  ASSERT_TRUE(new_as_cache.get(0x1234, true, false, as_list));
+  ASSERT_EQ(1u, as_list.size());
+  EXPECT_EQ("sip:as1.homedomain", as_list[0].server_name);
+  EXPECT_EQ(SESSION_TERMINATED, as_list[0].default_handling);
+  EXPECT_EQ("info", as_list[0].service_info);
+  EXPECT_FALSE(as_list[0].include_register_request);
+  EXPECT_TRUE(as_list[0].include_register_response);
+  EXPECT_FALSE(new_as_cache.get(0x1234, false, false, as_list));
+
+  EXPECT_EQ(1u, new_prefetcher.size());
+
+  // The snapshot can only be loaded once.
+  EXPECT_EQ(-1, access(_filename.c_str(), F_OK));
+  EXPECT_FALSE(snapshot.load());
+}
+
+// Restored answers keep the rest of their TTL, and answers that expired
+// while Sprout was down aren't restored.
+TEST_F(WarmStartSnapshotTest, TTLsHonoured)
+{
+  HSSAnswerCache cache(30000);
+  cache.put("key1", make_answer("sip:scscf1.homedomain"));
+  cwtest_advance_time_ms(20000);
+  cache.put("key2", make_answer("sip:scscf2.homedomain"));
+
+  WarmStartSnapshot snapshot(_filename);
+  add_hss_section(snapshot, cache);
+  EXPECT_TRUE(snapshot.save());
+
+  // Restart 15s later.
+  cwtest_advance_time_ms(15000);
+  HSSAnswerCache new_cache(30000);
+  WarmStartSnapshot new_snapshot(_filename);
+  add_hss_section(new_snapshot, new_cache);
+  EXPECT_TRUE(new_snapshot.load());
+
+  HSSAnswerCache::Answer answer;
+  EXPECT_FALSE(new_cache.get("key1", answer));
+  ASSERT_TRUE(new_cache.get("key2", answer));
+  EXPECT_EQ("sip:scscf2.homedomain", answer.caps.scscf);
+
+  cwtest_advance_time_ms(15000);
+  EXPECT_FALSE(new_cache.get("key2", answer));
+}
+
+// Snapshots that are too old, have the wrong version or are truncated are
+// ignored, as are sections nobody has registered.
+TEST_F(WarmStartSnapshotTest, BadSnapshots)
+{
+  HSSAnswerCache cache(30000);
+  cache.put("key1", make_answer("sip:scscf1.homedomain"));
+
+  WarmStartSnapshot snapshot(_filename, 60);
+  add_hss_section(snapshot, cache);
+  EXPECT_TRUE(snapshot.save());
+  std::string data = read_file();
+
+  HSSAnswerCache new_cache(30000);
+  WarmStartSnapshot new_snapshot(_filename, 60);
+  add_hss_section(new_snapshot, new_cache);
+
+  // Too old.
+  cwtest_advance_time_ms(61000);
+  EXPECT_FALSE(new_snapshot.load());
+  cwtest_reset_time();
+
+  // Wrong version - the version follows the 8 byte magic number.
+  std::string bad_version = data;
+  bad_version[8]++;
+  write_file(bad_version);
+  EXPECT_FALSE(new_snapshot.load());
+
+  // Truncated part way through the section.
+  write_file(data.substr(0, data.length() - 4));
+  new_snapshot.load();
+  EXPECT_EQ(0u, new_cache.size());
+
+  // Not registered.
+  write_file(data);
+  new_snapshot.remove_section(WarmStartSnapshot::SECTION_HSS_ANSWERS);
+  EXPECT_TRUE(new_snapshot.load());
+  EXPECT_EQ(0u, new_cache.size());
+}
+
+// A full HSS answer cache is restored in full, with each answer's TTL capped
+// at the new cache's TTL, and a smaller cache only restores what fits.
+TEST_F(WarmStartSnapshotTest, FullCacheRestored)
+{
+  const size_t num_entries = 1000;
+  HSSAnswerCache cache(30000, num_entries);
+
+  for (size_t i = 0; i < num_entries; ++i)
+  {
+    cache.put(HSSAnswerCache::lir_key("sip:" + std::to_string(i) + "@homedomain",
+                                      false),
+              make_answer("sip:scscf1.homedomain"));
+  }
+
+  WarmStartSnapshot snapshot(_filename);
+  add_hss_section(snapshot, cache);
+  EXPECT_TRUE(snapshot.save());
+  std::string data = read_file();
+
+  HSSAnswerCache new_cache(10000, num_entries);
+  WarmStartSnapshot new_snapshot(_filename);
+  add_hss_section(new_snapshot, new_cache);
+  EXPECT_TRUE(new_snapshot.load());
+  EXPECT_EQ(num_entries, new_cache.size());
+
+  HSSAnswerCache::Answer answer;
+
+  for (size_t i = 0; i < num_entries; ++i)
+  {
+    ASSERT_TRUE(new_cache.get(HSSAnswerCache::lir_key("sip:" + std::to_string(i) + "@homedomain",
+                                                      false),
+                              answer));
+    EXPECT_EQ("sip:scscf1.homedomain", answer.caps.scscf);
+  }
+
+  // The answers last for the new cache's TTL, not the rest of the old one.
+  cwtest_advance_time_ms(10001);
+  EXPECT_FALSE(new_cache.get(HSSAnswerCache::lir_key("sip:0@homedomain", false),
+                             answer));
+
+  // A smaller cache stops restoring once it is full.
+  write_file(data);
+  HSSAnswerCache small_cache(30000, num_entries / 2);
+  WarmStartSnapshot small_snapshot(_filename);
+  add_hss_section(small_snapshot, small_cache);
+  EXPECT_TRUE(small_snapshot.load());
+  EXPECT_EQ(num_entries / 2, small_cache.size());
+}
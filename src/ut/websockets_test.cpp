@@ -0,0 +1,173 @@
+/**
+ * @file websockets_test.cpp UT and scale benchmark for the WebSocket connection table.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "utils.h"
+#include "stack.h"
+#include "websockets.h"
+
+#include "basetest.hpp"
+
+using namespace std;
+
+/// Fixture for WSConnectionTable tests.
+class WSConnectionTableTest : public BaseTest
+{
+public:
+  WSConnectionTableTest() : _table() {}
+  virtual ~WSConnectionTableTest() {}
+
+  // Returns a fake connection/transport pointer for index ii.  The table
+  // never dereferences these, so they only need to be distinct and aligned
+  // like real heap pointers.
+  static const void* fake_con(long ii)
+  {
+    return (const void*)(0x10000 + (ii << 6));
+  }
+
+  static ws_transport* fake_transport(long ii)
+  {
+    return (ws_transport*)(0x20000000 + (ii << 6));
+  }
+
+  WSConnectionTable _table;
+};
+
+TEST_F(WSConnectionTableTest, InsertFindErase)
+{
+  EXPECT_EQ(0u, _table.size());
+  EXPECT_EQ(NULL, _table.find(fake_con(1)));
+
+  _table.insert(fake_con(1), fake_transport(1));
+  _table.insert(fake_con(2), fake_transport(2));
+  EXPECT_EQ(2u, _table.size());
+  EXPECT_EQ(fake_transport(1), _table.find(fake_con(1)));
+  EXPECT_EQ(fake_transport(2), _table.find(fake_con(2)));
+
+  EXPECT_EQ(fake_transport(1), _table.erase(fake_con(1)));
+  EXPECT_EQ(NULL, _table.find(fake_con(1)));
+  EXPECT_EQ(NULL, _table.erase(fake_con(1)));
+  EXPECT_EQ(1u, _table.size());
+}
+
+TEST_F(WSConnectionTableTest, InsertReplaces)
+{
+  _table.insert(fake_con(1), fake_transport(1));
+  _table.insert(fake_con(1), fake_transport(3));
+  EXPECT_EQ(1u, _table.size());
+  EXPECT_EQ(fake_transport(3), _table.find(fake_con(1)));
+}
+
+// Simulates a WebRTC edge with a pool of I/O threads, each opening its share
+// of the connections, passing a few messages over each of them, then closing
+// them.
+struct TableThreadData
+{
+  WSConnectionTable* table;
+  long first;
+  long count;
+  int messages;
+  long missing;
+};
+
+static void* table_thread(void* p)
+{
+  TableThreadData* data = (TableThreadData*)p;
+
+  for (long ii = data->first; ii < data->first + data->count; ++ii)
+  {
+    data->table->insert(WSConnectionTableTest::fake_con(ii),
+                        WSConnectionTableTest::fake_transport(ii));
+  }
+
+  for (int msg = 0; msg < data->messages; ++msg)
+  {
+    for (long ii = data->first; ii < data->first + data->count; ++ii)
+    {
+      if (data->table->find(WSConnectionTableTest::fake_con(ii)) !=
+          WSConnectionTableTest::fake_transport(ii))
+      {
+        data->missing++;
+      }
+    }
+  }
+
+  for (long ii = data->first; ii < data->first + data->count; ++ii)
+  {
+    if (data->table->erase(WSConnectionTableTest::fake_con(ii)) == NULL)
+    {
+      data->missing++;
+    }
+  }
+
+  return NULL;
+}
+
+TEST_F(WSConnectionTableTest, ConnectionsAcrossThreads)
+{
+  const int NUM_THREADS = 4;
+  const long NUM_CONNECTIONS = 400;
+  const int MESSAGES_PER_CONNECTION = 5;
+
+  pthread_t threads[NUM_THREADS];
+  TableThreadData data[NUM_THREADS];
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    data[ii].table = &_table;
+    data[ii].first = ii * (NUM_CONNECTIONS / NUM_THREADS);
+    data[ii].count = NUM_CONNECTIONS / NUM_THREADS;
+    data[ii].messages = MESSAGES_PER_CONNECTION;
+    data[ii].missing = 0;
+    pthread_create(&threads[ii], NULL, table_thread, &data[ii]);
+  }
+
+  // Every connection is found for every message and erased on close.
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    EXPECT_EQ(0, data[ii].missing);
+  }
+
+  EXPECT_EQ(0u, _table.size());
+}
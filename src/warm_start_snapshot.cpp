@@ -0,0 +1,367 @@
+/**
+ * @file warm_start_snapshot.cpp Snapshot of in-memory caches that survives a restart.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "warm_start_snapshot.h"
+
+/// "SPRTSNAP" when written on a little-endian host.
+static const uint64_t SNAPSHOT_MAGIC = 0x50414e5354525053ULL;
+
+const uint32_t WarmStartSnapshot::SECTION_HSS_ANSWERS;
+const uint32_t WarmStartSnapshot::SECTION_REGISTER_AS;
+const uint32_t WarmStartSnapshot::SECTION_DNS_TARGETS;
+const uint32_t WarmStartSnapshot::VERSION;
+const int WarmStartSnapshot::DEFAULT_MAX_AGE_S;
+
+void WarmStartSnapshot::Writer::put_u32(uint32_t value)
+{
+  _data.append((const char*)&value, sizeof(value));
+}
+
+
+void WarmStartSnapshot::Writer::put_u64(uint64_t value)
+{
+  _data.append((const char*)&value, sizeof(value));
+}
+
+
+void WarmStartSnapshot::Writer::put_string(const std::string& value)
+{
+  put_u32(value.length());
+  _data.append(value);
+}
+
+
+void WarmStartSnapshot::Writer::put_bytes(const std::string& value)
+{
+  _data.append(value);
+}
+
+
+WarmStartSnapshot::Reader::Reader(const char* data, size_t length) :
+  _data(data),
+  _length(length),
+  _pos(0),
+  _failed(false)
+{
+}
+
+
+uint32_t WarmStartSnapshot::Reader::get_u32()
+{
+  uint32_t value = 0;
+  if (check(sizeof(value)))
+  {
+    memcpy(&value, _data + _pos, sizeof(value));
+    _pos += sizeof(value);
+  }
+  return value;
+}
+
+
+uint64_t WarmStartSnapshot::Reader::get_u64()
+{
+  uint64_t value = 0;
+  if (check(sizeof(value)))
+  {
+    memcpy(&value, _data + _pos, sizeof(value));
+    _pos += sizeof(value);
+  }
+  return value;
+}
+
+
+std::string WarmStartSnapshot::Reader::get_string()
+{
+  std::string value;
+  uint32_t length = get_u32();
+  if (check(length))
+  {
+    value.assign(_data + _pos, length);
+    _pos += length;
+  }
+  return value;
+}
+
+
+const char* WarmStartSnapshot::Reader::get_bytes(size_t length)
+{
+  const char* bytes = NULL;
+  if (check(length))
+  {
+    bytes = _data + _pos;
+    _pos += length;
+  }
+  return bytes;
+}
+
+
+/// Checks that there are at least length bytes left to read, failing the
+/// reader if not.
+bool WarmStartSnapshot::Reader::check(size_t length)
+{
+  if ((!_failed) && (length > _length - _pos))
+  {
+    _failed = true;
+  }
+  return !_failed;
+}
+
+
+WarmStartSnapshot::WarmStartSnapshot(const std::string& filename,
+                                     int max_age_s) :
+  _filename(filename),
+  _max_age_s(max_age_s),
+  _sections()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+WarmStartSnapshot::~WarmStartSnapshot()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void WarmStartSnapshot::add_section(uint32_t id,
+                                    const SaveFn& save_fn,
+                                    const LoadFn& load_fn)
+{
+  pthread_mutex_lock(&_lock);
+  Section& section = _sections[id];
+  section.save_fn = save_fn;
+  section.load_fn = load_fn;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void WarmStartSnapshot::remove_section(uint32_t id)
+{
+  pthread_mutex_lock(&_lock);
+  _sections.erase(id);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+bool WarmStartSnapshot::save()
+{
+  Writer file;
+  file.put_u64(SNAPSHOT_MAGIC);
+  file.put_u32(VERSION);
+  file.put_u32(0);
+  file.put_u64(time(NULL));
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::map<uint32_t, Section>::iterator i = _sections.begin();
+       i != _sections.end();
+       ++i)
+  {
+    Writer section;
+    i->second.save_fn(section);
+
+    file.put_u32(i->first);
+    file.put_u32(0);
+    file.put_u64(section.data().length());
+    file.put_bytes(section.data());
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  // Write to a temporary file and rename it, so a failure part way through
+  // can't leave a truncated snapshot behind.
+  std::string tmp_filename = _filename + ".tmp";
+  int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0)
+  {
+    TRC_WARNING("Failed to open warm-start snapshot %s, errno %d",
+                tmp_filename.c_str(), errno);
+    return false;
+  }
+
+  const std::string& data = file.data();
+  size_t written = 0;
+
+  while (written < data.length())
+  {
+    ssize_t rc = write(fd, data.data() + written, data.length() - written);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      // LCOV_EXCL_START - write failures can't be provoked in UT
+      TRC_WARNING("Failed to write warm-start snapshot %s, errno %d",
+                  tmp_filename.c_str(), errno);
+      close(fd);
+      unlink(tmp_filename.c_str());
+      return false;
+      // LCOV_EXCL_STOP
+    }
+    written += rc;
+  }
+
+  close(fd);
+
+  if (rename(tmp_filename.c_str(), _filename.c_str()) != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to rename warm-start snapshot to %s, errno %d",
+                _filename.c_str(), errno);
+    unlink(tmp_filename.c_str());
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  TRC_STATUS("Saved %ld bytes of cached data to warm-start snapshot %s",
+             data.length(), _filename.c_str());
+  return true;
+}
+
+
+bool WarmStartSnapshot::load()
+{
+  int fd = open(_filename.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    TRC_DEBUG("No warm-start snapshot at %s", _filename.c_str());
+    return false;
+  }
+
+  bool loaded = false;
+  struct stat st;
+
+  if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+  {
+    // Map the file rather than reading it, so the sections are parsed
+    // straight out of the page cache.
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data != MAP_FAILED)
+    {
+      loaded = load_file((const char*)data, st.st_size);
+      munmap(data, st.st_size);
+    }
+  }
+
+  close(fd);
+
+  // Never load the same snapshot twice - if we restart again without
+  // quiescing, the snapshot would be stale.
+  unlink(_filename.c_str());
+
+  return loaded;
+}
+
+
+bool WarmStartSnapshot::load_file(const char* data, size_t length)
+{
+  Reader file(data, length);
+
+  uint64_t magic = file.get_u64();
+  uint32_t version = file.get_u32();
+  file.get_u32();
+  int64_t saved_at = file.get_u64();
+
+  if ((file.failed()) || (magic != SNAPSHOT_MAGIC) || (version != VERSION))
+  {
+    TRC_WARNING("Ignoring warm-start snapshot %s with unrecognised format",
+                _filename.c_str());
+    return false;
+  }
+
+  int age_s = std::max((int64_t)0, (int64_t)time(NULL) - saved_at);
+
+  if (age_s > _max_age_s)
+  {
+    TRC_WARNING("Ignoring warm-start snapshot %s saved %d seconds ago",
+                _filename.c_str(), age_s);
+    return false;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  while (!file.at_end())
+  {
+    uint32_t id = file.get_u32();
+    file.get_u32();
+    uint64_t section_length = file.get_u64();
+    const char* section_data = file.get_bytes(section_length);
+
+    if (section_data == NULL)
+    {
+      TRC_WARNING("Warm-start snapshot %s is truncated", _filename.c_str());
+      break;
+    }
+
+    std::map<uint32_t, Section>::iterator i = _sections.find(id);
+
+    if (i != _sections.end())
+    {
+      Reader section(section_data, section_length);
+      i->second.load_fn(section, age_s);
+
+      if (section.failed())
+      {
+        TRC_WARNING("Warm-start snapshot section %u is truncated", id);
+      }
+    }
+    else
+    {
+      TRC_DEBUG("Skipping warm-start snapshot section %u", id);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  TRC_STATUS("Loaded warm-start snapshot %s saved %d seconds ago",
+             _filename.c_str(), age_s);
+  return true;
+}
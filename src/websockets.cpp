@@ -45,6 +45,8 @@ extern "C" {
 
 #include <string>
 #include <cstring>
+#include <atomic>
+#include <boost/bind.hpp>
 
 #include "stack.h"
 #include "log.h"
@@ -54,6 +56,7 @@ extern "C" {
 using websocketpp::server;
 
 static unsigned short ws_port;
+static int ws_threads = 1;
 
 //
 // mod_ws_transport is the module implementing websockets
@@ -82,11 +85,83 @@ struct ws_transport
 {
   pjsip_transport	base;
   server::handler::connection_ptr con;
+  boost::asio::strand* strand;
   pjsip_rx_data rdata;
-  int			is_closing;
+
+  // Set by the handler when the connection closes, and read on the
+  // connection's strand and by senders, so must be atomic.
+  std::atomic<bool>	is_closing;
   pj_bool_t		is_paused;
 };
 
+/*
+ * Registers a WebSocket I/O thread with PJSIP the first time it calls into
+ * the PJSIP APIs.  The I/O threads are created by websocketpp, not PJSIP.
+ */
+static void ws_register_thread()
+{
+  if (!pj_thread_is_registered())
+  {
+    // The thread descriptor must stay in scope for the lifetime of the thread
+    // so we must allocate it from heap.  The I/O thread pool lives for the
+    // lifetime of the process, so this is not leaked in practice.
+    pj_thread_desc* td = (pj_thread_desc*)malloc(sizeof(pj_thread_desc));
+    pj_bzero(*td, sizeof(pj_thread_desc));
+    pj_thread_t* thread = 0;
+
+    pj_status_t status = pj_thread_register("websockets", *td, &thread);
+
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Failed to register websockets thread with PJSIP");
+    }
+  }
+}
+
+/*
+ * Runs on the connection's strand to write a message queued by ws_send_msg,
+ * then completes the pending send with the transport manager.
+ */
+static void ws_do_send(struct ws_transport *ws,
+                       pjsip_tx_data *tdata,
+                       void *token,
+                       pjsip_transport_callback callback)
+{
+  ws_register_thread();
+
+  pj_ssize_t len = tdata->buf.cur - tdata->buf.start;
+  pj_ssize_t sent = -PJSIP_ESESSIONTERMINATED;
+
+  if (!ws->is_closing)
+  {
+    try
+    {
+      // websocketpp frames the payload into its own write buffer, so this is
+      // the only copy of the message body.
+      ws->con->send(std::string(tdata->buf.start, len),
+                    websocketpp::frame::opcode::TEXT);
+      sent = len;
+    }
+    catch (std::exception& e)
+    {
+      TRC_WARNING("Failed to send message over WS: %s", e.what());
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Dropping message for closing WS transport");
+  }
+
+  if (callback != NULL)
+  {
+    (*callback)(&ws->base, token, sent);
+  }
+
+  // Release the references taken in ws_send_msg.
+  pjsip_tx_data_dec_ref(tdata);
+  pjsip_transport_dec_ref(&ws->base);
+}
+
 /*
  * This callback is called by transport manager to send SIP message
  */
@@ -97,14 +172,24 @@ static pj_status_t ws_send_msg(pjsip_transport *transport,
                                void *token,
                                pjsip_transport_callback callback)
 {
-  std::string body(tdata->buf.start);
-  TRC_DEBUG("Sending message over WS");
-
   struct ws_transport *ws = (struct ws_transport*)transport;
-  server::handler::connection_ptr con = ws->con;
-  con->send(body, websocketpp::frame::opcode::TEXT);
 
-  return PJ_SUCCESS;
+  if (ws->is_closing)
+  {
+    return PJSIP_ESESSIONTERMINATED;
+  }
+
+  TRC_DEBUG("Queuing message for send over WS");
+
+  // Hand the write off to the connection's strand so the calling thread
+  // never blocks on the WebSocket connection, and writes to a single
+  // connection stay ordered.  The tdata buffer is sent directly, so we hold
+  // a reference on it (and on the transport) until the write completes.
+  pjsip_tx_data_add_ref(tdata);
+  pjsip_transport_add_ref(transport);
+  ws->strand->post(boost::bind(&ws_do_send, ws, tdata, token, callback));
+
+  return PJ_EPENDING;
 }
 
 /*
@@ -186,6 +271,10 @@ static pj_status_t ws_transport_create(pjsip_endpoint *endpt,
 
   /* Keep reference to ws connection */
   tp->con = con;
+  tp->is_closing = false;
+
+  /* Writes to this connection are serialized through its own strand. */
+  tp->strand = new boost::asio::strand(con->get_socket().get_io_service());
 
   ///* Remote address is left zero (except the family) */
   //tp->base.key.rem_addr.addr.sa_family = (pj_uint16_t)pj_AF_INET();
@@ -288,7 +377,6 @@ static pj_bool_t on_ws_data(ws_transport *ws,
 
   /* Don't do anything if transport is closing. */
   if (ws->is_closing) {
-    ws->is_closing++;
     return PJ_FALSE;
   }
 
@@ -369,6 +457,10 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
   TRC_DEBUG("Destroying WS transport...");
   struct ws_transport *ws = (struct ws_transport*)transport;
 
+  delete ws->strand;
+  ws->strand = NULL;
+  ws->con.reset();
+
   if (ws->rdata.tp_info.pool) {
     pj_pool_release(ws->rdata.tp_info.pool);
     ws->rdata.tp_info.pool = NULL;
@@ -395,6 +487,81 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
   return PJ_SUCCESS;
 }
 
+WSConnectionTable::WSConnectionTable()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+}
+
+WSConnectionTable::~WSConnectionTable()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+}
+
+WSConnectionTable::Shard& WSConnectionTable::shard(const void* con)
+{
+  // Connection objects are heap allocated, so discard the low order bits
+  // (which are always zero) before picking a shard.
+  uintptr_t key = (uintptr_t)con;
+  return _shards[(key >> 4) % NUM_SHARDS];
+}
+
+void WSConnectionTable::insert(const void* con, ws_transport* transport)
+{
+  Shard& s = shard(con);
+  pthread_mutex_lock(&s.lock);
+  s.connections[con] = transport;
+  pthread_mutex_unlock(&s.lock);
+}
+
+ws_transport* WSConnectionTable::find(const void* con)
+{
+  ws_transport* transport = NULL;
+  Shard& s = shard(con);
+  pthread_mutex_lock(&s.lock);
+  std::unordered_map<const void*, ws_transport*>::const_iterator i =
+                                                        s.connections.find(con);
+  if (i != s.connections.end())
+  {
+    transport = i->second;
+  }
+  pthread_mutex_unlock(&s.lock);
+  return transport;
+}
+
+ws_transport* WSConnectionTable::erase(const void* con)
+{
+  ws_transport* transport = NULL;
+  Shard& s = shard(con);
+  pthread_mutex_lock(&s.lock);
+  std::unordered_map<const void*, ws_transport*>::iterator i =
+                                                        s.connections.find(con);
+  if (i != s.connections.end())
+  {
+    transport = i->second;
+    s.connections.erase(i);
+  }
+  pthread_mutex_unlock(&s.lock);
+  return transport;
+}
+
+size_t WSConnectionTable::size()
+{
+  size_t count = 0;
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_lock(&_shards[ii].lock);
+    count += _shards[ii].connections.size();
+    pthread_mutex_unlock(&_shards[ii].lock);
+  }
+  return count;
+}
+
 /* Setup callbacks for WebSockets events */
 class sip_server_handler : public server::handler {
   public:
@@ -428,6 +595,8 @@ class sip_server_handler : public server::handler {
     }
 
     void on_open(connection_ptr con) {
+      ws_register_thread();
+
       TRC_DEBUG("New web socket connection, creating PJSIP transport");
       pjsip_transport *transport;
       pj_status_t status = ws_transport_create(stack_data.endpt,
@@ -436,21 +605,27 @@ class sip_server_handler : public server::handler {
           &transport);
       if (status == PJ_SUCCESS){
         TRC_DEBUG("Created WS transport");
+        _connections.insert(con.get(), (struct ws_transport*)transport);
       }
       else{
         TRC_DEBUG("Failed to create WS transport");
       }
-
-      connectionMap.insert(
-          std::pair<connection_ptr, struct ws_transport*>(con, (struct ws_transport*)transport));
     }
 
     void on_message(connection_ptr con, message_ptr msg) {
       ws_transport *transport;
 
+      ws_register_thread();
+
       TRC_DEBUG("Received message from websockets");
 
-      transport = connectionMap.find(con)->second;
+      transport = _connections.find(con.get());
+      if (transport == NULL)
+      {
+        TRC_DEBUG("No WS transport for connection, dropping message");
+        return;
+      }
+
       TRC_DEBUG("Sending message to PJSIP...");
       pj_status_t status = on_ws_data(transport, msg);
       if (status == PJ_TRUE){
@@ -465,8 +640,18 @@ class sip_server_handler : public server::handler {
       ws_transport *transport;
       pjsip_tp_state_callback state_cb;
 
+      ws_register_thread();
+
       TRC_DEBUG("Closing websocket...");
-      transport = connectionMap.find(con)->second;
+      transport = _connections.erase(con.get());
+      if (transport == NULL)
+      {
+        TRC_DEBUG("No WS transport for closed connection");
+        return;
+      }
+
+      /* Fail any sends still queued on the connection's strand. */
+      transport->is_closing = true;
 
       /* Notify application of transport disconnected state */
       state_cb = pjsip_tpmgr_get_state_cb(transport->base.tpmgr);
@@ -488,7 +673,7 @@ class sip_server_handler : public server::handler {
 
   private:
     static std::string SUBPROTOCOL;
-    std::map<connection_ptr, struct ws_transport*> connectionMap;
+    WSConnectionTable _connections;
 };
 
 std::string sip_server_handler::SUBPROTOCOL = "sip";
@@ -510,9 +695,19 @@ static int websocket_thread(void* p)
     sip_endpoint.elog().set_level(websocketpp::log::elevel::RERROR);
     sip_endpoint.elog().set_level(websocketpp::log::elevel::FATAL);
 
-    TRC_DEBUG("Starting WebSocket SIP server on port %hu", ws_port);
-    boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), ws_port);
-    sip_endpoint.listen(ep);
+    // Listen using the same address family as the rest of the SIP stack, so
+    // that the remote addresses reported for WS flows match those of the
+    // other transports.
+    boost::asio::ip::tcp::endpoint ep((stack_data.addr_family == pj_AF_INET6()) ?
+                                        boost::asio::ip::tcp::v6() :
+                                        boost::asio::ip::tcp::v4(),
+                                      ws_port);
+
+    // websocketpp runs the server on a pool of ws_threads I/O threads (this
+    // thread being one of them) and only returns when the server stops.
+    TRC_DEBUG("Starting WebSocket SIP server on port %hu with %d threads",
+              ws_port, ws_threads);
+    sip_endpoint.listen(ep, ws_threads);
   } catch (std::exception& e) {
     TRC_ERROR("Exception: %s", e.what());
   }
@@ -537,9 +732,10 @@ static pj_bool_t ws_transport_on_start()
   return PJ_SUCCESS;
 }
 
-pj_status_t init_websockets(unsigned short port)
+pj_status_t init_websockets(unsigned short port, int num_threads)
 {
   ws_port = port;
+  ws_threads = (num_threads > 0) ? num_threads : 1;
 
   pj_status_t status;
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_ws_transport);
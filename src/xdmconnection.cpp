@@ -46,6 +46,7 @@
 #include "sproutsasevent.h"
 #include "httpconnection.h"
 #include "xdmconnection.h"
+#include "latency_breakdown.h"
 #include "snmp_continuous_accumulator_table.h"
 
 /// Main constructor.
@@ -85,6 +86,7 @@ bool XDMConnection::get_simservs(const std::string& user,
                                  const std::string& password,
                                  SAS::TrailId trail)
 {
+  LatencyBreakdown::PhaseTimer timer(LatencyBreakdown::XDM);
   Utils::StopWatch stopWatch;
   stopWatch.start();
 